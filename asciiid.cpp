@@ -157,7 +157,7 @@ struct Merge
 		{
 			// d = AddTerrainPatch(terrain, x / VISUAL_CELLS, y / VISUAL_CELLS, 0);
 			d = URDO_Create(terrain, x / VISUAL_CELLS, y / VISUAL_CELLS, 0);
-			URDO_Patch(d, true);
+			URDO_Patch(terrain, d, true);
 			uint16_t* src = GetTerrainVisualMap(p);
 			uint16_t* dst = GetTerrainVisualMap(d);
 			memcpy(dst, src, sizeof(uint16_t)*VISUAL_CELLS*VISUAL_CELLS);
@@ -166,7 +166,7 @@ struct Merge
 		}
 		else
 		{
-			URDO_Patch(d, false);
+			URDO_Patch(terrain, d, false);
 		}
 
 		uint16_t* src = GetTerrainHeightMap(p);
@@ -187,7 +187,7 @@ struct Merge
 
 		if (diag)
 		{
-			URDO_Diag(d);
+			URDO_Diag(terrain, d);
 			diag = GetTerrainDiag(p);
 			SetTerrainDiag(d, diag);
 		}
@@ -330,7 +330,7 @@ void MergeCommit()
 
 	if (merge._world)
 	{
-		QueryWorldCB cb = { Merge::CommitMesh, Merge::CommitSprite };
+		QueryWorldCB cb = { Merge::CommitMesh, Merge::CommitSprite, 0 };
 		QueryWorld(merge._world, 0, 0, &cb, &merge);
 		RebuildWorld(world, false);
 	}
@@ -1008,6 +1008,7 @@ int eg_crossbow = 0;
 bool diag_flipped = false;
 bool br_limit = false;
 int probe_z = 0;
+int render_threads = 1; // game in term window
 
 uint64_t g_Time; // in microsecs
 
@@ -2993,7 +2994,7 @@ struct MatIDStamp
 
 		bool diff = false;
 		diff = true;
-		URDO_Patch(p, true);
+		URDO_Patch(terrain, p, true);
 
 		for (int v = 0, i = 0; v < VISUAL_CELLS; v++)
 		{
@@ -3022,7 +3023,7 @@ struct MatIDStamp
 
 							if (!diff)
 							{
-								URDO_Patch(p, true);
+								URDO_Patch(terrain, p, true);
 								diff = true;
 							}
 
@@ -3049,7 +3050,7 @@ struct MatIDStamp
 
 							if (!diff)
 							{
-								URDO_Patch(p, true);
+								URDO_Patch(terrain, p, true);
 								diff = true;
 							}
 
@@ -3133,7 +3134,7 @@ static void StampCB(Patch* p, int x, int y, int view_flags, void* cookie)
 	if (hi == 0 && br_alpha < 0 || lo == 0xffff && br_alpha>0)
 		return;
 
-	URDO_Patch(p);
+	URDO_Patch(terrain, p);
 
 	double* xy = (double*)cookie;
 	uint16_t* map = GetTerrainHeightMap(p);
@@ -3326,7 +3327,7 @@ void Stamp(double x, double y)
 				Patch* p = gather->patch[px + size * py];
 				if (p)
 				{
-					URDO_Patch(p);
+					URDO_Patch(terrain, p);
 					uint16_t* map = GetTerrainHeightMap(p);
 
 					for (int sy = 0; sy <= HEIGHT_CELLS; sy++)
@@ -4029,10 +4030,15 @@ void TranslateMap(int delta_z, bool water_limit)
 
 	QueryTerrain(terrain, 0, 0, 0xAA, Translate::QueryPatch, &t);
 
-	QueryWorldCB cb = { Translate::QueryMesh, Translate::QuerySprite };
+	QueryWorldCB cb = { Translate::QueryMesh, Translate::QuerySprite, 0 };
 	QueryWorld(world, 0, 0, &cb, &t);
 
 	RebuildWorld(world, true);
+
+#ifdef DARK_TERRAIN
+	// not undoable, so not seen by URDO_Dirty()
+	InvalidateTerrainDark(terrain);
+#endif
 }
 
 void Load(const char* path)
@@ -4247,6 +4253,19 @@ void my_render(A3D_WND* wnd)
 			ImGui::NewFrame();
 		}
 
+#ifdef DARK_TERRAIN
+		// keep baked shadows in sync with edits, undo and redo, only where they can change
+		// if they were baked for other light, edited parts go stale so masks can't claim any light anymore
+		double dirty[6];
+		if (URDO_Dirty(dirty))
+		{
+			if (HasTerrainDark(terrain, global_lt))
+				UpdateTerrainDarkBox(terrain, world, global_lt, true, dirty);
+			else
+				InvalidateTerrainDark(terrain);
+		}
+#endif
+
 
 //		if (pFont)
 //			ImGui::PushFont(pFont);		
@@ -5333,7 +5352,10 @@ void my_render(A3D_WND* wnd)
 			}
 			else
 				if (ImGui::Button("PURGE"))
+				{
 					URDO_Purge();
+					CompactTerrain(terrain);
+				}
 			ImGui::SameLine();
 			ImGui::Text("%zu BYTES", URDO_Bytes());
 		}
@@ -5566,7 +5588,7 @@ void my_render(A3D_WND* wnd)
 					// 4. rotate toward terrain normal by given weight
 					// 5. post translate by constant xyz + random xyz
 
-					extern int bsp_insts, bsp_nodes, bsp_tests;
+					extern thread_local int bsp_insts, bsp_nodes, bsp_tests;
 					ImGui::Text("INSTS:%d, NODES:%d, TESTS:%d \n ", bsp_insts, bsp_nodes, bsp_tests);
 
 					const char* mode = "";
@@ -5628,7 +5650,7 @@ void my_render(A3D_WND* wnd)
 					// 4. rotate toward terrain normal by given weight
 					// 5. post translate by constant xyz + random xyz
 
-					extern int bsp_insts, bsp_nodes, bsp_tests;
+					extern thread_local int bsp_insts, bsp_nodes, bsp_tests;
 					ImGui::Text("INSTS:%d, NODES:%d, TESTS:%d \n ", bsp_insts, bsp_nodes, bsp_tests);
 
 					const char* mode = "";
@@ -5689,7 +5711,7 @@ void my_render(A3D_WND* wnd)
 					// 4. rotate toward terrain normal by given weight
 					// 5. post translate by constant xyz + random xyz
 
-					extern int bsp_insts, bsp_nodes, bsp_tests;
+					extern thread_local int bsp_insts, bsp_nodes, bsp_tests;
 					ImGui::Text("INSTS:%d, NODES:%d, TESTS:%d \n ", bsp_insts, bsp_nodes, bsp_tests);
 
 					const char* mode = "";
@@ -6837,7 +6859,7 @@ void my_render(A3D_WND* wnd)
 									uint16_t diag = GetTerrainDiag(p);
 									diag ^= 1 << (hx + hy * HEIGHT_CELLS);
 
-									URDO_Diag(p);
+									URDO_Diag(terrain, p);
 									SetTerrainDiag(p, diag);
 								}
 
@@ -7587,7 +7609,7 @@ void my_render(A3D_WND* wnd)
 
 	rc->BeginMeshes(tm, lt);
 
-	QueryWorldCB cb = { RenderContext::RenderMesh , RenderContext::RenderSprite };
+	QueryWorldCB cb = { RenderContext::RenderMesh , RenderContext::RenderSprite, 0 };
 	QueryWorld(world, planes, clip_world, &cb, rc);
 
 	if (merge._world)
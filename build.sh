@@ -15,15 +15,19 @@ if [[ "$OSTYPE" == "linux-gnu"* ]]; then
 		/usr/bin/time -f "----------------------\ndone in %e sec\n" make -j16 -f makefile_game
 		echo -e "BUILDING game_term\n----------------------"
 		/usr/bin/time -f "----------------------\ndone in %e sec\n" make -j16 -f makefile_game_term
+		echo -e "BUILDING bench\n----------------------"
+		/usr/bin/time -f "----------------------\ndone in %e sec\n" make -j16 -f makefile_bench
 	else
 		make -j16 -f makefile_asciiid
 		make -j16 -f makefile_server
 		make -j16 -f makefile_game
 		make -j16 -f makefile_game_term
+		make -j16 -f makefile_bench
 	fi
 else
 	make -j16 -f makefile_asciiid_mac
 	make -j16 -f makefile_server
 	make -j16 -f makefile_game_mac
 	make -j16 -f makefile_game_term_mac
+	make -j16 -f makefile_bench
 fi
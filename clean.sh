@@ -2,5 +2,6 @@ make -f makefile_asciiid clean
 make -f makefile_server clean
 make -f makefile_game clean
 make -f makefile_game_term clean
+make -f makefile_bench clean
 
 
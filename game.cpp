@@ -3691,6 +3691,15 @@ void Game::Render(uint64_t _stamp, AnsiCell* ptr, int width, int height)
 		}
 	}
 
+	// no-op unless terrain is streamed, keeps whole view resident
+	uint16_t stream_lo, stream_hi = GetTerrainHi(terrain, &stream_lo);
+	int stream_shift[2] = { scene_shift/2, 0 };
+	float stream_radius = GetRenderRadius(width, height, 1.0, water, io.pos[2], stream_lo, stream_hi, stream_shift, perspective);
+	float stream_pos[2][2] = { { io.pos[0], io.pos[1] }, { player.pos[0], player.pos[1] } };
+	// don't let physics fall through ground which is not loaded yet
+	bool stream_wait = !IsTerrainResident(terrain, player.pos[0], player.pos[1]);
+	UpdateTerrainStreaming(terrain, 2, stream_pos, stream_radius, stream_wait);
+
 	int steps = Animate(physics, _stamp, &io, player.req.mount);
 
 	if (io.grounded)
@@ -4770,6 +4779,38 @@ void Game::Render(uint64_t _stamp, AnsiCell* ptr, int width, int height)
 			if (x>=0 && x<width)
 				top[x] = status;
 	}
+
+	if (show_stats)
+	{
+		// render stats under status bar, toggled by F9
+		const RenderStats* rs = GetRenderStats(renderer);
+		char stats_text[10][32];
+		int lines = 0;
+		sprintf(stats_text[lines++], "render     %6.2f ms", rs->total_us / 1000.0f);
+		sprintf(stats_text[lines++], "terrain q  %6.2f ms", rs->terrain_query_us / 1000.0f);
+		sprintf(stats_text[lines++], "terrain r  %6.2f ms", rs->terrain_raster_us / 1000.0f);
+		sprintf(stats_text[lines++], "meshes     %6.2f ms", rs->mesh_raster_us / 1000.0f);
+		sprintf(stats_text[lines++], "reflection %6.2f ms", rs->refl_us / 1000.0f);
+		sprintf(stats_text[lines++], "water      %6.2f ms", rs->water_us / 1000.0f);
+		sprintf(stats_text[lines++], "post pass  %6.2f ms", rs->post_us / 1000.0f);
+		sprintf(stats_text[lines++], "sprites    %6.2f ms", rs->sprite_us / 1000.0f);
+		sprintf(stats_text[lines++], "%d patches %d faces", rs->patches, rs->faces);
+		sprintf(stats_text[lines++], "%d sprites %d samples", rs->sprites, rs->samples);
+
+		AnsiCell stats;
+		stats.fg = white;
+		stats.bk = black;
+		stats.spare = 0;
+		for (int l = 0; l < lines && l < height - 1; l++)
+		{
+			AnsiCell* row = ptr + (height - 2 - l) * width;
+			for (int x = 0; x < width && stats_text[l][x]; x++)
+			{
+				stats.gl = stats_text[l][x];
+				row[x] = stats;
+			}
+		}
+	}
 	
 
 	// NET_TODO:
@@ -5598,6 +5639,9 @@ void Game::OnKeyb(GAME_KEYB keyb, int key)
 		if (key == A3D_F10 && !auto_rep)
 			input.shot = true;
 
+		if (key == A3D_F9 && !auto_rep)
+			show_stats = !show_stats;
+
 		if (!player.talk_box && !auto_rep)
 		{
 			if (key == A3D_SPACE)
@@ -255,6 +255,7 @@ struct Game
 	bool show_inventory;
 	int scene_shift;
 	bool show_buts; // true only if no popup is visible
+	bool show_stats; // render stats overlay (F9)
 	int bars_pos; // used to hide buts (0..7)
 
 	// time relaxated KEY_UP/DOWN emulation by KEY_PRESSes
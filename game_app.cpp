@@ -17,6 +17,9 @@
 #include <signal.h>
 #include <termios.h>
 #include <time.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #ifdef USE_GPM
 # include <gpm.h>
 #endif
@@ -389,11 +392,154 @@ void exit_handler(int signum)
 
 uint64_t GetTime()
 {
-	static timespec ts;
+	timespec ts; // presenter thread calls it too
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
+// presenter thread encodes and writes frame N while main thread simulates and renders N+1
+// into the other buffer, main thread waits only if terminal can't keep up with it
+struct Presenter
+{
+    std::thread thread; // not running if -sync
+    std::mutex mu;
+    std::condition_variable cv;
+    bool quit;
+
+    // handed over frame, null when presenter is idle
+    AnsiCell* frame;
+    int w, h;
+    uint64_t input; // time of oldest input this frame responds to (0 if none)
+    const char (*utf)[4];
+
+    // pacing and latency, all in microsecs
+    uint64_t presented;
+    uint64_t last; // end of previous write
+    uint64_t write_sum, write_max;
+    uint64_t interval_sum, interval_sq, interval_max;
+    uint64_t latency_sum, latency_max, latency_num;
+    uint64_t stall_sum; // main thread waiting for presenter
+
+    void Write(AnsiCell* buf, int bw, int bh, uint64_t in)
+    {
+        uint64_t t0 = GetTime();
+        Print(buf, bw, bh, utf);
+        uint64_t t1 = GetTime();
+
+        write_sum += t1 - t0;
+        write_max = std::max(write_max, t1 - t0);
+
+        if (presented)
+        {
+            uint64_t i = t1 - last;
+            interval_sum += i;
+            interval_sq += i * i;
+            interval_max = std::max(interval_max, i);
+        }
+
+        if (in)
+        {
+            latency_sum += t1 - in;
+            latency_max = std::max(latency_max, t1 - in);
+            latency_num++;
+        }
+
+        last = t1;
+        presented++;
+    }
+
+    void Loop()
+    {
+        std::unique_lock<std::mutex> lock(mu);
+        while (true)
+        {
+            cv.wait(lock, [&] { return quit || frame; });
+            if (!frame)
+                return;
+
+            lock.unlock();
+            Write(frame, w, h, input);
+            lock.lock();
+
+            frame = 0;
+            cv.notify_all();
+        }
+    }
+
+    // wait until previous frame is on terminal, so its buffer can be reused or reallocated
+    void Wait()
+    {
+        if (!thread.joinable())
+            return;
+        uint64_t t0 = GetTime();
+        std::unique_lock<std::mutex> lock(mu);
+        cv.wait(lock, [&] { return !frame; });
+        stall_sum += GetTime() - t0;
+    }
+
+    void Present(AnsiCell* buf, int bw, int bh, uint64_t in)
+    {
+        if (!thread.joinable())
+        {
+            Write(buf, bw, bh, in);
+            return;
+        }
+
+        Wait();
+        std::unique_lock<std::mutex> lock(mu);
+        frame = buf;
+        w = bw;
+        h = bh;
+        input = in;
+        cv.notify_all();
+    }
+
+    void Report(FILE* f)
+    {
+        if (presented < 2)
+            return;
+        uint64_t n = presented - 1;
+        double avr = (double)interval_sum / n;
+        double dev = sqrt(std::max(0.0, (double)interval_sq / n - avr * avr));
+        fprintf(f, "PRESENT: %s, write avr %.2f max %.2f ms, interval avr %.2f dev %.2f max %.2f ms, stalls %.2f ms/frame\n",
+            thread.joinable() ? "async" : "sync",
+            write_sum / 1000.0 / presented, write_max / 1000.0,
+            avr / 1000.0, dev / 1000.0, interval_max / 1000.0,
+            stall_sum / 1000.0 / presented);
+        if (latency_num)
+            fprintf(f, "INPUT LATENCY: avr %.2f max %.2f ms (%d frames)\n",
+                latency_sum / 1000.0 / latency_num, latency_max / 1000.0, (int)latency_num);
+    }
+};
+
+Presenter* CreatePresenter(const char utf[256][4], bool async)
+{
+    Presenter* p = new Presenter(); // zeroed
+    p->utf = utf;
+    if (async)
+        p->thread = std::thread(&Presenter::Loop, p);
+    return p;
+}
+
+// optionally prints pacing and latency report before presenter thread is gone
+void DeletePresenter(Presenter* p, FILE* report = 0)
+{
+    if (report)
+        p->Report(report);
+
+    if (p->thread.joinable())
+    {
+        p->Wait();
+        {
+            std::unique_lock<std::mutex> lock(p->mu);
+            p->quit = true;
+            p->cv.notify_all();
+        }
+        p->thread.join();
+    }
+    delete p;
+}
+
 #else
 
 #define GetTime() a3dGetTime()
@@ -535,6 +681,10 @@ float pos_x,pos_y,pos_z;
 float rot_yaw;
 int probe_z;
 float global_lt[4];
+int render_threads = 1; // -threads N
+int terrain_stream = 0; // -stream N: stream terrain keeping up to N regions resident
+int terrain_cold = 0; // -cold N: and up to N evicted ones packed in memory
+bool present_sync = false; // -sync: write frames to terminal on main thread
 World* world=0;
 Terrain* terrain=0;
 
@@ -955,6 +1105,16 @@ static int find_tty()
 }
 #endif
 
+#ifdef DARK_TERRAIN
+static void BakeProgress(int done, int total, void*)
+{
+    printf("casting shadows %d%%\r", done * 100 / total);
+    if (done == total)
+        printf("\n");
+    fflush(stdout);
+}
+#endif
+
 int main(int argc, char* argv[])
 {
 	/*
@@ -1113,6 +1273,9 @@ int main(int argc, char* argv[])
     {
         if (strcmp(argv[p],"-term")==0)
             term = true;
+        else
+        if (strcmp(argv[p],"-sync")==0)
+            present_sync = true;
 		else
 		if (p+1<argc)
 		{
@@ -1121,6 +1284,24 @@ int main(int argc, char* argv[])
 				p++;
 				url = argv[p];
 			}
+			else
+			if (strcmp(argv[p], "-threads") == 0)
+			{
+				p++;
+				render_threads = atoi(argv[p]);
+			}
+			else
+			if (strcmp(argv[p], "-stream") == 0)
+			{
+				p++;
+				terrain_stream = atoi(argv[p]);
+			}
+			else
+			if (strcmp(argv[p], "-cold") == 0)
+			{
+				p++;
+				terrain_cold = atoi(argv[p]);
+			}
 		}
     }
 
@@ -1210,10 +1391,16 @@ int main(int argc, char* argv[])
 
 		if (f)
 		{
-			terrain = LoadTerrain(f);
+			terrain = terrain_stream ? StreamTerrain(f, terrain_stream, terrain_cold, lt) : LoadTerrain(f);
 
 			if (terrain)
 			{
+				// physics needs ground under spawn point right away, and first frame its view (largest one game renders)
+				uint16_t stream_lo, stream_hi = GetTerrainHi(terrain, &stream_lo);
+				int stream_shift[2] = { 0, 0 };
+				float stream_pos[1][2] = { { pos[0], pos[1] } };
+				UpdateTerrainStreaming(terrain, 1, stream_pos, GetRenderRadius(160, 90, 1.0, water, pos[2], stream_lo, stream_hi, stream_shift, true), true);
+
 				for (int i = 0; i < 256; i++)
 				{
 					if (fread(mat[i].shade, 1, sizeof(MatCell) * 4 * 16, f) != sizeof(MatCell) * 4 * 16)
@@ -1265,7 +1452,8 @@ int main(int argc, char* argv[])
         {
 			RebuildWorld(world, true);
             #ifdef DARK_TERRAIN
-            UpdateTerrainDark(terrain, world, lt, false);
+            if (!HasTerrainDark(terrain, lt))
+                UpdateTerrainDark(terrain, world, lt, false, 0, BakeProgress);
             #endif
         }
 	}
@@ -1458,7 +1646,9 @@ int main(int argc, char* argv[])
 
     Game* game = 0;
 
-    AnsiCell* buf = 0;
+    AnsiCell* buf = 0; // being rendered
+    AnsiCell* buf_pair[2] = {0,0};
+    int buf_back = 0;
     int wh[2] = {-1,-1};    
 
     uint64_t begin = GetTime();
@@ -1523,6 +1713,11 @@ int main(int argc, char* argv[])
     stamp = begin;
 
     game = CreateGame(water,pos,yaw,dir,stamp);
+    SetRenderThreads(game->renderer, render_threads);
+    SetRenderIncremental(game->renderer, true);
+
+    Presenter* presenter = CreatePresenter(CP437_UTF8, !present_sync);
+    uint64_t input_stamp = 0; // oldest input not yet presented
 
     while(running)
     {
@@ -1681,6 +1876,8 @@ int main(int argc, char* argv[])
             char fresh[256];
 
             int fresh_bytes = read(STDIN_FILENO, fresh, 256 - stream_bytes);
+            if (fresh_bytes > 0 && !input_stamp)
+                input_stamp = now;
             memcpy(stream + stream_bytes, fresh, fresh_bytes);
 
             int bytes = stream_bytes + fresh_bytes;
@@ -2203,7 +2400,9 @@ int main(int argc, char* argv[])
                 wh[1] = floor(wh[1] * scale + 0.5f);
             }
             */
-            buf = (AnsiCell*)realloc(buf,wh[0]*wh[1]*sizeof(AnsiCell));
+            presenter->Wait();
+            for (int i=0; i<2; i++)
+                buf_pair[i] = (AnsiCell*)realloc(buf_pair[i],wh[0]*wh[1]*sizeof(AnsiCell));
         }
 
         // check all pressed chars array, release if timed out
@@ -2224,9 +2423,13 @@ int main(int argc, char* argv[])
 		// render
         if (wh[0]>0 && wh[1]>0)
         {
+            buf = buf_pair[buf_back];
 		    game->Render(stamp,buf,wh[0],wh[1]);
-            // write to stdout
-            Print(buf,wh[0],wh[1],CP437_UTF8);
+            // write to stdout, asynchronously unless -sync
+            presenter->Present(buf,wh[0],wh[1],input_stamp);
+            input_stamp = 0;
+            if (!present_sync)
+                buf_back ^= 1;
         }
 
         frames++;
@@ -2246,14 +2449,20 @@ int main(int argc, char* argv[])
     }
 #endif // USE_GPM
 
+    // last frame must be on terminal before buffers go away, presenter is deleted after its report
+    presenter->Wait();
+
     if (terrain)
         DeleteTerrain(terrain);
 
     if (world)
         DeleteWorld(world);
 
-    if (buf)
-        free(buf);
+    for (int i=0; i<2; i++)
+    {
+        if (buf_pair[i])
+            free(buf_pair[i]);
+    }
 
     if (game)
         DeleteGame(game);
@@ -2261,6 +2470,7 @@ int main(int argc, char* argv[])
     SetScreen(false);
 
     printf("FPS: %f (%dx%d)\n", frames * 1000000.0 / (end-begin), wh[0], wh[1]);
+    DeletePresenter(presenter, stdout);
 
 #else
 
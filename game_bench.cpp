@@ -0,0 +1,641 @@
+// headless renderer benchmark
+// renders scripted camera passes over a map at few terminal sizes and reports ms per frame
+// with -views N every frame renders N views (spread along the pass) in one RenderViews() batch
+// with -record / -check it renders the same passes with fixed time and writes / compares
+// frame checksums instead, so renderer changes can be verified to be bit-exact,
+// several files can be given, each is checked in render modes it was recorded with
+// (a3d/game_map_y7.sum: defaults, a3d/game_map_y7_ref.sum: all reference paths, see 'make -f makefile_bench check')
+// with -stream N terrain is streamed (v2/v3 maps), regions around every pose are loaded before it's rendered,
+// -cold N keeps up to N evicted regions packed in memory
+// with -bake N shadow bake (on -threads) is timed N times
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+#include "terrain.h"
+#include "world.h"
+#include "render.h"
+#include "game.h"
+
+char base_path[1024] = "./";
+Server* server = 0; // this is to fullfil game.cpp externs!
+
+void SyncConf()
+{
+}
+
+const char* GetConfPath()
+{
+	return "asciicker.cfg";
+}
+
+bool Server::Send(const uint8_t*, int)
+{
+	return false;
+}
+
+void Server::Proc()
+{
+}
+
+void Server::Log(const char*)
+{
+}
+
+Terrain* terrain = 0;
+World* world = 0;
+Material mat[256];
+void* GetMaterialArr()
+{
+	return mat;
+}
+
+static uint64_t BenchClock() // microseconds
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct BenchView
+{
+	float pos[3];
+	float yaw;
+	float zoom;
+	bool perspective;
+};
+
+struct BenchPass
+{
+	const char* name;
+	void (*view)(float t, BenchView* v); // t in [0,1)
+};
+
+// path runs over the middle of y7 island, all passes end where next one begins
+static void WalkPass(float t, BenchView* v)
+{
+	v->pos[0] = -20 + 40 * t;
+	v->pos[1] = 90 + 20 * t;
+	v->yaw = 45;
+	v->zoom = 1.0f;
+	v->perspective = false;
+}
+
+static void TurnPass(float t, BenchView* v)
+{
+	v->pos[0] = 20;
+	v->pos[1] = 110;
+	v->yaw = 45 + 360 * t;
+	v->zoom = 1.0f;
+	v->perspective = false;
+}
+
+static void ZoomPass(float t, BenchView* v)
+{
+	v->pos[0] = 20 - 20 * t;
+	v->pos[1] = 110;
+	v->yaw = 45;
+	v->zoom = powf(0.1f, t); // 1.0 .. 0.1
+	v->perspective = false;
+}
+
+static void PerspPass(float t, BenchView* v)
+{
+	v->pos[0] = 0 - 40 * t;
+	v->pos[1] = 110 - 30 * t;
+	v->yaw = 45 + 90 * t;
+	v->zoom = 1.0f;
+	v->perspective = true;
+}
+
+static const BenchPass bench_pass[] =
+{
+	{ "walk", WalkPass },
+	{ "turn", TurnPass },
+	{ "zoom", ZoomPass },
+	{ "persp", PerspPass },
+};
+
+static const int bench_passes = sizeof(bench_pass) / sizeof(BenchPass);
+
+static float water = 55;
+static float lt[4] = { 1,0,1,.5 };
+
+static float GroundZ(float x, float y)
+{
+	double p[3] = { x, y, 0 };
+	double v[3] = { 0,0,-1 };
+	double ret[4];
+	if (HitTerrain(terrain, p, v, ret, 0) && ret[2] > water)
+		return (float)ret[2];
+	return water;
+}
+
+// places view on the ground, waits for regions so streamed frames are deterministic too
+static void GroundPose(BenchView* v, int width, int height)
+{
+	float pos[1][2] = { { v->pos[0], v->pos[1] } };
+	UpdateTerrainStreaming(terrain, 1, pos, VISUAL_CELLS, true);
+	v->pos[2] = GroundZ(v->pos[0], v->pos[1]);
+
+	uint16_t lo, hi = GetTerrainHi(terrain, &lo);
+	int scene_shift[2] = { 0,0 };
+	float radius = GetRenderRadius(width, height, v->zoom, water, v->pos[2], lo, hi, scene_shift, v->perspective);
+	UpdateTerrainStreaming(terrain, 1, pos, radius, true);
+}
+
+static void RenderPose(Renderer* r, uint64_t stamp, const BenchPass* pass, float t, int width, int height, AnsiCell* buf)
+{
+	BenchView v;
+	pass->view(t, &v);
+	GroundPose(&v, width, height);
+
+	int scene_shift[2] = { 0,0 };
+	Render(r, stamp, terrain, world, water, v.zoom, v.yaw, v.pos, lt, width, height, buf, 0, scene_shift, v.perspective);
+}
+
+// view i of n is placed 1/n of the pass further than view i-1
+static void SetupViews(RenderView* rv, int n, const BenchPass* pass, float t, int width, int height)
+{
+	for (int i = 0; i < n; i++)
+	{
+		float vt = t + (float)i / n;
+		vt -= floorf(vt);
+
+		BenchView v;
+		pass->view(vt, &v);
+		GroundPose(&v, width, height);
+
+		rv[i].zoom = v.zoom;
+		rv[i].yaw = v.yaw;
+		rv[i].pos[0] = v.pos[0];
+		rv[i].pos[1] = v.pos[1];
+		rv[i].pos[2] = v.pos[2];
+		rv[i].perspective = v.perspective;
+	}
+}
+
+static const BenchPass* FindPass(const char* name)
+{
+	for (int p = 0; p < bench_passes; p++)
+	{
+		if (strcmp(bench_pass[p].name, name) == 0)
+			return bench_pass + p;
+	}
+	return 0;
+}
+
+// checksum file starts with incremental, fast_water, lod and occlusion flags (last two are optional, 1 if missing),
+// then each line is: WxH pass frame/frames hash
+// when checking, poses are taken from the file and rendered in the same order
+// (renderer snaps translation depending on previous frame, incremental mode fits clip planes differently)
+// stamp never changes and water time is derived from the pose alone
+static int Checksums(const char* path, bool record, int (*size)[2], int sizes, int frames, int threads, bool incremental, bool fast_water, bool lod, bool occlusion)
+{
+	FILE* f = fopen(path, record ? "w" : "r");
+	if (!f)
+	{
+		printf("can't open %s\n", path);
+		return -1;
+	}
+
+	int inc = incremental ? 1 : 0;
+	int fw = fast_water ? 1 : 0;
+	int ld = lod ? 1 : 0;
+	int oc = occlusion ? 1 : 0;
+	if (record)
+		fprintf(f, "incremental %d fast_water %d lod %d occlusion %d\n", inc, fw, ld, oc);
+	else
+	if (fscanf(f, " incremental %d fast_water %d", &inc, &fw) != 2)
+	{
+		printf("bad header in %s\n", path);
+		fclose(f);
+		return -1;
+	}
+	else
+	{
+		if (fscanf(f, " lod %d", &ld) != 1)
+			ld = 1;
+		if (fscanf(f, " occlusion %d", &oc) != 1)
+			oc = 1;
+	}
+
+	Renderer* r = 0;
+	AnsiCell* buf = 0;
+	int width = 0, height = 0;
+
+	int poses = 0;
+	int errors = 0;
+
+	int s = 0, p = 0, i = 0;
+	while (1)
+	{
+		int w, h, n;
+		const BenchPass* pass;
+		uint64_t expected = 0;
+
+		if (record)
+		{
+			if (s == sizes)
+				break;
+			w = size[s][0];
+			h = size[s][1];
+			pass = bench_pass + p;
+			n = frames;
+		}
+		else
+		{
+			char name[32];
+			unsigned long long hash;
+			int ret = fscanf(f, "%dx%d %31s %d/%d %llx", &w, &h, name, &i, &n, &hash);
+			if (ret == EOF)
+				break;
+			pass = FindPass(name);
+			if (ret != 6 || !pass || w <= 0 || h <= 0 || n <= 0)
+			{
+				printf("bad line %d in %s\n", poses + 2, path);
+				errors++;
+				break;
+			}
+			expected = hash;
+		}
+
+		if (w != width || h != height)
+		{
+			if (r)
+				DeleteRenderer(r);
+			free(buf);
+
+			width = w;
+			height = h;
+			buf = (AnsiCell*)malloc(sizeof(AnsiCell) * width * height);
+			r = CreateRenderer(0);
+			SetRenderThreads(r, threads);
+			SetRenderIncremental(r, inc != 0);
+			SetRenderFastWater(r, fw != 0);
+			SetRenderLOD(r, ld != 0);
+			SetRenderOcclusion(r, oc != 0);
+		}
+
+		float t = (float)i / n;
+		SetRenderTime(r, 10.0 * t);
+		RenderPose(r, 0, pass, t, width, height, buf);
+		uint64_t hash = GetRenderChecksum(r, buf, width, height);
+
+		if (record)
+			fprintf(f, "%dx%d %s %d/%d %016llx\n", width, height, pass->name, i, n, (unsigned long long)hash);
+		else
+		if (hash != expected)
+		{
+			printf("%dx%d %s %d/%d: %016llx, expected %016llx\n", width, height, pass->name, i, n, (unsigned long long)hash, (unsigned long long)expected);
+			errors++;
+		}
+
+		poses++;
+
+		if (record && ++i == frames)
+		{
+			i = 0;
+			if (++p == bench_passes)
+			{
+				p = 0;
+				s++;
+			}
+		}
+	}
+
+	if (r)
+		DeleteRenderer(r);
+	free(buf);
+	fclose(f);
+
+	if (record)
+		printf("%d checksums written to %s\n", poses, path);
+	else
+		printf("%d poses checked, %d mismatches\n", poses, errors);
+
+	return errors ? 1 : 0;
+}
+
+static void Report(const char* size, const char* pass, float* ms, int n)
+{
+	std::sort(ms, ms + n);
+	int p99 = std::min(n - 1, (int)ceil(n * 0.99) - 1);
+	printf("%-9s %-6s %6d %8.2f %8.2f %8.2f\n", size, pass, n, ms[0], ms[n / 2], ms[p99]);
+}
+
+// ms are per batch of views, throughput is summed over all passes
+static void BenchViews(int (*size)[2], int sizes, int frames, int threads, int views, bool incremental, bool fast_water, bool lod, bool occlusion)
+{
+	int cores = threads > 0 ? threads : (int)std::thread::hardware_concurrency();
+	if (cores <= 0)
+		cores = 1;
+
+	printf("%-9s %-6s %6s %8s %8s %8s %10s\n", "size", "pass", "frames", "min ms", "med ms", "p99 ms", "views/s/core");
+
+	float* ms = (float*)malloc(sizeof(float) * frames);
+	RenderView* rv = (RenderView*)malloc(sizeof(RenderView) * views);
+	RenderBatch* batch = CreateRenderBatch(threads);
+
+	for (int s = 0; s < sizes; s++)
+	{
+		int width = size[s][0];
+		int height = size[s][1];
+		char size_str[32];
+		sprintf(size_str, "%dx%d", width, height);
+
+		uint64_t stamp = 0;
+		for (int i = 0; i < views; i++)
+		{
+			rv[i].renderer = CreateRenderer(stamp);
+			SetRenderIncremental(rv[i].renderer, incremental);
+			SetRenderFastWater(rv[i].renderer, fast_water);
+			SetRenderLOD(rv[i].renderer, lod);
+			SetRenderOcclusion(rv[i].renderer, occlusion);
+			rv[i].width = width;
+			rv[i].height = height;
+			rv[i].ptr = (AnsiCell*)malloc(sizeof(AnsiCell) * width * height);
+			rv[i].player = 0;
+			rv[i].scene_shift[0] = 0;
+			rv[i].scene_shift[1] = 0;
+		}
+
+		for (int p = 0; p < bench_passes; p++)
+		{
+			uint64_t pass_us = 0;
+			for (int i = -1; i < frames; i++) // first one warms up
+			{
+				stamp += 16666;
+				SetupViews(rv, views, bench_pass + p, i < 0 ? 0 : (float)i / frames, width, height);
+
+				uint64_t t0 = BenchClock();
+				RenderViews(batch, stamp, terrain, world, water, lt, rv, views);
+				uint64_t t1 = BenchClock();
+
+				if (i >= 0)
+				{
+					ms[i] = (t1 - t0) / 1000.0f;
+					pass_us += t1 - t0;
+				}
+			}
+
+			double vps = (double)views * frames * 1000000.0 / std::max(pass_us, (uint64_t)1) / cores;
+			std::sort(ms, ms + frames);
+			int p99 = std::min(frames - 1, (int)ceil(frames * 0.99) - 1);
+			printf("%-9s %-6s %6d %8.2f %8.2f %8.2f %10.1f\n", size_str, bench_pass[p].name, frames, ms[0], ms[frames / 2], ms[p99], vps);
+		}
+
+		for (int i = 0; i < views; i++)
+		{
+			DeleteRenderer(rv[i].renderer);
+			free(rv[i].ptr);
+		}
+	}
+
+	DeleteRenderBatch(batch);
+	free(rv);
+	free(ms);
+}
+
+int main(int argc, char* argv[])
+{
+	const char* map = "a3d/game_map_y7.a3d";
+	int threads = 1;
+	int frames = 120; // per pass
+	bool incremental = true;
+	bool fast_water = true;
+	bool lod = true;
+	bool occlusion = true;
+	static const int max_sums = 4;
+	const char* sum_path[max_sums];
+	bool record[max_sums];
+	int sums = 0;
+	int views = 0;
+	int stream = 0;
+	int cold = 0;
+	int bakes = 0;
+
+	static const int max_sizes = 8;
+	int size[max_sizes][2] = { {80,25}, {160,90}, {320,180} };
+	int sizes = 3;
+	bool user_sizes = false;
+
+	for (int p = 1; p + 1 < argc; p += 2)
+	{
+		if (strcmp(argv[p], "-map") == 0)
+			map = argv[p + 1];
+		else
+		if (strcmp(argv[p], "-threads") == 0)
+			threads = atoi(argv[p + 1]);
+		else
+		if (strcmp(argv[p], "-frames") == 0)
+			frames = std::max(1, atoi(argv[p + 1]));
+		else
+		if (strcmp(argv[p], "-incremental") == 0)
+			incremental = atoi(argv[p + 1]) != 0;
+		else
+		if (strcmp(argv[p], "-fast_water") == 0)
+			fast_water = atoi(argv[p + 1]) != 0;
+		else
+		if (strcmp(argv[p], "-lod") == 0)
+			lod = atoi(argv[p + 1]) != 0;
+		else
+		if (strcmp(argv[p], "-occlusion") == 0)
+			occlusion = atoi(argv[p + 1]) != 0;
+		else
+		if (strcmp(argv[p], "-views") == 0)
+			views = std::max(0, atoi(argv[p + 1]));
+		else
+		if (strcmp(argv[p], "-stream") == 0)
+			stream = std::max(0, atoi(argv[p + 1]));
+		else
+		if (strcmp(argv[p], "-cold") == 0)
+			cold = std::max(0, atoi(argv[p + 1]));
+		else
+		if (strcmp(argv[p], "-bake") == 0)
+			bakes = std::max(0, atoi(argv[p + 1]));
+		else
+		if (strcmp(argv[p], "-record") == 0 || strcmp(argv[p], "-check") == 0)
+		{
+			if (sums < max_sums)
+			{
+				sum_path[sums] = argv[p + 1];
+				record[sums] = argv[p][1] == 'r';
+				sums++;
+			}
+		}
+		else
+		if (strcmp(argv[p], "-size") == 0)
+		{
+			if (!user_sizes)
+				sizes = 0;
+			user_sizes = true;
+			if (sizes < max_sizes && sscanf(argv[p + 1], "%dx%d", size[sizes] + 0, size[sizes] + 1) == 2)
+				sizes++;
+		}
+		else
+		{
+			printf("usage: %s [-map a3d] [-threads N] [-frames N] [-incremental 0|1] [-fast_water 0|1] [-lod 0|1] [-occlusion 0|1] [-views N] [-stream N] [-cold N] [-bake N] [-size WxH]... [-record|-check file]...\n", argv[0]);
+			return -1;
+		}
+	}
+
+	LoadSprites();
+
+	FILE* f = fopen(map, "rb");
+	if (!f)
+	{
+		printf("can't open %s\n", map);
+		return -1;
+	}
+
+	terrain = stream ? StreamTerrain(f, stream, cold, lt) : LoadTerrain(f);
+
+	if (terrain)
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			if (fread(mat[i].shade, 1, sizeof(MatCell) * 4 * 16, f) != sizeof(MatCell) * 4 * 16)
+				break;
+		}
+
+		world = LoadWorld(f, false);
+		if (world)
+		{
+			// reload meshes too
+			Mesh* m = GetFirstMesh(world);
+
+			while (m)
+			{
+				char mesh_name[256];
+				GetMeshName(m, mesh_name, 256);
+				char obj_path[4096];
+				sprintf(obj_path, "%smeshes/%s", base_path, mesh_name);
+				UpdateMesh(m, obj_path);
+				m = GetNextMesh(m);
+			}
+		}
+	}
+
+	fclose(f);
+
+	if (!terrain || !world)
+	{
+		printf("can't load %s\n", map);
+		return -1;
+	}
+
+	RebuildWorld(world, true);
+
+	#ifdef DARK_TERRAIN
+	if (!HasTerrainDark(terrain, lt))
+		UpdateTerrainDark(terrain, world, lt, false, threads);
+
+	if (bakes)
+	{
+		float* bake_ms = (float*)malloc(sizeof(float) * bakes);
+		for (int i = 0; i < bakes; i++)
+		{
+			uint64_t t0 = BenchClock();
+			UpdateTerrainDark(terrain, world, lt, false, threads);
+			bake_ms[i] = (BenchClock() - t0) / 1000.0f;
+		}
+
+		printf("shadow bake: %d patches, %d threads\n", GetTerrainPatches(terrain), threads);
+		printf("%-9s %-6s %6s %8s %8s %8s\n", "", "pass", "bakes", "min ms", "med ms", "p99 ms");
+		Report("shadows", "bake", bake_ms, bakes);
+		free(bake_ms);
+	}
+	#endif
+
+	if (sums)
+	{
+		int ret = 0;
+		for (int i = 0; i < sums; i++)
+		{
+			int r = Checksums(sum_path[i], record[i], size, sizes, frames, threads, incremental, fast_water, lod, occlusion);
+			ret = r ? r : ret;
+		}
+		DeleteWorld(world);
+		DeleteTerrain(terrain);
+		FreeSprites();
+		return ret;
+	}
+
+	printf("map: %s, threads: %d, incremental: %d, fast_water: %d, lod: %d, occlusion: %d, frames per pass: %d\n", map, threads, incremental ? 1 : 0, fast_water ? 1 : 0, lod ? 1 : 0, occlusion ? 1 : 0, frames);
+
+	if (views)
+	{
+		printf("views per batch: %d\n", views);
+		BenchViews(size, sizes, frames, threads, views, incremental, fast_water, lod, occlusion);
+		if (stream)
+			printf("terrain: %d patches resident, %zu bytes\n", GetTerrainPatches(terrain), GetTerrainBytes(terrain));
+		DeleteWorld(world);
+		DeleteTerrain(terrain);
+		FreeSprites();
+		return 0;
+	}
+
+	printf("%-9s %-6s %6s %8s %8s %8s\n", "size", "pass", "frames", "min ms", "med ms", "p99 ms");
+
+	float* all_ms = (float*)malloc(sizeof(float) * frames * bench_passes);
+
+	for (int s = 0; s < sizes; s++)
+	{
+		int width = size[s][0];
+		int height = size[s][1];
+		char size_str[32];
+		sprintf(size_str, "%dx%d", width, height);
+
+		AnsiCell* buf = (AnsiCell*)malloc(sizeof(AnsiCell) * width * height);
+
+		// fixed frame stamps, so water animation doesn't depend on timing
+		uint64_t stamp = 0;
+		Renderer* r = CreateRenderer(stamp);
+		SetRenderThreads(r, threads);
+		SetRenderIncremental(r, incremental);
+		SetRenderFastWater(r, fast_water);
+		SetRenderLOD(r, lod);
+		SetRenderOcclusion(r, occlusion);
+
+		int all = 0;
+		for (int p = 0; p < bench_passes; p++)
+		{
+			float* ms = all_ms + all;
+			for (int i = -1; i < frames; i++) // first one warms up
+			{
+				stamp += 16666;
+
+				uint64_t t0 = BenchClock();
+				RenderPose(r, stamp, bench_pass + p, i < 0 ? 0 : (float)i / frames, width, height, buf);
+				uint64_t t1 = BenchClock();
+
+				if (i >= 0)
+					ms[i] = (t1 - t0) / 1000.0f;
+			}
+
+			Report(size_str, bench_pass[p].name, ms, frames);
+			all += frames;
+		}
+
+		Report(size_str, "all", all_ms, all);
+
+		DeleteRenderer(r);
+		free(buf);
+	}
+
+	free(all_ms);
+
+	if (stream)
+		printf("terrain: %d patches resident, %zu bytes\n", GetTerrainPatches(terrain), GetTerrainBytes(terrain));
+
+	DeleteWorld(world);
+	DeleteTerrain(terrain);
+
+	FreeSprites();
+	return 0;
+}
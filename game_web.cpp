@@ -170,7 +170,8 @@ int Main()
             RebuildWorld(world, true);
             #ifdef DARK_TERRAIN
             float lt[4] = { 1,0,1,0.5 };
-            UpdateTerrainDark(terrain, world, lt, false);
+            if (!HasTerrainDark(terrain, lt))
+                UpdateTerrainDark(terrain, world, lt, false);
             #endif    
         }
     }
@@ -184,6 +185,7 @@ int Main()
 
     stamp = GetTime();
     game = CreateGame(water,pos,yaw,dir,stamp);
+    SetRenderIncremental(game->renderer, true);
 
     printf("all ok\n");
     return 0;
@@ -998,7 +998,7 @@ int Animate(Physics* phys, uint64_t stamp, PhysicsIO* io, int mount)
 
 			phys->max_height = io->water;
 
-			QueryWorldCB cb = { Physics::MeshCollect , Physics::SpriteCollect };
+			QueryWorldCB cb = { Physics::MeshCollect , Physics::SpriteCollect, 0 };
 			QueryWorld(phys->world, 4, clip_world, &cb, phys);
 			QueryTerrain(phys->terrain, 4, clip_world, 0xAA, Physics::PatchCollect, phys);
 
@@ -0,0 +1,98 @@
+#pragma once
+
+// coherent rays traced together through terrain quadtree and world BSP
+// node boxes are tested against all lanes at once with slab test,
+// lanes which pass are then intersected with triangles one by one
+
+#include <math.h>
+#include <float.h>
+
+#if (defined(__x86_64__)||defined(_M_X64)) && !defined(__EMSCRIPTEN__)
+#define RAY_PACKET_SSE2
+#include <emmintrin.h>
+#endif
+
+#define RAY_PACKET 8
+
+// boxes are grown a bit so slabs never reject what exact triangle tests would hit
+// (world bboxes are floats)
+#define RAY_PACKET_MARGIN (1.0/16)
+
+struct RayPacket
+{
+	// lane per ray, unused lanes are zeroed
+	double org[3][RAY_PACKET];
+	double inv[3][RAY_PACKET]; // 1/dir, axis parallel lanes get huge finite value so no NaNs come out
+};
+
+inline void InitRayPacket(RayPacket* rp, int rays, double p[][3], double v[][3])
+{
+	for (int a = 0; a < 3; a++)
+	{
+		for (int i = 0; i < RAY_PACKET; i++)
+		{
+			if (i < rays)
+			{
+				rp->org[a][i] = p[i][a];
+				rp->inv[a][i] = fabs(v[i][a]) > 1E-300 ? 1.0 / v[i][a] : 1E300;
+			}
+			else
+			{
+				rp->org[a][i] = 0;
+				rp->inv[a][i] = 0;
+			}
+		}
+	}
+}
+
+// box is {x0,x1,y0,y1,z0,z1}, returns lanes of mask whose lines pass through it,
+// optional far[] rejects lanes which already have hit nearer than box
+inline int HitRayPacket(const RayPacket* rp, int mask, const double box[6], const double far[RAY_PACKET], bool positive_only)
+{
+	int pass = 0;
+
+#ifdef RAY_PACKET_SSE2
+	for (int i = 0; i < RAY_PACKET; i += 2)
+	{
+		if (!((mask >> i) & 3))
+			continue;
+
+		__m128d tlo = _mm_set1_pd(positive_only ? 0.0 : -DBL_MAX);
+		__m128d thi = far ? _mm_loadu_pd(far + i) : _mm_set1_pd(DBL_MAX);
+
+		for (int a = 0; a < 3; a++)
+		{
+			__m128d org = _mm_loadu_pd(rp->org[a] + i);
+			__m128d inv = _mm_loadu_pd(rp->inv[a] + i);
+			__m128d t0 = _mm_mul_pd(_mm_sub_pd(_mm_set1_pd(box[2 * a] - RAY_PACKET_MARGIN), org), inv);
+			__m128d t1 = _mm_mul_pd(_mm_sub_pd(_mm_set1_pd(box[2 * a + 1] + RAY_PACKET_MARGIN), org), inv);
+			tlo = _mm_max_pd(tlo, _mm_min_pd(t0, t1));
+			thi = _mm_min_pd(thi, _mm_max_pd(t0, t1));
+		}
+
+		pass |= _mm_movemask_pd(_mm_cmple_pd(tlo, thi)) << i;
+	}
+#else
+	for (int i = 0; i < RAY_PACKET; i++)
+	{
+		if (!((mask >> i) & 1))
+			continue;
+
+		double tlo = positive_only ? 0.0 : -DBL_MAX;
+		double thi = far ? far[i] : DBL_MAX;
+
+		for (int a = 0; a < 3; a++)
+		{
+			double t0 = (box[2 * a] - RAY_PACKET_MARGIN - rp->org[a][i]) * rp->inv[a][i];
+			double t1 = (box[2 * a + 1] + RAY_PACKET_MARGIN - rp->org[a][i]) * rp->inv[a][i];
+			tlo = fmax(tlo, fmin(t0, t1));
+			thi = fmin(thi, fmax(t0, t1));
+		}
+
+		if (tlo <= thi)
+			pass |= 1 << i;
+	}
+#endif
+
+	return pass & mask;
+}
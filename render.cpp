@@ -17,11 +17,13 @@
 #include "game.h"
 
 #include "PerlinNoise.hpp"
+#include "workers.h"
 
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <float.h>
 #include <string.h>
+#include <chrono>
 
 #ifdef min // thanks windows
 #undef min
@@ -33,18 +35,57 @@
 
 #define DBL
 
+// SSE2 is baseline on x86-64, AVX2 paths are selected at runtime
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(__EMSCRIPTEN__)
+#define RENDER_SIMD
+
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AVX2_TARGET
+#else
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+static bool HasAVX2()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27))) // osxsave
+		return false;
+	if ((_xgetbv(0) & 6) != 6) // xmm and ymm state enabled by os
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+static bool render_avx2 = HasAVX2();
+#endif
+
 extern Character* player_head;
 extern Character* player_tail;
 
-static bool global_refl_mode = false;
+static inline uint64_t StatsClock() // nanoseconds
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 extern Sprite* player_sprite;
 extern Sprite* attack_sprite;
 extern Sprite* inventory_sprite;
 
 void* GetMaterialArr();
 
-template <typename Sample>
-inline void Bresenham(Sample* buf, int w, int h, int from[3], int to[3], int _or)
+// touches only samples inside clip = {x0,y0,x1,y1} (x0 must be even), w is buffer row length
+template <typename Buffer>
+inline void Bresenham(Buffer* buf, int w, const int clip[4], int from[3], int to[3], int _or)
 {
 	int sx = to[0] - from[0];
 	int sy = to[1] - from[1];
@@ -69,22 +110,22 @@ inline void Bresenham(Sample* buf, int w, int h, int from[3], int to[3], int _or
 			to = swap;
 		}
 
-		int	x0 = (std::max(0, from[0]) + 1) & ~1; // round up start x, so we won't produce out of domain samples
-		int	x1 = std::min(w, to[0]);
+		int	x0 = (std::max(clip[0], from[0]) + 1) & ~1; // round up start x, so we won't produce out of domain samples
+		int	x1 = std::min(clip[2], to[0]);
 
 		for (int x = x0; x < x1; x+=2)
 		{
 			float a = x - from[0] + 0.5f;
 			int y = (int)floor((a * sy)*n + from[1] + 0.5f);
-			if (y >= 0 && y < h)
+			if (y >= clip[1] && y < clip[3])
 			{
 				float z = (a * sz) * n + from[2];
-				Sample* ptr = buf + w * y + x;
-				if (ptr->DepthTest_RO(z))
-					ptr->spare |= _or;
-				ptr++;
-				if (ptr->DepthTest_RO(z))
-					ptr->spare |= _or;
+				int i = w * y + x;
+				if (buf->DepthTest_RO(i, z))
+					buf->spare[i] |= _or;
+				i++;
+				if (buf->DepthTest_RO(i, z))
+					buf->spare[i] |= _or;
 			}
 		}
 	}
@@ -100,26 +141,26 @@ inline void Bresenham(Sample* buf, int w, int h, int from[3], int to[3], int _or
 			to = swap;
 		}
 
-		int y0 = std::max(0, from[1]);
-		int y1 = std::min(h, to[1]);
+		int y0 = std::max(clip[1], from[1]);
+		int y1 = std::min(clip[3], to[1]);
 
 		for (int y = y0; y < y1; y++)
 		{
 			int a = y - from[1];
 			int x = (int)floor((a * sx) * n + from[0] + 0.5f);
-			if (x >= 0 && x < w)
+			if (x >= clip[0] && x < clip[2])
 			{
 				float z = (a * sz)*n + from[2];
-				Sample* ptr = buf + w * y + x;
-				if (ptr->DepthTest_RO(z))
-					ptr->spare |= _or;
+				int i = w * y + x;
+				if (buf->DepthTest_RO(i, z))
+					buf->spare[i] |= _or;
 			}
 		}
 	}
 }
 
-template <typename Sample>
-inline void PerspectiveCorrectCellLine(/*const*/Sample* smp, AnsiCell* buf, int w, int h, int from[3], int to[3], float d_from, float d_to, int gl, int fg)
+template <typename Buffer>
+inline void PerspectiveCorrectCellLine(const Buffer* smp, AnsiCell* buf, int w, int h, int from[3], int to[3], float d_from, float d_to, int gl, int fg)
 {
 	int sx = to[0] - from[0];
 	int sy = to[1] - from[1];
@@ -160,8 +201,8 @@ inline void PerspectiveCorrectCellLine(/*const*/Sample* smp, AnsiCell* buf, int
 				ka = ka / ((1 - a * n) * d_from + ka);
 				float z = sz * ka + from[2];
 
-				/*const*/Sample* test = smp + hy * (2 * w + 4) + hx;
-				if (test->DepthTest_RO(z))
+				int test = hy * (2 * w + 4) + hx;
+				if (smp->DepthTest_RO(test, z))
 				{
 					AnsiCell* ptr = buf + w * y + x;
 					int av = AverageGlyph(ptr, 0xF);
@@ -200,8 +241,8 @@ inline void PerspectiveCorrectCellLine(/*const*/Sample* smp, AnsiCell* buf, int
 				ka = ka / ((1 - a * n) * d_from + ka);
 				float z = sz * ka + from[2];
 
-				/*const*/Sample* test = smp + hy * (2 * w + 4) + hx;
-				if (test->DepthTest_RO(z))
+				int test = hy * (2 * w + 4) + hx;
+				if (smp->DepthTest_RO(test, z))
 				{
 					AnsiCell* ptr = buf + w * y + x;
 					int av = AverageGlyph(ptr, 0xF);
@@ -214,8 +255,8 @@ inline void PerspectiveCorrectCellLine(/*const*/Sample* smp, AnsiCell* buf, int
 	}
 }
 
-template <typename Sample>
-inline void CellLine(/*const*/Sample* smp, AnsiCell* buf, int w, int h, int from[3], int to[3], int gl, int fg)
+template <typename Buffer>
+inline void CellLine(const Buffer* smp, AnsiCell* buf, int w, int h, int from[3], int to[3], int gl, int fg)
 {
 	int sx = to[0] - from[0];
 	int sy = to[1] - from[1];
@@ -253,8 +294,8 @@ inline void CellLine(/*const*/Sample* smp, AnsiCell* buf, int w, int h, int from
 				int hy = 2 * y + 2;
 				float z = (a * sz) * n + from[2];
 
-				/*const*/Sample* test = smp + hy * (2 * w + 4) + hx;
-				if (test->DepthTest_RO(z))
+				int test = hy * (2 * w + 4) + hx;
+				if (smp->DepthTest_RO(test, z))
 				{
 					AnsiCell* ptr = buf + w * y + x;
 					int av = AverageGlyph(ptr, 0xF);
@@ -290,8 +331,8 @@ inline void CellLine(/*const*/Sample* smp, AnsiCell* buf, int w, int h, int from
 				int hy = 2 * y + 2;
 				float z = (a * sz) * n + from[2];
 
-				/*const*/Sample* test = smp + hy * (2 * w + 4) + hx;
-				if (test->DepthTest_RO(z))
+				int test = hy * (2 * w + 4) + hx;
+				if (smp->DepthTest_RO(test, z))
 				{
 					AnsiCell* ptr = buf + w * y + x;
 					int av = AverageGlyph(ptr, 0xF);
@@ -311,15 +352,192 @@ inline void CellLine(/*const*/Sample* smp, AnsiCell* buf, int w, int h, int from
 // and provide all varyings interpolated into shader->Blend() call
 // we should do it also for 'z' coord
 
-template <typename Sample, typename Shader>
-inline void Rasterize(Sample* buf, int w, int h, Shader* s, const int* v[3], bool dblsided)
+#ifdef RENDER_SIMD
+// edge functions of N adjacent samples at once, Blend() is called for covered ones
+// results are exactly the same as in scalar loop (same int edge functions, same float ops order)
+
+template <typename Buffer, typename Shader>
+inline void RasterizeSSE2(Buffer* buf, int w, Shader* s, const int* v[3], int left, int right, int bottom, int top, float normalizer, bool neg)
+{
+	#define BC_P(a,b,c) (((b)[0] - (a)[0]) * (2*(c)[1]+1 - 2*(a)[1]) - ((b)[1] - (a)[1]) * (2*(c)[0]+1 - 2*(a)[0]))
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 nrm = _mm_set1_ps(normalizer);
+
+	__m128i step[3], inc[3], tie[3];
+	__m128 vz[3];
+	for (int k = 0; k < 3; k++)
+	{
+		const int* a = v[(k + 1) % 3];
+		const int* b = v[(k + 2) % 3];
+		int d = -2 * (b[1] - a[1]); // edge function x gradient
+		step[k] = _mm_setr_epi32(0, d, 2 * d, 3 * d);
+		inc[k] = _mm_set1_epi32(4 * d);
+		tie[k] = _mm_set1_epi32(a[0] <= b[0] ? -1 : 0); // edge pairing
+		vz[k] = _mm_set1_ps((float)v[k][2]);
+	}
+
+	int col = bottom * w + left;
+	for (int y = bottom; y < top; y++, col += w)
+	{
+		int p[2] = { left,y };
+		__m128i bc[3] =
+		{
+			_mm_add_epi32(_mm_set1_epi32(BC_P(v[1], v[2], p)), step[0]),
+			_mm_add_epi32(_mm_set1_epi32(BC_P(v[2], v[0], p)), step[1]),
+			_mm_add_epi32(_mm_set1_epi32(BC_P(v[0], v[1], p)), step[2])
+		};
+
+		int row = col;
+		for (int x = left; x < right; x += 4, row += 4)
+		{
+			__m128i out;
+			if (neg)
+				out = _mm_or_si128(_mm_or_si128(_mm_cmpgt_epi32(bc[0], zero), _mm_cmpgt_epi32(bc[1], zero)), _mm_cmpgt_epi32(bc[2], zero));
+			else
+				out = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi32(bc[0], zero), _mm_cmplt_epi32(bc[1], zero)), _mm_cmplt_epi32(bc[2], zero));
+
+			out = _mm_or_si128(out, _mm_and_si128(_mm_cmpeq_epi32(bc[0], zero), tie[0]));
+			out = _mm_or_si128(out, _mm_and_si128(_mm_cmpeq_epi32(bc[1], zero), tie[1]));
+			out = _mm_or_si128(out, _mm_and_si128(_mm_cmpeq_epi32(bc[2], zero), tie[2]));
+
+			int mask = ~_mm_movemask_ps(_mm_castsi128_ps(out)) & 0xF;
+			if (right - x < 4)
+				mask &= (1 << (right - x)) - 1;
+
+			if (mask)
+			{
+				float nbc[3][4];
+				float z[4];
+				__m128 n0 = _mm_mul_ps(_mm_cvtepi32_ps(bc[0]), nrm);
+				__m128 n1 = _mm_mul_ps(_mm_cvtepi32_ps(bc[1]), nrm);
+				__m128 n2 = _mm_mul_ps(_mm_cvtepi32_ps(bc[2]), nrm);
+				__m128 vzi = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n0, vz[0]), _mm_mul_ps(n1, vz[1])), _mm_mul_ps(n2, vz[2]));
+
+				// early depth test on height plane, partial spans are left to Blend
+				if (right - x >= 4)
+					mask &= _mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(buf->height + row), vzi));
+
+				_mm_storeu_ps(nbc[0], n0);
+				_mm_storeu_ps(nbc[1], n1);
+				_mm_storeu_ps(nbc[2], n2);
+				_mm_storeu_ps(z, vzi);
+
+				for (int i = 0; i < 4; i++)
+				{
+					if (mask & (1 << i))
+					{
+						float lane_bc[3] = { nbc[0][i], nbc[1][i], nbc[2][i] };
+						s->Blend(buf, row + i, z[i], lane_bc);
+					}
+				}
+			}
+
+			bc[0] = _mm_add_epi32(bc[0], inc[0]);
+			bc[1] = _mm_add_epi32(bc[1], inc[1]);
+			bc[2] = _mm_add_epi32(bc[2], inc[2]);
+		}
+	}
+
+	#undef BC_P
+}
+
+template <typename Buffer, typename Shader>
+AVX2_TARGET inline void RasterizeAVX2(Buffer* buf, int w, Shader* s, const int* v[3], int left, int right, int bottom, int top, float normalizer, bool neg)
+{
+	#define BC_P(a,b,c) (((b)[0] - (a)[0]) * (2*(c)[1]+1 - 2*(a)[1]) - ((b)[1] - (a)[1]) * (2*(c)[0]+1 - 2*(a)[0]))
+
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256 nrm = _mm256_set1_ps(normalizer);
+
+	__m256i step[3], inc[3], tie[3];
+	__m256 vz[3];
+	for (int k = 0; k < 3; k++)
+	{
+		const int* a = v[(k + 1) % 3];
+		const int* b = v[(k + 2) % 3];
+		int d = -2 * (b[1] - a[1]); // edge function x gradient
+		step[k] = _mm256_setr_epi32(0, d, 2 * d, 3 * d, 4 * d, 5 * d, 6 * d, 7 * d);
+		inc[k] = _mm256_set1_epi32(8 * d);
+		tie[k] = _mm256_set1_epi32(a[0] <= b[0] ? -1 : 0); // edge pairing
+		vz[k] = _mm256_set1_ps((float)v[k][2]);
+	}
+
+	int col = bottom * w + left;
+	for (int y = bottom; y < top; y++, col += w)
+	{
+		int p[2] = { left,y };
+		__m256i bc[3] =
+		{
+			_mm256_add_epi32(_mm256_set1_epi32(BC_P(v[1], v[2], p)), step[0]),
+			_mm256_add_epi32(_mm256_set1_epi32(BC_P(v[2], v[0], p)), step[1]),
+			_mm256_add_epi32(_mm256_set1_epi32(BC_P(v[0], v[1], p)), step[2])
+		};
+
+		int row = col;
+		for (int x = left; x < right; x += 8, row += 8)
+		{
+			__m256i out;
+			if (neg)
+				out = _mm256_or_si256(_mm256_or_si256(_mm256_cmpgt_epi32(bc[0], zero), _mm256_cmpgt_epi32(bc[1], zero)), _mm256_cmpgt_epi32(bc[2], zero));
+			else
+				out = _mm256_or_si256(_mm256_or_si256(_mm256_cmpgt_epi32(zero, bc[0]), _mm256_cmpgt_epi32(zero, bc[1])), _mm256_cmpgt_epi32(zero, bc[2]));
+
+			out = _mm256_or_si256(out, _mm256_and_si256(_mm256_cmpeq_epi32(bc[0], zero), tie[0]));
+			out = _mm256_or_si256(out, _mm256_and_si256(_mm256_cmpeq_epi32(bc[1], zero), tie[1]));
+			out = _mm256_or_si256(out, _mm256_and_si256(_mm256_cmpeq_epi32(bc[2], zero), tie[2]));
+
+			int mask = ~_mm256_movemask_ps(_mm256_castsi256_ps(out)) & 0xFF;
+			if (right - x < 8)
+				mask &= (1 << (right - x)) - 1;
+
+			if (mask)
+			{
+				float nbc[3][8];
+				float z[8];
+				__m256 n0 = _mm256_mul_ps(_mm256_cvtepi32_ps(bc[0]), nrm);
+				__m256 n1 = _mm256_mul_ps(_mm256_cvtepi32_ps(bc[1]), nrm);
+				__m256 n2 = _mm256_mul_ps(_mm256_cvtepi32_ps(bc[2]), nrm);
+				__m256 vzi = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(n0, vz[0]), _mm256_mul_ps(n1, vz[1])), _mm256_mul_ps(n2, vz[2]));
+
+				// early depth test on height plane, partial spans are left to Blend
+				if (right - x >= 8)
+					mask &= _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(buf->height + row), vzi, _CMP_LT_OQ));
+
+				_mm256_storeu_ps(nbc[0], n0);
+				_mm256_storeu_ps(nbc[1], n1);
+				_mm256_storeu_ps(nbc[2], n2);
+				_mm256_storeu_ps(z, vzi);
+
+				for (int i = 0; i < 8; i++)
+				{
+					if (mask & (1 << i))
+					{
+						float lane_bc[3] = { nbc[0][i], nbc[1][i], nbc[2][i] };
+						s->Blend(buf, row + i, z[i], lane_bc);
+					}
+				}
+			}
+
+			bc[0] = _mm256_add_epi32(bc[0], inc[0]);
+			bc[1] = _mm256_add_epi32(bc[1], inc[1]);
+			bc[2] = _mm256_add_epi32(bc[2], inc[2]);
+		}
+	}
+
+	#undef BC_P
+}
+#endif
+
+template <typename Buffer, typename Shader>
+inline void Rasterize(Buffer* buf, int w, const int clip[4], Shader* s, const int* v[3], bool dblsided)
 {
 	// each v[i] must point to 4 ints: {x,y,z,f} where f should indicate culling bits (can be 0)
-	// shader must implement: bool Shader::Fill(Sample* s, int bc[3])
-	// where bc contains 3 barycentric weights which are normalized to 0x8000 (use '>>15' after averaging)
-	// Sample must implement bool DepthTest(int z, int divisor);
-	// it must return true if z/divisor passes depth test on this sample
-	// if test passes, it should write new z/d to sample's depth (if something like depth write mask is enabled)
+	// shader must implement: void Shader::Blend(Buffer* buf, int i, float z, float bc[3])
+	// where i is sample index in buffer planes and bc contains 3 normalized barycentric weights
+	// Blend is expected to do nothing if buf->height[i] >= z (simd paths skip such samples)
+	// only samples inside clip = {x0,y0,x1,y1} are touched, w is buffer row length
+	// so bands (or dirty rects) of one buffer can be rasterized independently
 
 	// produces samples between buffer cells 
 	#define BC_A(a,b,c) (2*(((b)[0] - (a)[0]) * ((c)[1] - (a)[1]) - ((b)[1] - (a)[1]) * ((c)[0] - (a)[0])))
@@ -343,15 +561,23 @@ inline void Rasterize(Sample* buf, int w, int h, Shader* s, const int* v[3], boo
 			float normalizer = (1.0f - FLT_EPSILON) / area;
 
 			// canvas intersection with triangle bbox
-			int left = std::max(0, std::min(v[0][0], std::min(v[1][0], v[2][0])));
-			int right = std::min(w, std::max(v[0][0], std::max(v[1][0], v[2][0])));
-			int bottom = std::max(0, std::min(v[0][1], std::min(v[1][1], v[2][1])));
-			int top = std::min(h, std::max(v[0][1], std::max(v[1][1], v[2][1])));
+			int left = std::max(clip[0], std::min(v[0][0], std::min(v[1][0], v[2][0])));
+			int right = std::min(clip[2], std::max(v[0][0], std::max(v[1][0], v[2][0])));
+			int bottom = std::max(clip[1], std::min(v[0][1], std::min(v[1][1], v[2][1])));
+			int top = std::min(clip[3], std::max(v[0][1], std::max(v[1][1], v[2][1])));
+
+			#ifdef RENDER_SIMD
+			if (render_avx2)
+				RasterizeAVX2(buf, w, s, v, left, right, bottom, top, normalizer, false);
+			else
+				RasterizeSSE2(buf, w, s, v, left, right, bottom, top, normalizer, false);
+			return;
+			#endif
 
-			Sample* col = buf + bottom * w + left;
+			int col = bottom * w + left;
 			for (int y = bottom; y < top; y++, col+=w)
 			{
-				Sample* row = col;
+				int row = col;
 				for (int x = left; x < right; x++, row++)
 				{
 					int p[2] = { x,y };
@@ -384,7 +610,7 @@ inline void Rasterize(Sample* buf, int w, int h, Shader* s, const int* v[3], boo
 					};
 
 					float z = nbc[0] * v[0][2] + nbc[1] * v[1][2] + nbc[2] * v[2][2];
-					s->Blend(row,z,nbc);
+					s->Blend(buf, row, z, nbc);
 				}
 			}
 		}
@@ -397,15 +623,23 @@ inline void Rasterize(Sample* buf, int w, int h, Shader* s, const int* v[3], boo
 			float normalizer = (1.0f - FLT_EPSILON) / area;
 
 			// canvas intersection with triangle bbox
-			int left = std::max(0, std::min(v[0][0], std::min(v[1][0], v[2][0])));
-			int right = std::min(w, std::max(v[0][0], std::max(v[1][0], v[2][0])));
-			int bottom = std::max(0, std::min(v[0][1], std::min(v[1][1], v[2][1])));
-			int top = std::min(h, std::max(v[0][1], std::max(v[1][1], v[2][1])));
+			int left = std::max(clip[0], std::min(v[0][0], std::min(v[1][0], v[2][0])));
+			int right = std::min(clip[2], std::max(v[0][0], std::max(v[1][0], v[2][0])));
+			int bottom = std::max(clip[1], std::min(v[0][1], std::min(v[1][1], v[2][1])));
+			int top = std::min(clip[3], std::max(v[0][1], std::max(v[1][1], v[2][1])));
+
+			#ifdef RENDER_SIMD
+			if (render_avx2)
+				RasterizeAVX2(buf, w, s, v, left, right, bottom, top, normalizer, true);
+			else
+				RasterizeSSE2(buf, w, s, v, left, right, bottom, top, normalizer, true);
+			return;
+			#endif
 
-			Sample* col = buf + bottom * w + left;
+			int col = bottom * w + left;
 			for (int y = bottom; y < top; y++, col += w)
 			{
-				Sample* row = col;
+				int row = col;
 				for (int x = left; x < right; x++, row++)
 				{
 					int p[2] = { x,y };
@@ -438,7 +672,7 @@ inline void Rasterize(Sample* buf, int w, int h, Shader* s, const int* v[3], boo
 					};
 
 					float z = nbc[0] * v[0][2] + nbc[1] * v[1][2] + nbc[2] * v[2][2];
-					s->Blend(row, z, nbc);
+					s->Blend(buf, row, z, nbc);
 				}
 			}
 		}
@@ -448,35 +682,81 @@ inline void Rasterize(Sample* buf, int w, int h, Shader* s, const int* v[3], boo
 
 
 
-struct Sample
+// render surface, separate planes of w*h samples
+struct SampleBuffer
 {
-	uint16_t visual;
-	uint8_t diffuse;
-	uint8_t spare;   // refl, patch xy parity etc..., direct color bit (meshes): visual has just 565 color?
-	float height;
+	int w, h; // make 2x +2 bigger than terminal buffer
+	float* height;
+	uint16_t* visual;
+	uint8_t* diffuse;
+	uint8_t* spare;   // refl, patch xy parity etc..., direct color bit (meshes): visual has just 565 color?
 
-	/*
-	inline bool DepthTest_RW(float z)
+	inline bool DepthTest_RO(int i, float z) const
 	{
-		if (height > z)
-			return false;
-		spare &= ~0x4; // clear lines
-		height = z;
-		return true;
+		return height[i] <= z + HEIGHT_SCALE/2;
 	}
-	*/
+};
+
+static void AllocSampleBuffer(SampleBuffer* sb, int w, int h)
+{
+	int n = w * h;
+	uint8_t* block = (uint8_t*)malloc(n * (sizeof(float) + sizeof(uint16_t) + 2 * sizeof(uint8_t)));
+
+	sb->w = w;
+	sb->h = h;
+	sb->height = (float*)block;
+	sb->visual = (uint16_t*)(block + n * sizeof(float));
+	sb->diffuse = (uint8_t*)(sb->visual + n);
+	sb->spare = sb->diffuse + n;
+}
 
-	inline bool DepthTest_RO(float z)
+static void ClearSampleBuffer(SampleBuffer* sb)
+{
+	int n = sb->w * sb->h;
+	float* height = sb->height;
+	uint16_t* visual = sb->visual;
+	for (int i = 0; i < n; i++)
 	{
-		return height <= z + HEIGHT_SCALE/2;
+		height[i] = -1000000;
+		visual[i] = 0xC | (0xC << 5) | (0x1B << 10);
 	}
-};
+	memset(sb->diffuse, 0xFF, n);
+	memset(sb->spare, 0x8, n);
+}
 
-struct SampleBuffer
+static void ClearSampleRect(SampleBuffer* sb, const int rect[4])
 {
-	int w, h; // make 2x +2 bigger than terminal buffer
-	Sample* ptr;
-};
+	int n = rect[2] - rect[0];
+	for (int y = rect[1]; y < rect[3]; y++)
+	{
+		int i = y * sb->w + rect[0];
+		float* height = sb->height + i;
+		uint16_t* visual = sb->visual + i;
+		for (int x = 0; x < n; x++)
+		{
+			height[x] = -1000000;
+			visual[x] = 0xC | (0xC << 5) | (0x1B << 10);
+		}
+		memset(sb->diffuse + i, 0xFF, n);
+		memset(sb->spare + i, 0x8, n);
+	}
+}
+
+// moves all samples by dx,dy, uncovered samples are left with garbage
+static void ScrollSampleBuffer(SampleBuffer* sb, int dx, int dy)
+{
+	int ofs = dx + dy * sb->w;
+	int n = sb->w * sb->h - abs(ofs);
+	if (n <= 0 || !ofs)
+		return;
+
+	int src = ofs < 0 ? -ofs : 0;
+	int dst = ofs > 0 ? ofs : 0;
+	memmove(sb->height + dst, sb->height + src, sizeof(float) * n);
+	memmove(sb->visual + dst, sb->visual + src, sizeof(uint16_t) * n);
+	memmove(sb->diffuse + dst, sb->diffuse + src, n);
+	memmove(sb->spare + dst, sb->spare + src, n);
+}
 
 struct SpriteRenderBuf
 {
@@ -491,17 +771,145 @@ struct SpriteRenderBuf
 	bool refl;
 	Character* character;
 
-	static int FarToNear(const void* a, const void* b)
+	bool HasHPBar() const
 	{
-		const SpriteRenderBuf* p = (const SpriteRenderBuf*)a;
-		const SpriteRenderBuf* q = (const SpriteRenderBuf*)b;
-		
-		if (p->dist > q->dist)
-			return -1;
-		if (p->dist < q->dist)
-			return 1;
-		return 0;
+		return character && !refl && character->req.action != ACTION::DEAD;
+	}
+
+	// cells it can touch, sprite frame and hp bar
+	void Rect(int rect[4]) const
+	{
+		int i = frame + angle * sprite->anim[anim].length;
+		if (refl)
+			i += sprite->anim[anim].length * sprite->angles;
+		const Sprite::Frame* f = sprite->atlas + sprite->anim[anim].frame_idx[i];
+
+		rect[0] = s_pos[0] - f->ref[0] / 2;
+		rect[1] = s_pos[1] - f->ref[1] / 2;
+		rect[2] = rect[0] + f->width;
+		rect[3] = rect[1] + f->height;
+
+		if (HasHPBar())
+		{
+			rect[0] = std::min(rect[0], s_pos[0] - 2);
+			rect[2] = std::max(rect[2], s_pos[0] + 3);
+			rect[1] = std::min(rect[1], s_pos[1] + 10);
+			rect[3] = std::max(rect[3], s_pos[1] + 11);
+		}
+	}
+};
+
+// stable LSD radix sort of sprite indices far to near, by float bits of dist flipped to unsigned order,
+// passes where all sprites share the digit are skipped; key and order must have room for 2*n
+static void SortSprites(const SpriteRenderBuf* spr, int n, uint32_t* key, int* order)
+{
+	uint32_t* k[2] = { key, key + n };
+	int* o[2] = { order, order + n };
+
+	for (int i = 0; i < n; i++)
+	{
+		uint32_t u;
+		memcpy(&u, &spr[i].dist, sizeof(uint32_t));
+		u ^= (u & 0x80000000) ? 0xFFFFFFFF : 0x80000000;
+		k[0][i] = ~u; // far first
+		o[0][i] = i;
 	}
+
+	int src = 0;
+	for (int shift = 0; shift < 32; shift += 8)
+	{
+		int count[256] = { 0 };
+		for (int i = 0; i < n; i++)
+			count[(k[src][i] >> shift) & 0xFF]++;
+
+		if (count[(k[src][0] >> shift) & 0xFF] == n)
+			continue;
+
+		int sum = 0;
+		for (int d = 0; d < 256; d++)
+		{
+			int c = count[d];
+			count[d] = sum;
+			sum += c;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			int j = count[(k[src][i] >> shift) & 0xFF]++;
+			k[src ^ 1][j] = k[src][i];
+			o[src ^ 1][j] = o[src][i];
+		}
+
+		src ^= 1;
+	}
+
+	if (src)
+		memcpy(o[0], o[1], sizeof(int) * n);
+}
+
+// transformed patch, recorded by RenderPatch, rasterized by DrawPatch
+struct PatchJob
+{
+	int xyzf[HEIGHT_CELLS + 1][HEIGHT_CELLS + 1][4];
+	uint16_t* map;
+#ifdef DARK_TERRAIN
+	uint64_t dark;
+#endif
+	float water;
+	float light[4];
+	uint16_t diag;
+	uint8_t parity;
+	uint8_t rect; // Renderer::dirty_rect index, set when binned
+	bool refl;
+	int flat; // HEIGHT_SCALE times cell size in patch cells (node summaries have larger cells)
+};
+
+// transformed face, recorded by RenderFace, rasterized by DrawFace
+struct FaceJob
+{
+	int v[3][4]; // in rasterization order (reversed for reflections)
+	uint8_t rgb[3][4]; // per vertex colors, copied (mesh query passes temporaries)
+	float water;
+	uint8_t diffuse;
+	uint8_t rect; // Renderer::dirty_rect index, set when binned
+	bool refl;
+	bool dblsided;
+	bool line; // only v[0]-v[1] line
+};
+
+// mirrored patch gathered by direct pass query, rendered by Renderer::RenderRefl
+struct ReflPatch
+{
+	Patch* p; // or node summary
+	int x, y;
+	int range; // VISUAL_CELLS for patches
+	int view_flags;
+	int rect; // Renderer::dirty_rect index
+};
+
+// mirrored mesh or sprite inst gathered by direct pass query, rendered by Renderer::RenderRefl
+struct ReflInst
+{
+	Mesh* mesh; // null for sprites
+	double* tm;
+	Inst* inst;
+	Sprite* sprite;
+	float pos[3];
+	float yaw;
+	int anim;
+	int frame;
+	int* reps;
+};
+
+// horizontal slice of sample_buffer rasterized by single worker
+struct RenderBand
+{
+	int items;
+	int items_size;
+	uint32_t* item; // (job index << 1) | is_face, in submission order
+
+	uint64_t raster_ns[2]; // patches, faces
+	int samples;
 };
 
 struct Renderer
@@ -510,19 +918,69 @@ struct Renderer
 	{
 		memset(this, 0, sizeof(Renderer));
 		pn.reseed(std::default_random_engine::default_seed);
+
+		// same permutation as pn's, widened for gathers
+		for (int i = 0; i < 256; i++)
+			water_perm[i] = i;
+		std::shuffle(water_perm, water_perm + 256, std::default_random_engine(std::default_random_engine::default_seed));
+		for (int i = 0; i < 256; i++)
+			water_perm[256 + i] = water_perm[i];
+		fast_water = true;
+		lod = true;
+		culling = true;
 	}
 
 	void Free()
 	{
-		if (sample_buffer.ptr)
-			free(sample_buffer.ptr);
+		if (sample_buffer.height)
+			free(sample_buffer.height);
+		if (scroll_height)
+			free(scroll_height);
 		if (sprites_alloc)
 			free(sprites_alloc);
+		if (sprite_key)
+			free(sprite_key);
+		if (sprite_order)
+			free(sprite_order);
+		if (sprite_rect)
+			free(sprite_rect);
+		if (sprite_bin_ofs)
+			free(sprite_bin_ofs);
+		if (sprite_bin)
+			free(sprite_bin);
+
+		DeleteWorkers(workers);
+		if (patch_job)
+			free(patch_job);
+		if (face_job)
+			free(face_job);
+		if (refl_patch)
+			free(refl_patch);
+		if (refl_inst)
+			free(refl_inst);
+		if (water_mask)
+			free(water_mask);
+		for (int l = 0; l < 2; l++)
+		{
+			if (occl_min[l])
+				free(occl_min[l]);
+			if (occl_stale[l])
+				free(occl_stale[l]);
+		}
+		for (int b = 0; b < bands_size; b++)
+		{
+			if (band[b].item)
+				free(band[b].item);
+		}
+		if (band)
+			free(band);
 	}
 
 	uint64_t stamp;
 	siv::PerlinNoise pn;
 	double pn_time;
+	int32_t water_perm[512];
+	bool fast_water; // see SetRenderFastWater()
 
 	SampleBuffer sample_buffer; // render surface
 
@@ -530,6 +988,17 @@ struct Renderer
 	int sprites;
 	SpriteRenderBuf* sprites_alloc;
 
+	// CompositeSprites() scratch, grows with sprites_alloc
+	uint32_t* sprite_key; // [2*sprites_alloc_size]
+	int* sprite_order; // [2*sprites_alloc_size]
+	int (*sprite_rect)[4]; // [sprites_alloc_size]
+	int sprite_bins_size;
+	int* sprite_bin_ofs; // [tiles+1]
+	int sprite_bin_size;
+	int* sprite_bin; // sprite indices of all tiles, far to near in each
+	void CompositeSprites(AnsiCell* out, int width, int height);
+	void RenderHPBar(AnsiCell* out_ptr, int width, const SpriteRenderBuf* buf, const int clip[4]);
+
 	static const int max_items = 9; // picking with keyb: 1-9, 0-drop
 	int items;
 	Item* item_sort[max_items+1]; // +1 for null-terminator
@@ -543,13 +1012,119 @@ struct Renderer
 	uint8_t* buffer;
 	int buffer_size; // ansi_buffer allocation size in cells (minimize reallocs)
 
+	Inst* skip_inst; // player of batched view, world is shared so it can't be hidden there
+
 	static void RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie /*Renderer*/);
+	static void RenderNode(Patch* p, int x, int y, int range, int view_flags, void* cookie /*Renderer*/);
 	static void RenderSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int anim, int frame, int reps[4], void* cookie /*Renderer*/);
 	static void RenderMesh(Mesh* m, double* tm, void* cookie /*Renderer*/);
 	static void RenderFace(float coords[9], uint8_t colors[12], uint32_t visual, void* cookie /*Renderer*/);
+
+	// ortho face vertex: floor(viewinst_tm * xyz + 0.5f), same result as double product
+	void ProjectFaceVert(const float xyz[3], int v[4]) const;
 	
-	// unstatic -> needs R/W access to sample_buffer.ptr[].height for depth testing!
-	void RenderSprite(AnsiCell* ptr, int width, int height, Sprite* s, bool refl, int anim, int frame, int angle, int pos[3]);
+	// unstatic -> needs R/W access to sample_buffer.height[] for depth testing!
+	// clip (left,bottom,right,top) limits drawing to part of the screen, so it can be split between threads
+	void RenderSprite(AnsiCell* ptr, int width, int height, Sprite* s, bool refl, int anim, int frame, int angle, int pos[3], const int* clip = 0);
+
+	// with single band jobs are rasterized immediately,
+	// otherwise they are binned and rasterized by FlushBands()
+	void SubmitPatch(const PatchJob* job);
+	void SubmitFace(const FaceJob* job);
+	void BinItem(uint32_t item, const int rect[4], int y0, int y1);
+	void SetupBands();
+	void FlushBands();
+	void DrawBand(int b);
+
+	RenderStats stats; // see GetRenderStats()
+	uint64_t raster_ns[2]; // patches, faces rasterized in current frame (wall time)
+
+	Workers* workers; // null -> single threaded
+	int bands; // active bands in current frame
+	int bands_size; // allocated bands
+	int band_h; // sample rows per band
+	RenderBand* band;
+
+	int patch_jobs;
+	int patch_jobs_size;
+	PatchJob* patch_job;
+
+	int face_jobs;
+	int face_jobs_size;
+	FaceJob* face_job;
+
+	// sample rects {x0,y0,x1,y1} rendered in current frame, whole buffer unless scrolling
+	// patches are queried for each rect separately, faces are submitted to all rects they overlap
+	static const int max_dirty = 16;
+	int dirty_rects;
+	int dirty_rect[max_dirty][4];
+	int dirty; // rect of currently queried patches
+	void AddDirty(int x0, int y0, int x1, int y1);
+	void QueryDirty(Terrain* t, double clip_world[][4], double clip_refl[][4], int view_flags);
+	int lod_range; // nodes up to this range are rendered from their summaries (0 disables)
+	bool lod; // see SetRenderLOD()
+
+	// previous frame, for scrolling its samples (see SetRenderIncremental)
+	bool incremental;
+	bool scroll_ok;
+	float* scroll_height; // height plane before sprites wrote into it
+	int scroll_add[3]; // integral translation: x, y, reflection y
+	int scroll_shadow; // player shadow column
+	bool scroll_perspective;
+	float scroll_ds;
+	float scroll_water;
+	Terrain* scroll_terrain;
+	uint64_t scroll_revision; // GetTerrainRevision()
+	World* scroll_world;
+	uint64_t scroll_stamp; // GetWorldChanges() stamp
+
+	// mirrored patches and insts are gathered by the same queries as direct ones,
+	// then rendered only where direct pass left samples reflections can reach
+	bool refl_mode; // mirrored pass in progress
+	double refl_mul[6];
+	double refl_add[3];
+	int refl_patches;
+	int refl_patches_size;
+	ReflPatch* refl_patch;
+	int refl_insts;
+	int refl_insts_size;
+	ReflInst* refl_inst;
+	static void GatherPatch(Patch* p, int x, int y, int view_flags, void* cookie /*Renderer*/);
+	static void GatherNode(Patch* p, int x, int y, int range, int view_flags, void* cookie /*Renderer*/);
+	static void GatherMesh(Mesh* m, double* tm, void* cookie /*Renderer*/);
+	static void GatherSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int anim, int frame, int reps[4], void* cookie /*Renderer*/);
+	void RenderRefl();
+
+	// 1 per water_tile x water_tile samples having any height below water + HEIGHT_SCALE/8
+	static const int water_tile = 8;
+	int water_tiles_w;
+	int water_tiles_h;
+	int water_mask_size;
+	uint8_t* water_mask;
+	void UpdateWaterMask();
+	bool HitWaterMask(int x0, int y0, int x1, int y1, const int rect[4]) const; // inclusive box
+
+	// 2 level pyramid of min sample heights (farthest depth) for occlusion culling of queried
+	// nodes (ortho only), lazily refreshed from height plane, heights only grow while
+	// rendering so stale values are conservative
+	static const int occl_tile = 8; // samples per level 0 tile side, level 1 tile has 4x4 of them
+	bool occlusion; // current frame
+	bool culling; // see SetRenderOcclusion()
+	int occl_w[2];
+	int occl_h[2];
+	int occl_size[2];
+	float* occl_min[2];
+	uint8_t* occl_stale[2];
+	void ResetOcclusion();
+	void StaleOcclusion(int x0, int y0, int x1, int y1); // inclusive box
+	float OcclusionMin(int tx, int ty); // level 0
+	bool Occluded(int x0, int y0, int x1, int y1, const int rect[4], float z); // no sample in box below or at z
+	bool Occluded(const double mul[6], const double add[3], const double box[6], const int rect[4], float z);
+	bool ProjectBox(const double mul[6], const double add[3], const double box[6], int rc[4]) const;
+	static bool OccludedPatch(int x, int y, int range, int lo, int hi, void* cookie /*Renderer*/);
+	static bool OccludedReflPatch(int x, int y, int range, int lo, int hi, void* cookie /*Renderer*/);
+	static bool OccludedMesh(const float bbox[6], void* cookie /*Renderer*/);
+	static bool OccludedReflMesh(const float bbox[6], void* cookie /*Renderer*/);
 
 	// transform
 	double mul[6]; // 3x2 rot part
@@ -569,6 +1144,8 @@ struct Renderer
 
 	double viewinst_tm[16];
 	const double* inst_tm;
+	float viewinst_col[4][4]; // float copy of viewinst_tm columns
+	float viewinst_err[4][4]; // abs of columns scaled by float error bound, +1 in translation
 
 	int patch_uv[HEIGHT_CELLS][2]; // constant
 };
@@ -708,22 +1285,25 @@ static int create_auto_mat(uint8_t mat[])
 	return 1;
 }
 
-void Renderer::RenderFace(float coords[9], uint8_t colors[12], uint32_t visual, void* cookie)
+// returns number of samples covered
+static int DrawFace(const FaceJob* job, SampleBuffer* sb, const int clip[4])
 {
+	int w = sb->w;
 	struct Shader
 	{
-		void Blend(Sample*s, float z, float bc[3])
+		void Blend(SampleBuffer* sb, int i, float z, float bc[3])
 		{
-			if (s->height < z)
+			samples++;
+			if (sb->height[i] < z)
 			{
-				if (global_refl_mode)
+				if (refl)
 				{
 					if (z < water + HEIGHT_SCALE / 8)
 					{
 						if (z > water)
-							s->height = water;
+							sb->height[i] = water;
 						else
-							s->height = z;
+							sb->height[i] = z;
 
 						int r8 = (int)floor(rgb[0][0] * bc[0] + rgb[1][0] * bc[1] + rgb[2][0] * bc[2]);
 						int r5 = (r8 * 249 + 1014) >> 11;
@@ -732,9 +1312,9 @@ void Renderer::RenderFace(float coords[9], uint8_t colors[12], uint32_t visual,
 						int b8 = (int)floor(rgb[0][2] * bc[0] + rgb[1][2] * bc[1] + rgb[2][2] * bc[2]);
 						int b5 = (b8 * 249 + 1014) >> 11;
 
-						s->visual = r5 | (g5 << 5) | (b5 << 10);
-						s->diffuse = diffuse;
-						s->spare = (s->spare & ~0x44) | 0x8 | 0x3;
+						sb->visual[i] = r5 | (g5 << 5) | (b5 << 10);
+						sb->diffuse[i] = diffuse;
+						sb->spare[i] = (sb->spare[i] & ~0x44) | 0x8 | 0x3;
 					}  
 				}
 				else 
@@ -742,9 +1322,9 @@ void Renderer::RenderFace(float coords[9], uint8_t colors[12], uint32_t visual,
 					if (z >= water - HEIGHT_SCALE / 8)
 					{
 						if (z < water)
-							s->height = water;
+							sb->height[i] = water;
 						else
-							s->height = z;
+							sb->height[i] = z;
 
 						int r8 = (int)floor(rgb[0][0] * bc[0] + rgb[1][0] * bc[1] + rgb[2][0] * bc[2]);
 						int r5 = (r8 * 249 + 1014) >> 11;
@@ -753,71 +1333,101 @@ void Renderer::RenderFace(float coords[9], uint8_t colors[12], uint32_t visual,
 						int b8 = (int)floor(rgb[0][2] * bc[0] + rgb[1][2] * bc[1] + rgb[2][2] * bc[2]);
 						int b5 = (b8 * 249 + 1014) >> 11;
 
-						s->visual = r5 | (g5 << 5) | (b5 << 10);
-						s->diffuse = diffuse;
-						s->spare = (s->spare & ~(0x3|0x44)) | 0x8 | 0x1;
+						sb->visual[i] = r5 | (g5 << 5) | (b5 << 10);
+						sb->diffuse[i] = diffuse;
+						sb->spare[i] = (sb->spare[i] & ~(0x3|0x44)) | 0x8 | 0x1;
 					}
 				}
 			}
 		}
 
-		/*
-		void Refl(Sample* s, float bc[3]) const
-		{
-			if (s->height < water)
-			{
-				int r8 = (int)floor(rgb[0][0] * bc[0] + rgb[1][0] * bc[1] + rgb[2][0] * bc[2]);
-				int r5 = (r8 * 249 + 1014) >> 11;
-				int g8 = (int)floor(rgb[0][1] * bc[0] + rgb[1][1] * bc[1] + rgb[2][1] * bc[2]);
-				int g5 = (g8 * 249 + 1014) >> 11;
-				int b8 = (int)floor(rgb[0][2] * bc[0] + rgb[1][2] * bc[1] + rgb[2][2] * bc[2]);
-				int b5 = (b8 * 249 + 1014) >> 11;
-
-				s->visual = r5 | (g5 << 5) | (b5 << 10);
-				s->diffuse = diffuse;
-				s->spare |= 0x8 | 0x3;
-			}
-		}
-
-		void Fill(Sample* s, float bc[3]) const
-		{
-			if (s->height >= water)
-			{
-				int r8 = (int)floor(rgb[0][0] * bc[0] + rgb[1][0] * bc[1] + rgb[2][0] * bc[2]);
-				int r5 = (r8 * 249 + 1014) >> 11;
-				int g8 = (int)floor(rgb[0][1] * bc[0] + rgb[1][1] * bc[1] + rgb[2][1] * bc[2]);
-				int g5 = (g8 * 249 + 1014) >> 11;
-				int b8 = (int)floor(rgb[0][2] * bc[0] + rgb[1][2] * bc[1] + rgb[2][2] * bc[2]);
-				int b5 = (b8 * 249 + 1014) >> 11;
-
-				s->visual = r5 | (g5 << 5) | (b5 << 10);
-				s->diffuse = diffuse;
-				s->spare |= 0x8;
-			}
-			else
-				s->height = -1000000;
-			//	s->spare = 3;
-		}
-		*/
-
-		/*
-		inline void Diffuse(int dzdx, int dzdy)
-		{
-			float nl = (float)sqrt(dzdx * dzdx + dzdy * dzdy + HEIGHT_SCALE * HEIGHT_SCALE);
-			float df = (dzdx * light[0] + dzdy * light[1] + HEIGHT_SCALE * light[2]) / nl;
-			df = df * (1.0f - 0.5f*light[3]) + 0.5f*light[3];
-			diffuse = df <= 0 ? 0 : (int)(df * 0xFF);
-		}
-		*/
-
-		uint8_t* rgb[3]; // per vertex colors
+		const uint8_t (*rgb)[4]; // per vertex colors
 		float water;
-		float light[4];
+		int samples;
 		uint8_t diffuse; // shading experiment
+		bool refl;
 	} shader;
 
+	if (job->line)
+	{
+		int from[3] = { job->v[0][0], job->v[0][1], job->v[0][2] };
+		int to[3] = { job->v[1][0], job->v[1][1], job->v[1][2] };
+		Bresenham(sb, w, clip, from, to, 0x40);
+		return 0;
+	}
+
+	shader.rgb = job->rgb;
+	shader.water = job->water;
+	shader.diffuse = job->diffuse;
+	shader.refl = job->refl;
+	shader.samples = 0;
+
+	const int* pv[3] = { job->v[0],job->v[1],job->v[2] };
+	Rasterize(sb, w, clip, &shader, pv, job->dblsided);
+	return shader.samples;
+}
+
+// float transforms differ from double ones by less than few float ulps of the magnitudes involved,
+// it can change rounded result only if value lands within such distance from rounding boundary
+static const float project_tolerance = 1.0f / (1 << 20);
+
+void Renderer::ProjectFaceVert(const float xyz[3], int v[4]) const
+{
+#ifdef RENDER_SIMD
+	__m128 x = _mm_set1_ps(xyz[0]);
+	__m128 y = _mm_set1_ps(xyz[1]);
+	__m128 z = _mm_set1_ps(xyz[2]);
+
+	__m128 f = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(_mm_loadu_ps(viewinst_col[0]), x),
+		_mm_mul_ps(_mm_loadu_ps(viewinst_col[1]), y)),
+		_mm_mul_ps(_mm_loadu_ps(viewinst_col[2]), z)),
+		_mm_loadu_ps(viewinst_col[3]));
+	f = _mm_add_ps(f, _mm_set1_ps(0.5f));
+
+	__m128 sign = _mm_set1_ps(-0.0f);
+	__m128 err = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(_mm_loadu_ps(viewinst_err[0]), _mm_andnot_ps(sign, x)),
+		_mm_mul_ps(_mm_loadu_ps(viewinst_err[1]), _mm_andnot_ps(sign, y))),
+		_mm_mul_ps(_mm_loadu_ps(viewinst_err[2]), _mm_andnot_ps(sign, z))),
+		_mm_loadu_ps(viewinst_err[3]));
+
+	// floor
+	__m128i i = _mm_cvttps_epi32(f);
+	__m128 fi = _mm_cvtepi32_ps(i);
+	__m128 gt = _mm_cmpgt_ps(fi, f);
+	i = _mm_add_epi32(i, _mm_castps_si128(gt));
+	fi = _mm_sub_ps(fi, _mm_and_ps(gt, _mm_set1_ps(1.0f)));
+
+	__m128 frac = _mm_sub_ps(f, fi);
+	__m128 near = _mm_or_ps(_mm_cmplt_ps(frac, err), _mm_cmpgt_ps(_mm_add_ps(frac, err), _mm_set1_ps(1.0f)));
+
+	if (!(_mm_movemask_ps(near) & 7))
+	{
+		_mm_storeu_si128((__m128i*)v, i);
+		v[3] = 0; // clip flags
+		return;
+	}
+#endif
+
+	float xyzw[] = { xyz[0], xyz[1], xyz[2], 1.0f };
+	float tmp[4];
+	Product(viewinst_tm, xyzw, tmp);
+	v[0] = (int)floor(tmp[0] + 0.5f);
+	v[1] = (int)floor(tmp[1] + 0.5f);
+	v[2] = (int)floor(tmp[2] + 0.5f);
+	v[3] = 0; // clip flags
+}
+
+void Renderer::RenderFace(float coords[9], uint8_t colors[12], uint32_t visual, void* cookie)
+{
 	Renderer* r = (Renderer*)cookie;
-	shader.water = r->water;
+
+	FaceJob job;
+	job.water = r->water;
+	job.refl = r->refl_mode;
+	job.dblsided = (visual & (1<<30)) != 0;
+	job.line = false;
 
 	// temporarily, let's transform verts for each face separately
 
@@ -827,10 +1437,11 @@ void Renderer::RenderFace(float coords[9], uint8_t colors[12], uint32_t visual,
 
 	{
 		float xyzw[] = { coords[0], coords[1], coords[2], 1.0f };
-		Product(r->viewinst_tm, xyzw, tmp0);
 
 		if (r->perspective) // #if PERSPECTIVE_TEST 
 		{
+			Product(r->viewinst_tm, xyzw, tmp0);
+
 			float ws[4];
 			Product(r->inst_tm, xyzw, ws);
 			float viewer_dist; // {vx,vy,vz}  r->pos
@@ -865,19 +1476,17 @@ void Renderer::RenderFace(float coords[9], uint8_t colors[12], uint32_t visual,
 		}
 		else //#else
 		{
-			v[0][0] = (int)floor(tmp0[0] + 0.5f);
-			v[0][1] = (int)floor(tmp0[1] + 0.5f);
-			v[0][2] = (int)floor(tmp0[2] + 0.5f);
-			v[0][3] = 0; // clip flags
+			r->ProjectFaceVert(coords + 0, v[0]);
 		} //#endif
 	}
 
 	{
 		float xyzw[] = { coords[3], coords[4], coords[5], 1.0f };
-		Product(r->viewinst_tm, xyzw, tmp1);
 
 		if (r->perspective) // #if PERSPECTIVE_TEST
 		{
+			Product(r->viewinst_tm, xyzw, tmp1);
+
 			float ws[4];
 			Product(r->inst_tm, xyzw, ws);
 			float viewer_dist; // {vx,vy,vz}  r->pos
@@ -912,25 +1521,26 @@ void Renderer::RenderFace(float coords[9], uint8_t colors[12], uint32_t visual,
 		}
 		else // #else
 		{
-			v[1][0] = (int)floor(tmp1[0] + 0.5f);
-			v[1][1] = (int)floor(tmp1[1] + 0.5f);
-			v[1][2] = (int)floor(tmp1[2] + 0.5f);
-			v[1][3] = 0; // clip flags
+			r->ProjectFaceVert(coords + 3, v[1]);
 		} //#endif
 	}
 
 	if (visual & (1<<31))
 	{
-		Bresenham(r->sample_buffer.ptr,r->sample_buffer.w,r->sample_buffer.h, v[0], v[1], 0x40);
+		job.line = true;
+		memcpy(job.v[0], v[0], sizeof(int[4]));
+		memcpy(job.v[1], v[1], sizeof(int[4]));
+		r->SubmitFace(&job);
 		return;
 	}
 
 	{
 		float xyzw[] = { coords[6], coords[7], coords[8], 1.0f };
-		Product(r->viewinst_tm, xyzw, tmp2);
 
 		if (r->perspective) // #if PERSPECTIVE_TEST
 		{
+			Product(r->viewinst_tm, xyzw, tmp2);
+
 			float ws[4];
 			Product(r->inst_tm, xyzw, ws);
 			float viewer_dist; // {vx,vy,vz}  r->pos
@@ -965,17 +1575,10 @@ void Renderer::RenderFace(float coords[9], uint8_t colors[12], uint32_t visual,
 		}
 		else // #else
 		{
-			v[2][0] = (int)floor(tmp2[0] + 0.5f);
-			v[2][1] = (int)floor(tmp2[1] + 0.5f);
-			v[2][2] = (int)floor(tmp2[2] + 0.5f);
-			v[2][3] = 0; // clip flags
+			r->ProjectFaceVert(coords + 6, v[2]);
 		} // #endif
 	}
 
-	int w = r->sample_buffer.w;
-	int h = r->sample_buffer.h;
-	Sample* ptr = r->sample_buffer.ptr;
-
 	// normal is const, could be baked into mesh
 	float e1[] = { coords[3] - coords[0], coords[4] - coords[1], coords[5] - coords[2] };
 	float e2[] = { coords[6] - coords[0], coords[7] - coords[1], coords[8] - coords[2] };
@@ -1007,33 +1610,31 @@ void Renderer::RenderFace(float coords[9], uint8_t colors[12], uint32_t visual,
 	if (df < 0)
 		df = 0;
 
-	shader.diffuse = (int)(df * 0xFF);
+	job.diffuse = (int)(df * 0xFF);
 
-	if (global_refl_mode)
+	if (r->refl_mode)
 	{
-		const int* pv[3] = { v[2],v[1],v[0] };
-		shader.rgb[0] = colors + 8;
-		shader.rgb[1] = colors + 4;
-		shader.rgb[2] = colors + 0;
-
-		//for (int i = 0; i < 12; i++)
-		//	colors[i] = colors[i] * 3 / 4;
-
-		Rasterize(r->sample_buffer.ptr, r->sample_buffer.w, r->sample_buffer.h, &shader, pv, visual&(1<<30));
+		// reversed winding
+		for (int i = 0; i < 3; i++)
+		{
+			memcpy(job.v[i], v[2 - i], sizeof(int[4]));
+			memcpy(job.rgb[i], colors + 4 * (2 - i), 4);
+		}
 	}
 	else
 	{
-		const int* pv[3] = { v[0],v[1],v[2] };
-		shader.rgb[0] = colors + 0;
-		shader.rgb[1] = colors + 4;
-		shader.rgb[2] = colors + 8;
-		Rasterize(r->sample_buffer.ptr, r->sample_buffer.w, r->sample_buffer.h, &shader, pv, visual&(1<<30));
+		memcpy(job.v, v, sizeof(int[3][4]));
+		memcpy(job.rgb, colors, 12);
 	}
+
+	r->SubmitFace(&job);
 }
 
 void Renderer::RenderSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int anim, int frame, int reps[4], void* cookie /*Renderer*/)
 {
 	Renderer* r = (Renderer*)cookie;
+	if (inst == r->skip_inst)
+		return;
 
 	Character* h = (Character*)GetInstSpriteData(inst);
 
@@ -1042,7 +1643,7 @@ void Renderer::RenderSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int
 	if (h && h->req.action == ACTION::DEAD)
 	{
 		// we need to list his items if nearby
-		if (!global_refl_mode)
+		if (!r->refl_mode)
 		{
 			float dx = r->pos[0] - pos[0];
 			float dy = r->pos[1] - pos[1];
@@ -1100,7 +1701,7 @@ void Renderer::RenderSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int
 
 		// calc distance to player
 		// and choose upto 3 closest items
-		if (!global_refl_mode)
+		if (!r->refl_mode)
 		{
 			float dx = r->pos[0] - pos[0];
 			float dy = r->pos[1] - pos[1];
@@ -1170,14 +1771,18 @@ void Renderer::RenderSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int
 		}
 	}
 
-	if (global_refl_mode && s->projs == 1)
+	if (r->refl_mode && s->projs == 1)
 		return;
 
 	// transform and append to sprite render list
 	if (r->sprites == r->sprites_alloc_size)
 	{
-		r->sprites_alloc_size += 16;
+		// kept between frames, so crowded scenes stop reallocating after first one
+		r->sprites_alloc_size = r->sprites_alloc_size ? 2 * r->sprites_alloc_size : 64;
 		r->sprites_alloc = (SpriteRenderBuf*)realloc(r->sprites_alloc, sizeof(SpriteRenderBuf) * r->sprites_alloc_size);
+		r->sprite_key = (uint32_t*)realloc(r->sprite_key, sizeof(uint32_t) * 2 * r->sprites_alloc_size);
+		r->sprite_order = (int*)realloc(r->sprite_order, sizeof(int) * 2 * r->sprites_alloc_size);
+		r->sprite_rect = (int(*)[4])realloc(r->sprite_rect, sizeof(int[4]) * r->sprites_alloc_size);
 	}
 
 	SpriteRenderBuf* buf = r->sprites_alloc + r->sprites;
@@ -1195,7 +1800,7 @@ void Renderer::RenderSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int
 
 	viewer_dist = DotProduct(eye_to_vtx, r->view_dir);
 
-	if (global_refl_mode)
+	if (r->refl_mode)
 	{
 		if (r->perspective) // #if PERSPECTIVE_TEST
 		{
@@ -1352,7 +1957,7 @@ void Renderer::RenderSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int
 	buf->reps[1] = reps[1];
 	buf->reps[2] = reps[2];
 	buf->reps[3] = reps[3];
-	buf->refl = global_refl_mode;
+	buf->refl = r->refl_mode;
 
 	buf->character = h;
 
@@ -1368,12 +1973,21 @@ void Renderer::RenderMesh(Mesh* m, double* tm, void* cookie)
 	{
 		r->mul[0] * HEIGHT_CELLS, r->mul[1] * HEIGHT_CELLS, 0.0, 0.0,
 		r->mul[2] * HEIGHT_CELLS, r->mul[3] * HEIGHT_CELLS, 0.0, 0.0,
-		r->mul[4], r->mul[5], global_refl_mode ? -1.0 : 1.0, 0.0,
+		r->mul[4], r->mul[5], r->refl_mode ? -1.0 : 1.0, 0.0,
 		r->add[0], r->add[1], r->add[2], 1.0
 	};
 
 	r->inst_tm = tm;
 	MatProduct(view_tm, tm, r->viewinst_tm);
+
+	for (int c = 0; c < 4; c++)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			r->viewinst_col[c][i] = (float)r->viewinst_tm[4 * c + i];
+			r->viewinst_err[c][i] = (float)(fabs(r->viewinst_tm[4 * c + i]) + (c == 3 ? 1.0 : 0.0)) * project_tolerance;
+		}
+	}
 	QueryMesh(m, Renderer::RenderFace, r);
 
 	// transform verts int integer coords
@@ -1393,22 +2007,25 @@ void Renderer::RenderMesh(Mesh* m, double* tm, void* cookie)
 }
 
 // we could easily make it template of <Sample,Shader>
-void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie /*Renderer*/)
+// returns number of samples covered
+static int DrawPatch(const PatchJob* job, const int (*uv)[2], SampleBuffer* sb, const int clip[4])
 {
+	int w = sb->w;
 	struct Shader
 	{
-		void Blend(Sample*s, float z, float bc[3])
+		void Blend(SampleBuffer* sb, int i, float z, float bc[3])
 		{
-			if (s->height < z)
+			samples++;
+			if (sb->height[i] < z)
 			{
-				if (global_refl_mode)
+				if (refl)
 				{
 					if (z < water + HEIGHT_SCALE / 8)
 					{
 						if (z > water)
-							s->height = water;
+							sb->height[i] = water;
 						else
-							s->height = z;
+							sb->height[i] = z;
 
 						int u = (int)floor(uv[0] * bc[0] + uv[2] * bc[1] + uv[4] * bc[2]);
 						int v = (int)floor(uv[1] * bc[0] + uv[3] * bc[1] + uv[5] * bc[2]);
@@ -1417,15 +2034,15 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 						if (u >= VISUAL_CELLS || v >= VISUAL_CELLS)
 						{
 							// detect overflow
-							s->visual = 2;
+							sb->visual[i] = 2;
 						}
 						else
 						*/
 						{
-							s->visual = map[v * VISUAL_CELLS + u];
-							s->diffuse = diffuse;
-							s->spare |= parity | 0x3;
-							s->spare &= ~(0x44|0x8); // clear mesh and lines
+							sb->visual[i] = map[v * VISUAL_CELLS + u];
+							sb->diffuse[i] = diffuse;
+							sb->spare[i] |= parity | 0x3;
+							sb->spare[i] &= ~(0x44|0x8); // clear mesh and lines
 						}
 					}
 				}
@@ -1434,9 +2051,9 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 					if (z >= water - HEIGHT_SCALE / 8)
 					{
 						if (z < water)
-							s->height = water;
+							sb->height[i] = water;
 						else
-							s->height = z;
+							sb->height[i] = z;
 
 						int u = (int)floor(uv[0] * bc[0] + uv[2] * bc[1] + uv[4] * bc[2]);
 						int v = (int)floor(uv[1] * bc[0] + uv[3] * bc[1] + uv[5] * bc[2]);
@@ -1445,7 +2062,7 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 						if (u >= VISUAL_CELLS || v >= VISUAL_CELLS)
 						{
 							// detect overflow
-							s->visual = 2;
+							sb->visual[i] = 2;
 						}
 						else
 						*/
@@ -1453,322 +2070,79 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 							int visual_idx = v * VISUAL_CELLS + u;
 							uint16_t m = map[visual_idx];
 							if (m & 0x8000)
-								s->height += HEIGHT_SCALE;
+								sb->height[i] += HEIGHT_SCALE;
 
-							s->visual = m;
-							s->diffuse = diffuse;
+							sb->visual[i] = m;
+							sb->diffuse[i] = diffuse;
 
 							#ifdef DARK_TERRAIN
 							if (dark&(((uint64_t)1) << visual_idx))
 							{
-								if (s->diffuse > 64)
-									s->diffuse -= 64;
+								if (sb->diffuse[i] > 64)
+									sb->diffuse[i] -= 64;
 								else
-									s->diffuse = 0;
+									sb->diffuse[i] = 0;
 							}
 							#endif
 
 							/*
 							if (dark&(((uint64_t)1) << visual_idx))
-								s->diffuse /= 4;
+								sb->diffuse[i] /= 4;
 							else
-								s->diffuse *= 16;
+								sb->diffuse[i] *= 16;
 							*/
 
-							s->spare = (s->spare & ~(0x8|0x3|0x44)) | parity; // clear refl, mesh and line, then add parity
+							sb->spare[i] = (sb->spare[i] & ~(0x8|0x3|0x44)) | parity; // clear refl, mesh and line, then add parity
 						}
 					}
 				}
 			}
 		}
 
-		/*
-		void Refl(Sample* s, float bc[3]) const
+		inline void Diffuse(int dzdx, int dzdy)
 		{
-			if (s->height < water)
-			{
-				int u = (int)floor(uv[0] * bc[0] + uv[2] * bc[1] + uv[4] * bc[2]);
-				int v = (int)floor(uv[1] * bc[0] + uv[3] * bc[1] + uv[5] * bc[2]);
-
-				if (u >= VISUAL_CELLS || v >= VISUAL_CELLS)
-				{
-					// detect overflow
-					s->visual = 2;
-				}
-				else
-				{
-					s->visual = map[v * VISUAL_CELLS + u];
-					s->diffuse = diffuse;
-					s->spare |= parity;
-				}
-			}
-		}
-
-		void Fill(Sample* s, float bc[3]) const
-		{
-			if (s->height >= water)
-			{
-				int u = (int)floor(uv[0] * bc[0] + uv[2] * bc[1] + uv[4] * bc[2]);
-				int v = (int)floor(uv[1] * bc[0] + uv[3] * bc[1] + uv[5] * bc[2]);
-
-				if (u >= VISUAL_CELLS || v >= VISUAL_CELLS)
-				{
-					// detect overflow
-					s->visual = 2;
-				}
-				else
-				{
-					s->visual = map[v * VISUAL_CELLS + u];
-					s->diffuse = diffuse;
-					s->spare |= parity;
-				}
-			}
-			else
-				s->height = -1000000;
-			//else
-			//	s->spare = 3;
-		}
-		*/
-
-		inline void Diffuse(int dzdx, int dzdy)
-		{
-			float nl = (float)sqrt(dzdx * dzdx + dzdy * dzdy + HEIGHT_SCALE * HEIGHT_SCALE);
-			float df = (dzdx * light[0] + dzdy * light[1] + HEIGHT_SCALE * light[2]) / nl;
-			df = df * (1.0f - 0.5f*light[3]) + 0.5f*light[3];
-			diffuse = df <= 0 ? 0 : (int)(df * 0xFF);
+			float nl = (float)sqrt(dzdx * dzdx + dzdy * dzdy + flat * flat);
+			float df = (dzdx * light[0] + dzdy * light[1] + flat * light[2]) / nl;
+			df = df * (1.0f - 0.5f*light[3]) + 0.5f*light[3];
+			diffuse = df <= 0 ? 0 : (int)(df * 0xFF);
 		}
 
 		int* uv; // points to array of 6 ints (u0,v0,u1,v1,u2,v2) each is equal to 0 or VISUAL_CELLS
 		uint16_t* map; // points to array of VISUAL_CELLS x VISUAL_CELLS ushorts
 		float water;
 		float light[4];
+		int samples;
 		uint8_t diffuse; // shading experiment
 		uint8_t parity;
+		bool refl;
+		int flat;
 #ifdef DARK_TERRAIN
 		uint64_t dark;
 #endif
 	} shader;
 
-	Renderer* r = (Renderer*)cookie;
-
-	double* mul = r->mul;
-
-	int iadd[2] = { (int)r->add[0], (int)r->add[1] };
-	double* add = r->add;
-
-	int w = r->sample_buffer.w;
-	int h = r->sample_buffer.h;
-	Sample* ptr = r->sample_buffer.ptr;
-
-	uint16_t* hmap = GetTerrainHeightMap(p);
-	
-	uint16_t* hm = hmap;
-
-	// transform patch verts xy+dx+dy, together with hmap into this array
-	int xyzf[HEIGHT_CELLS + 1][HEIGHT_CELLS + 1][4];
-
-	for (int dy = 0; dy <= HEIGHT_CELLS; dy++)
-	{
-		int vy = y * HEIGHT_CELLS + dy * VISUAL_CELLS;
-
-		for (int dx = 0; dx <= HEIGHT_CELLS; dx++)
-		{
-			int vx = x * HEIGHT_CELLS + dx * VISUAL_CELLS;
-			int vz = *(hm++);
-
-			if (global_refl_mode)
-			{
-				if (r->perspective) // #if PERSPECTIVE_TEST
-				{
-					float viewer_dist; // {vx,vy,vz}  r->pos
-					float eye_to_vtx[3] =
-					{
-						vx - r->view_pos[0],
-						vy - r->view_pos[1],
-						vz - r->view_pos[2],
-					};
-
-					viewer_dist = DotProduct(eye_to_vtx, r->view_dir);
-					if (viewer_dist > 0)
-					{
-						viewer_dist = 1.0/viewer_dist;
-
-						float fx = mul[0] * vx + mul[2] * vy;// + add[0];
-						float fy = mul[1] * vx + mul[3] * vy + mul[5] * vz;// + add[1];
-
-						fx *= viewer_dist;
-						fy *= viewer_dist;
-
-						float qx = (add[0] - r->view_ofs[0]) * viewer_dist + r->view_ofs[0];
-						float qy = (add[1] - r->view_ofs[1]) * viewer_dist + r->view_ofs[1];
-
-						fx += qx;
-						fy += qy;
-
-						int tx = (int)floorf(fx + 0.5f);
-						int ty = (int)floorf(fy + 0.5f);
-
-						xyzf[dy][dx][0] = tx;
-						xyzf[dy][dx][1] = ty;
-						xyzf[dy][dx][2] = (int)(2 * r->water) - vz;
-
-						// todo: if patch is known to fully fit in screen, set f=0 
-						// otherwise we need to check if / which screen edges cull each vertex
-						xyzf[dy][dx][3] = (tx < 0) | ((tx > w) << 1) | ((ty < 0) << 2) | ((ty > h) << 3);
-					}
-					else
-					{
-						// cull entire patch if any vertex is behind view_pos
-						return;
-					}
-				}
-				else // #else
-				{
-					if (r->int_flag)
-					{
-						int tx = (int)floor(mul[0] * vx + mul[2] * vy + 0.5 + add[0]);
-						int ty = (int)floor(mul[1] * vx + mul[3] * vy + mul[5] * vz + 0.5 + add[1]);
-
-						xyzf[dy][dx][0] = tx;
-						xyzf[dy][dx][1] = ty;
-						xyzf[dy][dx][2] = (int)(2 * r->water) - vz;
-
-						// todo: if patch is known to fully fit in screen, set f=0 
-						// otherwise we need to check if / which screen edges cull each vertex
-						xyzf[dy][dx][3] = (tx < 0) | ((tx > w) << 1) | ((ty < 0) << 2) | ((ty > h) << 3);
-					}
-					else
-					{
-						int tx = (int)floor(mul[0] * vx + mul[2] * vy + 0.5) + iadd[0];
-						int ty = (int)floor(mul[1] * vx + mul[3] * vy + mul[5] * vz + 0.5) + iadd[1];
-
-						xyzf[dy][dx][0] = tx;
-						xyzf[dy][dx][1] = ty;
-						xyzf[dy][dx][2] = (int)(2 * r->water) - vz;
-
-						// todo: if patch is known to fully fit in screen, set f=0 
-						// otherwise we need to check if / which screen edges cull each vertex
-						xyzf[dy][dx][3] = (tx < 0) | ((tx > w) << 1) | ((ty < 0) << 2) | ((ty > h) << 3);
-					}
-				} // #endif
-			}
-			else
-			{
-				if (r->perspective) // #if PERSPECTIVE_TEST
-				{
-					float viewer_dist; // {vx,vy,vz}  r->pos
-					float eye_to_vtx[3] =
-					{
-						vx - r->view_pos[0],
-						vy - r->view_pos[1],
-						vz - r->view_pos[2],
-					};
-
-					viewer_dist = DotProduct(eye_to_vtx, r->view_dir);
-					if (viewer_dist > 0)
-					{
-						viewer_dist = 1.0/viewer_dist;
-						
-						float fx = mul[0] * vx + mul[2] * vy;// + add[0];
-						float fy = mul[1] * vx + mul[3] * vy + mul[5] * vz;// + add[1];
-
-						fx *= viewer_dist;
-						fy *= viewer_dist;
-
-						float qx = (add[0] - r->view_ofs[0]) * viewer_dist + r->view_ofs[0];
-						float qy = (add[1] - r->view_ofs[1]) * viewer_dist + r->view_ofs[1];
-
-						fx += qx;
-						fy += qy;
-
-						int tx = (int)floorf(fx + 0.5f);
-						int ty = (int)floorf(fy + 0.5f);
-
-						xyzf[dy][dx][0] = tx;
-						xyzf[dy][dx][1] = ty;
-						xyzf[dy][dx][2] = vz;
-
-						// todo: if patch is known to fully fit in screen, set f=0 
-						// otherwise we need to check if / which screen edges cull each vertex
-						xyzf[dy][dx][3] = (tx < 0) | ((tx > w) << 1) | ((ty < 0) << 2) | ((ty > h) << 3);
-					}
-					else
-					{
-						// cull entire patch if any vertex is behind view_pos
-						return;
-					}
-				}
-				else // #else
-				{
-					// transform 
-					if (r->int_flag)
-					{
-						int tx = (int)floor(mul[0] * vx + mul[2] * vy + 0.5 + add[0]);
-						int ty = (int)floor(mul[1] * vx + mul[3] * vy + mul[5] * vz + 0.5 + add[1]);
-
-						xyzf[dy][dx][0] = tx;
-						xyzf[dy][dx][1] = ty;
-						xyzf[dy][dx][2] = vz;
-
-						// todo: if patch is known to fully fit in screen, set f=0 
-						// otherwise we need to check if / which screen edges cull each vertex
-						xyzf[dy][dx][3] = (tx < 0) | ((tx > w) << 1) | ((ty < 0) << 2) | ((ty > h) << 3);
-					}
-					else
-					{
-						int tx = (int)floor(mul[0] * vx + mul[2] * vy + 0.5) + iadd[0];
-						int ty = (int)floor(mul[1] * vx + mul[3] * vy + mul[5] * vz + 0.5) + iadd[1];
-
-						xyzf[dy][dx][0] = tx;
-						xyzf[dy][dx][1] = ty;
-						xyzf[dy][dx][2] = vz;
-
-						// todo: if patch is known to fully fit in screen, set f=0 
-						// otherwise we need to check if / which screen edges cull each vertex
-						xyzf[dy][dx][3] = (tx < 0) | ((tx > w) << 1) | ((ty < 0) << 2) | ((ty > h) << 3);
-					}
-				} // #endif
-			}
-		}
-	}
-
-	uint16_t  diag = GetTerrainDiag(p);
-
-	// 2 parity bits for drawing lines around patches
-	// 0 - no patch rendered here
-	// 1 - odd
-	// 2 - even
-	// 3 - under water
+	const int (*xyzf)[HEIGHT_CELLS + 1][4] = job->xyzf;
+	uint16_t diag = job->diag;
 
 #ifdef DARK_TERRAIN
-	shader.dark = GetTerrainDark(p);
+	shader.dark = job->dark;
 #endif
 
-	shader.parity = (((x^y)/VISUAL_CELLS) & 1) + 1; 
-	shader.water = r->water;
-	shader.map = GetTerrainVisualMap(p);
-
-	shader.light[0] = r->light[0];
-	shader.light[1] = r->light[1];
-	shader.light[2] = r->light[2];
-	shader.light[3] = r->light[3];
+	shader.samples = 0;
+	shader.parity = job->parity;
+	shader.flat = job->flat;
+	shader.water = job->water;
+	shader.map = job->map;
+	shader.refl = job->refl;
 
-	/*
-	shader.light[0] = 0;
-	shader.light[1] = 0;
-	shader.light[2] = 1;
-	*/
-
-//	if (shader.parity == 1)
-//		return;
-
-	hm = hmap;
+	shader.light[0] = job->light[0];
+	shader.light[1] = job->light[1];
+	shader.light[2] = job->light[2];
+	shader.light[3] = job->light[3];
 
-	const int (*uv)[2] = r->patch_uv;
-
-	for (int dy = 0; dy < HEIGHT_CELLS; dy++, hm++)
+	for (int dy = 0; dy < HEIGHT_CELLS; dy++)
 	{
-		for (int dx = 0; dx < HEIGHT_CELLS; dx++,diag>>=1, hm++)
+		for (int dx = 0; dx < HEIGHT_CELLS; dx++, diag>>=1)
 		{
 			//if (!(diag & 1))
 			if (diag & 1)
@@ -1783,14 +2157,14 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 				// then if current light timestamp is different than in terrain we need to update diffuse (into terrain)
 				// now we should simply use diffuse from terrain
 				// note: if terrain is being modified, we should clear its timestamp or immediately update diffuse
-				if (global_refl_mode)
+				if (job->refl)
 				{
 					//done
 					int lo_uv[] = { uv[dx][0],uv[dy][1], uv[dx][1],uv[dy][0], uv[dx][0],uv[dy][0] };
 					const int* lo[3] = { xyzf[dy + 1][dx], xyzf[dy][dx + 1], xyzf[dy][dx] };
 					shader.uv = lo_uv;
 					shader.Diffuse(-xyzf[dy][dx][2] + xyzf[dy][dx + 1][2], -xyzf[dy][dx][2] + xyzf[dy + 1][dx][2]);
-					Rasterize(ptr, w, h, &shader, lo, false);
+					Rasterize(sb, w, clip, &shader, lo, false);
 				}
 				else
 				{
@@ -1798,7 +2172,7 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 					const int* lo[3] = { xyzf[dy][dx], xyzf[dy][dx + 1], xyzf[dy + 1][dx] };
 					shader.uv = lo_uv;
 					shader.Diffuse(xyzf[dy][dx][2] - xyzf[dy][dx + 1][2], xyzf[dy][dx][2] - xyzf[dy + 1][dx][2]);
-					Rasterize(ptr, w, h, &shader, lo, false);
+					Rasterize(sb, w, clip, &shader, lo, false);
 				}
 
 				// .__.
@@ -1806,14 +2180,14 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 				//   \|
 				//    '
 				// upper triangle
-				if (global_refl_mode)
+				if (job->refl)
 				{
 					//done
 					int up_uv[] = { uv[dx][1],uv[dy][0], uv[dx][0],uv[dy][1], uv[dx][1],uv[dy][1] };
 					const int* up[3] = { xyzf[dy][dx + 1], xyzf[dy + 1][dx], xyzf[dy + 1][dx + 1] };
 					shader.uv = up_uv;
 					shader.Diffuse(-xyzf[dy + 1][dx][2] + xyzf[dy + 1][dx + 1][2], -xyzf[dy][dx + 1][2] + xyzf[dy + 1][dx + 1][2]);
-					Rasterize(ptr, w, h, &shader, up, false);
+					Rasterize(sb, w, clip, &shader, up, false);
 				}
 				else
 				{
@@ -1821,7 +2195,7 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 					const int* up[3] = { xyzf[dy + 1][dx + 1], xyzf[dy + 1][dx], xyzf[dy][dx + 1] };
 					shader.uv = up_uv;
 					shader.Diffuse(xyzf[dy + 1][dx][2] - xyzf[dy + 1][dx + 1][2], xyzf[dy][dx + 1][2] - xyzf[dy + 1][dx + 1][2]);
-					Rasterize(ptr, w, h, &shader, up, false);
+					Rasterize(sb, w, clip, &shader, up, false);
 				}
 			}
 			else
@@ -1831,14 +2205,14 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 				//   /|
 				//  /_|
 				// '  '
-				if (global_refl_mode)
+				if (job->refl)
 				{
 					// done
 					int lo_uv[] = { uv[dx][0],uv[dy][0], uv[dx][1],uv[dy][1], uv[dx][1],uv[dy][0] };
 					const int* lo[3] = { xyzf[dy][dx], xyzf[dy + 1][dx + 1], xyzf[dy][dx + 1] };
 					shader.uv = lo_uv;
 					shader.Diffuse(-xyzf[dy][dx][2] + xyzf[dy][dx + 1][2], -xyzf[dy][dx + 1][2] + xyzf[dy + 1][dx + 1][2]);
-					Rasterize(ptr, w, h, &shader, lo, false);
+					Rasterize(sb, w, clip, &shader, lo, false);
 				}
 				else
 				{
@@ -1846,7 +2220,7 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 					const int* lo[3] = { xyzf[dy][dx + 1], xyzf[dy + 1][dx + 1], xyzf[dy][dx] };
 					shader.uv = lo_uv;
 					shader.Diffuse(xyzf[dy][dx][2] - xyzf[dy][dx + 1][2], xyzf[dy][dx + 1][2] - xyzf[dy + 1][dx + 1][2]);
-					Rasterize(ptr, w, h, &shader, lo, false);
+					Rasterize(sb, w, clip, &shader, lo, false);
 				}
 
 
@@ -1855,14 +2229,14 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 				// | / 
 				// |/  
 				// '
-				if (global_refl_mode)
+				if (job->refl)
 				{
 					//done
 					int up_uv[] = { uv[dx][1],uv[dy][1], uv[dx][0],uv[dy][0], uv[dx][0],uv[dy][1] };
 					const int* up[3] = { xyzf[dy + 1][dx + 1], xyzf[dy][dx], xyzf[dy + 1][dx]  };
 					shader.uv = up_uv;
 					shader.Diffuse(-xyzf[dy + 1][dx][2] + xyzf[dy + 1][dx + 1][2], -xyzf[dy][dx][2] + xyzf[dy + 1][dx][2]);
-					Rasterize(ptr, w, h, &shader, up, false);
+					Rasterize(sb, w, clip, &shader, up, false);
 				}
 				else
 				{
@@ -1870,498 +2244,1567 @@ void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie
 					const int* up[3] = { xyzf[dy + 1][dx], xyzf[dy][dx], xyzf[dy + 1][dx + 1] };
 					shader.uv = up_uv;
 					shader.Diffuse(xyzf[dy + 1][dx][2] - xyzf[dy + 1][dx + 1][2], xyzf[dy][dx][2] - xyzf[dy + 1][dx][2]);
-					Rasterize(ptr, w, h, &shader, up, false);
+					Rasterize(sb, w, clip, &shader, up, false);
 				}
 			}
 		}
 	}
 
 
-	if (!global_refl_mode) // disabled on reflections
+	if (!job->refl) // disabled on reflections
 	{
 		// grid lines thru middle of patch?
 		int mid = (HEIGHT_CELLS + 1) / 2;
 
+		int line[2][HEIGHT_CELLS + 1][3];
 		for (int lin = 0; lin <= HEIGHT_CELLS; lin++)
 		{
-			xyzf[lin][mid][2] += HEIGHT_SCALE / 2;
-			if (mid != lin)
-				xyzf[mid][lin][2] += HEIGHT_SCALE / 2;
+			line[0][lin][0] = xyzf[lin][mid][0];
+			line[0][lin][1] = xyzf[lin][mid][1];
+			line[0][lin][2] = xyzf[lin][mid][2] + HEIGHT_SCALE / 2;
+			line[1][lin][0] = xyzf[mid][lin][0];
+			line[1][lin][1] = xyzf[mid][lin][1];
+			line[1][lin][2] = xyzf[mid][lin][2] + HEIGHT_SCALE / 2;
 		}
 
 		for (int lin = 0; lin < HEIGHT_CELLS; lin++)
 		{
-			Bresenham(ptr, w, h, xyzf[lin][mid], xyzf[lin + 1][mid], 0x04);
-			Bresenham(ptr, w, h, xyzf[mid][lin], xyzf[mid][lin + 1], 0x04);
+			Bresenham(sb, w, clip, line[0][lin], line[0][lin + 1], 0x04);
+			Bresenham(sb, w, clip, line[1][lin], line[1][lin + 1], 0x04);
 		}
 	}
+
+	return shader.samples;
 }
 
-void Renderer::RenderSprite(AnsiCell* ptr, int width, int height, Sprite* s, bool refl, int anim, int frame, int angle, int pos[3])
+#ifdef RENDER_SIMD
+// dx,dy of patch verts in SIMD lanes
+static const struct PatchGrid
 {
-	// intersect frame with screen buffer
-	int i = frame + angle * s->anim[anim].length;
-	if (refl)
-		i += s->anim[anim].length * s->angles;
+	static const int lanes = (HEIGHT_CELLS + 1) * (HEIGHT_CELLS + 1) & ~3;
+	float d[2][lanes];
 
-	Sprite::Frame* f = s->atlas + s->anim[anim].frame_idx[i];
+	PatchGrid()
+	{
+		for (int i = 0; i < lanes; i++)
+		{
+			d[0][i] = (float)(i % (HEIGHT_CELLS + 1));
+			d[1][i] = (float)(i / (HEIGHT_CELLS + 1));
+		}
+	}
+} patch_grid;
+#endif
 
-	int dx = f->ref[0] / 2;
-	int dy = f->ref[1] / 2;
+// ortho transform of (HEIGHT_CELLS+1)^2 patch verts into xyzf[][][0..1]:
+// tx = floor(mul[0] * vx + mul[2] * vy + 0.5 + add[0])
+// ty = floor(mul[1] * vx + mul[3] * vy + mul[5] * vz + 0.5 + add[1])
+// computed in float relative to patch origin, verts close to rounding boundary are redone in double
+static void ProjectPatch(const double mul[6], const double add[2], int x, int y, int range, const uint16_t* hm, int (*xyzf)[HEIGHT_CELLS + 1][4])
+{
+	static const int verts = (HEIGHT_CELLS + 1) * (HEIGHT_CELLS + 1);
 
-	int left   = pos[0] - dx;
-	int right  = left + f->width;
-	int bottom = pos[1] - dy;
-	int top    = bottom + f->height;
+	int vx0 = x * HEIGHT_CELLS;
+	int vy0 = y * HEIGHT_CELLS;
 
-	left = std::max(0, left);
-	right = std::min(width, right);
+	float ox = (float)(mul[0] * vx0 + mul[2] * vy0 + 0.5 + add[0]);
+	float oy = (float)(mul[1] * vx0 + mul[3] * vy0 + 0.5 + add[1]);
+	float xx = (float)(mul[0] * range), xy = (float)(mul[2] * range);
+	float yx = (float)(mul[1] * range), yy = (float)(mul[3] * range), yz = (float)mul[5];
 
-	if (left >= right)
-		return;
+	float ex = (fabsf(ox) + HEIGHT_CELLS * (fabsf(xx) + fabsf(xy)) + 1) * project_tolerance;
+	float ey = (fabsf(oy) + HEIGHT_CELLS * (fabsf(yx) + fabsf(yy)) + 1) * project_tolerance;
+	float ez = fabsf(yz) * project_tolerance;
 
-	bottom = std::max(0, bottom);
-	top = std::min(height, top);
+	int (*txy)[4] = xyzf[0];
+	int i = 0;
 
-	if (bottom >= top)
-		return;
+#ifdef RENDER_SIMD
+	const float (*grid)[PatchGrid::lanes] = patch_grid.d;
+	__m128 one = _mm_set1_ps(1.0f);
 
-	int sample_xy = 2 + 2 * (2 + 2 * width + 2);
-	int sample_dx = 2;
-	int sample_dy = 2 * (2 + 2 * width + 2);
-	int sample_ofs[4] = { 0, 1, 2 + 2 * width + 2, 2 + 2 * width + 2 + 1 };
+	for (; i < PatchGrid::lanes; i += 4)
+	{
+		__m128 dx = _mm_loadu_ps(grid[0] + i);
+		__m128 dy = _mm_loadu_ps(grid[1] + i);
+		__m128 dz = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)(hm + i)), _mm_setzero_si128()));
 
-	//static const float height_scale = HEIGHT_SCALE / 1.5; // WHY?????  HS*DBL/ZOOM ?
+		__m128 f[2] =
+		{
+			_mm_add_ps(_mm_add_ps(_mm_set1_ps(ox), _mm_mul_ps(_mm_set1_ps(xx), dx)), _mm_mul_ps(_mm_set1_ps(xy), dy)),
+			_mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_set1_ps(oy), _mm_mul_ps(_mm_set1_ps(yx), dx)), _mm_mul_ps(_mm_set1_ps(yy), dy)), _mm_mul_ps(_mm_set1_ps(yz), dz))
+		};
 
-	static const float ds = 2.0 * (/*zoom*/ 1.0 * /*scale*/ 3.0) / VISUAL_CELLS * 0.5 /*we're not dbl_wh*/;
-	static const float dz_dy = HEIGHT_SCALE / (cos(30 * M_PI / 180) * HEIGHT_CELLS * ds);
+		__m128 e[2] = { _mm_set1_ps(ex), _mm_add_ps(_mm_set1_ps(ey), _mm_mul_ps(_mm_set1_ps(ez), dz)) };
 
-	for (int y = bottom; y < top; y++)
-	{
-		int fy = y - pos[1] + dy;
-		for (int x = left; x < right; x++)
+		__m128i t[2];
+		__m128 near = _mm_setzero_ps();
+		for (int c = 0; c < 2; c++)
 		{
-			int fx = x - pos[0] + dx;
-			AnsiCell* dst = ptr + x + width * y;
-			const AnsiCell* src = f->cell + fx + fy * f->width;
-
-			int depth_passed = 0;
+			// floor
+			t[c] = _mm_cvttps_epi32(f[c]);
+			__m128 ft = _mm_cvtepi32_ps(t[c]);
+			__m128 gt = _mm_cmpgt_ps(ft, f[c]);
+			t[c] = _mm_add_epi32(t[c], _mm_castps_si128(gt));
+			ft = _mm_sub_ps(ft, _mm_and_ps(gt, one));
+
+			__m128 frac = _mm_sub_ps(f[c], ft);
+			near = _mm_or_ps(near, _mm_or_ps(_mm_cmplt_ps(frac, e[c]), _mm_cmpgt_ps(_mm_add_ps(frac, e[c]), one)));
+		}
 
-			Sample* s00 = sample_buffer.ptr + sample_xy + x * sample_dx + y * sample_dy;
-			Sample* s01 = s00 + 1;
-			Sample* s10 = s00 + 2 + 2 * width + 2;
-			Sample* s11 = s10 + 1;
+		int tx[4], ty[4];
+		_mm_storeu_si128((__m128i*)tx, t[0]);
+		_mm_storeu_si128((__m128i*)ty, t[1]);
+		int redo = _mm_movemask_ps(near);
 
-			// spare is in full blocks, ref in half!
-			float height = (2 * src->spare + f->ref[2]) * 0.5 * dz_dy + pos[2]; // *height_scale + pos[2]; // transform!
-			if (!refl && height >= water || refl && height <= water)
+		for (int j = 0; j < 4; j++)
+		{
+			if (redo & (1 << j))
 			{
-				// early rejection
-				if (src->bk == 255 && src->fg == 255 ||
-					(src->gl == 32 || src->gl == 0) && src->bk == 255 ||
-					src->gl == 219 && src->fg == 255)
-				{
-					// NOP
-				}
-				else
-				if (src->fg == 254) // swoosh
-				{
-					// note: if both fg and bk are swoosh, 
-					// case is unified to fg swoosh with glyph 219
-					// during sprite loading!
+				int vx = vx0 + (int)grid[0][i + j] * range;
+				int vy = vy0 + (int)grid[1][i + j] * range;
+				int vz = hm[i + j];
+				tx[j] = (int)floor(mul[0] * vx + mul[2] * vy + 0.5 + add[0]);
+				ty[j] = (int)floor(mul[1] * vx + mul[3] * vy + mul[5] * vz + 0.5 + add[1]);
+			}
+			txy[i + j][0] = tx[j];
+			txy[i + j][1] = ty[j];
+		}
+	}
+#endif
 
-					// sprites MUST be sorted by viewing dir (from furthest to nearest)
-					// otherwise swoosh/smoke fx could get overwriten by further sprites!
+	for (; i < verts; i++)
+	{
+		int dx = i % (HEIGHT_CELLS + 1);
+		int dy = i / (HEIGHT_CELLS + 1);
+		int vz = hm[i];
 
-					int mask = 0;
-					if (height >= s00->height)
-					{
-						// s00->height = height;
-						mask |= 1;
-					}
-					if (height >= s01->height)
-					{
-						// s01->height = height;
-						mask |= 2;
-					}
-					if (height >= s10->height)
-					{
-						// s10->height = height;
-						mask |= 4;
-					}
-					if (height >= s11->height)
-					{
-						// s11->height = height;
-						mask |= 8;
-					}
+		float f[2] =
+		{
+			ox + xx * dx + xy * dy,
+			oy + yx * dx + yy * dy + yz * vz
+		};
+		float e[2] = { ex, ey + ez * vz };
 
-					if (!mask)
-						continue;
+		bool near = false;
+		for (int c = 0; c < 2; c++)
+		{
+			float ft = floorf(f[c]);
+			float frac = f[c] - ft;
+			near |= frac < e[c] || frac + e[c] > 1.0f;
+			txy[i][c] = (int)ft;
+		}
 
-					switch (src->gl)
-					{
-						case 219: // fullblock
-						{
-							if (mask == 15)
-							{
-								dst->bk = LightenColor(dst->bk);
-								dst->fg = LightenColor(dst->fg);
-								break;
-							}
+		if (near)
+		{
+			int vx = vx0 + dx * range;
+			int vy = vy0 + dy * range;
+			txy[i][0] = (int)floor(mul[0] * vx + mul[2] * vy + 0.5 + add[0]);
+			txy[i][1] = (int)floor(mul[1] * vx + mul[3] * vy + mul[5] * vz + 0.5 + add[1]);
+		}
+	}
+}
 
-							// no break is intentional here
-						}
+// perspective transform of patch verts into xyzf[][][0..1], exactly as scalar formula:
+// d = 1 / dot(v - view_pos, view_dir) in float, mul.v and (add - view_ofs) * d + view_ofs in double
+// returns false if any vert is behind view_pos (whole patch is culled)
+static bool ProjectPatchPersp(const Renderer* r, int x, int y, int range, const uint16_t* hm, int (*xyzf)[HEIGHT_CELLS + 1][4])
+{
+	static const int verts = (HEIGHT_CELLS + 1) * (HEIGHT_CELLS + 1);
 
-						default:
-							int fg = LightenColor(AverageGlyph(dst, mask));
-							if (src->bk == 255)
-								dst->bk = AverageGlyph(dst, 0xF ^ mask);
-							else
-								dst->bk = src->bk;
-							dst->fg = fg;
-							dst->gl = src->gl;
-					}
-				}
-				else
-				if (src->bk == 254) // swoosh
-				{
-					int mask = 0;
-					if (height >= s00->height)
-					{
-						s00->height = height;
-						mask |= 1;
-					}
-					if (height >= s01->height)
-					{
-						s01->height = height;
-						mask |= 2;
-					}
-					if (height >= s10->height)
-					{
-						s10->height = height;
-						mask |= 4;
-					}
-					if (height >= s11->height)
-					{
-						s11->height = height;
-						mask |= 8;
-					}
+	const double* mul = r->mul;
+	const double* add = r->add;
 
-					if (!mask)
-						continue;
+	int vx0 = x * HEIGHT_CELLS;
+	int vy0 = y * HEIGHT_CELLS;
 
-					switch (src->gl)
-					{
-						case 0:
-						case 32: // spaces
-						{
-							if (mask == 15)
-							{
-								dst->bk = LightenColor(dst->bk);
-								dst->fg = LightenColor(dst->fg);
-								break;
-							}
+	int (*txy)[4] = xyzf[0];
+	int i = 0;
 
-							// no break is intentional here
-						}
+#ifdef RENDER_SIMD
+	const float (*grid)[PatchGrid::lanes] = patch_grid.d;
 
-						default:
+	__m128 vp[3] = { _mm_set1_ps(r->view_pos[0]), _mm_set1_ps(r->view_pos[1]), _mm_set1_ps(r->view_pos[2]) };
+	__m128 vd[3] = { _mm_set1_ps(r->view_dir[0]), _mm_set1_ps(r->view_dir[1]), _mm_set1_ps(r->view_dir[2]) };
+	__m128d m[5] = { _mm_set1_pd(mul[0]), _mm_set1_pd(mul[1]), _mm_set1_pd(mul[2]), _mm_set1_pd(mul[3]), _mm_set1_pd(mul[5]) };
+	__m128d ofs[2] = { _mm_set1_pd(r->view_ofs[0]), _mm_set1_pd(r->view_ofs[1]) };
+	__m128d aofs[2] = { _mm_set1_pd(add[0] - r->view_ofs[0]), _mm_set1_pd(add[1] - r->view_ofs[1]) };
+	__m128 half = _mm_set1_ps(0.5f);
+	__m128 one = _mm_set1_ps(1.0f);
 
-							int bk = LightenColor(AverageGlyph(dst, 0xF ^ mask));
-							if (src->fg == 255)
-								dst->fg = AverageGlyph(dst, mask);
-							else
-								dst->fg = src->fg;
+	for (; i < PatchGrid::lanes; i += 4)
+	{
+		__m128i ix = _mm_setr_epi32(
+			vx0 + (int)grid[0][i] * range, vx0 + (int)grid[0][i + 1] * range,
+			vx0 + (int)grid[0][i + 2] * range, vx0 + (int)grid[0][i + 3] * range);
+		__m128i iy = _mm_setr_epi32(
+			vy0 + (int)grid[1][i] * range, vy0 + (int)grid[1][i + 1] * range,
+			vy0 + (int)grid[1][i + 2] * range, vy0 + (int)grid[1][i + 3] * range);
+		__m128i iz = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)(hm + i)), _mm_setzero_si128());
+
+		__m128 dist = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(ix), vp[0]), vd[0]),
+			_mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(iy), vp[1]), vd[1])),
+			_mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(iz), vp[2]), vd[2]));
+
+		if (_mm_movemask_ps(_mm_cmple_ps(dist, _mm_setzero_ps())))
+			return false;
 
-							dst->bk = bk;
-							dst->gl = src->gl;
-					}
-				}
-				else
-				// full block write with FG & BK
-				if (src->bk != 255 && src->fg != 255)
-				{
-					int mask = 0;
-					if (height >= s00->height)
-					{
-						s00->height = height;
-						mask|=1;
-					}
-					if (height >= s01->height)
-					{
-						s01->height = height;
-						mask |= 2;
-					}
-					if (height >= s10->height)
-					{
-						s10->height = height;
-						mask |= 4;
-					}
-					if (height >= s11->height)
-					{
-						s11->height = height;
-						mask |= 8;
-					}
+		__m128 rcp = _mm_div_ps(one, dist); // same as rounding double 1.0/dist to float
 
-					if (mask == 0xF)
-					{
-						*dst = *src;
-					}
-					else
-					if (mask == 0x0)
-					{
-					}
-					else
-					if (mask==0x3) // lower
-					{
-						dst->bk = AverageGlyph(dst, 0xC);
-						dst->fg = AverageGlyph(src, 0x3);
-						dst->gl = 220;
-					}
-					else
-					if (mask == 0xC) // upper
-					{
-						dst->bk = AverageGlyph(dst, 0x3);
-						dst->fg = AverageGlyph(src, 0xC);
-						dst->gl = 223;
-					}
-					else
-					if (mask == 0x5) // left
-					{
-						dst->bk = AverageGlyph(dst, 0xA);
-						dst->fg = AverageGlyph(src, 0x5);
-						dst->gl = 221;
-					}
-					else
-					if (mask == 0xA) // right
-					{
-						dst->bk = AverageGlyph(dst, 0x5);
-						dst->fg = AverageGlyph(src, 0xA);
-						dst->gl = 222;
-					}
-					else
-					{
-						dst->bk = AverageGlyph(dst, 0xF-mask);
-						dst->fg = AverageGlyph(dst, mask);
-						if (mask == 1 || mask == 2 || mask == 4 || mask == 8)
-							dst->gl = 176;
-						else
-						if (mask == 9 || mask == 6)
-							dst->gl = 177;
-						else
-							dst->gl = 178;
-					}
-				}
-				else
-				// full block write with BK
-				if (src->bk != 255 && (src->gl == 32 || src->gl == 0))
-				{
-					int mask = 0;
-					if (height >= s00->height)
-					{
-						s00->height = height;
-						mask |= 1;
-					}
-					if (height >= s01->height)
-					{
-						s01->height = height;
-						mask |= 2;
-					}
-					if (height >= s10->height)
-					{
-						s10->height = height;
-						mask |= 4;
-					}
-					if (height >= s11->height)
-					{
-						s11->height = height;
-						mask |= 8;
-					}
+		__m128 f[2];
+		for (int h = 0; h < 2; h++)
+		{
+			// 2 lanes at a time in double
+			__m128 rh = h ? _mm_movehl_ps(rcp, rcp) : rcp;
+			__m128d dx = _mm_cvtepi32_pd(h ? _mm_shuffle_epi32(ix, _MM_SHUFFLE(3, 2, 3, 2)) : ix);
+			__m128d dy = _mm_cvtepi32_pd(h ? _mm_shuffle_epi32(iy, _MM_SHUFFLE(3, 2, 3, 2)) : iy);
+			__m128d dz = _mm_cvtepi32_pd(h ? _mm_shuffle_epi32(iz, _MM_SHUFFLE(3, 2, 3, 2)) : iz);
+			__m128d dr = _mm_cvtps_pd(rh);
+
+			__m128 fx = _mm_cvtpd_ps(_mm_add_pd(_mm_mul_pd(m[0], dx), _mm_mul_pd(m[2], dy)));
+			__m128 fy = _mm_cvtpd_ps(_mm_add_pd(_mm_add_pd(_mm_mul_pd(m[1], dx), _mm_mul_pd(m[3], dy)), _mm_mul_pd(m[4], dz)));
+			__m128 qx = _mm_cvtpd_ps(_mm_add_pd(_mm_mul_pd(aofs[0], dr), ofs[0]));
+			__m128 qy = _mm_cvtpd_ps(_mm_add_pd(_mm_mul_pd(aofs[1], dr), ofs[1]));
+
+			// x0 y0 x1 y1
+			f[h] = _mm_add_ps(_mm_mul_ps(_mm_unpacklo_ps(fx, fy), _mm_unpacklo_ps(rh, rh)), _mm_unpacklo_ps(qx, qy));
+		}
 
-					if (mask == 0xF)
-					{
-						dst->gl = 219;
-						dst->fg = src->bk;
-					}
-					else
-					if (mask == 0x0)
-					{
-					}
-					else
-					if (mask==0x3) // lower
-					{
-						dst->bk = AverageGlyph(dst, 0xC);
-						dst->fg = src->bk;
-						dst->gl = 220;
-					}
-					else
-					if (mask == 0xC) // upper
-					{
-						dst->bk = AverageGlyph(dst, 0x3);
-						dst->fg = src->bk;
-						dst->gl = 223;
-					}
-					else
-					if (mask == 0x5) // left
-					{
-						dst->bk = AverageGlyph(dst, 0xA);
-						dst->fg = src->bk;
-						dst->gl = 221;
-					}
-					else
-					if (mask == 0xA) // right
-					{
-						dst->bk = AverageGlyph(dst, 0x5);
-						dst->fg = src->bk;
-						dst->gl = 222;
-					}
-					else
-					{
-						dst->bk = AverageGlyph(dst, 0xF-mask);
-						dst->fg = src->bk;
-						if (mask == 1 || mask == 2 || mask == 4 || mask == 8)
-							dst->gl = 176;
-						else
-						if (mask == 9 || mask == 6)
-							dst->gl = 177;
-						else
-							dst->gl = 178;
-					}
-				}
-				else
-				// full block write with FG
-				if (src->fg != 255 && src->gl == 219)
-				{
-					int mask = 0;
-					if (height >= s00->height)
-					{
-						s00->height = height;
-						mask |= 1;
-					}
-					if (height >= s01->height)
-					{
-						s01->height = height;
-						mask |= 2;
-					}
-					if (height >= s10->height)
-					{
-						s10->height = height;
-						mask |= 4;
-					}
-					if (height >= s11->height)
-					{
-						s11->height = height;
-						mask |= 8;
-					}
+		for (int h = 0; h < 2; h++)
+		{
+			// floor
+			__m128 v = _mm_add_ps(f[h], half);
+			__m128i t = _mm_cvttps_epi32(v);
+			t = _mm_add_epi32(t, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(t), v)));
+
+			int xy[4];
+			_mm_storeu_si128((__m128i*)xy, t);
+			txy[i + 2 * h][0] = xy[0];
+			txy[i + 2 * h][1] = xy[1];
+			txy[i + 2 * h + 1][0] = xy[2];
+			txy[i + 2 * h + 1][1] = xy[3];
+		}
+	}
+#endif
 
-					if (mask == 0xF)
-					{
-						dst->gl = ' ';// ooh 219;
-						dst->fg = src->bk;
-						dst->bk = src->fg;
-					}
-					else
-					if (mask == 0x0)
-					{
-					}
-					else
-					if (mask==0x3) // lower
-					{
-						dst->bk = AverageGlyph(dst, 0xC);
-						dst->fg = src->fg;
-						dst->gl = 220;
-					}
-					else
-					if (mask == 0xC) // upper
-					{
-						dst->bk = AverageGlyph(dst, 0x3);
-						dst->fg = src->fg;
-						dst->gl = 223;
-					}
-					else
-					if (mask == 0x5) // left
-					{
-						dst->bk = AverageGlyph(dst, 0xA);
-						dst->fg = src->fg;
-						dst->gl = 221;
-					}
-					else
-					if (mask == 0xA) // right
-					{
-						dst->bk = AverageGlyph(dst, 0x5);
-						dst->fg = src->fg;
-						dst->gl = 222;
-					}
-					else
-					{
-						dst->bk = AverageGlyph(dst, 0xF-mask);
-						dst->fg = src->fg;
-						if (mask == 1 || mask == 2 || mask == 4 || mask == 8)
-							dst->gl = 176;
-						else
-						if (mask == 9 || mask == 6)
-							dst->gl = 177;
-						else
-							dst->gl = 178;
-					}
-				}
-				else
-				// half block transparaent
-				if (src->gl >= 220 && src->gl <= 223)
-				{
-					int mask = 0;
-					if (src->bk == 255 && src->gl == 220 || src->fg == 255 && src->gl == 223) // lower
-					{
-						if (height >= s00->height)
-						{
-							s00->height = height;
-							mask |= 1;
-						}
-						if (height >= s01->height)
-						{
-							s01->height = height;
-							mask |= 2;
-						}
-					}
-					else
-					if (src->bk == 255 && src->gl == 221 || src->fg == 255 && src->gl == 222) // left
-					{
-						if (height >= s00->height)
-						{
-							s00->height = height;
-							mask |= 1;
-						}
-						if (height >= s10->height)
-						{
-							s10->height = height;
-							mask |= 4;
-						}
-					}
-					else
-					if (src->bk == 255 && src->gl == 222 || src->fg == 255 && src->gl == 221) // right
-					{
-						if (height >= s01->height)
-						{
-							s01->height = height;
-							mask |= 2;
-						}
-						if (height >= s11->height)
-						{
-							s11->height = height;
-							mask |= 8;
-						}
-					}
-					else
-					if (src->bk == 255 && src->gl == 223 || src->fg == 255 && src->gl == 220) // upper
-					{
-						if (height >= s10->height)
-						{
-							s10->height = height;
-							mask |= 4;
+	for (; i < verts; i++)
+	{
+		int vx = vx0 + i % (HEIGHT_CELLS + 1) * range;
+		int vy = vy0 + i / (HEIGHT_CELLS + 1) * range;
+		int vz = hm[i];
+
+		float viewer_dist; // {vx,vy,vz}  r->pos
+		float eye_to_vtx[3] =
+		{
+			vx - r->view_pos[0],
+			vy - r->view_pos[1],
+			vz - r->view_pos[2],
+		};
+
+		viewer_dist = DotProduct(eye_to_vtx, r->view_dir);
+		if (viewer_dist <= 0)
+			return false;
+
+		viewer_dist = 1.0/viewer_dist;
+
+		float fx = mul[0] * vx + mul[2] * vy;
+		float fy = mul[1] * vx + mul[3] * vy + mul[5] * vz;
+
+		fx *= viewer_dist;
+		fy *= viewer_dist;
+
+		float qx = (add[0] - r->view_ofs[0]) * viewer_dist + r->view_ofs[0];
+		float qy = (add[1] - r->view_ofs[1]) * viewer_dist + r->view_ofs[1];
+
+		fx += qx;
+		fy += qy;
+
+		txy[i][0] = (int)floorf(fx + 0.5f);
+		txy[i][1] = (int)floorf(fy + 0.5f);
+	}
+
+	return true;
+}
+
+void Renderer::RenderPatch(Patch* p, int x, int y, int view_flags, void* cookie /*Renderer*/)
+{
+	RenderNode(p, x, y, VISUAL_CELLS, view_flags, cookie);
+}
+
+// p is patch or node summary (see QueryTerrainCB::lod_cb) spanning range in x,y
+void Renderer::RenderNode(Patch* p, int x, int y, int range, int view_flags, void* cookie /*Renderer*/)
+{
+	Renderer* r = (Renderer*)cookie;
+
+	double* mul = r->mul;
+
+	int iadd[2] = { (int)r->add[0], (int)r->add[1] };
+	double* add = r->add;
+
+	int w = r->sample_buffer.w;
+	int h = r->sample_buffer.h;
+
+	uint16_t* hmap = GetTerrainHeightMap(p);
+	
+	uint16_t* hm = hmap;
+
+	// transform patch verts xy+dx+dy, together with hmap into this array
+	PatchJob job;
+	int (*xyzf)[HEIGHT_CELLS + 1][4] = job.xyzf;
+
+	// without int_flag add is truncated and added after rounding
+	double ortho_add[2] = { 0.0, 0.0 };
+	int add_after[2] = { iadd[0], iadd[1] };
+	if (r->perspective)
+	{
+		if (!ProjectPatchPersp(r, x, y, range, hmap, xyzf))
+			return; // cull entire patch if any vertex is behind view_pos
+		add_after[0] = 0;
+		add_after[1] = 0;
+	}
+	else
+	{
+		if (r->int_flag)
+		{
+			ortho_add[0] = add[0];
+			ortho_add[1] = add[1];
+			add_after[0] = 0;
+			add_after[1] = 0;
+		}
+
+		ProjectPatch(mul, ortho_add, x, y, range, hmap, xyzf);
+	}
+
+	int refl_z = (int)(2 * r->water);
+	for (int dy = 0; dy <= HEIGHT_CELLS; dy++)
+	{
+		for (int dx = 0; dx <= HEIGHT_CELLS; dx++)
+		{
+			int vz = *(hm++);
+			int tx = xyzf[dy][dx][0] + add_after[0];
+			int ty = xyzf[dy][dx][1] + add_after[1];
+
+			xyzf[dy][dx][0] = tx;
+			xyzf[dy][dx][1] = ty;
+			xyzf[dy][dx][2] = r->refl_mode ? refl_z - vz : vz;
+
+			// todo: if patch is known to fully fit in screen, set f=0 
+			// otherwise we need to check if / which screen edges cull each vertex
+			xyzf[dy][dx][3] = (tx < 0) | ((tx > w) << 1) | ((ty < 0) << 2) | ((ty > h) << 3);
+		}
+	}
+
+#ifdef DARK_TERRAIN
+	job.dark = GetTerrainDark(p);
+#endif
+
+	// 2 parity bits for drawing lines around patches
+	// 0 - no patch rendered here
+	// 1 - odd
+	// 2 - even
+	// 3 - under water
+
+	job.diag = GetTerrainDiag(p);
+	job.parity = (((x^y)/range) & 1) + 1; 
+	job.flat = HEIGHT_SCALE * range / VISUAL_CELLS;
+	job.water = r->water;
+	job.map = GetTerrainVisualMap(p);
+	job.refl = r->refl_mode;
+
+	job.light[0] = r->light[0];
+	job.light[1] = r->light[1];
+	job.light[2] = r->light[2];
+	job.light[3] = r->light[3];
+
+	r->SubmitPatch(&job);
+}
+
+void Renderer::SubmitPatch(const PatchJob* job)
+{
+	if (bands <= 1 && !job->refl && !occlusion)
+	{
+		uint64_t t0 = StatsClock();
+		stats.samples += DrawPatch(job, patch_uv, &sample_buffer, dirty_rect[dirty]);
+		raster_ns[0] += StatsClock() - t0;
+		stats.patches++;
+		return;
+	}
+
+	int x0 = job->xyzf[0][0][0];
+	int x1 = x0;
+	int y0 = job->xyzf[0][0][1];
+	int y1 = y0;
+	for (int dy = 0; dy <= HEIGHT_CELLS; dy++)
+	{
+		for (int dx = 0; dx <= HEIGHT_CELLS; dx++)
+		{
+			x0 = std::min(x0, job->xyzf[dy][dx][0]);
+			x1 = std::max(x1, job->xyzf[dy][dx][0]);
+			y0 = std::min(y0, job->xyzf[dy][dx][1]);
+			y1 = std::max(y1, job->xyzf[dy][dx][1]);
+		}
+	}
+
+	if (job->refl && !HitWaterMask(x0, y0, x1, y1, dirty_rect[dirty]))
+		return;
+
+	stats.patches++;
+
+	if (bands <= 1)
+	{
+		uint64_t t0 = StatsClock();
+		stats.samples += DrawPatch(job, patch_uv, &sample_buffer, dirty_rect[dirty]);
+		raster_ns[0] += StatsClock() - t0;
+		StaleOcclusion(x0, y0, x1, y1);
+		return;
+	}
+
+	if (patch_jobs == patch_jobs_size)
+	{
+		patch_jobs_size += 256;
+		patch_job = (PatchJob*)realloc(patch_job, sizeof(PatchJob) * patch_jobs_size);
+	}
+
+	patch_job[patch_jobs] = *job;
+	patch_job[patch_jobs].rect = dirty;
+	BinItem(patch_jobs << 1, dirty_rect[dirty], y0, y1);
+	patch_jobs++;
+
+	// let occlusion tests see what is queued
+	if (occlusion && patch_jobs >= 256)
+		FlushBands();
+}
+
+void Renderer::SubmitFace(const FaceJob* job)
+{
+	int n = job->line ? 2 : 3;
+	int x0 = job->v[0][0], x1 = x0;
+	int y0 = job->v[0][1], y1 = y0;
+	for (int i = 1; i < n; i++)
+	{
+		x0 = std::min(x0, job->v[i][0]);
+		x1 = std::max(x1, job->v[i][0]);
+		y0 = std::min(y0, job->v[i][1]);
+		y1 = std::max(y1, job->v[i][1]);
+	}
+
+	for (int rect = 0; rect < dirty_rects; rect++)
+	{
+		const int* rc = dirty_rect[rect];
+		if (x1 < rc[0] || x0 >= rc[2] || y1 < rc[1] || y0 >= rc[3])
+			continue;
+
+		if (job->refl && !HitWaterMask(x0, y0, x1, y1, rc))
+			continue;
+
+		stats.faces++;
+
+		if (bands <= 1)
+		{
+			stats.samples += DrawFace(job, &sample_buffer, rc);
+			StaleOcclusion(x0, y0, x1, y1);
+			continue;
+		}
+
+		if (face_jobs == face_jobs_size)
+		{
+			face_jobs_size += 1024;
+			face_job = (FaceJob*)realloc(face_job, sizeof(FaceJob) * face_jobs_size);
+		}
+
+		face_job[face_jobs] = *job;
+		face_job[face_jobs].rect = rect;
+		BinItem((face_jobs << 1) | 1, rc, y0, y1);
+		face_jobs++;
+
+		if (occlusion && face_jobs >= 4096)
+			FlushBands();
+	}
+}
+
+// y0,y1 is inclusive range of sample rows item may touch
+void Renderer::BinItem(uint32_t item, const int rect[4], int y0, int y1)
+{
+	y0 = std::max(y0, rect[1]);
+	y1 = std::min(y1, rect[3] - 1);
+	if (y1 < y0)
+		return;
+
+	int b0 = y0 / band_h;
+	int b1 = y1 / band_h;
+
+	for (int b = b0; b <= b1; b++)
+	{
+		RenderBand* rb = band + b;
+		if (rb->items == rb->items_size)
+		{
+			rb->items_size += 1024;
+			rb->item = (uint32_t*)realloc(rb->item, sizeof(uint32_t) * rb->items_size);
+		}
+		rb->item[rb->items++] = item;
+	}
+}
+
+void Renderer::SetupBands()
+{
+	bands = 1;
+	if (!workers)
+		return;
+
+	// few bands per thread for balancing, but not too thin
+	// (items crossing band edges are rasterized by each band)
+	int h = sample_buffer.h;
+	bands = std::min(GetWorkersThreads(workers) * 2, h / 16);
+	if (bands <= 1)
+	{
+		bands = 1;
+		return;
+	}
+
+	band_h = (h + bands - 1) / bands;
+	bands = (h + band_h - 1) / band_h;
+
+	if (bands > bands_size)
+	{
+		band = (RenderBand*)realloc(band, sizeof(RenderBand) * bands);
+		memset(band + bands_size, 0, sizeof(RenderBand) * (bands - bands_size));
+		bands_size = bands;
+	}
+
+	for (int b = 0; b < bands; b++)
+		band[b].items = 0;
+	patch_jobs = 0;
+	face_jobs = 0;
+}
+
+void Renderer::DrawBand(int b)
+{
+	int lo = b * band_h;
+	int hi = std::min(sample_buffer.h, lo + band_h);
+	SampleBuffer* sb = &sample_buffer;
+
+	RenderBand* rb = band + b;
+	rb->raster_ns[0] = 0;
+	rb->raster_ns[1] = 0;
+	rb->samples = 0;
+
+	// clock is read only where item kind changes (patches mostly precede faces)
+	int kind = 0;
+	uint64_t t0 = StatsClock();
+
+	for (int i = 0; i < rb->items; i++)
+	{
+		uint32_t item = rb->item[i];
+		if ((int)(item & 1) != kind)
+		{
+			uint64_t t1 = StatsClock();
+			rb->raster_ns[kind] += t1 - t0;
+			t0 = t1;
+			kind = item & 1;
+		}
+
+		if (item & 1)
+		{
+			const FaceJob* job = face_job + (item >> 1);
+			const int* rc = dirty_rect[job->rect];
+			int clip[4] = { rc[0], std::max(lo, rc[1]), rc[2], std::min(hi, rc[3]) };
+			rb->samples += DrawFace(job, sb, clip);
+		}
+		else
+		{
+			const PatchJob* job = patch_job + (item >> 1);
+			const int* rc = dirty_rect[job->rect];
+			int clip[4] = { rc[0], std::max(lo, rc[1]), rc[2], std::min(hi, rc[3]) };
+			rb->samples += DrawPatch(job, patch_uv, sb, clip);
+		}
+	}
+
+	rb->raster_ns[kind] += StatsClock() - t0;
+}
+
+// x is aligned to even samples (patch grid lines are drawn in sample pairs)
+void Renderer::AddDirty(int x0, int y0, int x1, int y1)
+{
+	x0 = std::max(0, x0) & ~1;
+	y0 = std::max(0, y0);
+	x1 = std::min(sample_buffer.w, (x1 + 1) & ~1);
+	y1 = std::min(sample_buffer.h, y1);
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	// keep rects disjoint, rendering sample twice could add grid lines of occluded patches
+	for (int i = 0; i < std::min(dirty_rects, (int)max_dirty); i++)
+	{
+		int rc[4] = { dirty_rect[i][0], dirty_rect[i][1], dirty_rect[i][2], dirty_rect[i][3] };
+		if (x0 >= rc[2] || x1 <= rc[0] || y0 >= rc[3] || y1 <= rc[1])
+			continue;
+
+		// add parts around overlapped rect
+		if (y0 < rc[1])
+			AddDirty(x0, y0, x1, rc[1]);
+		if (y1 > rc[3])
+			AddDirty(x0, rc[3], x1, y1);
+		y0 = std::max(y0, rc[1]);
+		y1 = std::min(y1, rc[3]);
+		if (x0 < rc[0])
+			AddDirty(x0, y0, rc[0], y1);
+		if (x1 > rc[2])
+			AddDirty(rc[2], y0, x1, y1);
+		return;
+	}
+
+	if (dirty_rects < max_dirty)
+	{
+		int* rc = dirty_rect[dirty_rects];
+		rc[0] = x0;
+		rc[1] = y0;
+		rc[2] = x1;
+		rc[3] = y1;
+	}
+	dirty_rects++; // overflow is checked by caller
+}
+
+// side planes of screen rect for given mul/add transform, water plane is copied
+static void FitRectPlanes(const double mul[6], const double add[3], const int rc[4], const double water[4], double clip[5][4])
+{
+	const double margin = 4; // vertex rounding
+	double rect[5][4] =
+	{
+		{ +mul[0] * HEIGHT_CELLS, +mul[2] * HEIGHT_CELLS, 0, add[0] - rc[0] + margin },
+		{ -mul[0] * HEIGHT_CELLS, -mul[2] * HEIGHT_CELLS, 0, rc[2] - add[0] + margin },
+		{ +mul[1] * HEIGHT_CELLS, +mul[3] * HEIGHT_CELLS, +mul[5], add[1] - rc[1] + margin },
+		{ -mul[1] * HEIGHT_CELLS, -mul[3] * HEIGHT_CELLS, -mul[5], rc[3] - add[1] + margin },
+		{ water[0], water[1], water[2], water[3] }
+	};
+	memcpy(clip, rect, sizeof(rect));
+}
+
+// direct patches are rendered right away, mirrored ones are gathered for RenderRefl()
+// clip planes are used as is for whole buffer rect, other rects replace their 4 side planes
+// with ones fitted to rect using direct and reflected mul/add transforms
+void Renderer::QueryDirty(Terrain* t, double clip_world[][4], double clip_refl[][4], int view_flags)
+{
+	QueryTerrainCB patch_cb = { Renderer::RenderPatch, occlusion ? Renderer::OccludedPatch : 0, Renderer::RenderNode, lod_range };
+	QueryTerrainCB refl_cb = { Renderer::GatherPatch, occlusion ? Renderer::OccludedReflPatch : 0, Renderer::GatherNode, lod_range };
+	QueryTerrainCB* cb[2] = { &patch_cb, &refl_cb };
+
+	// front to back for occlusion tests, depth ties are won by the first patch drawn
+	// so without culling keep original order
+	int near_quad = !occlusion ? 0 : (view_dir[0] < 0 ? 1 : 0) | (view_dir[1] < 0 ? 2 : 0);
+
+	for (int i = 0; i < dirty_rects; i++)
+	{
+		const int* rc = dirty_rect[i];
+		dirty = i;
+
+		// incremental mode needs the same patches at buffer edges regardless of sub-sample pos,
+		// so it always fits planes to rounded add
+		// perspective has no planes fitted to rect, occlusion tests skip patches outside of it
+		if (perspective || (rc[0] == 0 && rc[1] == 0 && rc[2] == sample_buffer.w && rc[3] == sample_buffer.h &&
+			!(incremental && int_flag)))
+		{
+			QueryTerrain(t, 5, clip_world, clip_refl, view_flags, near_quad, cb, this);
+			continue;
+		}
+
+		double clip_rect[2][5][4];
+		FitRectPlanes(mul, add, rc, clip_world[4], clip_rect[0]);
+		FitRectPlanes(refl_mul, refl_add, rc, clip_refl[4], clip_rect[1]);
+
+		QueryTerrain(t, 5, clip_rect[0], clip_rect[1], view_flags, near_quad, cb, this);
+	}
+}
+
+void Renderer::GatherPatch(Patch* p, int x, int y, int view_flags, void* cookie /*Renderer*/)
+{
+	GatherNode(p, x, y, VISUAL_CELLS, view_flags, cookie);
+}
+
+void Renderer::GatherNode(Patch* p, int x, int y, int range, int view_flags, void* cookie /*Renderer*/)
+{
+	Renderer* r = (Renderer*)cookie;
+	if (r->refl_patches == r->refl_patches_size)
+	{
+		r->refl_patches_size += 256;
+		r->refl_patch = (ReflPatch*)realloc(r->refl_patch, sizeof(ReflPatch) * r->refl_patches_size);
+	}
+
+	ReflPatch* rp = r->refl_patch + r->refl_patches++;
+	rp->p = p;
+	rp->x = x;
+	rp->y = y;
+	rp->range = range;
+	rp->view_flags = view_flags;
+	rp->rect = r->dirty;
+}
+
+void Renderer::GatherMesh(Mesh* m, double* tm, void* cookie /*Renderer*/)
+{
+	Renderer* r = (Renderer*)cookie;
+	if (r->refl_insts == r->refl_insts_size)
+	{
+		r->refl_insts_size += 64;
+		r->refl_inst = (ReflInst*)realloc(r->refl_inst, sizeof(ReflInst) * r->refl_insts_size);
+	}
+
+	ReflInst* ri = r->refl_inst + r->refl_insts++;
+	ri->mesh = m;
+	ri->tm = tm;
+}
+
+void Renderer::GatherSprite(Inst* inst, Sprite* s, float pos[3], float yaw, int anim, int frame, int reps[4], void* cookie /*Renderer*/)
+{
+	Renderer* r = (Renderer*)cookie;
+	if (inst == r->skip_inst)
+		return;
+
+	if (r->refl_insts == r->refl_insts_size)
+	{
+		r->refl_insts_size += 64;
+		r->refl_inst = (ReflInst*)realloc(r->refl_inst, sizeof(ReflInst) * r->refl_insts_size);
+	}
+
+	ReflInst* ri = r->refl_inst + r->refl_insts++;
+	ri->mesh = 0;
+	ri->inst = inst;
+	ri->sprite = s;
+	ri->pos[0] = pos[0];
+	ri->pos[1] = pos[1];
+	ri->pos[2] = pos[2];
+	ri->yaw = yaw;
+	ri->anim = anim;
+	ri->frame = frame;
+	ri->reps = reps;
+}
+
+// renders gathered mirrored set, expects reflected mul/add and refl_mode
+void Renderer::RenderRefl()
+{
+	for (int i = 0; i < refl_patches; i++)
+	{
+		const ReflPatch* rp = refl_patch + i;
+		dirty = rp->rect;
+
+		// skip transforming patches whose box misses water mask
+		uint16_t lo, hi;
+		GetTerrainLimits(rp->p, &lo, &hi);
+		if (rp->view_flags)
+			lo = 0;
+
+		double box[6] =
+		{
+			(double)rp->x * HEIGHT_CELLS, (double)(rp->x + rp->range) * HEIGHT_CELLS,
+			(double)rp->y * HEIGHT_CELLS, (double)(rp->y + rp->range) * HEIGHT_CELLS,
+			(double)lo, (double)hi
+		};
+
+		int rc[4];
+		if (ProjectBox(mul, add, box, rc) && !HitWaterMask(rc[0], rc[1], rc[2], rc[3], dirty_rect[dirty]))
+			continue;
+
+		RenderNode(rp->p, rp->x, rp->y, rp->range, rp->view_flags, this);
+	}
+
+	for (int i = 0; i < refl_insts; i++)
+	{
+		ReflInst* ri = refl_inst + i;
+		if (ri->mesh)
+			RenderMesh(ri->mesh, ri->tm, this);
+		else
+			RenderSprite(ri->inst, ri->sprite, ri->pos, ri->yaw, ri->anim, ri->frame, ri->reps, this);
+	}
+
+	refl_patches = 0;
+	refl_insts = 0;
+}
+
+void Renderer::ResetOcclusion()
+{
+	occlusion = culling;
+	if (!occlusion)
+		return;
+
+	int tile = occl_tile;
+	for (int l = 0; l < 2; l++)
+	{
+		occl_w[l] = (sample_buffer.w + tile - 1) / tile;
+		occl_h[l] = (sample_buffer.h + tile - 1) / tile;
+		int size = occl_w[l] * occl_h[l];
+		if (size > occl_size[l])
+		{
+			occl_size[l] = size;
+			occl_min[l] = (float*)realloc(occl_min[l], sizeof(float) * size);
+			occl_stale[l] = (uint8_t*)realloc(occl_stale[l], size);
+		}
+		memset(occl_stale[l], 1, size);
+		tile *= 4;
+	}
+}
+
+void Renderer::StaleOcclusion(int x0, int y0, int x1, int y1)
+{
+	if (!occlusion)
+		return;
+
+	x0 = std::max(x0, 0);
+	y0 = std::max(y0, 0);
+	x1 = std::min(x1, sample_buffer.w - 1);
+	y1 = std::min(y1, sample_buffer.h - 1);
+	if (x1 < x0 || y1 < y0)
+		return;
+
+	int tile = occl_tile;
+	for (int l = 0; l < 2; l++)
+	{
+		for (int ty = y0 / tile; ty <= y1 / tile; ty++)
+			memset(occl_stale[l] + ty * occl_w[l] + x0 / tile, 1, x1 / tile - x0 / tile + 1);
+		tile *= 4;
+	}
+}
+
+float Renderer::OcclusionMin(int tx, int ty)
+{
+	int i = tx + ty * occl_w[0];
+	if (occl_stale[0][i])
+	{
+		const SampleBuffer* sb = &sample_buffer;
+		int x0 = tx * occl_tile;
+		int y0 = ty * occl_tile;
+		int x1 = std::min(x0 + occl_tile, sb->w);
+		int y1 = std::min(y0 + occl_tile, sb->h);
+		float m = FLT_MAX;
+		for (int y = y0; y < y1; y++)
+		{
+			const float* row = sb->height + y * sb->w;
+			for (int x = x0; x < x1; x++)
+				m = std::min(m, row[x]);
+		}
+		occl_min[0][i] = m;
+		occl_stale[0][i] = 0;
+	}
+	return occl_min[0][i];
+}
+
+bool Renderer::Occluded(int x0, int y0, int x1, int y1, const int rect[4], float z)
+{
+	x0 = std::max(x0, rect[0]);
+	y0 = std::max(y0, rect[1]);
+	x1 = std::min(x1, rect[2] - 1);
+	y1 = std::min(y1, rect[3] - 1);
+	if (x1 < x0 || y1 < y0)
+		return true;
+
+	const int big = occl_tile * 4;
+	for (int by = y0 / big; by <= y1 / big; by++)
+	{
+		for (int bx = x0 / big; bx <= x1 / big; bx++)
+		{
+			int b = bx + by * occl_w[1];
+			if (!occl_stale[1][b] && occl_min[1][b] > z)
+				continue;
+
+			// level 0 tiles of this level 1 tile overlapping box
+			int tx0 = std::max(x0, bx * big) / occl_tile;
+			int ty0 = std::max(y0, by * big) / occl_tile;
+			int tx1 = std::min(x1, bx * big + big - 1) / occl_tile;
+			int ty1 = std::min(y1, by * big + big - 1) / occl_tile;
+
+			float m = FLT_MAX;
+			for (int ty = ty0; ty <= ty1; ty++)
+			{
+				for (int tx = tx0; tx <= tx1; tx++)
+				{
+					float t = OcclusionMin(tx, ty);
+					if (t <= z)
+						return false;
+					m = std::min(m, t);
+				}
+			}
+
+			// whole level 1 tile was scanned
+			if (tx0 == bx * 4 && ty0 == by * 4 && 
+				(tx1 == bx * 4 + 3 || tx1 == occl_w[0] - 1) && (ty1 == by * 4 + 3 || ty1 == occl_h[0] - 1))
+			{
+				occl_min[1][b] = m;
+				occl_stale[1][b] = 0;
+			}
+		}
+	}
+
+	return true;
+}
+
+// sample rect {x0,y0,x1,y1} covering world box (x0,x1,y0,y1,z0,z1) projected with given transform
+// in perspective, false if box gets too close to view_pos plane to be bounded reliably
+bool Renderer::ProjectBox(const double mul[6], const double add[3], const double box[6], int rc[4]) const
+{
+	double lo[2] = { DBL_MAX, DBL_MAX };
+	double hi[2] = { -DBL_MAX, -DBL_MAX };
+	for (int v = 0; v < 8; v++)
+	{
+		double x = box[v & 1];
+		double y = box[2 + ((v >> 1) & 1)];
+		double z = box[4 + (v >> 2)];
+		double sx = mul[0] * x + mul[2] * y + add[0];
+		double sy = mul[1] * x + mul[3] * y + mul[5] * z + add[1];
+
+		if (perspective)
+		{
+			// view_dir is scaled so focal plane is at 1, verts are projected in float
+			double dist = (x - view_pos[0]) * view_dir[0] + (y - view_pos[1]) * view_dir[1] + (z - view_pos[2]) * view_dir[2];
+			if (dist < 1.0 / 16)
+				return false;
+			sx = (sx - view_ofs[0]) / dist + view_ofs[0];
+			sy = (sy - view_ofs[1]) / dist + view_ofs[1];
+		}
+
+		lo[0] = std::min(lo[0], sx);
+		lo[1] = std::min(lo[1], sy);
+		hi[0] = std::max(hi[0], sx);
+		hi[1] = std::max(hi[1], sy);
+	}
+
+	// +2 for vertex rounding and truncated add when not int_flag
+	rc[0] = (int)floor(lo[0]) - 2;
+	rc[1] = (int)floor(lo[1]) - 2;
+	rc[2] = (int)ceil(hi[0]) + 2;
+	rc[3] = (int)ceil(hi[1]) + 2;
+	return true;
+}
+
+bool Renderer::Occluded(const double mul[6], const double add[3], const double box[6], const int rect[4], float z)
+{
+	int rc[4];
+	if (!ProjectBox(mul, add, box, rc))
+		return false;
+	return Occluded(rc[0], rc[1], rc[2], rc[3], rect, z);
+}
+
+bool Renderer::OccludedPatch(int x, int y, int range, int lo, int hi, void* cookie /*Renderer*/)
+{
+	Renderer* r = (Renderer*)cookie;
+	double box[6] =
+	{
+		(double)x * HEIGHT_CELLS, (double)(x + range) * HEIGHT_CELLS,
+		(double)y * HEIGHT_CELLS, (double)(y + range) * HEIGHT_CELLS,
+		(double)lo, (double)hi
+	};
+
+	// grid lines are depth tested HEIGHT_SCALE above patch
+	return r->Occluded(r->mul, r->add, box, r->dirty_rect[r->dirty], (float)(hi + HEIGHT_SCALE));
+}
+
+bool Renderer::OccludedReflPatch(int x, int y, int range, int lo, int hi, void* cookie /*Renderer*/)
+{
+	Renderer* r = (Renderer*)cookie;
+	double box[6] =
+	{
+		(double)x * HEIGHT_CELLS, (double)(x + range) * HEIGHT_CELLS,
+		(double)y * HEIGHT_CELLS, (double)(y + range) * HEIGHT_CELLS,
+		(double)lo, (double)hi
+	};
+
+	// reflections are never written at or above water + HEIGHT_SCALE / 8
+	float z = std::min(2 * r->water - lo, r->water + HEIGHT_SCALE / 8);
+	return r->Occluded(r->refl_mul, r->refl_add, box, r->dirty_rect[r->dirty], z);
+}
+
+bool Renderer::OccludedMesh(const float bbox[6], void* cookie /*Renderer*/)
+{
+	Renderer* r = (Renderer*)cookie;
+	double box[6] =
+	{
+		bbox[0] * HEIGHT_CELLS, bbox[1] * HEIGHT_CELLS,
+		bbox[2] * HEIGHT_CELLS, bbox[3] * HEIGHT_CELLS,
+		bbox[4], bbox[5]
+	};
+
+	const int rect[4] = { 0, 0, r->sample_buffer.w, r->sample_buffer.h };
+	return r->Occluded(r->mul, r->add, box, rect, bbox[5] + HEIGHT_SCALE / 2 + 1);
+}
+
+bool Renderer::OccludedReflMesh(const float bbox[6], void* cookie /*Renderer*/)
+{
+	Renderer* r = (Renderer*)cookie;
+	double box[6] =
+	{
+		bbox[0] * HEIGHT_CELLS, bbox[1] * HEIGHT_CELLS,
+		bbox[2] * HEIGHT_CELLS, bbox[3] * HEIGHT_CELLS,
+		bbox[4], bbox[5]
+	};
+
+	// lines are not limited to water level
+	const int rect[4] = { 0, 0, r->sample_buffer.w, r->sample_buffer.h };
+	return r->Occluded(r->refl_mul, r->refl_add, box, rect, 2 * r->water - bbox[4] + HEIGHT_SCALE / 2 + 1);
+}
+
+void Renderer::UpdateWaterMask()
+{
+	const SampleBuffer* sb = &sample_buffer;
+	water_tiles_w = (sb->w + water_tile - 1) / water_tile;
+	water_tiles_h = (sb->h + water_tile - 1) / water_tile;
+	int size = water_tiles_w * water_tiles_h;
+	if (size > water_mask_size)
+	{
+		water_mask_size = size;
+		water_mask = (uint8_t*)realloc(water_mask, size);
+	}
+
+	float lim = water + HEIGHT_SCALE / 8;
+	for (int ty = 0; ty < water_tiles_h; ty++)
+	{
+		int y0 = ty * water_tile;
+		int y1 = std::min(y0 + water_tile, sb->h);
+		for (int tx = 0; tx < water_tiles_w; tx++)
+		{
+			int x0 = tx * water_tile;
+			int x1 = std::min(x0 + water_tile, sb->w);
+			uint8_t hit = 0;
+			for (int y = y0; y < y1 && !hit; y++)
+			{
+				const float* row = sb->height + y * sb->w;
+				for (int x = x0; x < x1; x++)
+					hit |= row[x] < lim;
+			}
+			water_mask[tx + ty * water_tiles_w] = hit;
+		}
+	}
+}
+
+bool Renderer::HitWaterMask(int x0, int y0, int x1, int y1, const int rect[4]) const
+{
+	x0 = std::max(x0, rect[0]);
+	y0 = std::max(y0, rect[1]);
+	x1 = std::min(x1, rect[2] - 1);
+	y1 = std::min(y1, rect[3] - 1);
+	if (x1 < x0 || y1 < y0)
+		return false;
+
+	x0 /= water_tile;
+	y0 /= water_tile;
+	x1 /= water_tile;
+	y1 /= water_tile;
+
+	for (int ty = y0; ty <= y1; ty++)
+	{
+		const uint8_t* row = water_mask + ty * water_tiles_w;
+		for (int tx = x0; tx <= x1; tx++)
+		{
+			if (row[tx])
+				return true;
+		}
+	}
+	return false;
+}
+
+static void DrawBandJob(int index, void* cookie /*Renderer*/)
+{
+	Renderer* r = (Renderer*)cookie;
+	r->DrawBand(index);
+}
+
+// rasterizes all jobs submitted since previous flush
+void Renderer::FlushBands()
+{
+	if (bands <= 1)
+		return;
+
+	uint64_t t0 = StatsClock();
+	RunWorkers(workers, bands, DrawBandJob, this);
+	uint64_t wall = StatsClock() - t0;
+
+	// split wall time by what workers spent on patches and faces
+	uint64_t ns[2] = { 0,0 };
+	for (int b = 0; b < bands; b++)
+	{
+		ns[0] += band[b].raster_ns[0];
+		ns[1] += band[b].raster_ns[1];
+		stats.samples += band[b].samples;
+	}
+	uint64_t patch_ns = ns[0] + ns[1] ? wall * ns[0] / (ns[0] + ns[1]) : 0;
+	raster_ns[0] += patch_ns;
+	raster_ns[1] += wall - patch_ns;
+
+	for (int b = 0; b < bands; b++)
+		band[b].items = 0;
+	patch_jobs = 0;
+	face_jobs = 0;
+
+	if (occlusion)
+	{
+		memset(occl_stale[0], 1, occl_w[0] * occl_h[0]);
+		memset(occl_stale[1], 1, occl_w[1] * occl_h[1]);
+	}
+}
+
+void Renderer::RenderSprite(AnsiCell* ptr, int width, int height, Sprite* s, bool refl, int anim, int frame, int angle, int pos[3], const int* clip)
+{
+	if (!clip)
+		stats.sprites++; // clipped parts are counted by caller
+
+	// intersect frame with screen buffer
+	int i = frame + angle * s->anim[anim].length;
+	if (refl)
+		i += s->anim[anim].length * s->angles;
+
+	Sprite::Frame* f = s->atlas + s->anim[anim].frame_idx[i];
+
+	int dx = f->ref[0] / 2;
+	int dy = f->ref[1] / 2;
+
+	int left   = pos[0] - dx;
+	int right  = left + f->width;
+	int bottom = pos[1] - dy;
+	int top    = bottom + f->height;
+
+	left = std::max(clip ? clip[0] : 0, left);
+	right = std::min(clip ? clip[2] : width, right);
+
+	if (left >= right)
+		return;
+
+	bottom = std::max(clip ? clip[1] : 0, bottom);
+	top = std::min(clip ? clip[3] : height, top);
+
+	if (bottom >= top)
+		return;
+
+	int sample_xy = 2 + 2 * (2 + 2 * width + 2);
+	int sample_dx = 2;
+	int sample_dy = 2 * (2 + 2 * width + 2);
+	int sample_ofs[4] = { 0, 1, 2 + 2 * width + 2, 2 + 2 * width + 2 + 1 };
+
+	//static const float height_scale = HEIGHT_SCALE / 1.5; // WHY?????  HS*DBL/ZOOM ?
+
+	static const float ds = 2.0 * (/*zoom*/ 1.0 * /*scale*/ 3.0) / VISUAL_CELLS * 0.5 /*we're not dbl_wh*/;
+	static const float dz_dy = HEIGHT_SCALE / (cos(30 * M_PI / 180) * HEIGHT_CELLS * ds);
+
+	for (int y = bottom; y < top; y++)
+	{
+		int fy = y - pos[1] + dy;
+		for (int x = left; x < right; x++)
+		{
+			int fx = x - pos[0] + dx;
+			AnsiCell* dst = ptr + x + width * y;
+			const AnsiCell* src = f->cell + fx + fy * f->width;
+
+			int depth_passed = 0;
+
+			float* s00 = sample_buffer.height + sample_xy + x * sample_dx + y * sample_dy;
+			float* s01 = s00 + 1;
+			float* s10 = s00 + 2 + 2 * width + 2;
+			float* s11 = s10 + 1;
+
+			// spare is in full blocks, ref in half!
+			float height = (2 * src->spare + f->ref[2]) * 0.5 * dz_dy + pos[2]; // *height_scale + pos[2]; // transform!
+			if (!refl && height >= water || refl && height <= water)
+			{
+				// early rejection
+				if (src->bk == 255 && src->fg == 255 ||
+					(src->gl == 32 || src->gl == 0) && src->bk == 255 ||
+					src->gl == 219 && src->fg == 255)
+				{
+					// NOP
+				}
+				else
+				if (src->fg == 254) // swoosh
+				{
+					// note: if both fg and bk are swoosh, 
+					// case is unified to fg swoosh with glyph 219
+					// during sprite loading!
+
+					// sprites MUST be sorted by viewing dir (from furthest to nearest)
+					// otherwise swoosh/smoke fx could get overwriten by further sprites!
+
+					int mask = 0;
+					if (height >= *s00)
+					{
+						// *s00 = height;
+						mask |= 1;
+					}
+					if (height >= *s01)
+					{
+						// *s01 = height;
+						mask |= 2;
+					}
+					if (height >= *s10)
+					{
+						// *s10 = height;
+						mask |= 4;
+					}
+					if (height >= *s11)
+					{
+						// *s11 = height;
+						mask |= 8;
+					}
+
+					if (!mask)
+						continue;
+
+					switch (src->gl)
+					{
+						case 219: // fullblock
+						{
+							if (mask == 15)
+							{
+								dst->bk = LightenColor(dst->bk);
+								dst->fg = LightenColor(dst->fg);
+								break;
+							}
+
+							// no break is intentional here
+						}
+
+						default:
+							int fg = LightenColor(AverageGlyph(dst, mask));
+							if (src->bk == 255)
+								dst->bk = AverageGlyph(dst, 0xF ^ mask);
+							else
+								dst->bk = src->bk;
+							dst->fg = fg;
+							dst->gl = src->gl;
+					}
+				}
+				else
+				if (src->bk == 254) // swoosh
+				{
+					int mask = 0;
+					if (height >= *s00)
+					{
+						*s00 = height;
+						mask |= 1;
+					}
+					if (height >= *s01)
+					{
+						*s01 = height;
+						mask |= 2;
+					}
+					if (height >= *s10)
+					{
+						*s10 = height;
+						mask |= 4;
+					}
+					if (height >= *s11)
+					{
+						*s11 = height;
+						mask |= 8;
+					}
+
+					if (!mask)
+						continue;
+
+					switch (src->gl)
+					{
+						case 0:
+						case 32: // spaces
+						{
+							if (mask == 15)
+							{
+								dst->bk = LightenColor(dst->bk);
+								dst->fg = LightenColor(dst->fg);
+								break;
+							}
+
+							// no break is intentional here
+						}
+
+						default:
+
+							int bk = LightenColor(AverageGlyph(dst, 0xF ^ mask));
+							if (src->fg == 255)
+								dst->fg = AverageGlyph(dst, mask);
+							else
+								dst->fg = src->fg;
+
+							dst->bk = bk;
+							dst->gl = src->gl;
+					}
+				}
+				else
+				// full block write with FG & BK
+				if (src->bk != 255 && src->fg != 255)
+				{
+					int mask = 0;
+					if (height >= *s00)
+					{
+						*s00 = height;
+						mask|=1;
+					}
+					if (height >= *s01)
+					{
+						*s01 = height;
+						mask |= 2;
+					}
+					if (height >= *s10)
+					{
+						*s10 = height;
+						mask |= 4;
+					}
+					if (height >= *s11)
+					{
+						*s11 = height;
+						mask |= 8;
+					}
+
+					if (mask == 0xF)
+					{
+						*dst = *src;
+					}
+					else
+					if (mask == 0x0)
+					{
+					}
+					else
+					if (mask==0x3) // lower
+					{
+						dst->bk = AverageGlyph(dst, 0xC);
+						dst->fg = AverageGlyph(src, 0x3);
+						dst->gl = 220;
+					}
+					else
+					if (mask == 0xC) // upper
+					{
+						dst->bk = AverageGlyph(dst, 0x3);
+						dst->fg = AverageGlyph(src, 0xC);
+						dst->gl = 223;
+					}
+					else
+					if (mask == 0x5) // left
+					{
+						dst->bk = AverageGlyph(dst, 0xA);
+						dst->fg = AverageGlyph(src, 0x5);
+						dst->gl = 221;
+					}
+					else
+					if (mask == 0xA) // right
+					{
+						dst->bk = AverageGlyph(dst, 0x5);
+						dst->fg = AverageGlyph(src, 0xA);
+						dst->gl = 222;
+					}
+					else
+					{
+						dst->bk = AverageGlyph(dst, 0xF-mask);
+						dst->fg = AverageGlyph(dst, mask);
+						if (mask == 1 || mask == 2 || mask == 4 || mask == 8)
+							dst->gl = 176;
+						else
+						if (mask == 9 || mask == 6)
+							dst->gl = 177;
+						else
+							dst->gl = 178;
+					}
+				}
+				else
+				// full block write with BK
+				if (src->bk != 255 && (src->gl == 32 || src->gl == 0))
+				{
+					int mask = 0;
+					if (height >= *s00)
+					{
+						*s00 = height;
+						mask |= 1;
+					}
+					if (height >= *s01)
+					{
+						*s01 = height;
+						mask |= 2;
+					}
+					if (height >= *s10)
+					{
+						*s10 = height;
+						mask |= 4;
+					}
+					if (height >= *s11)
+					{
+						*s11 = height;
+						mask |= 8;
+					}
+
+					if (mask == 0xF)
+					{
+						dst->gl = 219;
+						dst->fg = src->bk;
+					}
+					else
+					if (mask == 0x0)
+					{
+					}
+					else
+					if (mask==0x3) // lower
+					{
+						dst->bk = AverageGlyph(dst, 0xC);
+						dst->fg = src->bk;
+						dst->gl = 220;
+					}
+					else
+					if (mask == 0xC) // upper
+					{
+						dst->bk = AverageGlyph(dst, 0x3);
+						dst->fg = src->bk;
+						dst->gl = 223;
+					}
+					else
+					if (mask == 0x5) // left
+					{
+						dst->bk = AverageGlyph(dst, 0xA);
+						dst->fg = src->bk;
+						dst->gl = 221;
+					}
+					else
+					if (mask == 0xA) // right
+					{
+						dst->bk = AverageGlyph(dst, 0x5);
+						dst->fg = src->bk;
+						dst->gl = 222;
+					}
+					else
+					{
+						dst->bk = AverageGlyph(dst, 0xF-mask);
+						dst->fg = src->bk;
+						if (mask == 1 || mask == 2 || mask == 4 || mask == 8)
+							dst->gl = 176;
+						else
+						if (mask == 9 || mask == 6)
+							dst->gl = 177;
+						else
+							dst->gl = 178;
+					}
+				}
+				else
+				// full block write with FG
+				if (src->fg != 255 && src->gl == 219)
+				{
+					int mask = 0;
+					if (height >= *s00)
+					{
+						*s00 = height;
+						mask |= 1;
+					}
+					if (height >= *s01)
+					{
+						*s01 = height;
+						mask |= 2;
+					}
+					if (height >= *s10)
+					{
+						*s10 = height;
+						mask |= 4;
+					}
+					if (height >= *s11)
+					{
+						*s11 = height;
+						mask |= 8;
+					}
+
+					if (mask == 0xF)
+					{
+						dst->gl = ' ';// ooh 219;
+						dst->fg = src->bk;
+						dst->bk = src->fg;
+					}
+					else
+					if (mask == 0x0)
+					{
+					}
+					else
+					if (mask==0x3) // lower
+					{
+						dst->bk = AverageGlyph(dst, 0xC);
+						dst->fg = src->fg;
+						dst->gl = 220;
+					}
+					else
+					if (mask == 0xC) // upper
+					{
+						dst->bk = AverageGlyph(dst, 0x3);
+						dst->fg = src->fg;
+						dst->gl = 223;
+					}
+					else
+					if (mask == 0x5) // left
+					{
+						dst->bk = AverageGlyph(dst, 0xA);
+						dst->fg = src->fg;
+						dst->gl = 221;
+					}
+					else
+					if (mask == 0xA) // right
+					{
+						dst->bk = AverageGlyph(dst, 0x5);
+						dst->fg = src->fg;
+						dst->gl = 222;
+					}
+					else
+					{
+						dst->bk = AverageGlyph(dst, 0xF-mask);
+						dst->fg = src->fg;
+						if (mask == 1 || mask == 2 || mask == 4 || mask == 8)
+							dst->gl = 176;
+						else
+						if (mask == 9 || mask == 6)
+							dst->gl = 177;
+						else
+							dst->gl = 178;
+					}
+				}
+				else
+				// half block transparaent
+				if (src->gl >= 220 && src->gl <= 223)
+				{
+					int mask = 0;
+					if (src->bk == 255 && src->gl == 220 || src->fg == 255 && src->gl == 223) // lower
+					{
+						if (height >= *s00)
+						{
+							*s00 = height;
+							mask |= 1;
+						}
+						if (height >= *s01)
+						{
+							*s01 = height;
+							mask |= 2;
+						}
+					}
+					else
+					if (src->bk == 255 && src->gl == 221 || src->fg == 255 && src->gl == 222) // left
+					{
+						if (height >= *s00)
+						{
+							*s00 = height;
+							mask |= 1;
+						}
+						if (height >= *s10)
+						{
+							*s10 = height;
+							mask |= 4;
+						}
+					}
+					else
+					if (src->bk == 255 && src->gl == 222 || src->fg == 255 && src->gl == 221) // right
+					{
+						if (height >= *s01)
+						{
+							*s01 = height;
+							mask |= 2;
+						}
+						if (height >= *s11)
+						{
+							*s11 = height;
+							mask |= 8;
+						}
+					}
+					else
+					if (src->bk == 255 && src->gl == 223 || src->fg == 255 && src->gl == 220) // upper
+					{
+						if (height >= *s10)
+						{
+							*s10 = height;
+							mask |= 4;
 						}
-						if (height >= s11->height)
+						if (height >= *s11)
 						{
-							s11->height = height;
+							*s11 = height;
 							mask |= 8;
 						}
 					}
@@ -2409,24 +3852,24 @@ void Renderer::RenderSprite(AnsiCell* ptr, int width, int height, Sprite* s, boo
 				{
 					// something else with transparency
 					int mask = 0;
-					if (height >= s00->height)
+					if (height >= *s00)
 					{
-						s00->height = height;
+						*s00 = height;
 						mask|=1;
 					}
-					if (height >= s01->height)
+					if (height >= *s01)
 					{
-						s01->height = height;
+						*s01 = height;
 						mask |= 2;
 					}
-					if (height >= s10->height)
+					if (height >= *s10)
 					{
-						s10->height = height;
+						*s10 = height;
 						mask |= 4;
 					}
-					if (height >= s11->height)
+					if (height >= *s11)
 					{
-						s11->height = height;
+						*s11 = height;
 						mask |= 8;
 					}
 
@@ -2483,187 +3926,1292 @@ void Renderer::RenderSprite(AnsiCell* ptr, int width, int height, Sprite* s, boo
 				}
 			}
 
-			///////////////////////////
+			///////////////////////////
+
+			/*
+			if (src->bk != 255)
+			{
+				if (src->fg != 255)
+				{
+					// check if at least 2/4 samples passes depth test, update all 4
+					// ...
+
+					if (!refl && height >= water || refl && height <= water)
+					{
+						if (height >= *s00)
+						{
+							*s00 = height;
+							depth_passed++;
+						}
+						if (height >= *s01)
+						{
+							*s01 = height;
+							depth_passed++;
+						}
+						if (height >= *s10)
+						{
+							*s10 = height;
+							depth_passed++;
+						}
+						if (height >= *s11)
+						{
+							*s11 = height;
+							depth_passed++;
+						}
+					}
+
+					if (depth_passed >= 3)
+					{
+						*dst = *src;
+						// *s00 = height;
+						// *s01 = height;
+						// *s10 = height;
+						// *s11 = height;
+					}
+				}
+				else
+				{
+					// check if at least 1/2 bk sample passes depth test, update both
+					// ...
+
+					if (!refl && height >= water || refl && height <= water)
+					{
+						if (height >= *s00)
+						{
+							*s00 = height;
+							depth_passed++;
+						}
+						if (height >= *s01)
+						{
+							*s01 = height;
+							depth_passed++;
+						}
+						if (height >= *s10)
+						{
+							*s10 = height;
+							depth_passed++;
+						}
+						if (height >= *s11)
+						{
+							*s11 = height;
+							depth_passed++;
+						}
+					}
+
+					if (depth_passed >= 3)
+					{
+						if (dst->gl == 0xDC && src->gl == 0xDF || dst->gl == 0xDD && src->gl == 0xDE ||
+							dst->gl == 0xDF && src->gl == 0xDC || dst->gl == 0xDE && src->gl == 0xDD)
+						{
+							dst->fg = src->bk;
+						}
+						else
+						{
+							dst->bk = src->bk;
+							dst->gl = src->gl;
+						}
+
+						// *s00 = height;
+						// *s01 = height;
+						// *s10 = height;
+						// *s11 = height;
+					}
+				}
+			}
+			else
+			{
+				if (src->fg != 255)
+				{
+					// check if at least 1/2 fg samples passes depth test, update both
+					// ...
+					if (!refl && height >= water || refl && height <= water)
+					{
+						if (height >= *s00)
+						{
+							*s00 = height;
+							depth_passed++;
+						}
+						if (height >= *s01)
+						{
+							*s01 = height;
+							depth_passed++;
+						}
+						if (height >= *s10)
+						{
+							*s10 = height;
+							depth_passed++;
+						}
+						if (height >= *s11)
+						{
+							*s11 = height;
+							depth_passed++;
+						}
+					}
+
+					if (depth_passed >= 3)
+					{
+						if (dst->gl == 0xDC && src->gl == 0xDF || dst->gl == 0xDD && src->gl == 0xDE ||
+							dst->gl == 0xDF && src->gl == 0xDC || dst->gl == 0xDE && src->gl == 0xDD)
+						{
+							dst->bk = src->fg;
+						}
+						else
+						{
+							dst->fg = src->fg;
+							dst->gl = src->gl;
+						}
+
+						// *s00 = height;
+						// *s01 = height;
+						// *s10 = height;
+						// *s11 = height;
+					}
+				}
+			}
+			*/
+		}
+	}
+}
+
+// mini hp bar above character, within clip
+void Renderer::RenderHPBar(AnsiCell* out_ptr, int width, const SpriteRenderBuf* buf, const int clip[4])
+{
+	// check if sprite has odd or even width, 
+	// paint accordingly bar with 5 or 6 width
+
+	int dy = 10;
+	int y = buf->s_pos[1] + dy;
+
+	static const float ds = 2.0 * (/*zoom*/ 1.0 * /*scale*/ 3.0) / VISUAL_CELLS * 0.5 /*we're not dbl_wh*/;
+	static const float dz_dy = HEIGHT_SCALE / (cos(30 * M_PI / 180) * HEIGHT_CELLS * ds);
+	float t = dy * dz_dy + buf->s_pos[2];
+
+	int lt_red = 16 + 0 + 0*6 + 5*36; // 102,0,0
+	int lt_orange = 16 + 0 + 2*6 + 5*36; 
+	int dk_red = 16 + 0 + 0 * 6 + 3 * 36; // 102,0,0
+	int dk_orange = 16 + 0 + 1 * 6 + 3 * 36;
+	uint8_t fg = buf->character->clr ? lt_orange : lt_red;
+	uint8_t bk = buf->character->clr ? dk_orange : dk_red;
+
+	AnsiCell ac;
+	ac.bk = bk;
+	ac.fg = fg;
+	ac.spare = 0xFF; // as post pass leaves it
+
+	if (y >= clip[1] && y < clip[3])
+	{
+		for (int bx = -2; bx <= 2; bx++)
+		{
+			int x = bx + buf->s_pos[0];
+
+			// calc average 2x2 height
+			// int height = 
+
+			if (x >= clip[0] && x < clip[2])
+			{
+				int test_ll = (2 * y + 0) * (2 * width + 4) + 2 * x + 2;
+				int test_lr = (2 * y + 0) * (2 * width + 4) + 2 * x + 3;
+				int test_ul = (2 * y + 1) * (2 * width + 4) + 2 * x + 2;
+				int test_ur = (2 * y + 1) * (2 * width + 4) + 2 * x + 3;
+
+				if (!sample_buffer.DepthTest_RO(test_ul, t) && !sample_buffer.DepthTest_RO(test_ur, t) &&
+					!sample_buffer.DepthTest_RO(test_ll, t) && !sample_buffer.DepthTest_RO(test_lr, t))
+				{
+					continue;
+				}
+
+				bool l = (bx + 2)*buf->character->MAX_HP * 2 + 0 < buf->character->HP * 10;
+				bool r = (bx + 2)*buf->character->MAX_HP * 2 + buf->character->MAX_HP < buf->character->HP * 10;
+
+				if (r)
+					ac.gl = 219; // full
+				else
+				if (l)
+					ac.gl = 221; // half
+				else
+					ac.gl = ' '; // none
+
+				out_ptr[x+width*y] = ac;
+			}
+		}
+	}
+}
+
+// sprites are composited far to near in screen tiles, each tile walks only sprites overlapping it,
+// sprites read and write just cells and samples they cover, so tiles are independent and run in parallel
+static const int sprite_tile_w = 32;
+static const int sprite_tile_h = 16;
+
+struct SpriteTiles
+{
+	Renderer* r;
+	AnsiCell* out;
+	int width, height;
+	int tiles_x;
+};
+
+static void SpriteTileJob(int index, void* cookie /*SpriteTiles*/)
+{
+	const SpriteTiles* st = (const SpriteTiles*)cookie;
+	Renderer* r = st->r;
+
+	int tx = index % st->tiles_x;
+	int ty = index / st->tiles_x;
+	int clip[4] =
+	{
+		tx * sprite_tile_w,
+		ty * sprite_tile_h,
+		std::min(st->width, (tx + 1) * sprite_tile_w),
+		std::min(st->height, (ty + 1) * sprite_tile_h)
+	};
+
+	for (int i = r->sprite_bin_ofs[index]; i < r->sprite_bin_ofs[index + 1]; i++)
+	{
+		const SpriteRenderBuf* buf = r->sprites_alloc + r->sprite_bin[i];
+
+		// IT IS PERFECTLY STICKED TO WORLD!
+		// it may not perectly stick to character but its fine! (its kinda character is not perfectly positioned)
+
+		// todo: use buf->alpha (perspective fades)
+
+		if (buf->HasHPBar())
+			r->RenderHPBar(st->out, st->width, buf, clip);
+
+		r->RenderSprite(st->out, st->width, st->height, buf->sprite, buf->refl, buf->anim, buf->frame, buf->angle, (int*)buf->s_pos, clip);
+	}
+}
+
+void Renderer::CompositeSprites(AnsiCell* out, int width, int height)
+{
+	stats.sprites += sprites;
+	if (!sprites)
+		return;
+
+	SortSprites(sprites_alloc, sprites, sprite_key, sprite_order);
+
+	SpriteTiles st;
+	st.r = this;
+	st.out = out;
+	st.width = width;
+	st.height = height;
+	st.tiles_x = (width + sprite_tile_w - 1) / sprite_tile_w;
+	int tiles_y = (height + sprite_tile_h - 1) / sprite_tile_h;
+	int tiles = st.tiles_x * tiles_y;
+
+	if (sprite_bins_size < tiles + 1)
+	{
+		sprite_bins_size = tiles + 1;
+		sprite_bin_ofs = (int*)realloc(sprite_bin_ofs, sizeof(int) * sprite_bins_size);
+	}
+	memset(sprite_bin_ofs, 0, sizeof(int) * (tiles + 1));
+
+	// count sprites per tile (shifted by one), rects are in tile units, empty if offscreen
+	for (int s = 0; s < sprites; s++)
+	{
+		int* rc = sprite_rect[s];
+		sprites_alloc[sprite_order[s]].Rect(rc);
+
+		rc[0] = std::max(0, rc[0]);
+		rc[1] = std::max(0, rc[1]);
+		rc[2] = std::min(width, rc[2]);
+		rc[3] = std::min(height, rc[3]);
+
+		if (rc[0] >= rc[2] || rc[1] >= rc[3])
+		{
+			rc[0] = rc[2] = 0;
+			continue;
+		}
+
+		rc[0] /= sprite_tile_w;
+		rc[1] /= sprite_tile_h;
+		rc[2] = (rc[2] - 1) / sprite_tile_w + 1;
+		rc[3] = (rc[3] - 1) / sprite_tile_h + 1;
+
+		for (int y = rc[1]; y < rc[3]; y++)
+			for (int x = rc[0]; x < rc[2]; x++)
+				sprite_bin_ofs[y * st.tiles_x + x + 1]++;
+	}
+
+	for (int t = 0; t < tiles; t++)
+		sprite_bin_ofs[t + 1] += sprite_bin_ofs[t];
+
+	int binned = sprite_bin_ofs[tiles];
+	if (sprite_bin_size < binned)
+	{
+		sprite_bin_size = 2 * binned;
+		sprite_bin = (int*)realloc(sprite_bin, sizeof(int) * sprite_bin_size);
+	}
+
+	// fill in sorted order, ofs[t] advances to end of tile t, then shift back
+	for (int s = 0; s < sprites; s++)
+	{
+		const int* rc = sprite_rect[s];
+		for (int y = rc[1]; y < rc[3]; y++)
+			for (int x = rc[0]; x < rc[2]; x++)
+				sprite_bin[sprite_bin_ofs[y * st.tiles_x + x]++] = sprite_order[s];
+	}
+
+	for (int t = tiles; t > 0; t--)
+		sprite_bin_ofs[t] = sprite_bin_ofs[t - 1];
+	sprite_bin_ofs[0] = 0;
+
+	RunWorkers(workers, tiles, SpriteTileJob, &st);
+}
+
+Renderer* CreateRenderer(uint64_t stamp)
+{
+	Renderer* r = (Renderer*)malloc(sizeof(Renderer));
+
+	r->Init();
+	r->stamp = stamp;
+	return r;
+}
+
+void DeleteRenderer(Renderer* r)
+{
+	r->Free();
+	free(r);
+}
+
+void SetRenderIncremental(Renderer* r, bool incremental)
+{
+	r->incremental = incremental;
+	r->scroll_ok = false;
+}
+
+void SetRenderThreads(Renderer* r, int threads)
+{
+	DeleteWorkers(r->workers);
+	r->workers = 0;
+
+	if (threads != 1)
+	{
+		r->workers = CreateWorkers(threads);
+		if (GetWorkersThreads(r->workers) <= 1)
+		{
+			DeleteWorkers(r->workers);
+			r->workers = 0;
+		}
+	}
+}
+
+const RenderStats* GetRenderStats(Renderer* r)
+{
+	return &r->stats;
+}
+
+void SetRenderFastWater(Renderer* r, bool fast)
+{
+	r->fast_water = fast;
+}
+
+void SetRenderLOD(Renderer* r, bool lod)
+{
+	r->lod = lod;
+	r->scroll_ok = false;
+}
+
+void SetRenderOcclusion(Renderer* r, bool culling)
+{
+	r->culling = culling;
+	r->scroll_ok = false;
+}
+
+void SetRenderTime(Renderer* r, double pn_time)
+{
+	r->pn_time = pn_time;
+}
+
+static uint64_t Checksum(uint64_t hash, const void* data, size_t size)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= p[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+uint64_t GetRenderChecksum(Renderer* r, const AnsiCell* ptr, int width, int height)
+{
+	uint64_t hash = 14695981039346656037ull;
+	hash = Checksum(hash, ptr, sizeof(AnsiCell) * width * height);
+	if (r->sample_buffer.height)
+		hash = Checksum(hash, r->sample_buffer.height, sizeof(float) * r->sample_buffer.w * r->sample_buffer.h);
+	return hash;
+}
+
+Item** GetNearbyItems(Renderer* r)
+{
+	return r->item_sort;
+}
+
+Inst** GetNearbyCharacters(Renderer* r)
+{
+	return r->npc_sort;
+}
+
+
+int render_break_point[2] = { -1,-1 };
+
+// POST PASS
+// every 2x2 samples are turned into single AnsiCell, rows of cells are independent
+// so they are split across workers. Each row goes in 3 steps:
+// - gather: per cell material lookups, rgb of all 4 samples into planes
+// - kernel: colour averaging, split errors and auto_mat indexing (SSE2/AVX2 if available)
+// - finish: glyph selection, lines, silhouettes and water
+
+enum POST_PLANE
+{
+	POST_C = 0, // [4 samples][3 channels] bg rgb
+	POST_FG = 12, // [3 channels] sum of material fg
+	POST_AUTO_H = 15, // [2] auto_mat cube (r|g<<5|b<<10) of upper, lower half
+	POST_AUTO_V = 17, // [2] of left, right half
+	POST_AUTO_AVR = 19, // of whole cell
+	POST_ERR_H = 20,
+	POST_ERR_V = 21,
+	POST_BK = 22, // xterm 6x6x6 of averaged bg
+	POST_FG_X = 23, // xterm 6x6x6 of averaged fg
+	POST_PLANES = 24
+};
+
+// float counterpart of pn.octaveNoise0_1(x * 0.05, y * 0.05, pn_time, 4) evaluated for whole row of water cells,
+// z is shared by all cells so its lattice and fade are computed once per frame for each octave
+struct WaterOctave
+{
+	int Z;
+	float z, w; // fraction and its fade
+};
+
+// both versions must do exactly the same float ops, so frames don't depend on cpu
+static inline float WaterFade(float t)
+{
+	return t * t * t * (t * (t * 6 - 15) + 10);
+}
+
+static inline float WaterLerp(float t, float a, float b)
+{
+	return a + t * (b - a);
+}
+
+static void SetupWaterOctaves(WaterOctave oct[4], double pn_time)
+{
+	for (int o = 0; o < 4; o++)
+	{
+		double z = pn_time * (1 << o);
+		double fz = floor(z);
+		oct[o].Z = (int)fz & 255;
+		oct[o].z = (float)(z - fz);
+		oct[o].w = WaterFade(oct[o].z);
+	}
+}
+
+static inline float WaterGrad(int h, float x, float y, float z)
+{
+	h &= 15;
+	float u = h < 8 ? x : y;
+	float v = h < 4 ? y : h == 12 || h == 14 ? x : z;
+	return ((h & 1) == 0 ? u : -u) + ((h & 2) == 0 ? v : -v);
+}
+
+// replaces wx[0..n) with noise
+static void WaterNoise_Scalar(const int32_t* p, const WaterOctave* oct, int n, float* wx, const float* wy)
+{
+	for (int i = 0; i < n; i++)
+	{
+		float x = wx[i] * 0.05f;
+		float y = wy[i] * 0.05f;
+		float result = 0;
+		float amp = 1;
+
+		for (int o = 0; o < 4; o++)
+		{
+			float fx = floorf(x);
+			float fy = floorf(y);
+			int X = (int)fx & 255;
+			int Y = (int)fy & 255;
+			int Z = oct[o].Z;
+
+			float xf = x - fx;
+			float yf = y - fy;
+			float zf = oct[o].z;
+
+			float u = WaterFade(xf);
+			float v = WaterFade(yf);
+			float w = oct[o].w;
+
+			int A = p[X] + Y, AA = p[A] + Z, AB = p[A + 1] + Z;
+			int B = p[X + 1] + Y, BA = p[B] + Z, BB = p[B + 1] + Z;
+
+			float noise = WaterLerp(w, WaterLerp(v, WaterLerp(u, WaterGrad(p[AA], xf, yf, zf),
+				WaterGrad(p[BA], xf - 1, yf, zf)),
+				WaterLerp(u, WaterGrad(p[AB], xf, yf - 1, zf),
+				WaterGrad(p[BB], xf - 1, yf - 1, zf))),
+				WaterLerp(v, WaterLerp(u, WaterGrad(p[AA + 1], xf, yf, zf - 1),
+				WaterGrad(p[BA + 1], xf - 1, yf, zf - 1)),
+				WaterLerp(u, WaterGrad(p[AB + 1], xf, yf - 1, zf - 1),
+				WaterGrad(p[BB + 1], xf - 1, yf - 1, zf - 1))));
+
+			result += noise * amp;
+			x *= 2;
+			y *= 2;
+			amp *= 0.5f;
+		}
+
+		wx[i] = result * 0.5f + 0.5f;
+	}
+}
+
+#ifdef RENDER_SIMD
+AVX2_TARGET static inline __m256 WaterFade_AVX2(__m256 t)
+{
+	__m256 t3 = _mm256_mul_ps(_mm256_mul_ps(t, t), t);
+	__m256 f = _mm256_sub_ps(_mm256_mul_ps(t, _mm256_set1_ps(6)), _mm256_set1_ps(15));
+	f = _mm256_add_ps(_mm256_mul_ps(t, f), _mm256_set1_ps(10));
+	return _mm256_mul_ps(t3, f);
+}
+
+AVX2_TARGET static inline __m256 WaterLerp_AVX2(__m256 t, __m256 a, __m256 b)
+{
+	return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a)));
+}
+
+AVX2_TARGET static inline __m256 WaterGrad_AVX2(__m256i h, __m256 x, __m256 y, __m256 z)
+{
+	h = _mm256_and_si256(h, _mm256_set1_epi32(15));
+	__m256 lt8 = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(8), h));
+	__m256 lt4 = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(4), h));
+	__m256 hx = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_or_si256(h, _mm256_set1_epi32(2)), _mm256_set1_epi32(14))); // 12 or 14
+	__m256 u = _mm256_blendv_ps(y, x, lt8);
+	__m256 v = _mm256_blendv_ps(_mm256_blendv_ps(z, x, hx), y, lt4);
+	u = _mm256_xor_ps(u, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(1)), 31)));
+	v = _mm256_xor_ps(v, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(2)), 30)));
+	return _mm256_add_ps(u, v);
+}
+
+// processes 8 cells at once, wx and wy must be readable and wx writable upto n rounded up to 8
+AVX2_TARGET static void WaterNoise_AVX2(const int32_t* p, const WaterOctave* oct, int n, float* wx, const float* wy)
+{
+	const __m256 one = _mm256_set1_ps(1);
+	const __m256i m255 = _mm256_set1_epi32(255);
+	const __m256i i1 = _mm256_set1_epi32(1);
+	const int* pi = (const int*)p;
+
+	#define GATHER(i) _mm256_i32gather_epi32(pi, i, 4)
+	#define GRAD(h, x, y, z) WaterGrad_AVX2(GATHER(h), x, y, z)
+
+	for (int i = 0; i < n; i += 8)
+	{
+		__m256 x = _mm256_mul_ps(_mm256_loadu_ps(wx + i), _mm256_set1_ps(0.05f));
+		__m256 y = _mm256_mul_ps(_mm256_loadu_ps(wy + i), _mm256_set1_ps(0.05f));
+		__m256 result = _mm256_setzero_ps();
+		__m256 amp = one;
+
+		for (int o = 0; o < 4; o++)
+		{
+			__m256 fx = _mm256_floor_ps(x);
+			__m256 fy = _mm256_floor_ps(y);
+			__m256i X = _mm256_and_si256(_mm256_cvttps_epi32(fx), m255);
+			__m256i Y = _mm256_and_si256(_mm256_cvttps_epi32(fy), m255);
+			__m256i Z = _mm256_set1_epi32(oct[o].Z);
+
+			__m256 xf = _mm256_sub_ps(x, fx);
+			__m256 yf = _mm256_sub_ps(y, fy);
+			__m256 zf = _mm256_set1_ps(oct[o].z);
+			__m256 xf1 = _mm256_sub_ps(xf, one);
+			__m256 yf1 = _mm256_sub_ps(yf, one);
+			__m256 zf1 = _mm256_sub_ps(zf, one);
+
+			__m256 u = WaterFade_AVX2(xf);
+			__m256 v = WaterFade_AVX2(yf);
+			__m256 w = _mm256_set1_ps(oct[o].w);
+
+			__m256i A = _mm256_add_epi32(GATHER(X), Y);
+			__m256i AA = _mm256_add_epi32(GATHER(A), Z);
+			__m256i AB = _mm256_add_epi32(GATHER(_mm256_add_epi32(A, i1)), Z);
+			__m256i B = _mm256_add_epi32(GATHER(_mm256_add_epi32(X, i1)), Y);
+			__m256i BA = _mm256_add_epi32(GATHER(B), Z);
+			__m256i BB = _mm256_add_epi32(GATHER(_mm256_add_epi32(B, i1)), Z);
+			__m256i AA1 = _mm256_add_epi32(AA, i1);
+			__m256i AB1 = _mm256_add_epi32(AB, i1);
+			__m256i BA1 = _mm256_add_epi32(BA, i1);
+			__m256i BB1 = _mm256_add_epi32(BB, i1);
+
+			__m256 noise = WaterLerp_AVX2(w, WaterLerp_AVX2(v, WaterLerp_AVX2(u, GRAD(AA, xf, yf, zf),
+				GRAD(BA, xf1, yf, zf)),
+				WaterLerp_AVX2(u, GRAD(AB, xf, yf1, zf),
+				GRAD(BB, xf1, yf1, zf))),
+				WaterLerp_AVX2(v, WaterLerp_AVX2(u, GRAD(AA1, xf, yf, zf1),
+				GRAD(BA1, xf1, yf, zf1)),
+				WaterLerp_AVX2(u, GRAD(AB1, xf, yf1, zf1),
+				GRAD(BB1, xf1, yf1, zf1))));
+
+			result = _mm256_add_ps(result, _mm256_mul_ps(noise, amp));
+			x = _mm256_add_ps(x, x);
+			y = _mm256_add_ps(y, y);
+			amp = _mm256_mul_ps(amp, _mm256_set1_ps(0.5f));
+		}
+
+		result = _mm256_add_ps(_mm256_mul_ps(result, _mm256_set1_ps(0.5f)), _mm256_set1_ps(0.5f));
+		_mm256_storeu_ps(wx + i, result);
+	}
+
+	#undef GRAD
+	#undef GATHER
+}
+#endif
+
+typedef void (*WaterNoise)(const int32_t* p, const WaterOctave* oct, int n, float* wx, const float* wy);
+
+static WaterNoise SelectWaterNoise()
+{
+#ifdef RENDER_SIMD
+	if (render_avx2)
+		return WaterNoise_AVX2;
+#endif
+	return WaterNoise_Scalar;
+}
+
+static WaterNoise water_noise = SelectWaterNoise();
+
+struct PostPass
+{
+	Renderer* r;
+	const Material* matlib;
+	AnsiCell* out;
+	int width, height;
+	int stride; // plane stride, width rounded up to 16
+	int jobs;
+	uint64_t (*job_ns)[2]; // per job: total, water ripples
+
+	float water;
+	const double* inv_tm;
+	float ww_x, ww_y, ww_c, wx_x, wx_y, wx_c, wy_x, wy_y, wy_c;
+
+	WaterOctave water_oct[4]; // for fast_water
+};
+
+static void PostKernel_Scalar(int n, int16_t* p[POST_PLANES])
+{
+	for (int x = 0; x < n; x++)
+	{
+		int err_h = 0, err_v = 0;
+		int auto_h[2] = { 0,0 }, auto_v[2] = { 0,0 }, auto_avr = 0;
+		int bk = 0, fg = 0;
+
+		for (int ch = 0; ch < 3; ch++)
+		{
+			int c[4] = { p[POST_C + ch][x], p[POST_C + 3 + ch][x], p[POST_C + 6 + ch][x], p[POST_C + 9 + ch][x] };
+
+			int bg_h[2] = { 2 * (c[0] + c[1]), 2 * (c[2] + c[3]) }; // 0+1 \ 2+3 
+			int bg_v[2] = { 2 * (c[0] + c[2]), 2 * (c[1] + c[3]) }; // 0+2 | 1+3
+			int bg = c[0] + c[1] + c[2] + c[3];
+
+			err_h += abs(bg_h[0] - 4 * c[0]) + abs(bg_h[0] - 4 * c[1]) + abs(bg_h[1] - 4 * c[2]) + abs(bg_h[1] - 4 * c[3]);
+			err_v += abs(bg_v[0] - 4 * c[0]) + abs(bg_v[1] - 4 * c[1]) + abs(bg_v[0] - 4 * c[2]) + abs(bg_v[1] - 4 * c[3]);
+
+			auto_h[0] |= ((bg_h[0] + 20) / 33) << (5 * ch);
+			auto_h[1] |= ((bg_h[1] + 20) / 33) << (5 * ch);
+			auto_v[0] |= ((bg_v[0] + 20) / 33) << (5 * ch);
+			auto_v[1] |= ((bg_v[1] + 20) / 33) << (5 * ch);
+			auto_avr |= (bg / 33) << (5 * ch);
+
+			bk = bk * 6 + (bg + 102) / 204;
+			fg = fg * 6 + (p[POST_FG + ch][x] + 102) / 204;
+		}
+
+		p[POST_AUTO_H + 0][x] = auto_h[0];
+		p[POST_AUTO_H + 1][x] = auto_h[1];
+		p[POST_AUTO_V + 0][x] = auto_v[0];
+		p[POST_AUTO_V + 1][x] = auto_v[1];
+		p[POST_AUTO_AVR][x] = auto_avr;
+		p[POST_ERR_H][x] = err_h;
+		p[POST_ERR_V][x] = err_v;
+		p[POST_BK][x] = 16 + bk;
+		p[POST_FG_X][x] = 16 + fg;
+	}
+}
+
+#ifdef RENDER_SIMD
+
+// all values fit in 16 bits: samples are 0..255, sums of 4 are upto 1020, errors upto 6120
+// divisions are done with mulhi:  x/33 == (x*1986)>>16 for x <= 1040,  x/51 == (x*1286)>>16 for x <= 281
+// (x+102)/204 is computed as ((x+102)>>2)/51
+
+static void PostKernel_SSE2(int n, int16_t* p[POST_PLANES])
+{
+	const __m128i m33 = _mm_set1_epi16(1986);
+	const __m128i m51 = _mm_set1_epi16(1286);
+	const __m128i c20 = _mm_set1_epi16(20);
+	const __m128i c102 = _mm_set1_epi16(102);
+	const __m128i c6 = _mm_set1_epi16(6);
+	const __m128i c16 = _mm_set1_epi16(16);
+	const __m128i zero = _mm_setzero_si128();
+
+	#define ABS16(a) _mm_max_epi16(a, _mm_sub_epi16(zero, a))
+	#define LOAD(q) _mm_loadu_si128((const __m128i*)(p[q] + x))
+	#define STORE(q, v) _mm_storeu_si128((__m128i*)(p[q] + x), v)
+
+	for (int x = 0; x < n; x += 8)
+	{
+		__m128i err_h = zero, err_v = zero;
+		__m128i auto_h0 = zero, auto_h1 = zero, auto_v0 = zero, auto_v1 = zero, auto_avr = zero;
+		__m128i bk = zero, fg = zero;
+
+		for (int ch = 0; ch < 3; ch++)
+		{
+			__m128i c0 = LOAD(POST_C + ch);
+			__m128i c1 = LOAD(POST_C + 3 + ch);
+			__m128i c2 = LOAD(POST_C + 6 + ch);
+			__m128i c3 = LOAD(POST_C + 9 + ch);
+
+			__m128i h0 = _mm_slli_epi16(_mm_add_epi16(c0, c1), 1);
+			__m128i h1 = _mm_slli_epi16(_mm_add_epi16(c2, c3), 1);
+			__m128i v0 = _mm_slli_epi16(_mm_add_epi16(c0, c2), 1);
+			__m128i v1 = _mm_slli_epi16(_mm_add_epi16(c1, c3), 1);
+			__m128i bg = _mm_srli_epi16(_mm_add_epi16(h0, h1), 1);
+
+			c0 = _mm_slli_epi16(c0, 2);
+			c1 = _mm_slli_epi16(c1, 2);
+			c2 = _mm_slli_epi16(c2, 2);
+			c3 = _mm_slli_epi16(c3, 2);
+
+			err_h = _mm_add_epi16(err_h, _mm_add_epi16(
+				_mm_add_epi16(ABS16(_mm_sub_epi16(h0, c0)), ABS16(_mm_sub_epi16(h0, c1))),
+				_mm_add_epi16(ABS16(_mm_sub_epi16(h1, c2)), ABS16(_mm_sub_epi16(h1, c3)))));
+			err_v = _mm_add_epi16(err_v, _mm_add_epi16(
+				_mm_add_epi16(ABS16(_mm_sub_epi16(v0, c0)), ABS16(_mm_sub_epi16(v1, c1))),
+				_mm_add_epi16(ABS16(_mm_sub_epi16(v0, c2)), ABS16(_mm_sub_epi16(v1, c3)))));
+
+			auto_h0 = _mm_or_si128(auto_h0, _mm_sll_epi16(_mm_mulhi_epu16(_mm_add_epi16(h0, c20), m33), _mm_cvtsi32_si128(5 * ch)));
+			auto_h1 = _mm_or_si128(auto_h1, _mm_sll_epi16(_mm_mulhi_epu16(_mm_add_epi16(h1, c20), m33), _mm_cvtsi32_si128(5 * ch)));
+			auto_v0 = _mm_or_si128(auto_v0, _mm_sll_epi16(_mm_mulhi_epu16(_mm_add_epi16(v0, c20), m33), _mm_cvtsi32_si128(5 * ch)));
+			auto_v1 = _mm_or_si128(auto_v1, _mm_sll_epi16(_mm_mulhi_epu16(_mm_add_epi16(v1, c20), m33), _mm_cvtsi32_si128(5 * ch)));
+			auto_avr = _mm_or_si128(auto_avr, _mm_sll_epi16(_mm_mulhi_epu16(bg, m33), _mm_cvtsi32_si128(5 * ch)));
+
+			bk = _mm_add_epi16(_mm_mullo_epi16(bk, c6), _mm_mulhi_epu16(_mm_srli_epi16(_mm_add_epi16(bg, c102), 2), m51));
+			fg = _mm_add_epi16(_mm_mullo_epi16(fg, c6), _mm_mulhi_epu16(_mm_srli_epi16(_mm_add_epi16(LOAD(POST_FG + ch), c102), 2), m51));
+		}
+
+		STORE(POST_AUTO_H + 0, auto_h0);
+		STORE(POST_AUTO_H + 1, auto_h1);
+		STORE(POST_AUTO_V + 0, auto_v0);
+		STORE(POST_AUTO_V + 1, auto_v1);
+		STORE(POST_AUTO_AVR, auto_avr);
+		STORE(POST_ERR_H, err_h);
+		STORE(POST_ERR_V, err_v);
+		STORE(POST_BK, _mm_add_epi16(bk, c16));
+		STORE(POST_FG_X, _mm_add_epi16(fg, c16));
+	}
+
+	#undef ABS16
+	#undef LOAD
+	#undef STORE
+}
+
+AVX2_TARGET static void PostKernel_AVX2(int n, int16_t* p[POST_PLANES])
+{
+	const __m256i m33 = _mm256_set1_epi16(1986);
+	const __m256i m51 = _mm256_set1_epi16(1286);
+	const __m256i c20 = _mm256_set1_epi16(20);
+	const __m256i c102 = _mm256_set1_epi16(102);
+	const __m256i c6 = _mm256_set1_epi16(6);
+	const __m256i c16 = _mm256_set1_epi16(16);
+	const __m256i zero = _mm256_setzero_si256();
+
+	#define ABS16(a) _mm256_abs_epi16(a)
+	#define LOAD(q) _mm256_loadu_si256((const __m256i*)(p[q] + x))
+	#define STORE(q, v) _mm256_storeu_si256((__m256i*)(p[q] + x), v)
+
+	for (int x = 0; x < n; x += 16)
+	{
+		__m256i err_h = zero, err_v = zero;
+		__m256i auto_h0 = zero, auto_h1 = zero, auto_v0 = zero, auto_v1 = zero, auto_avr = zero;
+		__m256i bk = zero, fg = zero;
+
+		for (int ch = 0; ch < 3; ch++)
+		{
+			__m256i c0 = LOAD(POST_C + ch);
+			__m256i c1 = LOAD(POST_C + 3 + ch);
+			__m256i c2 = LOAD(POST_C + 6 + ch);
+			__m256i c3 = LOAD(POST_C + 9 + ch);
+
+			__m256i h0 = _mm256_slli_epi16(_mm256_add_epi16(c0, c1), 1);
+			__m256i h1 = _mm256_slli_epi16(_mm256_add_epi16(c2, c3), 1);
+			__m256i v0 = _mm256_slli_epi16(_mm256_add_epi16(c0, c2), 1);
+			__m256i v1 = _mm256_slli_epi16(_mm256_add_epi16(c1, c3), 1);
+			__m256i bg = _mm256_srli_epi16(_mm256_add_epi16(h0, h1), 1);
+
+			c0 = _mm256_slli_epi16(c0, 2);
+			c1 = _mm256_slli_epi16(c1, 2);
+			c2 = _mm256_slli_epi16(c2, 2);
+			c3 = _mm256_slli_epi16(c3, 2);
+
+			err_h = _mm256_add_epi16(err_h, _mm256_add_epi16(
+				_mm256_add_epi16(ABS16(_mm256_sub_epi16(h0, c0)), ABS16(_mm256_sub_epi16(h0, c1))),
+				_mm256_add_epi16(ABS16(_mm256_sub_epi16(h1, c2)), ABS16(_mm256_sub_epi16(h1, c3)))));
+			err_v = _mm256_add_epi16(err_v, _mm256_add_epi16(
+				_mm256_add_epi16(ABS16(_mm256_sub_epi16(v0, c0)), ABS16(_mm256_sub_epi16(v1, c1))),
+				_mm256_add_epi16(ABS16(_mm256_sub_epi16(v0, c2)), ABS16(_mm256_sub_epi16(v1, c3)))));
+
+			__m128i sh = _mm_cvtsi32_si128(5 * ch);
+			auto_h0 = _mm256_or_si256(auto_h0, _mm256_sll_epi16(_mm256_mulhi_epu16(_mm256_add_epi16(h0, c20), m33), sh));
+			auto_h1 = _mm256_or_si256(auto_h1, _mm256_sll_epi16(_mm256_mulhi_epu16(_mm256_add_epi16(h1, c20), m33), sh));
+			auto_v0 = _mm256_or_si256(auto_v0, _mm256_sll_epi16(_mm256_mulhi_epu16(_mm256_add_epi16(v0, c20), m33), sh));
+			auto_v1 = _mm256_or_si256(auto_v1, _mm256_sll_epi16(_mm256_mulhi_epu16(_mm256_add_epi16(v1, c20), m33), sh));
+			auto_avr = _mm256_or_si256(auto_avr, _mm256_sll_epi16(_mm256_mulhi_epu16(bg, m33), sh));
+
+			bk = _mm256_add_epi16(_mm256_mullo_epi16(bk, c6), _mm256_mulhi_epu16(_mm256_srli_epi16(_mm256_add_epi16(bg, c102), 2), m51));
+			fg = _mm256_add_epi16(_mm256_mullo_epi16(fg, c6), _mm256_mulhi_epu16(_mm256_srli_epi16(_mm256_add_epi16(LOAD(POST_FG + ch), c102), 2), m51));
+		}
+
+		STORE(POST_AUTO_H + 0, auto_h0);
+		STORE(POST_AUTO_H + 1, auto_h1);
+		STORE(POST_AUTO_V + 0, auto_v0);
+		STORE(POST_AUTO_V + 1, auto_v1);
+		STORE(POST_AUTO_AVR, auto_avr);
+		STORE(POST_ERR_H, err_h);
+		STORE(POST_ERR_V, err_v);
+		STORE(POST_BK, _mm256_add_epi16(bk, c16));
+		STORE(POST_FG_X, _mm256_add_epi16(fg, c16));
+	}
+
+	#undef ABS16
+	#undef LOAD
+	#undef STORE
+}
+#endif
+
+typedef void (*PostKernel)(int n, int16_t* p[POST_PLANES]);
+
+static PostKernel SelectPostKernel()
+{
+#ifdef RENDER_SIMD
+	if (render_avx2)
+		return PostKernel_AVX2;
+	return PostKernel_SSE2;
+#else
+	return PostKernel_Scalar;
+#endif
+}
+
+static PostKernel post_kernel = SelectPostKernel();
+
+// water_x, water_w (2 planes of stride) are scratch for water cells of the row, time spent on ripples is added to water_ns
+static void PostPassRow(const PostPass* pp, int y, int16_t* p[POST_PLANES], uint8_t* cell, int* water_x, float* water_w, uint64_t* water_ns)
+{
+	Renderer* r = pp->r;
+	const Material* matlib = pp->matlib;
+	int width = pp->width;
+	const SampleBuffer* sb = &r->sample_buffer;
+	int dw = sb->w;
+	float water = pp->water;
+
+	AnsiCell* ptr = pp->out + y * width;
+
+#ifdef DBL
+	int src = 2 + 2 * dw + y * 2 * dw;
+	int water_cells = 0;
+
+	// gather
+	for (int x = 0; x < width; x++, src += 2)
+	{
+		// given interpolated RGB -> round to 555, store it in visual
+		// copy to diffuse to diffuse
+		// mark mash 'auto-material' as 0x8 flag in spare
+
+		// in post pass:
+		// if sample has 0x8 flag
+		//   multiply rgb by diffuse (into 888 bg=fg)
+		// apply color mixing with neighbours
+		// if at least 1 sample have mesh bit in spare
+		// - round mixed bg rgb to R5G5B5 and use auto_material[32K] -> {bg,fg,gl}
+		// else apply gridlines etc.
+
+		// average 4 backgrounds
+		// mask 11 (something rendered)
+		int spr[4] = { sb->spare[src] & 11, sb->spare[src + 1] & 11, sb->spare[src + dw] & 11, sb->spare[src + dw + 1] & 11 };
+		int mat[4] = { sb->visual[src] & 0x00FF , sb->visual[src + 1] & 0x00FF, sb->visual[src + dw] & 0x00FF, sb->visual[src + dw + 1] & 0x00FF };
+		int dif[4] = { sb->diffuse[src] , sb->diffuse[src + 1], sb->diffuse[src + dw], sb->diffuse[src + dw + 1] };
+		int vis[4] = { sb->visual[src], sb->visual[src + 1], sb->visual[src + dw], sb->visual[src + dw + 1] };
+
+		// TODO:
+		// every material must have 16x16 map and uses visual shade to select Y and lighting to select X
+		// animated materials additionaly pre shifts and wraps visual shade by current time scaled by material's 'speed'
+
+		int e_lo = (sb->visual[src - dw] >> 15) + (sb->visual[src - dw + 1] >> 15);
+		int e_hi = (sb->visual[src + dw] >> 15) + (sb->visual[src + dw + 1] >> 15);
+
+		int elv;
+		if (e_lo <= 1)
+		{
+			if (e_hi <= 1)
+				elv = 3; // lo
+			else
+				elv = 2; // raise
+		}
+		else
+		{
+			if (e_hi <= 1)
+				elv = 0; // lower
+			else
+				elv = 1; // hi
+		}
+
+		int shd = (dif[0] + dif[1] + dif[2] + dif[3] + 17 * 2) / (17 * 4); // 17: FF->F, 4: avr
 
-			/*
-			if (src->bk != 255)
+		int fg[3] = { 0,0,0 };
+
+		bool use_auto_mat = false;
+
+		// if cell contains both refl and non-refl terrain enable auto-mat
+		bool has_refl = (spr[0] & 3) == 3 || (spr[1] & 3) == 3 || (spr[2] & 3) == 3 || (spr[3] & 3) == 3;
+		bool has_norm = (spr[0] & 3) == 1 || (spr[1] & 3) == 1 || (spr[2] & 3) == 1 || (spr[3] & 3) == 1;
+		if (has_refl && has_norm)
+		{
+			use_auto_mat = true;
+		}
+
+		for (int i = 0; i < 4; i++)
+		{
+			int r, g, b;
+			if (spr[i] & 0x8)
 			{
-				if (src->fg != 255)
+				r = ((vis[i] & 0x1F) * 527 + 23) >> 6;
+				g = (((vis[i] >> 5) & 0x1F) * 527 + 23) >> 6;
+				b = (((vis[i] >> 10) & 0x1F) * 527 + 23) >> 6;
+
+				if ((spr[i] & 0x3) == 3)
 				{
-					// check if at least 2/4 samples passes depth test, update all 4
-					// ...
+					r = r * dif[i] / 400;
+					g = g * dif[i] / 400;
+					b = b * dif[i] / 400;
+				}
+				else
+				{
+					r = r * dif[i] / 255;
+					g = g * dif[i] / 255;
+					b = b * dif[i] / 255;
+				}
 
-					if (!refl && height >= water || refl && height <= water)
-					{
-						if (height >= s00->height)
-						{
-							s00->height = height;
-							depth_passed++;
-						}
-						if (height >= s01->height)
-						{
-							s01->height = height;
-							depth_passed++;
-						}
-						if (height >= s10->height)
-						{
-							s10->height = height;
-							depth_passed++;
-						}
-						if (height >= s11->height)
-						{
-							s11->height = height;
-							depth_passed++;
-						}
-					}
+				use_auto_mat = true;
+			}
+			else
+			{
+				int s = dif[i] / 17;
+				const MatCell* mc = &matlib[mat[i]].shade[elv][s];
+				r = mc->bg[0];
+				g = mc->bg[1];
+				b = mc->bg[2];
 
-					if (depth_passed >= 3)
-					{
-						*dst = *src;
-						//s00->height = height;
-						//s01->height = height;
-						//s10->height = height;
-						//s11->height = height;
-					}
+				if ((spr[i] & 0x3) == 3)
+				{
+					r = r * 255 / 400;
+					g = g * 255 / 400;
+					b = b * 255 / 400;
+
+					fg[0] += mc->fg[0] * 255 / 400;
+					fg[1] += mc->fg[1] * 255 / 400;
+					fg[2] += mc->fg[2] * 255 / 400;
 				}
 				else
 				{
-					// check if at least 1/2 bk sample passes depth test, update both
-					// ...
+					fg[0] += mc->fg[0];
+					fg[1] += mc->fg[1];
+					fg[2] += mc->fg[2];
+				}
+			}
 
-					if (!refl && height >= water || refl && height <= water)
-					{
-						if (height >= s00->height)
-						{
-							s00->height = height;
-							depth_passed++;
-						}
-						if (height >= s01->height)
-						{
-							s01->height = height;
-							depth_passed++;
-						}
-						if (height >= s10->height)
-						{
-							s10->height = height;
-							depth_passed++;
-						}
-						if (height >= s11->height)
-						{
-							s11->height = height;
-							depth_passed++;
-						}
-					}
+			p[POST_C + 3 * i + 0][x] = r;
+			p[POST_C + 3 * i + 1][x] = g;
+			p[POST_C + 3 * i + 2][x] = b;
+		}
 
-					if (depth_passed >= 3)
-					{
-						if (dst->gl == 0xDC && src->gl == 0xDF || dst->gl == 0xDD && src->gl == 0xDE ||
-							dst->gl == 0xDF && src->gl == 0xDC || dst->gl == 0xDE && src->gl == 0xDD)
-						{
-							dst->fg = src->bk;
-						}
-						else
-						{
-							dst->bk = src->bk;
-							dst->gl = src->gl;
-						}
+		p[POST_FG + 0][x] = fg[0];
+		p[POST_FG + 1][x] = fg[1];
+		p[POST_FG + 2][x] = fg[2];
 
-						// s00->height = height;
-						// s01->height = height;
-						// s10->height = height;
-						// s11->height = height;
-					}
-				}
+		// cell bits: 0-1 elv, 2 auto mat, glyph in next byte
+		cell[2 * x + 0] = elv | (use_auto_mat ? 4 : 0);
+		cell[2 * x + 1] = matlib[mat[0]].shade[elv][shd].gl;
+	}
+
+	post_kernel(width, p);
+
+	// finish
+	src = 2 + 2 * dw + y * 2 * dw;
+	for (int x = 0; x < width; x++, ptr++, src += 2)
+	{
+		if (x == render_break_point[0] && y == render_break_point[1])
+		{
+			render_break_point[0] = -1;
+			render_break_point[1] = -1;
+		}
+
+		int elv = cell[2 * x] & 3;
+		bool use_auto_mat = (cell[2 * x] & 4) != 0;
+
+		if (use_auto_mat)
+		{
+			int err_h = p[POST_ERR_H][x];
+			int err_v = p[POST_ERR_V][x];
+
+			// WORKS REALY WELL! 
+			bool vh_near = true;
+
+			if (err_h * 1000 < err_v * 999)
+			{
+				vh_near = false;
+				// _FG_
+				//  BK
+				ptr->gl = 0xDF;
+
+				int auto_mat_lo = 3 * p[POST_AUTO_H + 0][x];
+				int auto_mat_hi = 3 * p[POST_AUTO_H + 1][x];
+
+				ptr->bk = auto_mat[auto_mat_lo + 0];
+				ptr->fg = auto_mat[auto_mat_hi + 0];
 			}
 			else
+			if (err_v * 1000 < err_h * 999)
 			{
-				if (src->fg != 255)
-				{
-					// check if at least 1/2 fg samples passes depth test, update both
-					// ...
-					if (!refl && height >= water || refl && height <= water)
-					{
-						if (height >= s00->height)
-						{
-							s00->height = height;
-							depth_passed++;
-						}
-						if (height >= s01->height)
-						{
-							s01->height = height;
-							depth_passed++;
-						}
-						if (height >= s10->height)
-						{
-							s10->height = height;
-							depth_passed++;
-						}
-						if (height >= s11->height)
-						{
-							s11->height = height;
-							depth_passed++;
-						}
-					}
+				vh_near = false;
+				// B|F
+				// K|G
+				ptr->gl = 0xDE;
 
-					if (depth_passed >= 3)
-					{
-						if (dst->gl == 0xDC && src->gl == 0xDF || dst->gl == 0xDD && src->gl == 0xDE ||
-							dst->gl == 0xDF && src->gl == 0xDC || dst->gl == 0xDE && src->gl == 0xDD)
-						{
-							dst->bk = src->fg;
-						}
-						else
-						{
-							dst->fg = src->fg;
-							dst->gl = src->gl;
-						}
+				int auto_mat_lt = 3 * p[POST_AUTO_V + 0][x];
+				int auto_mat_rt = 3 * p[POST_AUTO_V + 1][x];
 
-						//s00->height = height;
-						//s01->height = height;
-						//s10->height = height;
-						//s11->height = height;
-					}
+				ptr->bk = auto_mat[auto_mat_lt + 0];
+				ptr->fg = auto_mat[auto_mat_rt + 0];
+			}
+
+			if (ptr->bk == ptr->fg || vh_near)
+			{
+				// avr4
+				int auto_mat_idx = 3 * p[POST_AUTO_AVR][x];
+				ptr->gl = auto_mat[auto_mat_idx + 2];
+				ptr->bk = auto_mat[auto_mat_idx + 0];
+				ptr->fg = auto_mat[auto_mat_idx + 1];
+				ptr->spare = 0xFF;
+			}
+		}
+		else
+		{
+			ptr->gl = cell[2 * x + 1];
+			ptr->bk = (uint8_t)p[POST_BK][x];
+			ptr->fg = (uint8_t)p[POST_FG_X][x];
+			ptr->spare = 0xFF;
+
+			// collect line bits
+
+			if (elv == 3) // only low elevation
+			{
+				int linecase = ((sb->spare[src] & 0x4) >> 2) | ((sb->spare[src + 1] & 0x4) >> 1) | (sb->spare[src + dw] & 0x4) | ((sb->spare[src + dw + 1] & 0x4) << 1);
+				static const int linecase_glyph[] = { 0, ',', ',', ',', '`', ';', ';', ';', '`', ';', ';', ';', '`', ';', ';', ';' };
+				if (linecase)
+					ptr->gl = linecase_glyph[linecase];
+			}
+
+			if (elv == 1 || elv == 3) // no elev change
+			{
+				// silhouette repetitoire:  _-/\| (should not be used by materials?)
+				float z_hi = sb->height[src + dw] + sb->height[src + dw + 1];
+				float z_lo = sb->height[src] + sb->height[src + 1];
+				float z_pr = sb->height[src - dw] + sb->height[src + 1 - dw];
+
+				float minus = z_lo - z_hi;
+				float under = z_pr - z_lo;
+
+				static const float thresh = 1 * HEIGHT_SCALE;
+
+				if ((minus > thresh && minus > under) || (under > thresh && under >= minus))
+				{
+					ptr->gl = minus > under ? 0xC4 /* '-' */ : 0x5F /* '_' */;
+
+					int bk = ptr->bk - 16;
+					int bk_rgb[3] = { bk / 36, bk / 6 % 6, bk % 6 };
+					bk_rgb[0] = std::max(0, bk_rgb[0] - 1);
+					bk_rgb[1] = std::max(0, bk_rgb[1] - 1);
+					bk_rgb[2] = std::max(0, bk_rgb[2] - 1);
+					ptr->fg = 16 + 36 * bk_rgb[0] + bk_rgb[1] * 6 + bk_rgb[2];
 				}
 			}
-			*/
 		}
+
+		int linecase = ((sb->spare[src] & 0x40) >> 6) | ((sb->spare[src + 1] & 0x40) >> 5) | ((sb->spare[src + dw] & 0x40)>>4) | ((sb->spare[src + dw + 1] & 0x40) >> 3);
+		static const int linecase_glyph[] = { 0, ',', ',', ',', '`', ';', ';', ';', '`', ';', ';', ';', '`', ';', ';', ';' };
+		if (linecase)
+		{
+			ptr->gl = linecase_glyph[linecase];
+			ptr->fg = 16;
+		}
+		else
+		if (sb->height[src] < water && sb->height[src + 1] < water && sb->height[src + dw] < water && sb->height[src + dw+1] < water)
+		{
+			double w[4]; 
+			if (r->perspective) // #if PERSPECTIVE_TEST
+			{
+				float sx_dx = 2.0*x - r->view_ofs[0];
+				float sy_dy = 2.0*y - r->view_ofs[1];
+				float ww = (sx_dx*pp->ww_x + sy_dy*pp->ww_y + pp->ww_c);
+				if (ww<0)
+				{
+					ww = 1.0/ww;
+					float wx = ww * (pp->wx_c + pp->wx_x * sx_dx - pp->wx_y * sy_dy);
+					float wy = ww * (pp->wy_c - pp->wy_x * sx_dx + pp->wy_y * sy_dy);
+					w[0] = wx;
+					w[1] = wy;
+				}
+				else
+				{
+					ptr->gl = ' ';
+					continue;
+				}
+			}
+			else // #else
+			{
+				double s[4] = { 2.0*x, 2.0*y, water, 1.0 };
+				Product(pp->inv_tm, s, w); // convert from screen to world
+				w[0] = round(w[0]);
+				w[1] = round(w[1]);
+			}
+			// #endif
+
+			// ripples are applied after whole row
+			water_x[water_cells] = x;
+			water_w[water_cells] = (float)w[0];
+			water_w[pp->stride + water_cells] = (float)w[1];
+			water_cells++;
+		}
+
+		// xterm conv
 	}
-}
 
-Renderer* CreateRenderer(uint64_t stamp)
-{
-	Renderer* r = (Renderer*)malloc(sizeof(Renderer));
+	// water ripples
+	uint64_t t0 = StatsClock();
+	ptr = pp->out + y * width;
+	if (r->fast_water)
+	{
+		for (int i = water_cells; i < ((water_cells + 7) & ~7); i++)
+		{
+			water_w[i] = 0;
+			water_w[pp->stride + i] = 0;
+		}
+		water_noise(r->water_perm, pp->water_oct, water_cells, water_w, water_w + pp->stride);
+	}
 
-	r->Init();
-	r->stamp = stamp;
-	return r;
-}
+	for (int i = 0; i < water_cells; i++)
+	{
+		AnsiCell* wc = ptr + water_x[i];
+		double d = r->fast_water ? water_w[i] :
+			r->pn.octaveNoise0_1(water_w[i] * 0.05, water_w[pp->stride + i] * 0.05, r->pn_time, 4);
 
-void DeleteRenderer(Renderer* r)
-{
-	r->Free();
-	free(r);
-}
+		int id = (int)(d * 5) - 2;
 
-Item** GetNearbyItems(Renderer* r)
-{
-	return r->item_sort;
+		if (id < -1)
+			id = 2;
+		if (id > 1)
+			id = -2;
+
+		if (id > 0)
+		{
+			int c = wc->fg - 16;
+			int cr = c / 36;
+			c -= cr * 36;
+			int cg = c / 6;
+			c -= cr * 6;
+			int cb = c;
+
+			if (cr < 5 && cg < 5 /*&& cb < 5*/)
+			{
+				if (cb < 5)
+					wc->fg += 1 + 6 + 36;
+				else
+					wc->fg += 6 + 36;
+			}
+		}
+		else
+		if (id < 0)
+		{
+			int c = wc->fg - 16;
+			int cr = c / 36;
+			c -= cr * 36;
+			int cg = c / 6;
+			c -= cr * 6;
+			int cb = c;
+
+			if (cr > 0 && cg > 0 /*&& cb > 0*/)
+			{
+				if (cb > 0)
+					wc->fg -= 1 + 6 + 36;
+				else
+					wc->fg -= 6 + 36;
+			}
+		}
+	}
+	*water_ns += StatsClock() - t0;
+#else
+	int src = 2 + 2 * dw + y * dw;
+	for (int x = 0; x < width; x++, ptr++, src++)
+	{
+		int mat = sb->visual[src] & 0x00FF;
+		int shd = 0; // (sb->visual[src] >> 8) & 0x007F;
+		int elv = 0; // (sb->visual[src] >> 15) & 0x0001;
+
+		// fill from material
+		const MatCell* cell = &(matlib[mat].shade[1][shd]);
+		const uint8_t* bg = matlib[mat].shade[1][shd].bg;
+		const uint8_t* fg = matlib[mat].shade[1][shd].fg;
+
+		ptr->gl = cell->gl;
+		ptr->bk = 16 + (((bg[0] + 25) / 51) + (((bg[1] + 25) / 51) * 6) + (((bg[2] + 25) / 51) * 36));
+		ptr->fg = 16 + (((fg[0] + 25) / 51) + (((fg[1] + 25) / 51) * 6) + (((fg[2] + 25) / 51) * 36));
+		ptr->spare = 0xFF;
+	}
+#endif
 }
 
-Inst** GetNearbyCharacters(Renderer* r)
+static void PostPassJob(int index, void* cookie /*PostPass*/)
 {
-	return r->npc_sort;
+	const PostPass* pp = (const PostPass*)cookie;
+	int y0 = pp->height * index / pp->jobs;
+	int y1 = pp->height * (index + 1) / pp->jobs;
+
+	int16_t* p[POST_PLANES];
+	int16_t* planes = (int16_t*)calloc(POST_PLANES * pp->stride, sizeof(int16_t));
+	uint8_t* cell = (uint8_t*)malloc(2 * pp->stride);
+	for (int i = 0; i < POST_PLANES; i++)
+		p[i] = planes + i * pp->stride;
+
+	int* water_x = (int*)malloc(sizeof(int) * pp->stride);
+	float* water_w = (float*)malloc(sizeof(float) * 2 * pp->stride);
+	uint64_t water_ns = 0;
+	uint64_t t0 = StatsClock();
+
+	for (int y = y0; y < y1; y++)
+		PostPassRow(pp, y, p, cell, water_x, water_w, &water_ns);
+
+	pp->job_ns[index][0] = StatsClock() - t0;
+	pp->job_ns[index][1] = water_ns;
+
+	free(water_w);
+	free(water_x);
+	free(cell);
+	free(planes);
 }
 
-
-int render_break_point[2] = { -1,-1 };
-
-void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, float zoom, float yaw, const float pos[3], const float lt[4], int width, int height, AnsiCell* ptr, Inst* inst, const int scene_shift[2], bool perspective)
+// inst (player) must be hidden in world or set as r->skip_inst
+static void RenderScene(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, float zoom, float yaw, const float pos[3], const float lt[4], int width, int height, AnsiCell* ptr, Inst* inst, const int scene_shift[2], bool perspective)
 {
-	r->perspective = perspective;
+	uint64_t frame_t0 = StatsClock();
+	memset(&r->stats, 0, sizeof(RenderStats));
+	r->raster_ns[0] = 0;
+	r->raster_ns[1] = 0;
 
-	if (inst)
-		HideInst(inst);
+	r->perspective = perspective;
 
 	AnsiCell* out_ptr = ptr;
 
@@ -2692,7 +5240,7 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, floa
 
 	float ds = 2*zoom / VISUAL_CELLS;
 
-	if (!r->sample_buffer.ptr)
+	if (!r->sample_buffer.height)
 	{
 		r->int_flag = true;
 		for (int uv=0; uv<HEIGHT_CELLS; uv++)
@@ -2702,34 +5250,20 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, floa
 		};
 
 
-		r->sample_buffer.w = dw;
-		r->sample_buffer.h = dh;
-		r->sample_buffer.ptr = (Sample*)malloc(dw*dh * sizeof(Sample) * 2); // upper half is clear cache
-
-		for (int cl = dw * dh; cl < 2*dw*dh; cl++)
-		{
-			r->sample_buffer.ptr[cl].height = -1000000;
-			r->sample_buffer.ptr[cl].spare = 0x8;
-			r->sample_buffer.ptr[cl].diffuse = 0xFF;
-			r->sample_buffer.ptr[cl].visual = 0xC | (0xC << 5) | (0x1B << 10);
-		}
+		AllocSampleBuffer(&r->sample_buffer, dw, dh);
+		r->scroll_ok = false;
+		free(r->scroll_height);
+		r->scroll_height = 0;
 	}
 	else
 	if (r->sample_buffer.w != dw || r->sample_buffer.h != dh)
 	{
 		r->int_flag = true;
-		r->sample_buffer.w = dw;
-		r->sample_buffer.h = dh;
-		free(r->sample_buffer.ptr);
-		r->sample_buffer.ptr = (Sample*)malloc(dw*dh * sizeof(Sample) * 2); // upper half is clear cache
-
-		for (int cl = dw * dh; cl < 2 * dw*dh; cl++)
-		{
-			r->sample_buffer.ptr[cl].height = -1000000;
-			r->sample_buffer.ptr[cl].spare = 0x8;
-			r->sample_buffer.ptr[cl].diffuse = 0xFF;
-			r->sample_buffer.ptr[cl].visual = 0xC | (0xC << 5) | (0x1B << 10);
-		}
+		free(r->sample_buffer.height);
+		AllocSampleBuffer(&r->sample_buffer, dw, dh);
+		r->scroll_ok = false;
+		free(r->scroll_height);
+		r->scroll_height = 0;
 	}
 	else
 	{
@@ -2744,11 +5278,19 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, floa
 		}
 	}
 
+	// perspective verts are divided when projected, spans are still rasterized affine (as in ortho)
 	if (r->perspective) // #if PERSPECTIVE_TEST
 	{
 		r->int_flag = false;
 	} // #endif
 
+	// perspective frame can be reused only if camera didn't move at all (no scrolling)
+	bool still = r->perspective && pos[0] == r->pos[0] && pos[1] == r->pos[1] && pos[2] == r->pos[2];
+
+	bool scroll = r->incremental && r->scroll_ok && (r->int_flag || still) && yaw == r->yaw &&
+		r->perspective == r->scroll_perspective &&
+		lt[0] == r->light[0] && lt[1] == r->light[1] && lt[2] == r->light[2] && lt[3] == r->light[3];
+
 	r->pos[0] = pos[0];
 	r->pos[1] = pos[1];
 	r->pos[2] = pos[2];
@@ -2759,9 +5301,6 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, floa
 	r->light[2] = lt[2];
 	r->light[3] = lt[3];
 
-	// memset(r->sample_buffer.ptr, 0x00, dw*dh * sizeof(Sample));
-	memcpy(r->sample_buffer.ptr, r->sample_buffer.ptr + dw * dh, dw*dh * sizeof(Sample));
-
 	// for every cell we need to know world's xy coord where z is at the water level
 
 
@@ -2818,21 +5357,129 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, floa
 	r->add[1] = tm[13] + 0.5;
 	r->add[2] = tm[14];
 
-	if (r->int_flag)
-	{
-		int x = (int)floor(r->add[0] + 0.5);
-		int y = (int)floor(r->add[1] + 0.5);
+	if (r->int_flag)
+	{
+		int x = (int)floor(r->add[0] + 0.5);
+		int y = (int)floor(r->add[1] + 0.5);
+
+		#ifdef DBL
+		x &= ~1;
+		y &= ~1;
+		#endif
+
+		r->add[0] = (double)x;
+		r->add[1] = (double)y;
+	}
+
+	double proj_tm[] = { r->mul[0], r->mul[1], r->mul[2], r->mul[3], r->mul[4], r->mul[5], r->add[0], r->add[1], r->add[2] };
+
+	// incremental frame: if only integral translation changed since previous one
+	// scroll its samples, then render exposed strips, both player shadow columns
+	// and rects of changed mesh insts (direct and reflected)
+	int sh_x = width+1 +scene_shift[0]*2; // & ~1;
+	int scroll_add[3] = { (int)r->add[0], (int)r->add[1], 0 };
+	double refl_y; // same as reflection pass translation below
+	{
+		refl_y = dh*0.5 - (pos[0] * tm[1] * HEIGHT_CELLS + pos[1] * tm[5] * HEIGHT_CELLS + ((2 * water) - pos[2]) * -tm[9]) + scene_shift[1]*2;
+		scroll_add[2] = (int)floor(refl_y + 0.5 + 0.5);
+		#ifdef DBL
+		scroll_add[2] &= ~1;
+		#endif
+	}
+
+	int scroll_dx = scroll_add[0] - r->scroll_add[0];
+	int scroll_dy = scroll_add[1] - r->scroll_add[1];
+
+	uint64_t terrain_revision = t ? GetTerrainRevision(t) : 0;
+	scroll = scroll && ds == r->scroll_ds && water == r->scroll_water && t == r->scroll_terrain && w == r->scroll_world &&
+		terrain_revision == r->scroll_revision &&
+		scroll_dy == scroll_add[2] - r->scroll_add[2] && 2 * abs(scroll_dx) < dw && 2 * abs(scroll_dy) < dh &&
+		(!r->perspective || (scroll_dx == 0 && scroll_dy == 0));
+
+	float changed[8][6];
+	int changes = 0;
+	uint64_t world_stamp = 0;
+	if (w)
+		changes = GetWorldChanges(w, r->scroll_stamp, changed, 8, &world_stamp);
+
+	r->dirty_rects = 0;
+	if (scroll && changes >= 0)
+	{
+		if (scroll_dx > 0)
+			r->AddDirty(0, 0, scroll_dx, dh);
+		else
+		if (scroll_dx < 0)
+			r->AddDirty(dw + scroll_dx, 0, dw, dh);
+
+		if (scroll_dy > 0)
+			r->AddDirty(0, 0, dw, scroll_dy);
+		else
+		if (scroll_dy < 0)
+			r->AddDirty(0, dh + scroll_dy, dw, dh);
+
+		// shadow is applied over rendered samples
+		r->AddDirty(r->scroll_shadow + scroll_dx - 5, 0, r->scroll_shadow + scroll_dx + 6, dh);
+		r->AddDirty(sh_x - 5, 0, sh_x + 6, dh);
+
+		// perspective needs view_pos, view_dir and view_ofs set below, those are unchanged when still
+		double persp_refl_mul[6] = { r->mul[0], r->mul[1], r->mul[2], r->mul[3], r->mul[4], -r->mul[5] };
+		double persp_refl_add[3] = { r->add[0], refl_y + 0.5, 2 * r->water };
+
+		for (int c = 0; c < changes; c++)
+		{
+			for (int refl = 0; refl < 2; refl++)
+			{
+				if (r->perspective)
+				{
+					double box[6];
+					for (int b = 0; b < 6; b++)
+						box[b] = b < 4 ? changed[c][b] * HEIGHT_CELLS : changed[c][b];
 
-		#ifdef DBL
-		x &= ~1;
-		y &= ~1;
-		#endif
+					int rc[4];
+					if (r->ProjectBox(refl ? persp_refl_mul : r->mul, refl ? persp_refl_add : r->add, box, rc))
+						r->AddDirty(rc[0], rc[1], rc[2] + 1, rc[3] + 1);
+					else
+						r->AddDirty(0, 0, dw, dh);
+					continue;
+				}
 
-		r->add[0] = (double)x;
-		r->add[1] = (double)y;
+				double lo[2] = { DBL_MAX, DBL_MAX };
+				double hi[2] = { -DBL_MAX, -DBL_MAX };
+				for (int v = 0; v < 8; v++)
+				{
+					double x = changed[c][v & 1] * HEIGHT_CELLS;
+					double y = changed[c][2 + ((v >> 1) & 1)] * HEIGHT_CELLS;
+					double z = changed[c][4 + (v >> 2)];
+					double sx = r->mul[0] * x + r->mul[2] * y + scroll_add[0];
+					double sy = r->mul[1] * x + r->mul[3] * y + (refl ? -r->mul[5] : r->mul[5]) * z + scroll_add[1 + refl];
+					lo[0] = std::min(lo[0], sx);
+					lo[1] = std::min(lo[1], sy);
+					hi[0] = std::max(hi[0], sx);
+					hi[1] = std::max(hi[1], sy);
+				}
+				r->AddDirty((int)floor(lo[0]) - 2, (int)floor(lo[1]) - 2, (int)ceil(hi[0]) + 3, (int)ceil(hi[1]) + 3);
+			}
+		}
+
+		if (r->dirty_rects <= Renderer::max_dirty)
+		{
+			memcpy(r->sample_buffer.height, r->scroll_height, sizeof(float) * dw * dh);
+			ScrollSampleBuffer(&r->sample_buffer, scroll_dx, scroll_dy);
+			for (int i = 0; i < r->dirty_rects; i++)
+				ClearSampleRect(&r->sample_buffer, r->dirty_rect[i]);
+		}
+		else
+			scroll = false;
 	}
+	else
+		scroll = false;
 
-	double proj_tm[] = { r->mul[0], r->mul[1], r->mul[2], r->mul[3], r->mul[4], r->mul[5], r->add[0], r->add[1], r->add[2] };
+	if (!scroll)
+	{
+		ClearSampleBuffer(&r->sample_buffer);
+		r->dirty_rects = 0;
+		r->AddDirty(0, 0, dw, dh);
+	}
 
 	int planes = 5;
 	int view_flags = 0xAA; // should contain only bits that face viewing direction
@@ -2983,159 +5630,72 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, floa
 	}
 	// #endif
 
-	r->items = 0;
-	r->npcs = 0;
-
-	r->sprites = 0;
-
-	QueryTerrain(t, planes, clip_world, view_flags, Renderer::RenderPatch, r);
-	QueryWorldCB cb = { Renderer::RenderMesh , Renderer::RenderSprite };
-	QueryWorld(w, planes, clip_world, &cb, r);
-
-	// player shadow
-	// double inv_tm[16];
-	Invert(tm, r->inv_tm);
-	double* inv_tm = r->inv_tm;
-
-	Material* matlib = (Material*)GetMaterialArr();
-
-	int sh_x = width+1 +scene_shift[0]*2; // & ~1;
-	
-	for (int y = 0; y < dh; y++)
-	{
-		int left = sh_x-5;
-		int right = sh_x+5;
-		if (left<0)
-			left=0;
-		if (right>=dw)
-			right=dw-1;
-
-		for (int x = left; x <= right; x++)
-		{
-			Sample* s = r->sample_buffer.ptr + x + y * dw;
-			if (abs(s->height - pos[2]) <= 64)
-			{
-				double screen_space[] = { (double)x,(double)y,s->height,1.0 };
-				double world_space[4];
-
-				Product(inv_tm, screen_space, world_space);
-				double dx = world_space[0]/HEIGHT_CELLS - pos[0];
-				double dy = world_space[1]/HEIGHT_CELLS - pos[1];
-				double sq_xy = dx*dx + dy*dy;
-
-				// de-elevation
-				/*
-				if (sq_xy <= 3.50 && s->height > pos[2])
-				{
-					s->visual &= ~(1 << 15); // its fine even for rgb (15 bits)
-					s->diffuse = 0;
-					s->height -= HEIGHT_SCALE;
-				}
-				*/
-
-				// continue;
-
-
-				if (sq_xy <= 2.00)
-				{
-					int dz = (int)(2*(pos[2] - s->height) + 2*sq_xy);
-					if (dz<180)
-						dz=180;
-					if (dz>180)
-						dz=255;
-
-					if (s->spare & 0x8)
-					{
-						s->diffuse = s->diffuse * dz / 255;
-					}
-					else
-					{
-						int mat = s->visual & 0xFF;
-						int shd = (s->visual >> 8) & 0x7F;
-
-						int r = (matlib[mat].shade[1][shd].bg[0] * 249 + 1014) >> 11;
-						int g = (matlib[mat].shade[1][shd].bg[1] * 249 + 1014) >> 11;
-						int b = (matlib[mat].shade[1][shd].bg[2] * 249 + 1014) >> 11;
-						s->visual = r | (g << 5) | (b << 10);
-
-						// if this is terrain sample, convert it to rgb first
-						// s->visual = ;
-						s->spare |= 0x8;
-						s->spare &= ~0x44;
-						s->diffuse = dz;
-					}
-				}
-			}
-		}
-	}
-
-	////////////////////
-	// REFL
-
-	// once again for reflections
-	tm[8] = -tm[8];
-	tm[9] = -tm[9];
-	tm[10] = -tm[10]; // let them simply go below 0 :)
-
-	//tm[12] = dw*0.5 - (pos[0] * tm[0] + pos[1] * tm[4] + ((2 * water / HEIGHT_CELLS) - pos[2]) * tm[8]) * HEIGHT_CELLS;
-	//tm[13] = dh*0.5 - (pos[0] * tm[1] + pos[1] * tm[5] + ((2 * water / HEIGHT_CELLS) - pos[2]) * tm[9]) * HEIGHT_CELLS;
-	tm[12] = dw*0.5 - (pos[0] * tm[0] * HEIGHT_CELLS + pos[1] * tm[4] * HEIGHT_CELLS + ((2 * water) - pos[2]) * tm[8]) + scene_shift[0]*2;
-	tm[13] = dh*0.5 - (pos[0] * tm[1] * HEIGHT_CELLS + pos[1] * tm[5] * HEIGHT_CELLS + ((2 * water) - pos[2]) * tm[9]) + scene_shift[1]*2;
-	tm[14] = 2*r->water;
-
-	r->mul[0] = tm[0];
-	r->mul[1] = tm[1];
-	r->mul[2] = tm[4];
-	r->mul[3] = tm[5];
-	r->mul[4] = 0;
-	r->mul[5] = tm[9];
+	// reflections transform and clip planes, mirrored set is gathered by the same queries
+	double refl_tm[16];
+	memcpy(refl_tm, tm, sizeof(tm));
+	refl_tm[8] = -refl_tm[8];
+	refl_tm[9] = -refl_tm[9];
+	refl_tm[10] = -refl_tm[10]; // let them simply go below 0 :)
+
+	//refl_tm[12] = dw*0.5 - (pos[0] * refl_tm[0] + pos[1] * refl_tm[4] + ((2 * water / HEIGHT_CELLS) - pos[2]) * refl_tm[8]) * HEIGHT_CELLS;
+	//refl_tm[13] = dh*0.5 - (pos[0] * refl_tm[1] + pos[1] * refl_tm[5] + ((2 * water / HEIGHT_CELLS) - pos[2]) * refl_tm[9]) * HEIGHT_CELLS;
+	refl_tm[12] = dw*0.5 - (pos[0] * refl_tm[0] * HEIGHT_CELLS + pos[1] * refl_tm[4] * HEIGHT_CELLS + ((2 * water) - pos[2]) * refl_tm[8]) + scene_shift[0]*2;
+	refl_tm[13] = dh*0.5 - (pos[0] * refl_tm[1] * HEIGHT_CELLS + pos[1] * refl_tm[5] * HEIGHT_CELLS + ((2 * water) - pos[2]) * refl_tm[9]) + scene_shift[1]*2;
+	refl_tm[14] = 2*r->water;
+
+	r->refl_mul[0] = refl_tm[0];
+	r->refl_mul[1] = refl_tm[1];
+	r->refl_mul[2] = refl_tm[4];
+	r->refl_mul[3] = refl_tm[5];
+	r->refl_mul[4] = 0;
+	r->refl_mul[5] = refl_tm[9];
 
 	// if yaw didn't change, make it INTEGRAL (and EVEN in case of DBL)
-	r->add[0] = tm[12];
-	r->add[1] = tm[13] + 0.5;
-	r->add[2] = tm[14];
+	r->refl_add[0] = refl_tm[12];
+	r->refl_add[1] = refl_tm[13] + 0.5;
+	r->refl_add[2] = refl_tm[14];
 
 	if (r->int_flag)
 	{
-		int x = (int)floor(r->add[0] + 0.5);
-		int y = (int)floor(r->add[1] + 0.5);
+		int x = (int)floor(r->refl_add[0] + 0.5);
+		int y = (int)floor(r->refl_add[1] + 0.5);
 
 		#ifdef DBL
 		x &= ~1;
 		y &= ~1;
 		#endif
 
-		r->add[0] = (double)x;
-		r->add[1] = (double)y;
+		r->refl_add[0] = (double)x;
+		r->refl_add[1] = (double)y;
 	}
 
-	double refl_tm[] = { r->mul[0], r->mul[1], r->mul[2], r->mul[3], r->mul[4], r->mul[5], r->add[0], r->add[1], r->add[2] };
+	double clip_refl[5][4];
 
 	if (r->perspective) // #if PERSPECTIVE_TEST
 	{
-		corner_ll[2] = 2*water - corner_ll[2];
-		corner_lr[2] = 2*water - corner_lr[2];
-		corner_ul[2] = 2*water - corner_ul[2];
-		corner_ur[2] = 2*water - corner_ur[2];
+		// simply reflect corners and focal node ( z' = 2*water-z )
+		double refl_ll[3] = { corner_ll[0], corner_ll[1], 2*water - corner_ll[2] };
+		double refl_lr[3] = { corner_lr[0], corner_lr[1], 2*water - corner_lr[2] };
+		double refl_ul[3] = { corner_ul[0], corner_ul[1], 2*water - corner_ul[2] };
+		double refl_ur[3] = { corner_ur[0], corner_ur[1], 2*water - corner_ur[2] };
+		double refl_focus[3] = { focus_node[0], focus_node[1], 2*water - focus_node[2] };
 
-		focus_node[2] = 2*water - focus_node[2];
-		
 		// left  ( focus, ll, ul )
-		PlaneFromPoints(focus_node, corner_ul, corner_ll, clip_world[0]);
+		PlaneFromPoints(refl_focus, refl_ul, refl_ll, clip_refl[0]);
 
 		// right ( focus, ur, lr )
-		PlaneFromPoints(focus_node, corner_lr, corner_ur, clip_world[1]);
+		PlaneFromPoints(refl_focus, refl_lr, refl_ur, clip_refl[1]);
 
 		// top   ( focus, ul, ur )
-		PlaneFromPoints(focus_node, corner_ur, corner_ul, clip_world[2]);
+		PlaneFromPoints(refl_focus, refl_ur, refl_ul, clip_refl[2]);
 
 		// bottom( focus, lr, ll )
-		PlaneFromPoints(focus_node, corner_ll, corner_lr, clip_world[3]);	
+		PlaneFromPoints(refl_focus, refl_ll, refl_lr, clip_refl[3]);
 
-		clip_world[4][0]=0;
-		clip_world[4][1]=0;
-		clip_world[4][2]=1; // note: during refl, we again query ABOVE water!
-		clip_world[4][3]=-clip_world[0][2]*(r->water-1);
+		clip_refl[4][0]=0;
+		clip_refl[4][1]=0;
+		clip_refl[4][2]=1; // note: during refl, we again query ABOVE water!
+		clip_refl[4][3]=-clip_refl[0][2]*(r->water-1);
 	}
 	else // #else
 	{
@@ -3152,587 +5712,238 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, floa
 		clip_tm[5] = +cosyaw * sin30 / (0.5 * dh) * ds * HEIGHT_CELLS;
 		clip_tm[6] = 0;
 		clip_tm[7] = 0;
-		clip_tm[8] = 0;
-		clip_tm[9] = -cos30 / HEIGHT_SCALE / (0.5 * dh) * ds * HEIGHT_CELLS;
-		clip_tm[10] = -2. / 0xffff;
-		clip_tm[11] = 0;
-		clip_tm[12] = -(pos[0] * clip_tm[0] + pos[1] * clip_tm[4] + (2 * r->water - pos[2]) * clip_tm[8] - (double)scene_shift[0] * 2 / width);
-		clip_tm[13] = -(pos[0] * clip_tm[1] + pos[1] * clip_tm[5] + (2 * r->water - pos[2]) * clip_tm[9] - (double)scene_shift[1] * 2 / height);
-		clip_tm[14] = +1.0;
-		clip_tm[15] = 1.0;
-
-		TransposeProduct(clip_tm, clip_left, clip_world[0]);
-		TransposeProduct(clip_tm, clip_right, clip_world[1]);
-		TransposeProduct(clip_tm, clip_bottom, clip_world[2]);
-		TransposeProduct(clip_tm, clip_top, clip_world[3]);
-		TransposeProduct(clip_tm, clip_water, clip_world[4]);
-	}
-	// #endif
-
-	global_refl_mode = true;
-	QueryTerrain(t, planes, clip_world, view_flags, Renderer::RenderPatch, r);
-	QueryWorld(w, planes, clip_world, &cb, r);
-
-	global_refl_mode = false;
-
-	// clear and write new water ripples from player history position
-	// do not emit wave if given z is greater than water level!
-	memset(out_ptr, 0, sizeof(AnsiCell)*width*height);
-
-	/*
-	for (int h = 0; h < 64; h++)
-	{
-		float* xyz = hist[h];
-		if (xyz[2] < water)
-		{
-			// draw ellipse
-		}
-	}
-	*/
-
-	float ww_x, ww_y, ww_c, wx_x, wx_y, wx_c, wy_x, wy_y, wy_c;
-
-	if (r->perspective) // #if PERSPECTIVE_TEST
-	{
-		// screen to world water coords conversion coefficients
-		ww_x = r->view_dir[0]*tm[5] - r->view_dir[1]*tm[1];
-		ww_y = r->view_dir[1]*tm[0] - r->view_dir[0]*tm[4];
-		ww_c = tm[1]*tm[4] - tm[0]*tm[5];
-		wx_x = (r->view_pos[0]*tm[5]*r->view_dir[0] + r->view_dir[1]*(-r->view_ofs[1] + r->view_pos[1]*tm[5] + tm[13] + tm[9]*water));
-		wx_y = (r->view_pos[0]*tm[4]*r->view_dir[0] + r->view_dir[1]*(-r->view_ofs[0] + r->view_pos[1]*tm[4] + tm[12] + tm[8]*water));
-		wx_c = tm[5]*(-r->view_ofs[0] + tm[12] + tm[8]*water) + tm[4]*(r->view_ofs[1] - tm[13] - tm[9]*water);
-		wy_x = (r->view_pos[1]*tm[1]*r->view_dir[1] + r->view_dir[0]*(-r->view_ofs[1] + r->view_pos[0]*tm[1] + tm[13] + tm[9]*water));
-		wy_y = (r->view_pos[1]*tm[0]*r->view_dir[1] + r->view_dir[0]*(-r->view_ofs[0] + r->view_pos[0]*tm[0] + tm[12] + tm[8]*water));
-		wy_c = tm[1]*(r->view_ofs[0] - tm[12] - tm[8]*water) + tm[0]*(-r->view_ofs[1] + tm[13] + tm[9]*water);
-		/*
-		e1 = cx == m00*wx + m10*wy + m20*wz + m30
-		e2 = cy == m01*wx + m11*wy + m21*wz + m31
-		e3 = cw == (wx-ex)*vx + (wy-ey)*vy
-		e4 = (sx - dx) * cw + dx == cx
-		e5 = (sy - dy) * cw + dy == cy
-		sol = Solve[{e1, e2, e3, e4, e5}, {wx, wy, cx, cy, cw}]
-		*/
-	} // #endif
-
-	Sample* src = r->sample_buffer.ptr + 2 + 2 * dw;
-	for (int y = 0; y < height; y++)
-	{
-		for (int x = 0; x < width; x++, ptr++)
-		{
-			if (x == render_break_point[0] && y == render_break_point[1])
-			{
-				render_break_point[0] = -1;
-				render_break_point[1] = -1;
-			}
-			// given interpolated RGB -> round to 555, store it in visual
-			// copy to diffuse to diffuse
-			// mark mash 'auto-material' as 0x8 flag in spare
-
-			// in post pass:
-			// if sample has 0x8 flag
-			//   multiply rgb by diffuse (into 888 bg=fg)
-			// apply color mixing with neighbours
-			// if at least 1 sample have mesh bit in spare
-			// - round mixed bg rgb to R5G5B5 and use auto_material[32K] -> {bg,fg,gl}
-			// else apply gridlines etc.
-
-
-#ifdef DBL
-
-// average 4 backgrounds
-// mask 11 (something rendered)
-			int spr[4] = { src[0].spare & 11, src[1].spare & 11, src[dw].spare & 11, src[dw + 1].spare & 11 };
-			int mat[4] = { src[0].visual & 0x00FF , src[1].visual & 0x00FF, src[dw].visual & 0x00FF, src[dw + 1].visual & 0x00FF };
-			int dif[4] = { src[0].diffuse , src[1].diffuse, src[dw].diffuse, src[dw + 1].diffuse };
-			int vis[4] = { src[0].visual, src[1].visual, src[dw].visual, src[dw + 1].visual };
-
-			// TODO:
-			// every material must have 16x16 map and uses visual shade to select Y and lighting to select X
-			// animated materials additionaly pre shifts and wraps visual shade by current time scaled by material's 'speed'
-
-			int e_lo = (src[-dw].visual >> 15) + (src[-dw + 1].visual >> 15);
-			int e_mi = (src[0].visual >> 15) + (src[1].visual >> 15);
-			int e_hi = (src[dw].visual >> 15) + (src[dw + 1].visual >> 15);
-
-			int elv;
-			if (e_lo <= 1)
-			{
-				if (e_hi <= 1)
-					elv = 3; // lo
-				else
-					elv = 2; // raise
-			}
-			else
-			{
-				if (e_hi <= 1)
-					elv = 0; // lower
-				else
-					elv = 1; // hi
-			}
-
-			/*
-			int shd = 0; // (src[0].visual >> 8) & 0x007F;
-
-			int gl = matlib[mat[0]].shade[1][shd].gl;
-			int bg[3] = { 0,0,0 };
-			int fg[3] = { 0,0,0 };
-			for (int i = 0; i < 4; i++)
-			{
-				bg[0] += matlib[mat[i]].shade[1][shd].bg[0] * dif[i];
-				bg[1] += matlib[mat[i]].shade[1][shd].bg[1] * dif[i];
-				bg[2] += matlib[mat[i]].shade[1][shd].bg[2] * dif[i];
-				fg[0] += matlib[mat[i]].shade[1][shd].fg[0] * dif[i];
-				fg[1] += matlib[mat[i]].shade[1][shd].fg[1] * dif[i];
-				fg[2] += matlib[mat[i]].shade[1][shd].fg[2] * dif[i];
-			}
-			*/
-
-			int shd = (dif[0] + dif[1] + dif[2] + dif[3] + 17 * 2) / (17 * 4); // 17: FF->F, 4: avr
-
-			
-
-			int gl = matlib[mat[0]].shade[elv][shd].gl;
-
-			int bg[3] = { 0,0,0 }; // 4
-			int fg[3] = { 0,0,0 };
-
-			int half_h[2][2] = { {0,1},{2,3} };
-			int half_v[2][2] = { {0,2},{1,3} };
-			int bg_h[2][3] = { { 0,0,0 },{ 0,0,0 } }; // 0+1 \ 2+3 
-			int bg_v[2][3] = { { 0,0,0 },{ 0,0,0 } }; // 0+2 | 1+3
-
-			bool use_auto_mat = false;
-
-			int err_h = 0;
-			int err_v = 0;
-
-			// if cell contains both refl and non-refl terrain enable auto-mat
-			bool has_refl = (spr[0] & 3) == 3 || (spr[1] & 3) == 3 || (spr[2] & 3) == 3 || (spr[3] & 3) == 3;
-			bool has_norm = (spr[0] & 3) == 1 || (spr[1] & 3) == 1 || (spr[2] & 3) == 1 || (spr[3] & 3) == 1;
-			if (has_refl && has_norm)
-			{
-				use_auto_mat = true;
-			}
-
-			for (int m = 0; m < 2; m++)
-			{
-				for (int i = 0; i < 4; i++)
-				{
-					//if (spr[i])
-					{
-						if (spr[i] & 0x8)
-						{
-							int r = ((vis[i] & 0x1F) * 527 + 23) >> 6;
-							int g = (((vis[i] >> 5) & 0x1F) * 527 + 23) >> 6;
-							int b = (((vis[i] >> 10) & 0x1F) * 527 + 23) >> 6;
-
-							if ((spr[i] & 0x3) == 3)
-							{
-								r = r * dif[i] / 400;
-								g = g * dif[i] / 400;
-								b = b * dif[i] / 400;
-							}
-							else
-							{
-								r = r * dif[i] / 255;
-								g = g * dif[i] / 255;
-								b = b * dif[i] / 255;
-							}
-
-							if (i == 0 || i == 1)
-							{
-								if (m)
-								{
-									err_h += abs(bg_h[0][0] - 4 * r);
-									err_h += abs(bg_h[0][1] - 4 * g);
-									err_h += abs(bg_h[0][2] - 4 * b);
-								}
-								else
-								{
-									bg_h[0][0] += 2 * r;
-									bg_h[0][1] += 2 * g;
-									bg_h[0][2] += 2 * b;
-								}
-							}
-							if (i == 2 || i == 3)
-							{
-								if (m)
-								{
-									err_h += abs(bg_h[1][0] - 4 * r);
-									err_h += abs(bg_h[1][1] - 4 * g);
-									err_h += abs(bg_h[1][2] - 4 * b);
-								}
-								else
-								{
-									bg_h[1][0] += 2 * r;
-									bg_h[1][1] += 2 * g;
-									bg_h[1][2] += 2 * b;
-								}
-							}
-
-							if (i == 0 || i == 2)
-							{
-								if (m)
-								{
-									err_v += abs(bg_v[0][0] - 4 * r);
-									err_v += abs(bg_v[0][1] - 4 * g);
-									err_v += abs(bg_v[0][2] - 4 * b);
-								}
-								else
-								{
-									bg_v[0][0] += 2 * r;
-									bg_v[0][1] += 2 * g;
-									bg_v[0][2] += 2 * b;
-								}
-							}
-							if (i == 1 || i == 3)
-							{
-								if (m)
-								{
-									err_v += abs(bg_v[1][0] - 4 * r);
-									err_v += abs(bg_v[1][1] - 4 * g);
-									err_v += abs(bg_v[1][2] - 4 * b);
-								}
-								else
-								{
-									bg_v[1][0] += 2 * r;
-									bg_v[1][1] += 2 * g;
-									bg_v[1][2] += 2 * b;
-								}
-							}
-
-							if (!m)
-							{
-								bg[0] += r;
-								bg[1] += g;
-								bg[2] += b;
-								use_auto_mat = true;
-							}
-						}
-						else
-						{
-							int s = dif[i] / 17;
-							int r = matlib[mat[i]].shade[elv][s].bg[0];
-							int g = matlib[mat[i]].shade[elv][s].bg[1];
-							int b = matlib[mat[i]].shade[elv][s].bg[2];
-
-							if ((spr[i] & 0x3) == 3)
-							{
-								r = r * 255 / 400;
-								g = g * 255 / 400;
-								b = b * 255 / 400;
-							}
-
-							if (i == 0 || i == 1)
-							{
-								if (m)
-								{
-									err_h += abs(bg_h[0][0] - 4 * r);
-									err_h += abs(bg_h[0][1] - 4 * g);
-									err_h += abs(bg_h[0][2] - 4 * b);
-								}
-								else
-								{
-									bg_h[0][0] += 2 * r;
-									bg_h[0][1] += 2 * g;
-									bg_h[0][2] += 2 * b;
-								}
-							}
-							if (i == 2 || i == 3)
-							{
-								if (m)
-								{
-									err_h += abs(bg_h[1][0] - 4 * r);
-									err_h += abs(bg_h[1][1] - 4 * g);
-									err_h += abs(bg_h[1][2] - 4 * b);
-								}
-								else
-								{
-									bg_h[1][0] += 2*r;
-									bg_h[1][1] += 2*g;
-									bg_h[1][2] += 2*b;
-								}
-							}
-
-							if (i == 0 || i == 2)
-							{
-								if (m)
-								{
-									err_v += abs(bg_v[0][0] - 4 * r);
-									err_v += abs(bg_v[0][1] - 4 * g);
-									err_v += abs(bg_v[0][2] - 4 * b);
-								}
-								else
-								{
-									bg_v[0][0] += 2*r;
-									bg_v[0][1] += 2*g;
-									bg_v[0][2] += 2*b;
-								}
-							}
-							if (i == 1 || i == 3)
-							{
-								if (m)
-								{
-									err_v += abs(bg_v[1][0] - 4 * r);
-									err_v += abs(bg_v[1][1] - 4 * g);
-									err_v += abs(bg_v[1][2] - 4 * b);
-								}
-								else
-								{
-									bg_v[1][0] += 2*r;
-									bg_v[1][1] += 2*g;
-									bg_v[1][2] += 2*b;
-								}
-							}
-
-							if (!m)
-							{
-								bg[0] += r;
-								bg[1] += g;
-								bg[2] += b;
-
-								if ((spr[i] & 0x3) == 0x3)
-								{
-									fg[0] += matlib[mat[i]].shade[elv][s].fg[0] * 255 / 400;
-									fg[1] += matlib[mat[i]].shade[elv][s].fg[1] * 255 / 400;
-									fg[2] += matlib[mat[i]].shade[elv][s].fg[2] * 255 / 400;
-								}
-								else
-								{
-									fg[0] += matlib[mat[i]].shade[elv][s].fg[0];
-									fg[1] += matlib[mat[i]].shade[elv][s].fg[1];
-									fg[2] += matlib[mat[i]].shade[elv][s].fg[2];
-								}
-							}
-						}
-					}
-				}
-			}
+		clip_tm[8] = 0;
+		clip_tm[9] = -cos30 / HEIGHT_SCALE / (0.5 * dh) * ds * HEIGHT_CELLS;
+		clip_tm[10] = -2. / 0xffff;
+		clip_tm[11] = 0;
+		clip_tm[12] = -(pos[0] * clip_tm[0] + pos[1] * clip_tm[4] + (2 * r->water - pos[2]) * clip_tm[8] - (double)scene_shift[0] * 2 / width);
+		clip_tm[13] = -(pos[0] * clip_tm[1] + pos[1] * clip_tm[5] + (2 * r->water - pos[2]) * clip_tm[9] - (double)scene_shift[1] * 2 / height);
+		clip_tm[14] = +1.0;
+		clip_tm[15] = 1.0;
 
-			if (use_auto_mat)
-			{
-				// WORKS REALY WELL! 
-				bool vh_near = true;
+		TransposeProduct(clip_tm, clip_left, clip_refl[0]);
+		TransposeProduct(clip_tm, clip_right, clip_refl[1]);
+		TransposeProduct(clip_tm, clip_bottom, clip_refl[2]);
+		TransposeProduct(clip_tm, clip_top, clip_refl[3]);
+		TransposeProduct(clip_tm, clip_water, clip_refl[4]);
+	}
+	// #endif
 
-				if (err_h * 1000 < err_v * 999)
-				{
-					vh_near = false;
-					// _FG_
-					//  BK
-					ptr->gl = 0xDF;
+	r->items = 0;
+	r->npcs = 0;
 
-					int auto_mat_lo = 3 * ((bg_h[0][0]+20) / 33 + 32 * ((bg_h[0][1]+20) / 33) + 32 * 32 * ((bg_h[0][2]+20) / 33));
-					int auto_mat_hi = 3 * ((bg_h[1][0]+20) / 33 + 32 * ((bg_h[1][1]+20) / 33) + 32 * 32 * ((bg_h[1][2]+20) / 33));
+	r->sprites = 0;
 
-					ptr->bk = auto_mat[auto_mat_lo + 0];
-					ptr->fg = auto_mat[auto_mat_hi + 0];
-				}
-				else
-				if (err_v * 1000 < err_h * 999)
-				{
-					vh_near = false;
-					// B|F
-					// K|G
-					ptr->gl = 0xDE;
+	r->SetupBands();
+	r->ResetOcclusion();
 
-					int auto_mat_lt = 3 * ((bg_v[0][0]+20) / 33 + 32 * ((bg_v[0][1]+20) / 33) + 32 * 32 * ((bg_v[0][2]+20) / 33));
-					int auto_mat_rt = 3 * ((bg_v[1][0]+20) / 33 + 32 * ((bg_v[1][1]+20) / 33) + 32 * 32 * ((bg_v[1][2]+20) / 33));
+	// zoomed out ortho views take whole nodes once summary visual cell fits in single sample
+	r->lod_range = perspective || !r->lod ? 0 : (int)(VISUAL_CELLS / (HEIGHT_CELLS * ds));
 
-					ptr->bk = auto_mat[auto_mat_lt + 0];
-					ptr->fg = auto_mat[auto_mat_rt + 0];
-				}
+	r->refl_patches = 0;
+	r->refl_insts = 0;
 
-				
-				if (ptr->bk == ptr->fg || vh_near)
-				{
-					// avr4
-					int auto_mat_idx = 3 * (bg[0] / 33 + 32 * (bg[1] / 33) + 32 * 32 * (bg[2] / 33));
-					ptr->gl = auto_mat[auto_mat_idx + 2];
-					ptr->bk = auto_mat[auto_mat_idx + 0];
-					ptr->fg = auto_mat[auto_mat_idx + 1];
-					ptr->spare = 0xFF;
-				}
-			}
-			else
-			{
-				int bk_rgb[3] =
-				{
-					(bg[0] + 102) / 204,
-					(bg[1] + 102) / 204,
-					(bg[2] + 102) / 204
-				};
+	// patch rasterization (raster_ns[0]) is taken out of both query phases, mesh phase keeps faces
+	uint64_t phase_t0 = StatsClock();
+	r->QueryDirty(t, clip_world, clip_refl, view_flags);
+	uint64_t phase_t1 = StatsClock();
+	uint64_t query_raster_ns = r->raster_ns[0]; // no faces yet
 
-				ptr->gl = gl;
-				ptr->bk = 16 + 36*bk_rgb[0] + bk_rgb[1] * 6 + bk_rgb[2];
-				ptr->fg = 16 + (36*((fg[0] + 102) / 204) + (((fg[1] + 102) / 204) * 6) + ((fg[2] + 102) / 204));
-				ptr->spare = 0xFF;
+	QueryWorldCB cb = { Renderer::RenderMesh , Renderer::RenderSprite, r->occlusion ? Renderer::OccludedMesh : 0 };
+	QueryWorldCB refl_cb = { Renderer::GatherMesh , Renderer::GatherSprite, r->occlusion ? Renderer::OccludedReflMesh : 0 };
+	QueryWorldCB* both_cb[2] = { &cb, &refl_cb };
+	QueryWorld(w, planes, clip_world, clip_refl, both_cb, r);
+	r->FlushBands();
+	r->occlusion = false;
 
-				// collect line bits
+	uint64_t phase_t2 = StatsClock();
+	r->stats.terrain_query_us = (int)((phase_t1 - phase_t0 - query_raster_ns) / 1000);
+	r->stats.terrain_raster_us = (int)(r->raster_ns[0] / 1000);
+	r->stats.mesh_raster_us = (int)((phase_t2 - phase_t1 - (r->raster_ns[0] - query_raster_ns)) / 1000);
 
-				if (elv == 3) // only low elevation
-				{
-					int linecase = ((src[0].spare & 0x4) >> 2) | ((src[1].spare & 0x4) >> 1) | (src[dw].spare & 0x4) | ((src[dw + 1].spare & 0x4) << 1);
-					static const int linecase_glyph[] = { 0, ',', ',', ',', '`', ';', ';', ';', '`', ';', ';', ';', '`', ';', ';', ';' };
-					if (linecase)
-						ptr->gl = linecase_glyph[linecase];
-				}
+	// player shadow
+	// double inv_tm[16];
+	Invert(tm, r->inv_tm);
+	double* inv_tm = r->inv_tm;
 
-				if (elv == 1 || elv == 3) // no elev change
-				{
-					// silhouette repetitoire:  _-/\| (should not be used by materials?)
-					float z_hi = src[dw].height + src[dw + 1].height;
-					float z_lo = src[0].height + src[1].height;
-					float z_pr = src[-dw].height + src[1 - dw].height;
+	Material* matlib = (Material*)GetMaterialArr();
 
-					float minus = z_lo - z_hi;
-					float under = z_pr - z_lo;
+	SampleBuffer* sb = &r->sample_buffer;
+	
+	for (int y = 0; y < dh; y++)
+	{
+		int left = sh_x-5;
+		int right = sh_x+5;
+		if (left<0)
+			left=0;
+		if (right>=dw)
+			right=dw-1;
 
-					static const float thresh = 1 * HEIGHT_SCALE;
+		for (int x = left; x <= right; x++)
+		{
+			int s = x + y * dw;
+			if (abs(sb->height[s] - pos[2]) <= 64)
+			{
+				double screen_space[] = { (double)x,(double)y,sb->height[s],1.0 };
+				double world_space[4];
 
-					if (minus > under)
-					{
-						if (minus > thresh)
-						{
-							ptr->gl = 0xC4; // '-'
-							bk_rgb[0] = std::max(0, bk_rgb[0] - 1);
-							bk_rgb[1] = std::max(0, bk_rgb[1] - 1);
-							bk_rgb[2] = std::max(0, bk_rgb[2] - 1);
-							ptr->fg = 16 + 36 * bk_rgb[0] + bk_rgb[1] * 6 + bk_rgb[2];
-						}
-					}
-					else
-					{
-						if (under > thresh)
-						{
-							ptr->gl = 0x5F; // '_'
-							bk_rgb[0] = std::max(0, bk_rgb[0] - 1);
-							bk_rgb[1] = std::max(0, bk_rgb[1] - 1);
-							bk_rgb[2] = std::max(0, bk_rgb[2] - 1);
-							ptr->fg = 16 + 36 * bk_rgb[0] + bk_rgb[1] * 6 + bk_rgb[2];
-						}
-					}
-				}
-			}
+				Product(inv_tm, screen_space, world_space);
+				double dx = world_space[0]/HEIGHT_CELLS - pos[0];
+				double dy = world_space[1]/HEIGHT_CELLS - pos[1];
+				double sq_xy = dx*dx + dy*dy;
 
-			int linecase = ((src[0].spare & 0x40) >> 6) | ((src[1].spare & 0x40) >> 5) | ((src[dw].spare & 0x40)>>4) | ((src[dw + 1].spare & 0x40) >> 3);
-			static const int linecase_glyph[] = { 0, ',', ',', ',', '`', ';', ';', ';', '`', ';', ';', ';', '`', ';', ';', ';' };
-			if (linecase)
-			{
-				ptr->gl = linecase_glyph[linecase];
-				ptr->fg = 16;
-			}
-			else
-			if (src[0].height < water && src[1].height < water && src[dw].height < water && src[dw+1].height < water)
-			{
-				double w[4]; 
-				if (r->perspective) // #if PERSPECTIVE_TEST
-				{
-					float sx_dx = 2.0*x - r->view_ofs[0];
-					float sy_dy = 2.0*y - r->view_ofs[1];
-					float ww = (sx_dx*ww_x + sy_dy*ww_y + ww_c);
-					if (ww<0)
-					{
-						ww = 1.0/ww;
-						float wx = ww * (wx_c + wx_x * sx_dx - wx_y * sy_dy);
-						float wy = ww * (wy_c - wy_x * sx_dx + wy_y * sy_dy);
-						w[0] = wx;
-						w[1] = wy;
-					}
-					else
-					{
-						ptr->gl = ' ';
-						src += 2;
-						continue;
-					}
-				}
-				else // #else
+				// de-elevation
+				/*
+				if (sq_xy <= 3.50 && sb->height[s] > pos[2])
 				{
-					double s[4] = { 2.0*x, 2.0*y, water, 1.0 };
-					Product(inv_tm, s, w); // convert from screen to world
-					w[0] = round(w[0]);
-					w[1] = round(w[1]);
+					sb->visual[s] &= ~(1 << 15); // its fine even for rgb (15 bits)
+					sb->diffuse[s] = 0;
+					sb->height[s] -= HEIGHT_SCALE;
 				}
-				// #endif
-
-				double d = r->pn.octaveNoise0_1(w[0] * 0.05, w[1] * 0.05, r->pn_time, 4);
+				*/
 
-				int id = (int)(d * 5) - 2;
+				// continue;
 
-				if (id < -1)
-					id = 2;
-				if (id > 1)
-					id = -2;
 
-				if (id > 0)
+				if (sq_xy <= 2.00)
 				{
-					int c = ptr->fg - 16;
-					int cr = c / 36;
-					c -= cr * 36;
-					int cg = c / 6;
-					c -= cr * 6;
-					int cb = c;
-
-					if (cr < 5 && cg < 5 /*&& cb < 5*/)
+					int dz = (int)(2*(pos[2] - sb->height[s]) + 2*sq_xy);
+					if (dz<180)
+						dz=180;
+					if (dz>180)
+						dz=255;
+
+					if (sb->spare[s] & 0x8)
 					{
-						if (cb < 5)
-							ptr->fg += 1 + 6 + 36;
-						else
-							ptr->fg += 6 + 36;
+						sb->diffuse[s] = sb->diffuse[s] * dz / 255;
 					}
-				}
-				else
-				if (id < 0)
-				{
-					int c = ptr->fg - 16;
-					int cr = c / 36;
-					c -= cr * 36;
-					int cg = c / 6;
-					c -= cr * 6;
-					int cb = c;
-
-					if (cr > 0 && cg > 0 /*&& cb > 0*/)
+					else
 					{
-						if (cb > 0)
-							ptr->fg -= 1 + 6 + 36;
-						else
-							ptr->fg -= 6 + 36;
+						int mat = sb->visual[s] & 0xFF;
+						int shd = (sb->visual[s] >> 8) & 0x7F;
+
+						int r = (matlib[mat].shade[1][shd].bg[0] * 249 + 1014) >> 11;
+						int g = (matlib[mat].shade[1][shd].bg[1] * 249 + 1014) >> 11;
+						int b = (matlib[mat].shade[1][shd].bg[2] * 249 + 1014) >> 11;
+						sb->visual[s] = r | (g << 5) | (b << 10);
+
+						// if this is terrain sample, convert it to rgb first
+						// sb->visual[s] = ;
+						sb->spare[s] |= 0x8;
+						sb->spare[s] &= ~0x44;
+						sb->diffuse[s] = dz;
 					}
 				}
 			}
+		}
+	}
 
-			// xterm conv
+	////////////////////
+	// REFL
 
-			src += 2;
+	// once again for reflections, only where direct pass left samples they can reach
+	phase_t0 = StatsClock();
+	memcpy(tm, refl_tm, sizeof(tm));
+	memcpy(r->mul, r->refl_mul, sizeof(r->mul));
+	memcpy(r->add, r->refl_add, sizeof(r->add));
 
+	assert(!r->int_flag || (int)r->add[1] == scroll_add[2]);
 
-			
-			#else
-			
-			int mat = src[0].visual & 0x00FF;
-			int shd = 0; // (src[0].visual >> 8) & 0x007F;
-			int elv = 0; // (src[0].visual >> 15) & 0x0001;
+	r->refl_mode = true;
+	r->UpdateWaterMask();
+	r->RenderRefl();
+	r->FlushBands();
 
-			// fill from material
-			const MatCell* cell = &(matlib[mat].shade[1][shd]);
-			const uint8_t* bg = matlib[mat].shade[1][shd].bg;
-			const uint8_t* fg = matlib[mat].shade[1][shd].fg;
+	r->refl_mode = false;
+	r->stats.refl_us = (int)((StatsClock() - phase_t0) / 1000);
 
-			ptr->gl = cell->gl;
-			ptr->bk = 16 + (((bg[0] + 25) / 51) + (((bg[1] + 25) / 51) * 6) + (((bg[2] + 25) / 51) * 36));
-			ptr->fg = 16 + (((fg[0] + 25) / 51) + (((fg[1] + 25) / 51) * 6) + (((fg[2] + 25) / 51) * 36));
-			ptr->spare = 0xFF;
+	r->scroll_ok = r->incremental && (r->int_flag || r->perspective);
+	r->scroll_perspective = r->perspective;
+	if (r->scroll_ok)
+	{
+		if (!r->scroll_height)
+			r->scroll_height = (float*)malloc(sizeof(float) * dw * dh);
+		memcpy(r->scroll_height, r->sample_buffer.height, sizeof(float) * dw * dh);
+	}
+	r->scroll_add[0] = scroll_add[0];
+	r->scroll_add[1] = scroll_add[1];
+	r->scroll_add[2] = scroll_add[2];
+	r->scroll_shadow = sh_x;
+	r->scroll_ds = ds;
+	r->scroll_water = water;
+	r->scroll_terrain = t;
+	r->scroll_revision = terrain_revision;
+	r->scroll_world = w;
+	r->scroll_stamp = world_stamp;
 
-			src++;
-			#endif
+	// clear and write new water ripples from player history position
+	// do not emit wave if given z is greater than water level!
+	memset(out_ptr, 0, sizeof(AnsiCell)*width*height);
 
+	/*
+	for (int h = 0; h < 64; h++)
+	{
+		float* xyz = hist[h];
+		if (xyz[2] < water)
+		{
+			// draw ellipse
 		}
+	}
+	*/
 
-		#ifdef DBL
-		src += 4 + dw;
-		#else
-		src += 2;
-		#endif
+	PostPass pp;
+
+	if (r->perspective) // #if PERSPECTIVE_TEST
+	{
+		// screen to world water coords conversion coefficients
+		pp.ww_x = r->view_dir[0]*tm[5] - r->view_dir[1]*tm[1];
+		pp.ww_y = r->view_dir[1]*tm[0] - r->view_dir[0]*tm[4];
+		pp.ww_c = tm[1]*tm[4] - tm[0]*tm[5];
+		pp.wx_x = (r->view_pos[0]*tm[5]*r->view_dir[0] + r->view_dir[1]*(-r->view_ofs[1] + r->view_pos[1]*tm[5] + tm[13] + tm[9]*water));
+		pp.wx_y = (r->view_pos[0]*tm[4]*r->view_dir[0] + r->view_dir[1]*(-r->view_ofs[0] + r->view_pos[1]*tm[4] + tm[12] + tm[8]*water));
+		pp.wx_c = tm[5]*(-r->view_ofs[0] + tm[12] + tm[8]*water) + tm[4]*(r->view_ofs[1] - tm[13] - tm[9]*water);
+		pp.wy_x = (r->view_pos[1]*tm[1]*r->view_dir[1] + r->view_dir[0]*(-r->view_ofs[1] + r->view_pos[0]*tm[1] + tm[13] + tm[9]*water));
+		pp.wy_y = (r->view_pos[1]*tm[0]*r->view_dir[1] + r->view_dir[0]*(-r->view_ofs[0] + r->view_pos[0]*tm[0] + tm[12] + tm[8]*water));
+		pp.wy_c = tm[1]*(r->view_ofs[0] - tm[12] - tm[8]*water) + tm[0]*(-r->view_ofs[1] + tm[13] + tm[9]*water);
+		/*
+		e1 = cx == m00*wx + m10*wy + m20*wz + m30
+		e2 = cy == m01*wx + m11*wy + m21*wz + m31
+		e3 = cw == (wx-ex)*vx + (wy-ey)*vy
+		e4 = (sx - dx) * cw + dx == cx
+		e5 = (sy - dy) * cw + dy == cy
+		sol = Solve[{e1, e2, e3, e4, e5}, {wx, wy, cx, cy, cw}]
+		*/
+	} // #endif
+
+	pp.r = r;
+	pp.matlib = matlib;
+	pp.out = out_ptr;
+	pp.width = width;
+	pp.height = height;
+	pp.stride = (width + 15) & ~15;
+	pp.jobs = r->workers ? std::min(height, GetWorkersThreads(r->workers) * 4) : 1;
+	pp.water = water;
+	pp.inv_tm = inv_tm;
+	SetupWaterOctaves(pp.water_oct, r->pn_time);
+	pp.job_ns = (uint64_t(*)[2])malloc(sizeof(uint64_t[2]) * pp.jobs);
+
+	phase_t0 = StatsClock();
+	RunWorkers(r->workers, pp.jobs, PostPassJob, &pp);
+	uint64_t post_ns = StatsClock() - phase_t0;
+
+	// split wall time by what jobs spent on ripples
+	uint64_t job_ns[2] = { 0,0 };
+	for (int j = 0; j < pp.jobs; j++)
+	{
+		job_ns[0] += pp.job_ns[j][0];
+		job_ns[1] += pp.job_ns[j][1];
 	}
+	free(pp.job_ns);
+	uint64_t water_ns = job_ns[0] ? post_ns * job_ns[1] / job_ns[0] : 0;
+	r->stats.water_us = (int)(water_ns / 1000);
+	r->stats.post_us = (int)((post_ns - water_ns) / 1000);
+
+	phase_t0 = StatsClock();
 
 #if 0
 
@@ -3869,86 +6080,7 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, floa
 	}
 #endif
 
-	qsort(r->sprites_alloc, r->sprites, sizeof(SpriteRenderBuf), SpriteRenderBuf::FarToNear);
-
-	// lets check drawing sprites in world space
-	for (int s=0; s<r->sprites; s++)
-	{
-		SpriteRenderBuf* buf = r->sprites_alloc + s;
-
-		// IT IS PERFECTLY STICKED TO WORLD!
-		// it may not perectly stick to character but its fine! (its kinda character is not perfectly positioned)
-
-		// todo: use buf->alpha (perspective fades)
-
-		if (buf->character && !buf->refl && buf->character->req.action!=ACTION::DEAD)
-		{
-			// render mini-hp_bar
-
-			// check if sprite has odd or even width, 
-			// paint accordingly bar with 5 or 6 width
-
-			int dy = 10;
-			int y = buf->s_pos[1] + dy;
-
-			static const float ds = 2.0 * (/*zoom*/ 1.0 * /*scale*/ 3.0) / VISUAL_CELLS * 0.5 /*we're not dbl_wh*/;
-			static const float dz_dy = HEIGHT_SCALE / (cos(30 * M_PI / 180) * HEIGHT_CELLS * ds);
-			float t = dy * dz_dy + buf->s_pos[2];
-
-			int lt_red = 16 + 0 + 0*6 + 5*36; // 102,0,0
-			int lt_orange = 16 + 0 + 2*6 + 5*36; 
-			int dk_red = 16 + 0 + 0 * 6 + 3 * 36; // 102,0,0
-			int dk_orange = 16 + 0 + 1 * 6 + 3 * 36;
-			uint8_t fg = buf->character->clr ? lt_orange : lt_red;
-			uint8_t bk = buf->character->clr ? dk_orange : dk_red;
-
-			AnsiCell ac;
-			ac.bk = bk;
-			ac.fg = fg;
-
-			if (y >= 0 && y < height)
-			{
-				for (int bx = -2; bx <= 2; bx++)
-				{
-					int x = bx + buf->s_pos[0];
-
-					// calc average 2x2 height
-					// int height = 
-
-					if (x >= 0 && x < width)
-					{
-						Sample* test_ll = r->sample_buffer.ptr + (2 * y + 0) * (2 * width + 4) + 2 * x + 2;
-						Sample* test_lr = r->sample_buffer.ptr + (2 * y + 0) * (2 * width + 4) + 2 * x + 3;
-						Sample* test_ul = r->sample_buffer.ptr + (2 * y + 1) * (2 * width + 4) + 2 * x + 2;
-						Sample* test_ur = r->sample_buffer.ptr + (2 * y + 1) * (2 * width + 4) + 2 * x + 3;
-
-						if (!test_ul->DepthTest_RO(t) && !test_ur->DepthTest_RO(t) &&
-							!test_ll->DepthTest_RO(t) && !test_lr->DepthTest_RO(t))
-						{
-							continue;
-						}
-
-						bool l = (bx + 2)*buf->character->MAX_HP * 2 + 0 < buf->character->HP * 10;
-						bool r = (bx + 2)*buf->character->MAX_HP * 2 + buf->character->MAX_HP < buf->character->HP * 10;
-
-						if (r)
-							ac.gl = 219; // full
-						else
-						if (l)
-							ac.gl = 221; // half
-						else
-							ac.gl = ' '; // none
-
-						out_ptr[x+width*y] = ac;
-					}
-				}
-			}
-		}
-
-		int frame = buf->frame;
-		int anim = buf->anim;
-		r->RenderSprite(out_ptr, width, height, buf->sprite, buf->refl, anim, frame, buf->angle, buf->s_pos);
-	}
+	r->CompositeSprites(out_ptr, width, height);
 
 	// restore positive projection for ProjectCoords func (now they are for reflection).
 
@@ -4155,7 +6287,7 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, floa
 
 					if (ok)
 					{
-						PerspectiveCorrectCellLine(r->sample_buffer.ptr, out_ptr, width, height, from, to, d_from, d_to, 7, 231/*231*/);
+						PerspectiveCorrectCellLine(&r->sample_buffer, out_ptr, width, height, from, to, d_from, d_to, 7, 231/*231*/);
 					}
 				}
 				else
@@ -4176,7 +6308,7 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, floa
 					to[1] = (ty - 1) >> 1;
 					to[2] = (int)floorf(tail_pos[2] + 0.5) + HEIGHT_SCALE / 2;
 
-					CellLine(r->sample_buffer.ptr, out_ptr, width, height, from, to, 7, 231/*231*/);
+					CellLine(&r->sample_buffer, out_ptr, width, height, from, to, 7, 231/*231*/);
 				}
 			}
 		}
@@ -4195,10 +6327,202 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, floa
 	// and return only those that are already confirmed as exclusive and still visible now
 	// (maybe we should introduce few frames window until we request de-exclusivity?)
 
+	uint64_t frame_t1 = StatsClock();
+	r->stats.sprite_us = (int)((frame_t1 - phase_t0) / 1000);
+	r->stats.total_us = (int)((frame_t1 - frame_t0) / 1000);
+}
+
+void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, float zoom, float yaw, const float pos[3], const float lt[4], int width, int height, AnsiCell* ptr, Inst* inst, const int scene_shift[2], bool perspective)
+{
+	if (inst)
+		HideInst(inst);
+
+	RenderScene(r, stamp, t, w, water, zoom, yaw, pos, lt, width, height, ptr, inst, scene_shift, perspective);
+
 	if (inst)
 		ShowInst(inst);
 }
 
+float GetRenderRadius(int width, int height, float zoom, float water, float pos_z, int lo, int hi, const int scene_shift[2], bool perspective)
+{
+	// mirrors projection set up by RenderScene()
+#ifdef DBL
+	float scale = 3.0;
+	int dw = 4+2*width;
+	int dh = 4+2*height;
+#else
+	float scale = 1.5;
+	int dw = 1 + width + 1;
+	int dh = 1 + height + 1;
+#endif
+
+	static const double sin30 = sin(M_PI*30.0/180.0); 
+	static const double cos30 = cos(M_PI*30.0/180.0);
+
+	double ds = 2*zoom*scale / VISUAL_CELLS;
+
+	// screen half extents around view center
+	double hw = dw*0.5 + abs(scene_shift[0]*2);
+	double hh = dh*0.5 + abs(scene_shift[1]*2);
+
+	// farthest height (from view and from its reflection) which can be seen
+	double dz = 0;
+	for (int i = 0; i < 2; i++)
+	{
+		double z = i ? hi : lo;
+		dz = fmax(dz, fabs(z - pos_z));
+		dz = fmax(dz, fabs(2 * water - z - pos_z));
+	}
+	double zy = cos30/HEIGHT_SCALE*ds*HEIGHT_CELLS * dz;
+
+	double u, v;
+	if (perspective)
+	{
+		// screen y shrinks by focal/depth, ground beyond horizon never gets in
+		double focal = fmax(dw,dh) * 2.0;
+		double den = ds*sin30*focal - hh;
+		if (den <= 0)
+			return FLT_MAX;
+		v = fmax(focal * (hh + zy) / (den * HEIGHT_CELLS), focal / HEIGHT_CELLS);
+		u = hw * (HEIGHT_CELLS * v + focal) / (ds * HEIGHT_CELLS * focal);
+	}
+	else
+	{
+		u = hw / (ds * HEIGHT_CELLS);
+		v = (hh + zy) / (ds * sin30 * HEIGHT_CELLS);
+	}
+
+	// plus a patch around for rounding and sprites standing on edge
+	return (float)(sqrt(u*u + v*v) + 2 * VISUAL_CELLS);
+}
+
+struct RenderBatch
+{
+	Workers* workers; // null -> views are rendered one by one on calling thread
+};
+
+RenderBatch* CreateRenderBatch(int threads)
+{
+	RenderBatch* b = (RenderBatch*)malloc(sizeof(RenderBatch));
+	b->workers = 0;
+
+	if (threads != 1)
+	{
+		b->workers = CreateWorkers(threads);
+		if (GetWorkersThreads(b->workers) <= 1)
+		{
+			DeleteWorkers(b->workers);
+			b->workers = 0;
+		}
+	}
+
+	return b;
+}
+
+void DeleteRenderBatch(RenderBatch* b)
+{
+	if (!b)
+		return;
+	DeleteWorkers(b->workers);
+	free(b);
+}
+
+struct RenderViewsJob
+{
+	uint64_t stamp;
+	Terrain* t;
+	World* w;
+	float water;
+	const float* lt;
+	RenderView* view;
+	int views;
+	int* group; // view indices grouped by renderer
+	int* group_ofs; // [groups+1]
+};
+
+static bool SameView(const RenderView* a, const RenderView* b)
+{
+	return a->zoom == b->zoom && a->yaw == b->yaw &&
+		a->pos[0] == b->pos[0] && a->pos[1] == b->pos[1] && a->pos[2] == b->pos[2] &&
+		a->perspective == b->perspective && a->width == b->width && a->height == b->height &&
+		a->player == b->player && a->scene_shift[0] == b->scene_shift[0] && a->scene_shift[1] == b->scene_shift[1];
+}
+
+// renders views of one renderer in order, each with its own scene query, consecutive identical views are copied
+static void RenderViewsGroup(int index, void* cookie)
+{
+	RenderViewsJob* job = (RenderViewsJob*)cookie;
+	const RenderView* prev = 0;
+
+	for (int g = job->group_ofs[index]; g < job->group_ofs[index + 1]; g++)
+	{
+		RenderView* v = job->view + job->group[g];
+		if (prev && SameView(prev, v))
+		{
+			memcpy(v->ptr, prev->ptr, sizeof(AnsiCell) * v->width * v->height);
+			continue;
+		}
+
+		Renderer* r = v->renderer;
+		r->skip_inst = v->player;
+		RenderScene(r, job->stamp, job->t, job->w, job->water, v->zoom, v->yaw, v->pos, job->lt,
+			v->width, v->height, v->ptr, v->player, v->scene_shift, v->perspective);
+		r->skip_inst = 0;
+		prev = v;
+	}
+}
+
+void RenderViews(RenderBatch* b, uint64_t stamp, Terrain* t, World* w, float water, const float lt[4], RenderView* view, int views)
+{
+	if (views <= 0)
+		return;
+
+	RenderViewsJob job;
+	job.stamp = stamp;
+	job.t = t;
+	job.w = w;
+	job.water = water;
+	job.lt = lt;
+	job.view = view;
+	job.views = views;
+	job.group = (int*)malloc(sizeof(int) * (2 * views + 1));
+	job.group_ofs = job.group + views;
+
+	// views sharing renderer must be rendered one after another by the same job
+	int groups = 0;
+	int grouped = 0;
+	for (int i = 0; i < views; i++)
+	{
+		bool first = true;
+		for (int j = 0; j < i; j++)
+		{
+			if (view[j].renderer == view[i].renderer)
+			{
+				first = false;
+				break;
+			}
+		}
+
+		if (!first)
+			continue;
+
+		job.group_ofs[groups++] = grouped;
+		for (int j = i; j < views; j++)
+		{
+			if (view[j].renderer == view[i].renderer)
+				job.group[grouped++] = j;
+		}
+	}
+	job.group_ofs[groups] = grouped;
+
+	// views must not build stale node summaries concurrently (they would wait for each other)
+	UpdateTerrainLOD(t);
+
+	RunWorkers(b ? b->workers : 0, groups, RenderViewsGroup, &job);
+
+	free(job.group);
+}
+
 bool ProjectCoords(Renderer* r, const float pos[3], int view[3])
 {
 	// TODO: add perspective!
@@ -4264,10 +6588,10 @@ bool UnprojectCoords2D(Renderer* r, const int xy[2], float pos[3])
 	int y1 = y0 + r->sample_buffer.w;
 	float sh[4] =
 	{
-		r->sample_buffer.ptr[y0].height,
-		r->sample_buffer.ptr[y0 + 1].height,
-		r->sample_buffer.ptr[y1].height,
-		r->sample_buffer.ptr[y1 + 1].height,
+		r->sample_buffer.height[y0],
+		r->sample_buffer.height[y0 + 1],
+		r->sample_buffer.height[y1],
+		r->sample_buffer.height[y1 + 1],
 	};
 
 	float height = sh[0];
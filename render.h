@@ -43,6 +43,15 @@ struct Renderer;
 Renderer* CreateRenderer(uint64_t stamp);
 void DeleteRenderer(Renderer* r);
 
+// 1: rasterize on calling thread (default), 0: use all cores
+// otherwise sample buffer is split into horizontal bands rasterized by given number of threads
+void SetRenderThreads(Renderer* r, int threads);
+
+// when camera moves by whole samples, scroll previous frame and render only what's uncovered
+// perspective frames have parallax, they are reused only while camera stays still, any move renders all again
+// mesh insts changes are tracked by world, terrain streaming too, terrain edits are not (keep it off in editor)
+void SetRenderIncremental(Renderer* r, bool incremental);
+
 // return null-terminated array of item pointers that are reachable by player
 /*
 Item** Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, 		// scene
@@ -59,6 +68,75 @@ void Render(Renderer* r, uint64_t stamp, Terrain* t, World* w, float water, 		//
 	const int scene_shift[2],
 	bool perspective);
 
+// distance (in world xy units) from pos to the farthest ground such view can show,
+// lo/hi is terrain height range (reflections included), FLT_MAX if it reaches horizon
+float GetRenderRadius(int width, int height, float zoom, float water, float pos_z, int lo, int hi, const int scene_shift[2], bool perspective);
+
+// several views of the same scene rendered in one call, spread over batch threads
+// (1: calling thread only, 0: all cores), each renderer is used by one thread at a time
+// it's only a threaded wrapper of Render(): every view still queries terrain and world on its own
+// (lod, occlusion and dirty rects are per view), nothing is shared between overlapping views
+// so give renderers single thread (SetRenderThreads) unless views are fewer than cores
+// views sharing renderer are rendered in given order, identical consecutive ones only once
+// player is not hidden in the world, it is skipped only by its own view
+struct RenderView
+{
+	Renderer* renderer;
+	float zoom, yaw, pos[3];
+	bool perspective;
+	int width, height;
+	AnsiCell* ptr;
+	Inst* player;
+	int scene_shift[2];
+};
+
+struct RenderBatch;
+RenderBatch* CreateRenderBatch(int threads);
+void DeleteRenderBatch(RenderBatch* b);
+
+void RenderViews(RenderBatch* b, uint64_t stamp, Terrain* t, World* w, float water, const float lt[4], RenderView* view, int views);
+
+// timings and counters of last Render() call
+struct RenderStats
+{
+	// wall time in microseconds, rasterization done by worker threads is split between
+	// terrain and meshes in proportion to time workers spent on each
+	int terrain_query_us; // quadtree walk and patch transforms
+	int terrain_raster_us;
+	int mesh_raster_us; // including world query and face transforms
+	int refl_us; // whole mirrored pass
+	int water_us; // water noise in post pass
+	int post_us; // rest of post pass
+	int sprite_us; // sorting and blitting sprites
+	int total_us;
+
+	int patches; // patch and node summary jobs drawn (both passes)
+	int faces;
+	int sprites;
+	int samples; // samples covered by rasterized triangles
+};
+
+const RenderStats* GetRenderStats(Renderer* r);
+
+// water ripples noise: true - float version in batches, vectorized where available (default)
+// false - double precision reference
+void SetRenderFastWater(Renderer* r, bool fast);
+
+// zoomed out ortho views: true - distant nodes are drawn from terrain node summaries (default)
+// false - every patch is drawn, reference for validating summaries
+void SetRenderLOD(Renderer* r, bool lod);
+
+// true - terrain and meshes hidden behind what's already drawn are skipped, terrain is queried front to back (default)
+// false - everything in view is drawn in original order, reference output (depth ties may resolve differently with culling)
+void SetRenderOcclusion(Renderer* r, bool culling);
+
+// water animation phase, normally advanced by Render() stamps
+// set it (and pass unchanged stamp) to make frames reproducible
+void SetRenderTime(Renderer* r, double pn_time);
+
+// FNV-1a of given output cells and sample heights of last Render() call
+uint64_t GetRenderChecksum(Renderer* r, const AnsiCell* ptr, int width, int height);
+
 bool ProjectCoords(Renderer* r, const float pos[3], int view[3]); // like a sprite!
 bool UnprojectCoords2D(Renderer* r, const int xy[2], float pos[3]); // reads height from buffer first!
 bool UnprojectCoords3D(Renderer* r, const int xy[3], float pos[3]); // reads height from buffer first!
@@ -66,6 +66,7 @@ extern float pos_x, pos_y, pos_z;
 extern float rot_yaw;
 extern float global_lt[];
 extern int probe_z;
+extern int render_threads;
 
 void term_render(A3D_WND* wnd)
 {
@@ -201,6 +202,7 @@ void term_init(A3D_WND* wnd)
 	float dir = 0;
 	int water = probe_z;
 	term->game = CreateGame(water, pos, yaw, dir, stamp);
+	SetRenderThreads(term->game->renderer, render_threads);
 
 	int loglen = 999;
 	char logstr[1000] = "";
@@ -5,17 +5,34 @@
 #include <math.h>
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <float.h>
 
+#if (defined(__linux__) || defined(__APPLE__)) && !defined(__EMSCRIPTEN__)
+#define TERRAIN_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef EDITOR
+#include <new>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#define TERRAIN_STREAMING
+#endif
+#endif
+
 #ifdef EDITOR
 #include "texheap.h"
 #endif
 
 #include "terrain.h"
 #include "matrix.h"
+#include "workers.h"
+#include "raypacket.h"
 
 #include "fast_rand.h"
 
@@ -76,11 +93,14 @@ struct QuadItem
 	Node* parent;
 	uint16_t lo, hi;
 	uint16_t flags; // 8 bits of neighbors, CCW, bit0 is on (-,-), bit7 is on (-,0)
+	uint8_t slot; // index in its TerrainSlab (fits struct padding)
 };
 
 struct Node : QuadItem
 {
 	QuadItem* quad[4]; // all 4 are same, either Nodes or Patches, at least 1 must not be NULL
+	Patch* lod; // downsampled summary of whole node, see GetNodeLOD()
+	std::atomic<int> lod_state; // 0 - stale, 1 - valid, 2 - node has holes (no summary), see lod_mutex
 };
 
 struct Patch : QuadItem // 564 bytes (512x512 'raster' map would require 564KB)
@@ -95,11 +115,108 @@ struct Patch : QuadItem // 564 bytes (512x512 'raster' map would require 564KB)
 	uint16_t height[HEIGHT_CELLS + 1][HEIGHT_CELLS + 1];
 	uint16_t diag; // (4x4)
 
+	int x, y; // as passed to AddTerrainPatch(), hash key
+
 #ifdef TEXHEAP
 	TexAlloc* ta; // MUST BE AT THE TAIL OF STRUCT !!!
 #endif
 };
 
+// patches and nodes are allocated from slabs of 64 items, free slots in lowest slabs are reused first,
+// CompactTerrain() rewrites whole tree into fresh slabs in quadtree (Morton) order
+#define TERRAIN_SLAB_ITEMS 64
+
+struct TerrainPool;
+
+struct TerrainSlab
+{
+	TerrainPool* pool;
+	int index; // in pool->slab[]
+	uint64_t used; // bit per slot
+};
+
+static const size_t slab_head = (sizeof(TerrainSlab) + 15) & ~(size_t)15;
+
+struct TerrainPool
+{
+	Terrain* terrain;
+	size_t item; // sizeof(Patch) or sizeof(Node)
+	int slabs;
+	int slabs_size;
+	int hint; // all slabs below are full
+	TerrainSlab** slab;
+};
+
+static void CreatePool(TerrainPool* p, Terrain* t, size_t item)
+{
+	p->terrain = t;
+	p->item = item;
+	p->slabs = 0;
+	p->slabs_size = 0;
+	p->hint = 0;
+	p->slab = 0;
+}
+
+static void DeletePool(TerrainPool* p)
+{
+	for (int i = 0; i < p->slabs; i++)
+		free(p->slab[i]);
+	free(p->slab);
+	p->slabs = 0;
+	p->slabs_size = 0;
+	p->hint = 0;
+	p->slab = 0;
+}
+
+static void AddSlab(TerrainPool* p, TerrainSlab* s)
+{
+	if (p->slabs == p->slabs_size)
+	{
+		p->slabs_size = p->slabs_size ? 2 * p->slabs_size : 16;
+		p->slab = (TerrainSlab**)realloc(p->slab, sizeof(TerrainSlab*) * p->slabs_size);
+	}
+	s->pool = p;
+	s->index = p->slabs;
+	p->slab[p->slabs++] = s;
+}
+
+static QuadItem* PoolAlloc(TerrainPool* p)
+{
+	const uint64_t full = ~(uint64_t)0;
+	while (p->hint < p->slabs && p->slab[p->hint]->used == full)
+		p->hint++;
+
+	if (p->hint == p->slabs)
+	{
+		TerrainSlab* s = (TerrainSlab*)malloc(slab_head + p->item * TERRAIN_SLAB_ITEMS);
+		s->used = 0;
+		AddSlab(p, s);
+	}
+
+	TerrainSlab* s = p->slab[p->hint];
+	int i = 0;
+	while (s->used & ((uint64_t)1 << i))
+		i++;
+	s->used |= (uint64_t)1 << i;
+
+	QuadItem* q = (QuadItem*)((char*)s + slab_head + p->item * i);
+	q->slot = i;
+	return q;
+}
+
+static void PoolFree(QuadItem* q, size_t item)
+{
+	TerrainSlab* s = (TerrainSlab*)((char*)q - item * q->slot - slab_head);
+	s->used &= ~((uint64_t)1 << q->slot);
+	if (s->index < s->pool->hint)
+		s->pool->hint = s->index;
+}
+
+static size_t PoolBytes(const TerrainPool* p)
+{
+	return p->slabs * (slab_head + p->item * TERRAIN_SLAB_ITEMS) + p->slabs_size * sizeof(TerrainSlab*);
+}
+
 struct Terrain
 {
 	int x, y; // worldspace origin from tree origin
@@ -108,11 +225,144 @@ struct Terrain
 	int nodes;
 	int patches;
 
+	TerrainPool node_pool;
+	TerrainPool patch_pool;
+
+	// open addressing (linear probing) of attached patches by Morton key of their x,y
+	int hash_bits;
+	int hash_used;
+	Patch** hash;
+
+	struct TerrainStream* stream; // NULL unless StreamTerrain()
+	uint64_t revision; // bumped when streaming changes resident patches
+
+	float dark_light[3]; // all dark masks were baked with it, 0,0,0 if not
+
+	// kept alive between bakes, editor rebakes boxes every frame
+	Workers* dark_workers;
+	int dark_threads; // as requested, 0 -> all cores
+
 #ifdef TEXHEAP
 	TexHeap th; // MUST BE AT THE TAIL OF STRUCT !!!
 #endif
 };
 
+static Node* CreateNode(Terrain* t)
+{
+	Node* n = (Node*)PoolAlloc(&t->node_pool);
+	n->lod = 0;
+	n->lod_state = 0;
+	return n;
+}
+
+static void DeleteNode(Node* n)
+{
+	if (n->lod)
+		free(n->lod);
+	PoolFree(n, sizeof(Node));
+}
+
+static inline uint64_t MortonKey(int x, int y)
+{
+	uint64_t k[2] = { (uint32_t)x, (uint32_t)y };
+	for (int i = 0; i < 2; i++)
+	{
+		k[i] = (k[i] | (k[i] << 16)) & 0x0000FFFF0000FFFFull;
+		k[i] = (k[i] | (k[i] << 8)) & 0x00FF00FF00FF00FFull;
+		k[i] = (k[i] | (k[i] << 4)) & 0x0F0F0F0F0F0F0F0Full;
+		k[i] = (k[i] | (k[i] << 2)) & 0x3333333333333333ull;
+		k[i] = (k[i] | (k[i] << 1)) & 0x5555555555555555ull;
+	}
+	return k[0] | (k[1] << 1);
+}
+
+static inline int HashSlot(const Terrain* t, int x, int y)
+{
+	return (int)((MortonKey(x, y) * 0x9E3779B97F4A7C15ull) >> (64 - t->hash_bits));
+}
+
+static Patch* HashGet(const Terrain* t, int x, int y)
+{
+	if (!t->hash_used)
+		return 0;
+
+	int mask = (1 << t->hash_bits) - 1;
+	for (int i = HashSlot(t, x, y); ; i = (i + 1) & mask)
+	{
+		Patch* p = t->hash[i];
+		if (!p || (p->x == x && p->y == y))
+			return p;
+	}
+}
+
+static int HashFind(const Terrain* t, const Patch* p)
+{
+	int mask = (1 << t->hash_bits) - 1;
+	int i = HashSlot(t, p->x, p->y);
+	while (t->hash[i] != p)
+		i = (i + 1) & mask;
+	return i;
+}
+
+static void HashAdd(Terrain* t, Patch* p)
+{
+	if (2 * (t->hash_used + 1) > (1 << t->hash_bits))
+	{
+		int size = t->hash ? 1 << t->hash_bits : 0;
+		Patch** old = t->hash;
+
+		t->hash_bits = t->hash_bits ? t->hash_bits + 1 : 8;
+		t->hash = (Patch**)malloc(sizeof(Patch*) << t->hash_bits);
+		memset(t->hash, 0, sizeof(Patch*) << t->hash_bits);
+		t->hash_used = 0;
+
+		for (int i = 0; i < size; i++)
+			if (old[i])
+				HashAdd(t, old[i]);
+		free(old);
+	}
+
+	int mask = (1 << t->hash_bits) - 1;
+	int i = HashSlot(t, p->x, p->y);
+	while (t->hash[i])
+		i = (i + 1) & mask;
+	t->hash[i] = p;
+	t->hash_used++;
+}
+
+static void HashDel(Terrain* t, Patch* p)
+{
+	// backward shift, no tombstones
+	int mask = (1 << t->hash_bits) - 1;
+	int i = HashFind(t, p);
+	int j = i;
+	while (true)
+	{
+		j = (j + 1) & mask;
+		Patch* q = t->hash[j];
+		if (!q)
+			break;
+		int k = HashSlot(t, q->x, q->y);
+		if (((j - k) & mask) >= ((j - i) & mask))
+		{
+			t->hash[i] = q;
+			i = j;
+		}
+	}
+	t->hash[i] = 0;
+	t->hash_used--;
+}
+
+static Patch* CreatePatch(Terrain* t)
+{
+	return (Patch*)PoolAlloc(&t->patch_pool);
+}
+
+static void DeletePatch(Patch* p)
+{
+	PoolFree(p, sizeof(Patch));
+}
+
 void GetTerrainBase(Terrain* t, int b[2])
 {
 	b[0] = t->x;
@@ -121,8 +371,34 @@ void GetTerrainBase(Terrain* t, int b[2])
 
 void SetTerrainBase(Terrain* t, const int b[2])
 {
+	// patch x,y (hash keys) are relative to base, move them along and rehash
+	// (editor only, streamed regions keep coords they were saved with)
+	int dx = t->x - b[0];
+	int dy = t->y - b[1];
+
 	t->x = b[0];
 	t->y = b[1];
+
+	if ((!dx && !dy) || !t->hash_used)
+		return;
+
+	int size = 1 << t->hash_bits;
+	Patch** old = t->hash;
+
+	t->hash = (Patch**)malloc(sizeof(Patch*) << t->hash_bits);
+	memset(t->hash, 0, sizeof(Patch*) << t->hash_bits);
+	t->hash_used = 0;
+
+	for (int i = 0; i < size; i++)
+	{
+		if (old[i])
+		{
+			old[i]->x += dx;
+			old[i]->y += dy;
+			HashAdd(t, old[i]);
+		}
+	}
+	free(old);
 }
 
 Terrain* CreateTerrain(int z)
@@ -132,6 +408,23 @@ Terrain* CreateTerrain(int z)
 	t->y = 0;
 	t->nodes = 0;
 
+	t->hash_bits = 0;
+	t->hash_used = 0;
+	t->hash = 0;
+
+	t->stream = 0;
+	t->revision = 0;
+
+	t->dark_light[0] = 0;
+	t->dark_light[1] = 0;
+	t->dark_light[2] = 0;
+
+	t->dark_workers = 0;
+	t->dark_threads = 0;
+
+	CreatePool(&t->node_pool, t, sizeof(Node));
+	CreatePool(&t->patch_pool, t, sizeof(Patch));
+
 #ifdef TEXHEAP
 
 	int cap = TERRAIN_TEXHEAP_CAPACITY;
@@ -149,11 +442,14 @@ Terrain* CreateTerrain(int z)
 	{
 		t->level = 0;
 
-		Patch* p = (Patch*)malloc(sizeof(Patch));
+		Patch* p = CreatePatch(t);
 		p->parent = 0;
 		p->lo = z;
 		p->hi = z;
 		p->flags = 0; // (no neighbor)
+		p->x = 0;
+		p->y = 0;
+		HashAdd(t, p);
 
 #ifdef DARK_TERRAIN
 		p->dark = 0;
@@ -194,29 +490,10 @@ Terrain* CreateTerrain(int z)
 	return t;
 }
 
-static void DeleteTerrain(Node* n, int lev)
-{
-	if (lev == 1)
-	{
-		for (int i = 0; i < 4; i++)
-		{
-			Patch* p = (Patch*)n->quad[i];
-			if (p)
-				free(p);
-		}
-	}
-	else
-	{
-		for (int i = 0; i < 4; i++)
-		{
-			Node* c = (Node*)n->quad[i];
-			if (c)
-				DeleteTerrain(c, lev - 1);
-		}
-	}
-
-	free(n);
-}
+#ifdef TERRAIN_STREAMING
+static void CloseStream(struct TerrainStream* s);
+static size_t GetStreamBytes(struct TerrainStream* s);
+#endif
 
 void DeleteTerrain(Terrain* t)
 {
@@ -227,80 +504,33 @@ void DeleteTerrain(Terrain* t)
 	t->th.Destroy();
 #endif
 
-	if (!t->root)
-	{
-		free(t);
-		return;
-	}
-
-	if (t->level == 0)
-	{
-		Patch* p = (Patch*)t->root;
-		free(p);
-		free(t);
-		return;
-	}
-
-	int lev = t->level;
-	int xy = 0;
-	Node* n = (Node*)t->root;
-	free(t);
-
-	DeleteTerrain(n, lev);
+#ifdef TERRAIN_STREAMING
+	if (t->stream)
+		CloseStream(t->stream);
+#endif
 
-	/*
+	DeleteWorkers(t->dark_workers);
 
-	while (true)
+	// no tree walk, only node summaries are allocated outside of slabs
+	TerrainPool* np = &t->node_pool;
+	for (int i = 0; i < np->slabs; i++)
 	{
-	recurse:
-		lev--;
-
-		if (!lev)
-		{
-			for (int i = 0; i < 4; i++)
-			{
-				Patch* p = (Patch*)n->quad[i];
-				if (p)
-					free(p);
-			}
-		}
-		else
-		{
-			for (int i = 0; i < 4; i++)
-			{
-				if (n->quad[i])
-				{
-					xy = (xy << 2) + i;
-					n = (Node*)n->quad[i];
-					goto recurse;
-				}
-			}
-		}
-
-		while (true)
+		TerrainSlab* s = np->slab[i];
+		for (int j = 0; j < TERRAIN_SLAB_ITEMS; j++)
 		{
-			Node* p = n->parent;
-			free(n);
-
-			if (!p)
-				return;
-
-			while ((xy & 3) < 3)
+			if (s->used & ((uint64_t)1 << j))
 			{
-				xy++;
-				if (p->quad[xy & 3])
-				{
-					n = (Node*)p->quad[xy & 3];
-					goto recurse;
-				}
+				Node* n = (Node*)((char*)s + slab_head + sizeof(Node) * j);
+				if (n->lod)
+					free(n->lod);
 			}
-
-			xy <<= 2;
-			n = p;
-			lev++;
 		}
 	}
-	*/
+
+	DeletePool(&t->node_pool);
+	DeletePool(&t->patch_pool);
+	free(t->hash);
+	free(t);
 }
 
 struct Tap3x3
@@ -449,62 +679,36 @@ struct Tap3x3
 
 Patch* GetTerrainPatch(Terrain* t, int x, int y)
 {
-	if (!t->root)
-		return 0;
-
-	x += t->x;
-	y += t->y;
-
-	int range = 1 << t->level;
-	if (x < 0 || y < 0 || x >= range || y >= range)
-		return 0;
-
-	if (t->level == 0)
-		return (Patch*)t->root;
+	return HashGet(t, x, y);
+}
 
-	int lev = t->level;
+void GetTerrainPatch(Terrain*, Patch* p, int* x, int* y)
+{
+	if (x)
+		*x = p->x;
+	if (y)
+		*y = p->y;
+}
 
-	Node* n = (Node*)t->root;
-	while (n)
+// node summaries depend on all descendants, ancestors of valid node are never stale
+static void StaleLOD(Node* n)
+{
+	while (n && n->lod_state)
 	{
-		lev--;
-		int i = ((x >> lev) & 1) | (((y >> lev) & 1) << 1);
-
-		if (lev)
-			n = (Node*)n->quad[i];
-		else
-			return (Patch*)n->quad[i];
+		n->lod_state = 0;
+		n = n->parent;
 	}
-
-	return 0;
 }
 
-void GetTerrainPatch(Terrain* t, Patch* p, int* x, int* y)
+static void StaleLOD(Node* n, int lev)
 {
-	int px = 0, py = 0;
-
-	int lev = 0;
-	QuadItem* q = p;
-	Node* n = p->parent;
-	while (n)
+	n->lod_state = 0;
+	if (lev > 1)
 	{
-		for (int i=0; i<4; i++)
-			if (n->quad[i] == q)
-			{
-				px = px | ((i & 1) << lev);
-				py = py | (((i>>1) & 1) << lev);
-				break;
-			}
-
-		q = n;
-		n = n->parent;
-		lev++;
+		for (int i = 0; i < 4; i++)
+			if (n->quad[i])
+				StaleLOD((Node*)n->quad[i], lev - 1);
 	}
-
-	if (x)
-		*x = px - t->x;
-	if (x)
-		*y = py - t->y;
 }
 
 static void UpdateNodes(Patch* p)
@@ -531,6 +735,7 @@ static void UpdateNodes(Patch* p)
 		n->lo = lo;
 		n->hi = hi;
 		n->flags = fl;
+		n->lod_state = 0;
 
 		n = n->parent;
 	}
@@ -545,6 +750,8 @@ bool DelTerrainPatch(Terrain* t, int x, int y)
 	int flags = p->flags;
 	Node* n = p->parent;
 
+	HashDel(t, p);
+
 #ifdef TEXHEAP
 	TexAlloc* last = p->ta->Free();
 	if (last)
@@ -554,7 +761,7 @@ bool DelTerrainPatch(Terrain* t, int x, int y)
 		UpdateTerrainHeightMap(l);
 	}
 #endif
-	free(p);
+	DeletePatch(p);
 
 	t->patches--;
 
@@ -585,13 +792,15 @@ bool DelTerrainPatch(Terrain* t, int x, int y)
 		{
 			q = n;
 			n = n->parent;
-			free((Node*)q);
+			DeleteNode((Node*)q);
 			t->nodes--;
 		}
 		else
 			break;
 	}
 
+	StaleLOD(n);
+
 	// root trim
 
 	n = (Node*)t->root;
@@ -623,11 +832,11 @@ bool DelTerrainPatch(Terrain* t, int x, int y)
 
 		t->root = n->quad[j];
 		t->root->parent = 0;
-		free(n);
+		DeleteNode(n);
 		t->nodes--;
 
 		if (t->level)
-			n = (Node*)n->quad[j];
+			n = (Node*)t->root;
 		else
 			break;
 	}
@@ -658,17 +867,24 @@ bool DelTerrainPatch(Terrain* t, int x, int y)
 
 Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 {
+	Patch* e = HashGet(t, x, y);
+	if (e)
+		return e;
+
 	if (!t->root)
 	{
 		t->x = -x;
 		t->y = -y;
 		t->level = 0;
 
-		Patch* p = (Patch*)malloc(sizeof(Patch));
+		Patch* p = CreatePatch(t);
 		p->parent = 0;
 		p->lo = z;
 		p->hi = z;
 		p->flags = 0; // no neighbor
+		p->x = x;
+		p->y = y;
+		HashAdd(t, p);
 
 #ifdef DARK_TERRAIN
 		p->dark = 0;
@@ -712,7 +928,7 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 
 	while (x < 0)
 	{
-		Node* n = (Node*)malloc(sizeof(Node));
+		Node* n = CreateNode(t);
 		t->nodes++;
 
 		if (2 * y < range)
@@ -758,7 +974,7 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 
 	while (y < 0)
 	{
-		Node* n = (Node*)malloc(sizeof(Node));
+		Node* n = CreateNode(t);
 		t->nodes++;
 
 		if (2 * x < range)
@@ -804,7 +1020,7 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 
 	while (x >= range)
 	{
-		Node* n = (Node*)malloc(sizeof(Node));
+		Node* n = CreateNode(t);
 		t->nodes++;
 
 		if (2 * y > range)
@@ -844,7 +1060,7 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 
 	while (y >= range)
 	{
-		Node* n = (Node*)malloc(sizeof(Node));
+		Node* n = CreateNode(t);
 		t->nodes++;
 
 		if (2 * x > range)
@@ -902,7 +1118,7 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 		{
 			if (!(Node*)n->quad[i])
 			{
-				Node* c = (Node*)malloc(sizeof(Node));
+				Node* c = CreateNode(t);
 				t->nodes++;
 
 				c->parent = n;
@@ -920,7 +1136,7 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 				return (Patch*)n->quad[i];
 			}
 
-			Patch* p = (Patch*)malloc(sizeof(Patch));
+			Patch* p = CreatePatch(t);
 			t->patches++;
 
 			n->quad[i] = p;
@@ -934,6 +1150,9 @@ Patch* AddTerrainPatch(Terrain* t, int x, int y, int z)
 			p->diag = 0;
 
 			int nx = x - t->x, ny = y - t->y;
+			p->x = nx;
+			p->y = ny;
+			HashAdd(t, p);
 
 			Patch* np[8] =
 			{
@@ -1139,72 +1358,97 @@ Patch* GetTerrainNeighbor(Patch* p, int dx, int dy)
 	if (dx == 0 && dy == 0)
 		return p;
 
-	int r = 1;
+	TerrainSlab* s = (TerrainSlab*)((char*)p - sizeof(Patch) * p->slot - slab_head);
+	Terrain* t = s->pool->terrain;
 
-	QuadItem* q = p;
-	Node* n = q->parent;
+	// detached
+	if (!p->parent && t->root != p)
+		return 0;
 
-	while (n)
-	{
-		if (n->quad[1] == q)
-			dx += r;
-		else
-		if (n->quad[2] == q)
-			dy += r;
-		else
-		if (n->quad[3] == q)
-		{
-			dx += r;
-			dy += r;
-		}
-		else
-			assert(n->quad[0] == q);
+	return HashGet(t, p->x + dx, p->y + dy);
+}
 
-		r <<= 1;
 
-		if (dx >= 0 && dx < r && dy >= 0 && dy < r)
-			break; // in range!
+int GetTerrainPatches(Terrain* t)
+{
+	return t->patches;
+}
 
-		q = n;
-		n = n->parent;
-	}
+size_t GetTerrainBytes(Terrain* t)
+{
+	size_t bytes = sizeof(Terrain) + PoolBytes(&t->node_pool) + PoolBytes(&t->patch_pool) + (sizeof(Patch*) << t->hash_bits);
+#ifdef TERRAIN_STREAMING
+	if (t->stream)
+		bytes += GetStreamBytes(t->stream);
+#endif
+	return bytes;
+}
 
-	while (n)
+static QuadItem* CompactItem(Terrain* t, QuadItem* q, int lev)
+{
+	TerrainPool* p = lev ? &t->node_pool : &t->patch_pool;
+	QuadItem* c = PoolAlloc(p);
+	int slot = c->slot;
+	memcpy(c, q, p->item);
+	c->slot = slot;
+	PoolFree(q, p->item);
+
+	if (!lev)
 	{
-		int hr = r >> 1;
+		t->hash[HashFind(t, (Patch*)q)] = (Patch*)c;
+#ifdef TEXHEAP
+		((Patch*)c)->ta->user = c;
+#endif
+		return c;
+	}
 
-		int i = 0;
-		if (dx >= hr)
-		{
-			i |= 1;
-			dx -= hr;
-		}
+	Node* n = (Node*)c;
+	if (n->lod)
+		n->lod->parent = n;
 
-		if (dy >= hr)
+	for (int i = 0; i < 4; i++)
+	{
+		if (n->quad[i])
 		{
-			i |= 2;
-			dy -= hr;
+			n->quad[i] = CompactItem(t, n->quad[i], lev - 1);
+			n->quad[i]->parent = n;
 		}
-
-		if (hr == 1)
-			return (Patch*)n->quad[i];
-
-		r = hr;
-		n = (Node*)n->quad[i];
 	}
-	   
-	return 0;
-}
 
+	return c;
+}
 
-int GetTerrainPatches(Terrain* t)
+static void CompactPool(TerrainPool* p, TerrainPool* old)
 {
-	return t->patches;
+	// slabs still holding detached patches are kept as they are
+	for (int i = 0; i < old->slabs; i++)
+	{
+		if (old->slab[i]->used)
+			AddSlab(p, old->slab[i]);
+		else
+			free(old->slab[i]);
+	}
+	free(old->slab);
+	p->hint = 0;
 }
 
-size_t GetTerrainBytes(Terrain* t)
+void CompactTerrain(Terrain* t)
 {
-	return t->patches * sizeof(Patch) + t->nodes * sizeof(Node);
+	TerrainPool old[2] = { t->node_pool, t->patch_pool };
+	for (int i = 0; i < old[0].slabs; i++)
+		old[0].slab[i]->pool = old + 0;
+	for (int i = 0; i < old[1].slabs; i++)
+		old[1].slab[i]->pool = old + 1;
+
+	CreatePool(&t->node_pool, t, sizeof(Node));
+	CreatePool(&t->patch_pool, t, sizeof(Patch));
+
+	// depth first, quad[i] is at x+(i&1), y+(i>>1) so patches end up in Morton order
+	if (t->root)
+		t->root = CompactItem(t, t->root, t->level);
+
+	CompactPool(&t->node_pool, old + 0);
+	CompactPool(&t->patch_pool, old + 1);
 }
 
 
@@ -1402,6 +1646,8 @@ void UpdateTerrainVisualMap(Patch* p)
 	TexData data = { GL_RED_INTEGER, GL_UNSIGNED_SHORT, p->visual };
 	p->ta->Update(1, 1, &data); // ONLY VISUAL !!!
 #endif
+
+	StaleLOD(p->parent);
 }
 
 #ifdef TEXHEAP
@@ -1423,6 +1669,15 @@ uint16_t GetTerrainHi(Patch* p, uint16_t* lo)
 	return p->hi;
 }
 
+uint16_t GetTerrainHi(Terrain* t, uint16_t* lo)
+{
+	// root keeps whole map range even when streamed regions are out
+	QuadItem* p = t ? t->root : 0;
+	if (lo)
+		*lo = p ? p->lo : 0;
+	return p ? p->hi : 0;
+}
+
 uint16_t GetTerrainDiag(Patch* p)
 {
 	return p->diag;
@@ -1442,6 +1697,7 @@ uint64_t GetTerrainDark(Patch* p)
 void SetTerrainDark(Patch* p, uint64_t dark)
 {
 	p->dark = dark;
+	StaleLOD(p->parent);
 }
 #endif
 
@@ -1528,57 +1784,267 @@ void QueryTerrainSample(QuadItem* q, int x, int y, int range, void(*cb)(Patch* p
 }
 
 #ifdef DARK_TERRAIN
-void UpdateTerrainDark(Terrain* t, World* w, float lightpos[3], bool editor)
+struct DarkBake
 {
-	struct Updater
-	{
-		static void cb(Patch* p, int u, int v, double coords[3], void* cookie)
-		{
-			Updater* updater = (Updater*)cookie;
+	bool editor;
+	Terrain* t;
+	World* w;
+	double lightdir[3];
+	Patch** patch;
+	int first; // of current batch
+};
+
+struct DarkSamples
+{
+	int samples;
+	int bit[VISUAL_CELLS * VISUAL_CELLS];
+	double coords[VISUAL_CELLS * VISUAL_CELLS][3];
+};
+
+static void DarkSample(Patch*, int u, int v, double coords[3], void* cookie)
+{
+	DarkSamples* ds = (DarkSamples*)cookie;
+	ds->bit[ds->samples] = u + VISUAL_CELLS * v;
+	ds->coords[ds->samples][0] = coords[0];
+	ds->coords[ds->samples][1] = coords[1];
+	ds->coords[ds->samples][2] = coords[2];
+	ds->samples++;
+}
+
+// rays only read terrain and world, so patches can be baked in parallel, each job writes its own dark
+// shadow rays of a patch are parallel and start next to each other, so they are traced in packets
+static void DarkPatch(int index, void* cookie)
+{
+	DarkBake* bake = (DarkBake*)cookie;
+	Patch* p = bake->patch[bake->first + index];
+
+	DarkSamples ds;
+	ds.samples = 0;
+	QueryTerrainSample(p, p->x * VISUAL_CELLS, p->y * VISUAL_CELLS, DarkSample, &ds);
+
+	double dir[RAY_PACKET][3];
+	for (int i = 0; i < RAY_PACKET; i++)
+	{
+		dir[i][0] = bake->lightdir[0];
+		dir[i][1] = bake->lightdir[1];
+		dir[i][2] = bake->lightdir[2];
+	}
+
+	for (int first = 0; first < ds.samples; first += RAY_PACKET)
+	{
+		int rays = ds.samples - first < RAY_PACKET ? ds.samples - first : RAY_PACKET;
+		double (*coords)[3] = ds.coords + first;
+
+		double hit[RAY_PACKET][3];
+		for (int i = 0; i < rays; i++)
+		{
+			hit[i][0] = coords[i][0];
+			hit[i][1] = coords[i][1];
+			hit[i][2] = coords[i][2];
+		}
 
-			double hit[3] = { coords[0], coords[1], coords[2] };
-			Patch* q = HitTerrain(updater->t, coords, updater->lightdir, hit, 0);
+		Patch* q[RAY_PACKET];
+		HitTerrain(bake->t, rays, coords, dir, hit, 0, q);
 
-			uint64_t mask = ((uint64_t)1) << (u + VISUAL_CELLS * v);
+		// rays not shadowed by terrain go on to world, packed together
+		int lane[RAY_PACKET];
+		double from[RAY_PACKET][3];
+		double whit[RAY_PACKET][3];
+		int wrays = 0;
+
+		for (int i = 0; i < rays; i++)
+		{
+			uint64_t mask = ((uint64_t)1) << ds.bit[first + i];
 
-			if (q)
+			if (q[i] && /*q != p || */ hit[i][2] > coords[i][2] + HEIGHT_SCALE/4)
 			{
-				if (/*q != p || */ hit[2] > coords[2] + HEIGHT_SCALE/4)
-				{
-					p->dark |= mask;
-					return;
-				}
+				p->dark |= mask;
+				continue;
 			}
 
-			Inst* i = HitWorld(updater->w, coords, updater->lightdir, hit, 0, false, updater->editor);
-
-			if (i)
+			lane[wrays] = i;
+			for (int a = 0; a < 3; a++)
 			{
-				if (hit[2] > coords[2])
-				{
-					p->dark |= mask;
-					return;
-				}
+				from[wrays][a] = coords[i][a];
+				whit[wrays][a] = hit[i][a];
 			}
+			wrays++;
+		}
+
+		if (!wrays)
+			continue;
+
+		Inst* inst[RAY_PACKET];
+		HitWorld(bake->w, wrays, from, dir, whit, 0, inst, false, bake->editor);
 
-			p->dark &= ~mask;
+		for (int i = 0; i < wrays; i++)
+		{
+			uint64_t mask = ((uint64_t)1) << ds.bit[first + lane[i]];
+
+			if (inst[i] && whit[i][2] > from[i][2])
+				p->dark |= mask;
+			else
+				p->dark &= ~mask;
 		}
+	}
+}
 
-		bool editor;
-		Terrain* t;
-		World* w;
-		double lightdir[3];
-	};
+static void GatherPatches(QuadItem* q, int lev, Patch** patch, int* patches)
+{
+	if (!lev)
+	{
+		patch[(*patches)++] = (Patch*)q;
+		return;
+	}
+
+	Node* n = (Node*)q;
+	for (int i = 0; i < 4; i++)
+		if (n->quad[i])
+			GatherPatches(n->quad[i], lev - 1, patch, patches);
+}
+
+// only patches touching box (x0,x1,y0,y1)
+static void GatherPatches(QuadItem* q, int x, int y, int range, const double box[4], Patch** patch, int* patches)
+{
+	if (x > box[1] || x + range < box[0] || y > box[3] || y + range < box[2])
+		return;
+
+	if (range == VISUAL_CELLS)
+	{
+		patch[(*patches)++] = (Patch*)q;
+		return;
+	}
+
+	Node* n = (Node*)q;
+	range >>= 1;
+	if (n->quad[0])
+		GatherPatches(n->quad[0], x, y, range, box, patch, patches);
+	if (n->quad[1])
+		GatherPatches(n->quad[1], x + range, y, range, box, patch, patches);
+	if (n->quad[2])
+		GatherPatches(n->quad[2], x, y + range, range, box, patch, patches);
+	if (n->quad[3])
+		GatherPatches(n->quad[3], x + range, y + range, range, box, patch, patches);
+}
+
+static void BakeDark(DarkBake* bake, int patches, int threads, void (*progress)(int done, int total, void* cookie), void* cookie)
+{
+	// batches are only there to report progress in between
+	int batch = progress ? (patches + 31) / 32 : patches;
+	if (batch < 256)
+		batch = 256;
+
+	Terrain* t = bake->t;
+	if (!t->dark_workers || t->dark_threads != threads)
+	{
+		DeleteWorkers(t->dark_workers);
+		t->dark_workers = CreateWorkers(threads);
+		t->dark_threads = threads;
+	}
+
+	for (bake->first = 0; bake->first < patches; bake->first += batch)
+	{
+		int jobs = patches - bake->first < batch ? patches - bake->first : batch;
+		RunWorkers(t->dark_workers, jobs, DarkPatch, bake);
+		if (progress)
+			progress(bake->first + jobs, patches, cookie);
+	}
+}
 
-	Updater updater = { editor, t, w, {-lightpos[0], -lightpos[1], -lightpos[2] * HEIGHT_SCALE} };
+void UpdateTerrainDark(Terrain* t, World* w, float lightpos[3], bool editor, int threads, void (*progress)(int done, int total, void* cookie), void* cookie)
+{
+	DarkBake bake = { editor, t, w, {-lightpos[0], -lightpos[1], -lightpos[2] * HEIGHT_SCALE}, 0, 0 };
 
 //	double n = 1.0 / sqrt(lightpos[0]* lightpos[0]+ lightpos[1]* lightpos[1]+ lightpos[2]* lightpos[2]);
-//	updater.lightdir[0] *= n;
-//	updater.lightdir[1] *= n;
-//	updater.lightdir[2] *= n;
+//	bake.lightdir[0] *= n;
+//	bake.lightdir[1] *= n;
+//	bake.lightdir[2] *= n;
 
-	if (t->root)
-		QueryTerrainSample(t->root, -t->x*VISUAL_CELLS, -t->y*VISUAL_CELLS, VISUAL_CELLS << t->level, Updater::cb, &updater);
+	if (!t->root)
+		return;
+
+	int patches = 0;
+	bake.patch = (Patch**)malloc(sizeof(Patch*) * t->patches);
+	GatherPatches(t->root, t->level, bake.patch, &patches);
+	BakeDark(&bake, patches, threads, progress, cookie);
+	free(bake.patch);
+
+	if (t->level)
+	{
+		StaleLOD((Node*)t->root, t->level);
+		UpdateTerrainLOD(t);
+	}
+
+	// non resident regions keep what they have, still right if it was baked for the same light
+	bool all = !t->stream || HasTerrainDark(t, lightpos);
+	for (int i = 0; i < 3; i++)
+		t->dark_light[i] = all ? lightpos[i] : 0;
+}
+
+void UpdateTerrainDarkBox(Terrain* t, World* w, float lightpos[3], bool editor, const double bbox[6], int threads)
+{
+	if (lightpos[2] <= 0)
+	{
+		UpdateTerrainDark(t, w, lightpos, editor, threads);
+		return;
+	}
+
+	DarkBake bake = { editor, t, w, {-lightpos[0], -lightpos[1], -lightpos[2] * HEIGHT_SCALE}, 0, 0 };
+
+	if (!t->root)
+		return;
+
+	int rx = -t->x * VISUAL_CELLS, ry = -t->y * VISUAL_CELLS, range = VISUAL_CELLS << t->level;
+
+	int patches = 0;
+	bake.patch = (Patch**)malloc(sizeof(Patch*) * t->patches);
+	GatherPatches(t->root, rx, ry, range, bbox, bake.patch, &patches);
+
+	// occluders are bbox and whatever terrain is under it now
+	double x0 = bbox[0], x1 = bbox[1], y0 = bbox[2], y1 = bbox[3], z1 = bbox[5];
+	for (int i = 0; i < patches; i++)
+		if (bake.patch[i]->hi > z1)
+			z1 = bake.patch[i]->hi;
+
+	// receivers are under bbox swept away from light down to the lowest terrain
+	double k = (z1 - t->root->lo) / (lightpos[2] * HEIGHT_SCALE);
+	if (k > 0)
+	{
+		double dx = -lightpos[0] * k, dy = -lightpos[1] * k;
+		if (dx < 0)
+			x0 += dx;
+		else
+			x1 += dx;
+		if (dy < 0)
+			y0 += dy;
+		else
+			y1 += dy;
+	}
+
+	double box[4] = { x0 - 1, x1 + 1, y0 - 1, y1 + 1 };
+	int bakes = 0;
+	GatherPatches(t->root, rx, ry, range, box, bake.patch, &bakes);
+
+	BakeDark(&bake, bakes, threads, 0, 0);
+
+	for (int i = 0; i < bakes; i++)
+		StaleLOD(bake.patch[i]->parent);
+
+	free(bake.patch);
+}
+
+bool HasTerrainDark(Terrain* t, const float lightpos[3])
+{
+	return
+		(t->dark_light[0] || t->dark_light[1] || t->dark_light[2]) &&
+		t->dark_light[0] == lightpos[0] && t->dark_light[1] == lightpos[1] && t->dark_light[2] == lightpos[2];
+}
+
+void InvalidateTerrainDark(Terrain* t)
+{
+	t->dark_light[0] = 0;
+	t->dark_light[1] = 0;
+	t->dark_light[2] = 0;
 }
 #endif
 
@@ -1696,120 +2162,379 @@ static void inline /*__forceinline*/ QueryTerrain(QuadItem* q, int x, int y, int
 	}
 }
 
-void QueryTerrain(Terrain* t, int planes, double plane[][4], int view_flags, void(*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie)
+// returns -1 if box is outside any of planes, otherwise number of planes still intersecting it
+// (fully containing planes are moved past returned count)
+static inline int CullTerrain(int x, int y, int range, int lo, int hi, int planes, double* plane[])
 {
-	if (!t || !t->root)
-		return;
+	int c[4] = { x, y, lo, 1 }; // 0,0,0
 
-	if (planes<=0)
-		QueryTerrain(t->root, -t->x*VISUAL_CELLS, -t->y*VISUAL_CELLS, VISUAL_CELLS << t->level, view_flags & 0xAA, cb, cookie);
-	else
+	for (int i = 0; i < planes; i++)
 	{
-		double* pp[6] = { plane[0],plane[1],plane[2],plane[3],plane[4],plane[5] };
-		QueryTerrain(t->root, -t->x*VISUAL_CELLS, -t->y*VISUAL_CELLS, VISUAL_CELLS << t->level, planes, pp, view_flags & 0xAA, cb, cookie);
-	}
-}
+		int neg_pos[2] = { 0,0 };
 
+		neg_pos[PositiveProduct(plane[i], c)] ++;
 
-void QueryTerrain(QuadItem* q, int x, int y, int range, const double xyr[3], int view_flags, void(*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie)
-{
-	int hit = 0;
+		c[0] += range; // 1,0,0
+		neg_pos[PositiveProduct(plane[i], c)] ++;
 
-	double rr = xyr[2] * xyr[2];
-	double dx0 = xyr[0] - x; dx0 *= dx0;
-	double dy0 = xyr[1] - y; dy0 *= dy0;
-	double dx1 = xyr[0] - x - range; dx1 *= dx1;
-	double dy1 = xyr[1] - y - range; dy1 *= dy1;
+		c[1] += range; // 1,1,0
+		neg_pos[PositiveProduct(plane[i], c)] ++;
 
-	if (dx0 + dy0 < rr) 
-		hit++;
+		c[0] -= range; // 0,1,0
+		neg_pos[PositiveProduct(plane[i], c)] ++;
 
-	if (dx1 + dy0 < rr)
-		hit++;
+		c[2] = hi; // 0,1,1
+		neg_pos[PositiveProduct(plane[i], c)] ++;
 
-	if (dx0 + dy1 < rr)
-		hit++;
-	
-	if (dx1 + dy1 < rr)
-		hit++;
+		c[0] += range; // 1,1,1
+		neg_pos[PositiveProduct(plane[i], c)] ++;
 
-	if (!hit)
-	{
-		bool fit_x = xyr[0] >= x && xyr[0] <= x + range;
-		bool fit_y = xyr[1] >= y && xyr[1] <= y + range;
+		c[1] -= range; // 1,0,1
+		neg_pos[PositiveProduct(plane[i], c)] ++;
 
-		if (fit_y && xyr[0] >= x - xyr[2] && xyr[0] <= x + range + xyr[2] ||
-			fit_x && xyr[1] >= y - xyr[2] && xyr[1] <= y + range + xyr[2])
+		c[0] -= range; // 0,0,1
+		neg_pos[PositiveProduct(plane[i], c)] ++;
+
+		c[2] = lo; // 0,0,0
+
+		if (neg_pos[0] == 8)
+			return -1;
+
+		if (neg_pos[1] == 8)
 		{
-			hit = 1;
+			planes--;
+			if (i < planes)
+			{
+				double* swap = plane[i];
+				plane[i] = plane[planes];
+				plane[planes] = swap;
+			}
+			i--;
 		}
-		else
-			return;
 	}
 
-	if (range == VISUAL_CELLS)
-	{
-		cb((Patch*)q, x, y, view_flags & ~q->flags, cookie);
-	}
-	else
+	return planes;
+}
+
+// queries may run on several threads at once, stale summaries are built by one of them at a time
+static std::mutex lod_mutex;
+
+// lod_mutex must be held, returns new lod_state
+static int BuildNodeLOD(Node* n, int lev)
+{
+	int state = n->lod_state.load(std::memory_order_relaxed);
+	if (state)
+		return state;
+
+	Patch* s[4];
+	for (int i = 0; i < 4; i++)
 	{
-		Node* n = (Node*)q;
-		range >>= 1;
+		s[i] = 0;
+		if (n->quad[i])
+		{
+			if (lev > 1)
+			{
+				Node* c = (Node*)n->quad[i];
+				s[i] = BuildNodeLOD(c, lev - 1) == 1 ? c->lod : 0;
+			}
+			else
+				s[i] = (Patch*)n->quad[i];
+		}
 
-		if (hit == 4)
+		if (!s[i])
 		{
-			if (n->quad[0])
-				QueryTerrain(n->quad[0], x, y, range, view_flags, cb, cookie);
-			if (n->quad[1])
-				QueryTerrain(n->quad[1], x + range, y, range, view_flags, cb, cookie);
-			if (n->quad[2])
-				QueryTerrain(n->quad[2], x, y + range, range, view_flags, cb, cookie);
-			if (n->quad[3])
-				QueryTerrain(n->quad[3], x + range, y + range, range, view_flags, cb, cookie);
+			n->lod_state.store(2, std::memory_order_release);
+			return 2;
 		}
-		else
+	}
+
+	if (!n->lod)
+		n->lod = (Patch*)malloc(sizeof(Patch));
+
+	Patch* l = n->lod;
+	l->parent = n;
+	l->lo = n->lo;
+	l->hi = n->hi;
+	l->flags = n->flags;
+	l->diag = 0;
+#ifdef DARK_TERRAIN
+	l->dark = 0;
+#endif
+#ifdef TEXHEAP
+	l->ta = 0;
+#endif
+
+	static const int hh = HEIGHT_CELLS / 2;
+	static const int vh = VISUAL_CELLS / 2;
+
+	for (int i = 0; i < 4; i++)
+	{
+		int ox = i & 1, oy = i >> 1;
+
+		for (int y = 0; y <= hh; y++)
+			for (int x = 0; x <= hh; x++)
+				l->height[oy * hh + y][ox * hh + x] = s[i]->height[2 * y][2 * x];
+
+		for (int y = 0; y < hh; y++)
+			for (int x = 0; x < hh; x++)
+				if (s[i]->diag & (1 << (2 * y * HEIGHT_CELLS + 2 * x)))
+					l->diag |= 1 << ((oy * hh + y) * HEIGHT_CELLS + ox * hh + x);
+
+		for (int y = 0; y < vh; y++)
 		{
-			if (n->quad[0])
-				QueryTerrain(n->quad[0], x, y, range, xyr, view_flags, cb, cookie);
-			if (n->quad[1])
-				QueryTerrain(n->quad[1], x + range, y, range, xyr, view_flags, cb, cookie);
-			if (n->quad[2])
-				QueryTerrain(n->quad[2], x, y + range, range, xyr, view_flags, cb, cookie);
-			if (n->quad[3])
-				QueryTerrain(n->quad[3], x + range, y + range, range, xyr, view_flags, cb, cookie);
+			for (int x = 0; x < vh; x++)
+			{
+				l->visual[oy * vh + y][ox * vh + x] = s[i]->visual[2 * y][2 * x];
+#ifdef DARK_TERRAIN
+				if (s[i]->dark & ((uint64_t)1 << (2 * y * VISUAL_CELLS + 2 * x)))
+					l->dark |= (uint64_t)1 << ((oy * vh + y) * VISUAL_CELLS + ox * vh + x);
+#endif
+			}
 		}
 	}
+
+	n->lod_state.store(1, std::memory_order_release);
+	return 1;
 }
 
-void QueryTerrain(Terrain* t, double x, double y, double r, int view_flags, void(*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie)
+// returns patch sized summary of node at given level (0 is patch itself),
+// every other height, visual, dark and diag sample of its children, NULL if node has holes
+static Patch* GetNodeLOD(QuadItem* q, int lev)
 {
-	if (!t || !t->root)
-		return;
+	if (!lev)
+		return (Patch*)q;
 
-	if (r <= 0)
+	Node* n = (Node*)q;
+	int state = n->lod_state.load(std::memory_order_acquire);
+	if (!state)
+	{
+		std::lock_guard<std::mutex> lock(lod_mutex);
+		state = BuildNodeLOD(n, lev);
+	}
+
+	return state == 1 ? n->lod : 0;
+}
+
+// valid node has all descendants valid, others may hide stale ones below
+static void UpdateNodeLOD(Node* n, int lev)
+{
+	if (n->lod_state.load(std::memory_order_relaxed) == 1)
 		return;
 
-	double xyr[3] = { x,y,r };
+	if (lev > 1)
+	{
+		for (int i = 0; i < 4; i++)
+			if (n->quad[i])
+				UpdateNodeLOD((Node*)n->quad[i], lev - 1);
+	}
 
-	QueryTerrain(t->root, -t->x*VISUAL_CELLS, -t->y*VISUAL_CELLS, VISUAL_CELLS << t->level, xyr, view_flags & 0xAA, cb, cookie);
+	BuildNodeLOD(n, lev);
 }
 
-
-int triangle_intersections = 0; 
-int hit_patch_tests = 0;
-bool HitPatch(Patch* p, int x, int y, double ray[10], double ret[3], double nrm[3], bool positive_only)
+void UpdateTerrainLOD(Terrain* t)
 {
-	hit_patch_tests ++;
-	static const double sxy = (double)VISUAL_CELLS / (double)HEIGHT_CELLS;
-	bool hit = false;
+	if (!t || !t->root || t->level <= 0)
+		return;
 
-	int rot = p->diag;
+	std::lock_guard<std::mutex> lock(lod_mutex);
+	UpdateNodeLOD((Node*)t->root, t->level);
+}
 
-	for (int hy = 0; hy < HEIGHT_CELLS; hy++)
-	{
-		for (int hx = 0; hx < HEIGHT_CELLS; hx++)
-		{
-			double x0 = x + hx * sxy, x1 = x0 + sxy;
+// 2 plane sets in single walk, set with negative planes count is culled away
+// children are visited from near_quad so occlusion test can see what is in front
+static void QueryTerrain(QuadItem* q, int x, int y, int range, const int planes[2], double* plane[2][6], int view_flags, int near_quad, QueryTerrainCB* cb[2], void* cookie)
+{
+	int hi = q->hi;
+	int lo = q->lo;
+	int fl = view_flags & ~q->flags;
+
+	if (fl)
+		lo = 0;
+
+	int left[2] = { -1,-1 };
+	for (int s = 0; s < 2; s++)
+	{
+		if (planes[s] < 0)
+			continue;
+		left[s] = CullTerrain(x, y, range, lo, hi, planes[s], plane[s]);
+		if (left[s] >= 0 && cb[s]->occluded_cb && cb[s]->occluded_cb(x, y, range, lo, hi, cookie))
+			left[s] = -1;
+	}
+
+	if (range > VISUAL_CELLS)
+	{
+		for (int s = 0; s < 2; s++)
+		{
+			if (left[s] < 0 || !cb[s]->lod_cb || range > cb[s]->lod_range)
+				continue;
+
+			int lev = 0;
+			while ((VISUAL_CELLS << lev) < range)
+				lev++;
+
+			Patch* lod = GetNodeLOD(q, lev);
+			if (lod)
+			{
+				cb[s]->lod_cb(lod, x, y, range, fl, cookie);
+				left[s] = -1;
+			}
+		}
+	}
+
+	if (left[0] < 0 && left[1] < 0)
+		return;
+
+	if (range == VISUAL_CELLS)
+	{
+		for (int s = 0; s < 2; s++)
+		{
+			if (left[s] >= 0)
+				cb[s]->patch_cb((Patch*)q, x, y, fl, cookie);
+		}
+	}
+	else
+	{
+		Node* n = (Node*)q;
+
+		range >>= 1;
+
+		for (int i = 0; i < 4; i++)
+		{
+			int c = near_quad ^ i;
+			if (n->quad[c])
+				QueryTerrain(n->quad[c], x + (c & 1) * range, y + (c >> 1) * range, range, left, plane, view_flags, near_quad, cb, cookie);
+		}
+	}
+}
+
+void QueryTerrain(Terrain* t, int planes, double plane[][4], int view_flags, void(*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie)
+{
+	if (!t || !t->root)
+		return;
+
+	if (planes<=0)
+		QueryTerrain(t->root, -t->x*VISUAL_CELLS, -t->y*VISUAL_CELLS, VISUAL_CELLS << t->level, view_flags & 0xAA, cb, cookie);
+	else
+	{
+		double* pp[6] = { plane[0],plane[1],plane[2],plane[3],plane[4],plane[5] };
+		QueryTerrain(t->root, -t->x*VISUAL_CELLS, -t->y*VISUAL_CELLS, VISUAL_CELLS << t->level, planes, pp, view_flags & 0xAA, cb, cookie);
+	}
+}
+
+void QueryTerrain(Terrain* t, int planes, double plane[][4], double plane2[][4], int view_flags, int near_quad, QueryTerrainCB* cb[2], void* cookie)
+{
+	if (!t || !t->root)
+		return;
+
+	int pl[2] = { planes, planes };
+	double* pp[2][6] =
+	{
+		{ plane[0],plane[1],plane[2],plane[3],plane[4],plane[5] },
+		{ plane2[0],plane2[1],plane2[2],plane2[3],plane2[4],plane2[5] }
+	};
+	QueryTerrain(t->root, -t->x*VISUAL_CELLS, -t->y*VISUAL_CELLS, VISUAL_CELLS << t->level, pl, pp, view_flags & 0xAA, near_quad, cb, cookie);
+}
+
+
+void QueryTerrain(QuadItem* q, int x, int y, int range, const double xyr[3], int view_flags, void(*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie)
+{
+	int hit = 0;
+
+	double rr = xyr[2] * xyr[2];
+	double dx0 = xyr[0] - x; dx0 *= dx0;
+	double dy0 = xyr[1] - y; dy0 *= dy0;
+	double dx1 = xyr[0] - x - range; dx1 *= dx1;
+	double dy1 = xyr[1] - y - range; dy1 *= dy1;
+
+	if (dx0 + dy0 < rr) 
+		hit++;
+
+	if (dx1 + dy0 < rr)
+		hit++;
+
+	if (dx0 + dy1 < rr)
+		hit++;
+	
+	if (dx1 + dy1 < rr)
+		hit++;
+
+	if (!hit)
+	{
+		bool fit_x = xyr[0] >= x && xyr[0] <= x + range;
+		bool fit_y = xyr[1] >= y && xyr[1] <= y + range;
+
+		if (fit_y && xyr[0] >= x - xyr[2] && xyr[0] <= x + range + xyr[2] ||
+			fit_x && xyr[1] >= y - xyr[2] && xyr[1] <= y + range + xyr[2])
+		{
+			hit = 1;
+		}
+		else
+			return;
+	}
+
+	if (range == VISUAL_CELLS)
+	{
+		cb((Patch*)q, x, y, view_flags & ~q->flags, cookie);
+	}
+	else
+	{
+		Node* n = (Node*)q;
+		range >>= 1;
+
+		if (hit == 4)
+		{
+			if (n->quad[0])
+				QueryTerrain(n->quad[0], x, y, range, view_flags, cb, cookie);
+			if (n->quad[1])
+				QueryTerrain(n->quad[1], x + range, y, range, view_flags, cb, cookie);
+			if (n->quad[2])
+				QueryTerrain(n->quad[2], x, y + range, range, view_flags, cb, cookie);
+			if (n->quad[3])
+				QueryTerrain(n->quad[3], x + range, y + range, range, view_flags, cb, cookie);
+		}
+		else
+		{
+			if (n->quad[0])
+				QueryTerrain(n->quad[0], x, y, range, xyr, view_flags, cb, cookie);
+			if (n->quad[1])
+				QueryTerrain(n->quad[1], x + range, y, range, xyr, view_flags, cb, cookie);
+			if (n->quad[2])
+				QueryTerrain(n->quad[2], x, y + range, range, xyr, view_flags, cb, cookie);
+			if (n->quad[3])
+				QueryTerrain(n->quad[3], x + range, y + range, range, xyr, view_flags, cb, cookie);
+		}
+	}
+}
+
+void QueryTerrain(Terrain* t, double x, double y, double r, int view_flags, void(*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie)
+{
+	if (!t || !t->root)
+		return;
+
+	if (r <= 0)
+		return;
+
+	double xyr[3] = { x,y,r };
+
+	QueryTerrain(t->root, -t->x*VISUAL_CELLS, -t->y*VISUAL_CELLS, VISUAL_CELLS << t->level, xyr, view_flags & 0xAA, cb, cookie);
+}
+
+
+thread_local int triangle_intersections = 0; 
+thread_local int hit_patch_tests = 0;
+bool HitPatch(Patch* p, int x, int y, double ray[10], double ret[3], double nrm[3], bool positive_only)
+{
+	hit_patch_tests ++;
+	static const double sxy = (double)VISUAL_CELLS / (double)HEIGHT_CELLS;
+	bool hit = false;
+
+	int rot = p->diag;
+
+	for (int hy = 0; hy < HEIGHT_CELLS; hy++)
+	{
+		for (int hx = 0; hx < HEIGHT_CELLS; hx++)
+		{
+			double x0 = x + hx * sxy, x1 = x0 + sxy;
 			double y0 = y + hy * sxy, y1 = y0 + sxy;
 
 			double v[4][3] =
@@ -2439,10 +3164,106 @@ Patch* HitTerrain(Terrain* t, double p[3], double v[3], double ret[3], double nr
 	return patch;
 }
 
+struct HitTerrainRays
+{
+	RayPacket rp;
+	double ray[RAY_PACKET][10];
+	double (*ret)[3];
+	double (*nrm)[3];
+	Patch** patch;
+	int near_quad;
+	bool positive_only;
+};
+
+static void HitTerrainPacket(QuadItem* q, int x, int y, int range, int mask, HitTerrainRays* hr)
+{
+	double box[6] = { (double)x, (double)(x + range), (double)y, (double)(y + range), (double)q->lo, (double)q->hi };
+
+	// all triangles of a patch are inside its box, so lanes with nearer hit can skip it
+	double far[RAY_PACKET];
+	for (int i = 0; i < RAY_PACKET; i++)
+		far[i] = hr->ray[i][9];
+
+	mask = HitRayPacket(&hr->rp, mask, box, far, hr->positive_only);
+	if (!mask)
+		return;
+
+	if (range == VISUAL_CELLS)
+	{
+		Patch* p = (Patch*)q;
+		for (int i = 0; i < RAY_PACKET; i++)
+		{
+			if ((mask >> i) & 1)
+			{
+				if (HitPatch(p, x, y, hr->ray[i], hr->ret[i], hr->nrm ? hr->nrm[i] : 0, hr->positive_only))
+					hr->patch[i] = p;
+			}
+		}
+		return;
+	}
+
+	range >>= 1;
+	Node* n = (Node*)q;
+	for (int i = 0; i < 4; i++)
+	{
+		int c = i ^ hr->near_quad;
+		if (n->quad[c])
+			HitTerrainPacket(n->quad[c], x + (c & 1) * range, y + (c >> 1) * range, range, mask, hr);
+	}
+}
+
+int HitTerrain(Terrain* t, int rays, double p[][3], double v[][3], double ret[][3], double nrm[][3], Patch* patch[], bool positive_only)
+{
+	for (int i = 0; i < rays; i++)
+		patch[i] = 0;
+
+	if (!t || !t->root)
+		return 0;
+
+	hit_patch_tests = 0;
+	triangle_intersections = 0;
+
+	HitTerrainRays hr;
+	hr.positive_only = positive_only;
+
+	int hits = 0;
+	for (int first = 0; first < rays; first += RAY_PACKET)
+	{
+		int lanes = rays - first < RAY_PACKET ? rays - first : RAY_PACKET;
+
+		InitRayPacket(&hr.rp, lanes, p + first, v + first);
+		for (int i = 0; i < lanes; i++)
+		{
+			double* r = hr.ray[i];
+			const double* o = p[first + i];
+			const double* d = v[first + i];
+			r[0] = o[1] * d[2] - o[2] * d[1];
+			r[1] = o[2] * d[0] - o[0] * d[2];
+			r[2] = o[0] * d[1] - o[1] * d[0];
+			r[3] = d[0]; r[4] = d[1]; r[5] = d[2];
+			r[6] = o[0]; r[7] = o[1]; r[8] = o[2];
+			r[9] = FLT_MAX;
+		}
+
+		hr.ret = ret + first;
+		hr.nrm = nrm ? nrm + first : 0;
+		hr.patch = patch + first;
+
+		// rays are coherent, first one decides which children are visited first
+		hr.near_quad = (v[first][0] < 0 ? 1 : 0) | (v[first][1] < 0 ? 2 : 0);
+
+		HitTerrainPacket(t->root, -t->x*VISUAL_CELLS, -t->y*VISUAL_CELLS, VISUAL_CELLS << t->level, (1 << lanes) - 1, &hr);
+
+		for (int i = 0; i < lanes; i++)
+			hits += patch[first + i] != 0;
+	}
+
+	return hits;
+}
+
 size_t TerrainDetach(Terrain* t, Patch* p, int* px, int* py)
 {
-	int x, y;
-	GetTerrainPatch(t, p, &x, &y);
+	int x = p->x, y = p->y;
 
 	if (px)
 		*px = x;
@@ -2452,6 +3273,8 @@ size_t TerrainDetach(Terrain* t, Patch* p, int* px, int* py)
 	int flags = p->flags;
 	Node* n = p->parent;
 
+	HashDel(t, p);
+
 	/////////////
 	// free(p);
 	t->patches--;
@@ -2485,13 +3308,15 @@ size_t TerrainDetach(Terrain* t, Patch* p, int* px, int* py)
 		{
 			q = n;
 			n = n->parent;
-			free((Node*)q);
+			DeleteNode((Node*)q);
 			t->nodes--;
 		}
 		else
 			break;
 	}
 
+	StaleLOD(n);
+
 	// root trim
 
 	n = (Node*)t->root;
@@ -2523,7 +3348,7 @@ size_t TerrainDetach(Terrain* t, Patch* p, int* px, int* py)
 
 		t->root = n->quad[j];
 		t->root->parent = 0;
-		free(n);
+		DeleteNode(n);
 		t->nodes--;
 
 		if (t->level)
@@ -2558,6 +3383,12 @@ size_t TerrainDetach(Terrain* t, Patch* p, int* px, int* py)
 
 size_t TerrainAttach(Terrain* t, Patch* p, int x, int y)
 {
+	if (HashGet(t, x, y))
+		return 0;
+
+	p->x = x;
+	p->y = y;
+
 	if (!t->root)
 	{
 		t->x = -x;
@@ -2565,6 +3396,7 @@ size_t TerrainAttach(Terrain* t, Patch* p, int x, int y)
 		t->level = 0;
 
 		p->parent = 0;
+		HashAdd(t, p);
 
 		t->root = p;
 		t->patches = 1;
@@ -2581,7 +3413,7 @@ size_t TerrainAttach(Terrain* t, Patch* p, int x, int y)
 
 	while (x < 0)
 	{
-		Node* n = (Node*)malloc(sizeof(Node));
+		Node* n = CreateNode(t);
 		t->nodes++;
 
 		if (2 * y < range)
@@ -2627,7 +3459,7 @@ size_t TerrainAttach(Terrain* t, Patch* p, int x, int y)
 
 	while (y < 0)
 	{
-		Node* n = (Node*)malloc(sizeof(Node));
+		Node* n = CreateNode(t);
 		t->nodes++;
 
 		if (2 * x < range)
@@ -2673,7 +3505,7 @@ size_t TerrainAttach(Terrain* t, Patch* p, int x, int y)
 
 	while (x >= range)
 	{
-		Node* n = (Node*)malloc(sizeof(Node));
+		Node* n = CreateNode(t);
 		t->nodes++;
 
 		if (2 * y > range)
@@ -2713,7 +3545,7 @@ size_t TerrainAttach(Terrain* t, Patch* p, int x, int y)
 
 	while (y >= range)
 	{
-		Node* n = (Node*)malloc(sizeof(Node));
+		Node* n = CreateNode(t);
 		t->nodes++;
 
 		if (2 * x > range)
@@ -2771,7 +3603,7 @@ size_t TerrainAttach(Terrain* t, Patch* p, int x, int y)
 		{
 			if (!(Node*)n->quad[i])
 			{
-				Node* c = (Node*)malloc(sizeof(Node));
+				Node* c = CreateNode(t);
 				t->nodes++;
 
 				c->parent = n;
@@ -2793,6 +3625,7 @@ size_t TerrainAttach(Terrain* t, Patch* p, int x, int y)
 
 			n->quad[i] = p;
 			p->parent = n;
+			HashAdd(t, p);
 
 			UpdateNodes(p);
 
@@ -2818,7 +3651,7 @@ size_t TerrainDispose(Patch* p)
 	}
 #endif
 
-	free(p);
+	DeletePatch(p);
 
 	return sizeof(Patch);
 }
@@ -2830,9 +3663,10 @@ struct FileHeader
 	uint32_t file_sign;
 	uint32_t header_size;
 	uint32_t num_patches;
-	uint32_t reserved;
+	uint32_t reserved; // 0 in v1, version in later ones
 };
 
+// v1, patches in arbitrary order, everything else is recalculated by AddTerrainPatch() and Update*Map()
 struct FilePatch
 {
 	int32_t x,y; // 4
@@ -2841,70 +3675,566 @@ struct FilePatch
 	uint16_t diag; // 2
 };
 
-void SaveTree(FILE* f, int x, int y, int lev, const QuadItem* item)
+// v2, depth first quadtree nodes followed by 64 byte aligned table of patches in the same (Morton) order,
+// with lo/hi/flags/diag/dark exactly as they were in memory, so load is a single read (or mmap) and linear copy
+// v3 is the same but patch table has only headers, visual and height are packed into
+// variable size records (see PackPatch) stored after it in the same order
+// v4 (written since) adds light direction dark masks were baked with, so loading can skip the bake
+#define FILE_VERSION 4
+#define FILE_VERSION_PACKED 3
+#define FILE_VERSION_RAW 2
+#define FILE_ALIGN 64
+
+struct FileHeaderV2
 {
-	if (!lev)
-	{
-		const Patch* p = (const Patch*)item;
-		fwrite(&x,1,sizeof(int32_t),f);
-		fwrite(&y,1,sizeof(int32_t),f);
-		fwrite(p->visual,VISUAL_CELLS*VISUAL_CELLS,sizeof(uint16_t),f);
-		fwrite(p->height,(HEIGHT_CELLS+1)*(HEIGHT_CELLS+1),sizeof(uint16_t),f);
-		fwrite(&p->diag,1,sizeof(int16_t),f);
-		return;
-	}
+	FileHeader hdr; // header_size = sizeof(FileHeaderV2) (FILE_HEADER_V3_SIZE before v4), reserved = version
+	int32_t x, y; // terrain origin
+	int32_t level;
+	uint32_t num_nodes;
+	uint32_t node_offset; // all offsets are from hdr
+	uint32_t patch_offset;
+	uint32_t data_size; // whole terrain section
+	uint32_t blob_offset; // packed patches (v3), 0 in v2
+	float dark_light[3]; // v4, 0,0,0 if dark masks are not baked
+	uint32_t reserved;
+};
 
-	const Node* n = (const Node*)item;
-	lev--;
+#define FILE_HEADER_V3_SIZE offsetof(FileHeaderV2, dark_light)
 
-	int r = 1<<lev;
+struct FileNode
+{
+	uint16_t lo, hi;
+	uint16_t flags;
+	uint16_t quad; // bit per present child
+};
 
-	if (n->quad[0])
-		SaveTree(f,x,y,lev,n->quad[0]);
-	if (n->quad[1])
-		SaveTree(f,x+r,y,lev,n->quad[1]);
-	if (n->quad[2])
-		SaveTree(f,x,y+r,lev,n->quad[2]);
-	if (n->quad[3])
-		SaveTree(f,x+r,y+r,lev,n->quad[3]);
-}
+struct FilePatchHead
+{
+	int32_t x, y;
+	uint16_t lo, hi;
+	uint16_t flags;
+	uint16_t diag;
+	uint64_t dark;
+};
 
-bool SaveTerrain(const Terrain* t, FILE* f)
+struct FilePatchV2
 {
-	if (!t || !f)
-		return false;
+	FilePatchHead head;
+	uint16_t visual[VISUAL_CELLS][VISUAL_CELLS];
+	uint16_t height[HEIGHT_CELLS + 1][HEIGHT_CELLS + 1];
+};
 
-	FileHeader hdr =
-	{
-		*(uint32_t*)"AS3D",
-		(uint32_t)sizeof(FileHeader),
-		(uint32_t)t->patches,
-		(uint32_t)0
-	};
+struct FilePackedPatch
+{
+	FilePatchHead head;
+	uint32_t offset; // from blob_offset
+	uint32_t size;
+};
 
-	fwrite(&hdr,1,sizeof(FileHeader),f);
+// visual is a palette of distinct cells in order of appearance followed by 1/2/4/8 bit indices
+// (or raw cells if that's not smaller), height is predicted from left, up and up-left samples
+// (left + up - upleft) with residuals stored as zigzag varints, so smooth slopes take a byte per sample
+#define PACK_CELLS (VISUAL_CELLS * VISUAL_CELLS)
+#define PACK_SAMPLES ((HEIGHT_CELLS + 1) * (HEIGHT_CELLS + 1))
+#define PACK_MAX (1 + 2 * PACK_CELLS + 3 * PACK_SAMPLES)
 
-	if (t->root)
-		SaveTree(f, -t->x, -t->y, t->level,t->root);
+static inline int PackBits(int colors)
+{
+	return colors <= 1 ? 0 : colors <= 2 ? 1 : colors <= 4 ? 2 : colors <= 16 ? 4 : 8;
+}
 
-	return true;
+static inline int PackPredict(const uint16_t h[][HEIGHT_CELLS + 1], int x, int y)
+{
+	if (x && y)
+		return h[y][x - 1] + h[y - 1][x] - h[y - 1][x - 1];
+	return x ? h[y][x - 1] : y ? h[y - 1][x] : 0;
 }
 
-Terrain* LoadTerrain(FILE* f)
+static int PackPatch(uint8_t* dst, const Patch* p)
 {
-	if (!f)
-		return 0;
+	uint8_t* out = dst;
 
-	FileHeader hdr;
-	if (fread(&hdr,1,sizeof(FileHeader),f)!=sizeof(FileHeader))
+	const uint16_t* v = &p->visual[0][0];
+	uint16_t pal[PACK_CELLS];
+	uint8_t idx[PACK_CELLS];
+	int colors = 0;
+	for (int i = 0; i < PACK_CELLS; i++)
 	{
-		return 0;
+		int j = 0;
+		while (j < colors && pal[j] != v[i])
+			j++;
+		if (j == colors)
+			pal[colors++] = v[i];
+		idx[i] = j;
 	}
 
-	if (hdr.file_sign != *(uint32_t*)"AS3D" ||
-		hdr.header_size != sizeof(FileHeader))
+	int bits = PackBits(colors);
+	if (2 * colors + PACK_CELLS * bits / 8 < 2 * PACK_CELLS)
 	{
-		return 0;
+		*out++ = colors;
+		memcpy(out, pal, 2 * colors);
+		out += 2 * colors;
+		if (bits)
+		{
+			for (int i = 0; i < PACK_CELLS; )
+			{
+				int acc = 0;
+				for (int k = 0; k < 8; k += bits)
+					acc |= idx[i++] << k;
+				*out++ = acc;
+			}
+		}
+	}
+	else
+	{
+		*out++ = 0;
+		memcpy(out, v, 2 * PACK_CELLS);
+		out += 2 * PACK_CELLS;
+	}
+
+	for (int y = 0; y <= HEIGHT_CELLS; y++)
+	{
+		for (int x = 0; x <= HEIGHT_CELLS; x++)
+		{
+			int16_t d = (int16_t)(p->height[y][x] - PackPredict(p->height, x, y));
+			unsigned z = (uint16_t)(((unsigned)d << 1) ^ (d >> 15));
+			while (z >= 0x80)
+			{
+				*out++ = z | 0x80;
+				z >>= 7;
+			}
+			*out++ = z;
+		}
+	}
+
+	return (int)(out - dst);
+}
+
+static bool UnpackPatch(Patch* p, const uint8_t* src, size_t size)
+{
+	const uint8_t* end = src + size;
+	if (src == end)
+		return false;
+
+	uint16_t* v = &p->visual[0][0];
+	int colors = *src++;
+	if (!colors)
+	{
+		if ((size_t)(end - src) < 2 * PACK_CELLS)
+			return false;
+		memcpy(v, src, 2 * PACK_CELLS);
+		src += 2 * PACK_CELLS;
+	}
+	else
+	{
+		int bits = PackBits(colors);
+		if (colors > PACK_CELLS || (size_t)(end - src) < (size_t)(2 * colors + PACK_CELLS * bits / 8))
+			return false;
+
+		uint16_t pal[PACK_CELLS];
+		memcpy(pal, src, 2 * colors);
+		src += 2 * colors;
+
+		if (!bits)
+		{
+			for (int i = 0; i < PACK_CELLS; i++)
+				v[i] = pal[0];
+		}
+		else
+		{
+			int mask = (1 << bits) - 1;
+			for (int i = 0; i < PACK_CELLS; )
+			{
+				int acc = *src++;
+				for (int k = 0; k < 8; k += bits)
+				{
+					int j = (acc >> k) & mask;
+					if (j >= colors)
+						return false;
+					v[i++] = pal[j];
+				}
+			}
+		}
+	}
+
+	for (int y = 0; y <= HEIGHT_CELLS; y++)
+	{
+		for (int x = 0; x <= HEIGHT_CELLS; x++)
+		{
+			unsigned z = 0;
+			for (int shift = 0; ; shift += 7)
+			{
+				if (src == end || shift > 14)
+					return false;
+				int b = *src++;
+				z |= (b & 0x7F) << shift;
+				if (!(b & 0x80))
+					break;
+			}
+			int d = (int)(z >> 1) ^ -(int)(z & 1);
+			p->height[y][x] = (uint16_t)(PackPredict(p->height, x, y) + d);
+		}
+	}
+
+	return src == end;
+}
+
+struct PackBuf
+{
+	uint8_t* data;
+	size_t size;
+	size_t alloc;
+};
+
+static uint8_t* PackGrow(PackBuf* b, size_t n)
+{
+	if (b->size + n > b->alloc)
+	{
+		b->alloc = b->alloc ? 2 * b->alloc : 4096;
+		if (b->alloc < b->size + n)
+			b->alloc = b->size + n;
+		b->data = (uint8_t*)realloc(b->data, b->alloc);
+	}
+	uint8_t* ptr = b->data + b->size;
+	b->size += n;
+	return ptr;
+}
+
+static void PackNodes(PackBuf* b, int lev, const QuadItem* item)
+{
+	if (!lev)
+		return;
+
+	const Node* n = (const Node*)item;
+	FileNode* fn = (FileNode*)PackGrow(b, sizeof(FileNode));
+	fn->lo = n->lo;
+	fn->hi = n->hi;
+	fn->flags = n->flags;
+	fn->quad = 0;
+	for (int i = 0; i < 4; i++)
+		if (n->quad[i])
+			fn->quad |= 1 << i;
+
+	for (int i = 0; i < 4; i++)
+		if (n->quad[i])
+			PackNodes(b, lev - 1, n->quad[i]);
+}
+
+// patch headers go to head, packed visual and height to blob
+static void PackPatches(PackBuf* head, PackBuf* blob, int lev, const QuadItem* item)
+{
+	if (!lev)
+	{
+		const Patch* p = (const Patch*)item;
+		FilePackedPatch* fp = (FilePackedPatch*)PackGrow(head, sizeof(FilePackedPatch));
+		memset(fp, 0, sizeof(FilePackedPatch));
+		fp->head.x = p->x;
+		fp->head.y = p->y;
+		fp->head.lo = p->lo;
+		fp->head.hi = p->hi;
+		fp->head.flags = p->flags;
+		fp->head.diag = p->diag;
+#ifdef DARK_TERRAIN
+		fp->head.dark = p->dark;
+#endif
+		fp->offset = (uint32_t)blob->size;
+		fp->size = PackPatch(PackGrow(blob, PACK_MAX), p);
+		blob->size = fp->offset + fp->size;
+		return;
+	}
+
+	const Node* n = (const Node*)item;
+	for (int i = 0; i < 4; i++)
+		if (n->quad[i])
+			PackPatches(head, blob, lev - 1, n->quad[i]);
+}
+
+bool SaveTerrain(const Terrain* t, FILE* f)
+{
+	if (!t || !f)
+		return false;
+
+	PackBuf node = {}, head = {}, blob = {};
+	if (t->root)
+	{
+		PackNodes(&node, t->level, t->root);
+		PackPatches(&head, &blob, t->level, t->root);
+	}
+
+	uint32_t node_offset = sizeof(FileHeaderV2);
+	uint32_t patch_offset = (node_offset + (uint32_t)node.size + FILE_ALIGN - 1) & ~(FILE_ALIGN - 1);
+	uint32_t blob_offset = patch_offset + (uint32_t)head.size;
+
+	FileHeaderV2 hdr =
+	{
+		{
+			*(uint32_t*)"AS3D",
+			(uint32_t)sizeof(FileHeaderV2),
+			(uint32_t)(head.size / sizeof(FilePackedPatch)),
+			(uint32_t)FILE_VERSION
+		},
+		t->x, t->y,
+		t->level,
+		(uint32_t)(node.size / sizeof(FileNode)),
+		node_offset,
+		patch_offset,
+		(uint32_t)(blob_offset + blob.size),
+		blob_offset,
+		{ t->dark_light[0], t->dark_light[1], t->dark_light[2] },
+		0
+	};
+
+	fwrite(&hdr,1,sizeof(FileHeaderV2),f);
+	fwrite(node.data, 1, node.size, f);
+
+	static const uint8_t pad[FILE_ALIGN] = { 0 };
+	fwrite(pad, 1, patch_offset - node_offset - node.size, f);
+
+	fwrite(head.data, 1, head.size, f);
+	fwrite(blob.data, 1, blob.size, f);
+
+	free(node.data);
+	free(head.data);
+	free(blob.data);
+	return true;
+}
+
+struct FileTree
+{
+	Terrain* t;
+	const FileNode* node;
+	const FileNode* node_end;
+	const char* patch; // FilePatchV2 or FilePackedPatch records
+	const char* patch_end;
+	const uint8_t* blob; // packed records data, 0 if patches are raw
+	uint64_t blob_first; // offset of blob data (from blob_offset), for partially read tables
+	uint64_t blob_size;
+
+	QuadItem* Load(int lev)
+	{
+		if (!lev)
+		{
+			if (patch == patch_end)
+				return 0;
+
+			const FilePatchHead* fh = (const FilePatchHead*)patch;
+			Patch* p = CreatePatch(t);
+
+			if (blob)
+			{
+				const FilePackedPatch* fp = (const FilePackedPatch*)patch;
+				patch += sizeof(FilePackedPatch);
+				if (fp->offset < blob_first || fp->offset - blob_first + fp->size > blob_size ||
+					!UnpackPatch(p, blob + (fp->offset - blob_first), fp->size))
+				{
+					DeletePatch(p);
+					return 0;
+				}
+			}
+			else
+			{
+				const FilePatchV2* fp = (const FilePatchV2*)patch;
+				patch += sizeof(FilePatchV2);
+				memcpy(p->visual, fp->visual, sizeof(p->visual));
+				memcpy(p->height, fp->height, sizeof(p->height));
+			}
+
+			p->lo = fh->lo;
+			p->hi = fh->hi;
+			p->flags = fh->flags;
+			p->diag = fh->diag;
+#ifdef DARK_TERRAIN
+			p->dark = fh->dark;
+#endif
+			p->x = fh->x;
+			p->y = fh->y;
+			HashAdd(t, p);
+			t->patches++;
+
+#ifdef TEXHEAP
+			TexData data[2] =
+			{
+				{GL_RED_INTEGER, GL_UNSIGNED_SHORT, p->height},
+				{GL_RED_INTEGER, GL_UNSIGNED_SHORT, p->visual},
+			};
+			p->ta = t->th.Alloc(data);
+			p->ta->user = p;
+#endif
+			return p;
+		}
+
+		if (node == node_end)
+			return 0;
+
+		const FileNode* fn = node++;
+		Node* n = CreateNode(t);
+		t->nodes++;
+		n->lo = fn->lo;
+		n->hi = fn->hi;
+		n->flags = fn->flags;
+
+		for (int i = 0; i < 4; i++)
+		{
+			n->quad[i] = 0;
+			if (fn->quad & (1 << i))
+			{
+				n->quad[i] = Load(lev - 1);
+				if (!n->quad[i])
+					return 0; // truncated, orphans go with terrain slabs
+				n->quad[i]->parent = n;
+			}
+		}
+
+		return n;
+	}
+};
+
+static bool IsHeaderV2(const FileHeader* h)
+{
+	return
+		h->file_sign == *(uint32_t*)"AS3D" &&
+		(h->reserved == FILE_VERSION ?
+			h->header_size == sizeof(FileHeaderV2) :
+			(h->reserved == FILE_VERSION_PACKED || h->reserved == FILE_VERSION_RAW) &&
+			h->header_size == FILE_HEADER_V3_SIZE);
+}
+
+// reads rest of header after h, older ones are zero extended
+static bool ReadHeaderV2(FILE* f, const FileHeader* h, FileHeaderV2* hdr)
+{
+	if (!IsHeaderV2(h))
+		return false;
+
+	memset(hdr, 0, sizeof(FileHeaderV2));
+	hdr->hdr = *h;
+	size_t rest = h->header_size - sizeof(FileHeader);
+	if (fread((char*)hdr + sizeof(FileHeader), 1, rest, f) != rest)
+		return false;
+
+	return
+		hdr->node_offset >= h->header_size &&
+		hdr->patch_offset >= hdr->node_offset + (uint64_t)hdr->num_nodes * sizeof(FileNode) &&
+		(h->reserved == FILE_VERSION_RAW ?
+			hdr->blob_offset == 0 &&
+			hdr->data_size == hdr->patch_offset + (uint64_t)h->num_patches * sizeof(FilePatchV2) :
+			hdr->blob_offset == hdr->patch_offset + (uint64_t)h->num_patches * sizeof(FilePackedPatch) &&
+			hdr->data_size >= hdr->blob_offset) &&
+		hdr->level >= (h->num_patches ? 0 : -1) && hdr->level <= 30;
+}
+
+static Terrain* LoadTerrainV2(FILE* f, const FileHeader* h)
+{
+	long pos = ftell(f) - (long)sizeof(FileHeader);
+
+	FileHeaderV2 hdr;
+	if (!ReadHeaderV2(f, h, &hdr))
+		return 0;
+
+	// map (or read) whole section at once
+	const char* data = 0;
+	void* map = 0;
+	size_t map_size = 0;
+
+#ifdef TERRAIN_MMAP
+	struct stat st;
+	if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode))
+	{
+		// mapping past the end would fault
+		if (st.st_size < pos + (off_t)hdr.data_size)
+			return 0;
+
+		long page = sysconf(_SC_PAGESIZE);
+		long base = pos & ~(page - 1);
+		map_size = pos + hdr.data_size - base;
+		map = mmap(0, map_size, PROT_READ, MAP_PRIVATE, fileno(f), base);
+		if (map == MAP_FAILED)
+			map = 0;
+		else
+			data = (const char*)map + (pos - base);
+	}
+#endif
+
+	char* buf = 0;
+	if (!data)
+	{
+		buf = (char*)malloc(hdr.data_size);
+		fseek(f, pos, SEEK_SET);
+		if (fread(buf, 1, hdr.data_size, f) != hdr.data_size)
+		{
+			free(buf);
+			return 0;
+		}
+		data = buf;
+	}
+
+	fseek(f, pos + hdr.data_size, SEEK_SET);
+
+	Terrain* t = CreateTerrain();
+
+	if (hdr.hdr.num_patches)
+	{
+		FileTree tree =
+		{
+			t,
+			(const FileNode*)(data + hdr.node_offset),
+			(const FileNode*)(data + hdr.node_offset) + hdr.num_nodes,
+			data + hdr.patch_offset,
+			data + hdr.patch_offset + hdr.hdr.num_patches * (hdr.blob_offset ? sizeof(FilePackedPatch) : sizeof(FilePatchV2)),
+			hdr.blob_offset ? (const uint8_t*)data + hdr.blob_offset : 0,
+			0,
+			hdr.data_size - hdr.blob_offset
+		};
+
+		t->x = hdr.x;
+		t->y = hdr.y;
+		t->level = hdr.level;
+		t->root = tree.Load(hdr.level);
+		memcpy(t->dark_light, hdr.dark_light, sizeof(t->dark_light));
+
+		if (!t->root || tree.patch != tree.patch_end || tree.node != tree.node_end)
+		{
+			if (!t->root)
+				t->level = -1;
+			DeleteTerrain(t);
+			t = 0;
+		}
+		else
+			t->root->parent = 0;
+	}
+
+#ifdef TERRAIN_MMAP
+	if (map)
+		munmap(map, map_size);
+#endif
+	free(buf);
+
+	return t;
+}
+
+Terrain* LoadTerrain(FILE* f)
+{
+	if (!f)
+		return 0;
+
+	FileHeader hdr;
+	if (fread(&hdr,1,sizeof(FileHeader),f)!=sizeof(FileHeader))
+	{
+		return 0;
+	}
+
+	if (hdr.file_sign != *(uint32_t*)"AS3D")
+		return 0;
+
+	if (IsHeaderV2(&hdr))
+	{
+		Terrain* t = LoadTerrainV2(f, &hdr);
+		UpdateTerrainLOD(t);
+		return t;
+	}
+
+	if (hdr.header_size != sizeof(FileHeader))
+	{
+		return 0;
 	}
 
 	Terrain* t = CreateTerrain();
@@ -2928,5 +4258,661 @@ Terrain* LoadTerrain(FILE* f)
 		p->diag = pch.diag;
 	}
 
+	CompactTerrain(t);
+	UpdateTerrainLOD(t);
+
+	return t;
+}
+
+// streaming (v2 and v3 files only): patches are loaded in regions, whole subtrees at TERRAIN_REGION_LEVEL,
+// nodes above them (region roots included) are always resident, so culling by lo/hi still works
+// and non-resident regions are just empty to all queries
+
+#define TERRAIN_REGION_LEVEL 4 // 16x16 patches
+
+uint64_t GetTerrainRevision(Terrain* t)
+{
+	return t->revision;
+}
+
+#ifdef TERRAIN_STREAMING
+
+enum REGION_STATE
+{
+	REGION_OUT,
+	REGION_LOADING, // queued or being read by loader thread
+	REGION_LOADED, // data is ready to be linked
+	REGION_RESIDENT,
+	REGION_COLD, // evicted but kept packed in data
+};
+
+struct TerrainRegion
+{
+	uint64_t key; // Morton code of region coords, regions are sorted by it
+	Node* root;
+	uint32_t node_first, nodes; // in file node table, root included
+	uint32_t patch_first, patches; // in file patch table
+	int state;
+	uint64_t used; // last update which wanted it, for LRU
+	uint64_t seen; // last update which found it around given positions (wanted or not)
+	int seen_req; // its request in that update
+	char* data; // node records, patch records, packed patches (if any)
+	uint32_t data_nodes, data_patches; // cold data may differ from file
+	bool packed;
+	uint64_t blob_first, blob_size; // packed patches in data, offsets are relative to blob_first
+};
+
+struct TerrainStream
+{
+	int fd;
+	long pos; // terrain section in fd
+	FileHeaderV2 hdr;
+
+	int regions;
+	int regions_size;
+	TerrainRegion* region;
+
+	int budget; // max resident regions
+	int residents;
+	int* resident; // [regions]
+	int cold_budget; // max evicted regions kept packed
+	int colds;
+	uint64_t update;
+
+	// loader thread, everything below is guarded by mu (and region states)
+	std::thread thread;
+	std::mutex mu;
+	std::condition_variable wake;
+	std::condition_variable done;
+	bool quit;
+	int* queue; // ring of [regions+1]
+	int queue_head, queue_tail;
+	int loading;
+};
+
+static void StreamLoop(TerrainStream* s)
+{
+	std::unique_lock<std::mutex> lock(s->mu);
+	while (true)
+	{
+		s->wake.wait(lock, [s] { return s->quit || s->queue_head != s->queue_tail; });
+		if (s->quit)
+			return;
+
+		TerrainRegion* r = s->region + s->queue[s->queue_head];
+		s->queue_head = (s->queue_head + 1) % (s->regions + 1);
+		lock.unlock();
+
+		bool packed = s->hdr.blob_offset != 0;
+		size_t stride = packed ? sizeof(FilePackedPatch) : sizeof(FilePatchV2);
+		size_t nb = r->nodes * sizeof(FileNode);
+		size_t pb = r->patches * stride;
+		char* data = (char*)malloc(nb + pb);
+		bool ok =
+			pread(s->fd, data, nb, s->pos + s->hdr.node_offset + r->node_first * sizeof(FileNode)) == (ssize_t)nb &&
+			pread(s->fd, data + nb, pb, s->pos + s->hdr.patch_offset + r->patch_first * stride) == (ssize_t)pb;
+
+		// packed data of region's patches is contiguous
+		uint64_t first = 0, size = 0;
+		if (ok && packed && r->patches)
+		{
+			const FilePackedPatch* fp = (const FilePackedPatch*)(data + nb);
+			first = fp[0].offset;
+			uint64_t last = (uint64_t)fp[r->patches - 1].offset + fp[r->patches - 1].size;
+			ok = last >= first && s->hdr.blob_offset + last <= s->hdr.data_size;
+			if (ok)
+			{
+				size = last - first;
+				data = (char*)realloc(data, nb + pb + size);
+				ok = pread(s->fd, data + nb + pb, size, s->pos + s->hdr.blob_offset + first) == (ssize_t)size;
+			}
+		}
+
+		if (!ok)
+		{
+			// region stays empty
+			free(data);
+			data = 0;
+		}
+
+		lock.lock();
+		r->data = data;
+		r->data_nodes = r->nodes;
+		r->data_patches = r->patches;
+		r->packed = packed;
+		r->blob_first = first;
+		r->blob_size = size;
+		r->state = REGION_LOADED;
+		s->loading--;
+		s->done.notify_all();
+	}
+}
+
+static void CloseStream(TerrainStream* s)
+{
+	if (s->thread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(s->mu);
+			s->quit = true;
+		}
+		s->wake.notify_all();
+		s->thread.join();
+	}
+
+	if (s->fd >= 0)
+		close(s->fd);
+
+	for (int i = 0; i < s->regions; i++)
+		free(s->region[i].data);
+	free(s->region);
+	free(s->resident);
+	free(s->queue);
+
+	s->~TerrainStream();
+	free(s);
+}
+
+// counts nodes and patches of subtree below given record
+static bool SkipNodes(const FileNode* fn, uint32_t nodes, uint32_t* ni, uint32_t* pi, const FileNode* n, int lev)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		if (!(n->quad & (1 << i)))
+			continue;
+
+		if (lev == 1)
+			(*pi)++;
+		else
+		{
+			if (*ni == nodes)
+				return false;
+			const FileNode* c = fn + (*ni)++;
+			if (!SkipNodes(fn, nodes, ni, pi, c, lev - 1))
+				return false;
+		}
+	}
+	return true;
+}
+
+// builds always resident nodes from root down to region roots, x,y are node origin in patches
+static Node* StreamSkeleton(Terrain* t, const FileNode* fn, uint32_t* ni, uint32_t* pi, int lev, int x, int y)
+{
+	TerrainStream* s = t->stream;
+	if (*ni == s->hdr.num_nodes)
+		return 0;
+
+	uint32_t first = (*ni)++;
+	const FileNode* f = fn + first;
+
+	Node* n = CreateNode(t);
+	t->nodes++;
+	n->lo = f->lo;
+	n->hi = f->hi;
+	n->flags = f->flags;
+	n->quad[0] = n->quad[1] = n->quad[2] = n->quad[3] = 0;
+
+	if (lev == TERRAIN_REGION_LEVEL)
+	{
+		uint32_t patch_first = *pi;
+		if (!SkipNodes(fn, s->hdr.num_nodes, ni, pi, f, lev))
+			return 0;
+
+		if (s->regions == s->regions_size)
+		{
+			s->regions_size = s->regions_size ? 2 * s->regions_size : 64;
+			s->region = (TerrainRegion*)realloc(s->region, sizeof(TerrainRegion) * s->regions_size);
+		}
+
+		TerrainRegion* r = s->region + s->regions++;
+		r->key = MortonKey(x >> TERRAIN_REGION_LEVEL, y >> TERRAIN_REGION_LEVEL);
+		r->root = n;
+		r->node_first = first;
+		r->nodes = *ni - first;
+		r->patch_first = patch_first;
+		r->patches = *pi - patch_first;
+		r->state = REGION_OUT;
+		r->used = 0;
+		r->seen = 0;
+		r->data = 0;
+		return n;
+	}
+
+	int hr = 1 << (lev - 1);
+	for (int i = 0; i < 4; i++)
+	{
+		if (f->quad & (1 << i))
+		{
+			Node* c = StreamSkeleton(t, fn, ni, pi, lev - 1, x + (i & 1) * hr, y + (i >> 1) * hr);
+			if (!c)
+				return 0;
+			n->quad[i] = c;
+			c->parent = n;
+		}
+	}
+
+	return n;
+}
+
+Terrain* StreamTerrain(FILE* f, int budget, int cold, const float lightpos[3])
+{
+	if (!f)
+		return 0;
+
+	long pos = ftell(f);
+	FileHeader h;
+	FileHeaderV2 hdr;
+	if (fread(&h, 1, sizeof(FileHeader), f) != sizeof(FileHeader) ||
+		!ReadHeaderV2(f, &h, &hdr) || hdr.level <= TERRAIN_REGION_LEVEL)
+	{
+		// v1 or too small to be worth it
+		fseek(f, pos, SEEK_SET);
+		return LoadTerrain(f);
+	}
+
+	#ifdef DARK_TERRAIN
+	// regions are linked long after bake, their masks must already match the light
+	if (lightpos && (!(hdr.dark_light[0] || hdr.dark_light[1] || hdr.dark_light[2]) ||
+		hdr.dark_light[0] != lightpos[0] || hdr.dark_light[1] != lightpos[1] || hdr.dark_light[2] != lightpos[2]))
+	{
+		fseek(f, pos, SEEK_SET);
+		return LoadTerrain(f);
+	}
+	#endif
+
+	FileNode* fn = (FileNode*)malloc(sizeof(FileNode) * hdr.num_nodes);
+	fseek(f, pos + hdr.node_offset, SEEK_SET);
+	if (fread(fn, sizeof(FileNode), hdr.num_nodes, f) != hdr.num_nodes)
+	{
+		free(fn);
+		return 0;
+	}
+
+	Terrain* t = CreateTerrain();
+
+	TerrainStream* s = new (malloc(sizeof(TerrainStream))) TerrainStream();
+	t->stream = s;
+	s->fd = -1;
+	s->pos = pos;
+	s->hdr = hdr;
+	s->regions = 0;
+	s->regions_size = 0;
+	s->region = 0;
+	s->budget = budget > 0 ? budget : 1;
+	s->residents = 0;
+	s->resident = 0;
+	s->cold_budget = cold > 0 ? cold : 0;
+	s->colds = 0;
+	s->update = 0;
+	s->quit = false;
+	s->queue = 0;
+	s->queue_head = 0;
+	s->queue_tail = 0;
+	s->loading = 0;
+
+	uint32_t ni = 0, pi = 0;
+	t->x = hdr.x;
+	t->y = hdr.y;
+	t->level = hdr.level;
+	memcpy(t->dark_light, hdr.dark_light, sizeof(t->dark_light));
+	t->root = StreamSkeleton(t, fn, &ni, &pi, hdr.level, 0, 0);
+	free(fn);
+
+	if (!t->root || ni != hdr.num_nodes || pi != hdr.hdr.num_patches)
+	{
+		DeleteTerrain(t);
+		return 0;
+	}
+
+	t->root->parent = 0;
+
+	s->resident = (int*)malloc(sizeof(int) * s->regions);
+	s->queue = (int*)malloc(sizeof(int) * (s->regions + 1));
+	s->fd = dup(fileno(f));
+	s->thread = std::thread(StreamLoop, s);
+
+	fseek(f, pos + hdr.data_size, SEEK_SET);
 	return t;
 }
+
+static int FindRegion(const TerrainStream* s, uint64_t key)
+{
+	int lo = 0, hi = s->regions;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) >> 1;
+		if (s->region[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < s->regions && s->region[lo].key == key ? lo : -1;
+}
+
+static void LinkRegion(Terrain* t, TerrainRegion* r)
+{
+	if (r->data)
+	{
+		const FileNode* fn = (const FileNode*)r->data;
+		const char* fp = r->data + r->data_nodes * sizeof(FileNode);
+		const char* fp_end = fp + r->data_patches * (r->packed ? sizeof(FilePackedPatch) : sizeof(FilePatchV2));
+		FileTree tree =
+		{
+			t,
+			fn + 1, fn + r->data_nodes,
+			fp, fp_end,
+			r->packed ? (const uint8_t*)fp_end : 0,
+			r->blob_first, r->blob_size
+		};
+
+		for (int i = 0; i < 4; i++)
+		{
+			if (fn->quad & (1 << i))
+			{
+				QuadItem* q = tree.Load(TERRAIN_REGION_LEVEL - 1);
+				if (!q)
+					break;
+				r->root->quad[i] = q;
+				q->parent = r->root;
+			}
+		}
+
+		free(r->data);
+		r->data = 0;
+	}
+
+	r->state = REGION_RESIDENT;
+	t->stream->resident[t->stream->residents++] = (int)(r - t->stream->region);
+	StaleLOD(r->root);
+	t->revision++;
+}
+
+static void FreeTree(Terrain* t, QuadItem* q, int lev)
+{
+	if (!lev)
+	{
+		HashDel(t, (Patch*)q);
+		DeletePatch((Patch*)q);
+		t->patches--;
+		return;
+	}
+
+	Node* n = (Node*)q;
+	for (int i = 0; i < 4; i++)
+		if (n->quad[i])
+			FreeTree(t, n->quad[i], lev - 1);
+	DeleteNode(n);
+	t->nodes--;
+}
+
+static void EvictRegion(Terrain* t, int res)
+{
+	TerrainStream* s = t->stream;
+	TerrainRegion* r = s->region + s->resident[res];
+	s->resident[res] = s->resident[--s->residents];
+
+	if (s->cold_budget)
+	{
+		// keep it packed (with edits), bringing it back is just unpacking
+		PackBuf node = {}, head = {}, blob = {};
+		PackNodes(&node, TERRAIN_REGION_LEVEL, r->root);
+		PackPatches(&head, &blob, TERRAIN_REGION_LEVEL, r->root);
+
+		r->data = (char*)malloc(node.size + head.size + blob.size);
+		memcpy(r->data, node.data, node.size);
+		memcpy(r->data + node.size, head.data, head.size);
+		memcpy(r->data + node.size + head.size, blob.data, blob.size);
+		r->data_nodes = (uint32_t)(node.size / sizeof(FileNode));
+		r->data_patches = (uint32_t)(head.size / sizeof(FilePackedPatch));
+		r->packed = true;
+		r->blob_first = 0;
+		r->blob_size = blob.size;
+
+		free(node.data);
+		free(head.data);
+		free(blob.data);
+	}
+
+	for (int i = 0; i < 4; i++)
+	{
+		if (r->root->quad[i])
+		{
+			FreeTree(t, r->root->quad[i], TERRAIN_REGION_LEVEL - 1);
+			r->root->quad[i] = 0;
+		}
+	}
+
+	if (r->data)
+	{
+		r->state = REGION_COLD;
+		s->colds++;
+	}
+	else
+		r->state = REGION_OUT;
+
+	StaleLOD(r->root);
+	t->revision++;
+}
+
+static void DropColdRegion(TerrainStream* s)
+{
+	TerrainRegion* lru = 0;
+	for (int i = 0; i < s->regions; i++)
+	{
+		TerrainRegion* r = s->region + i;
+		if (r->state == REGION_COLD && (!lru || r->used < lru->used))
+			lru = r;
+	}
+
+	free(lru->data);
+	lru->data = 0;
+	lru->state = REGION_OUT;
+	s->colds--;
+}
+
+struct RegionRequest
+{
+	int region;
+	float dist;
+};
+
+static int CompareRequest(const void* a, const void* b)
+{
+	float da = ((const RegionRequest*)a)->dist;
+	float db = ((const RegionRequest*)b)->dist;
+	if (da != db)
+		return da < db ? -1 : 1;
+	return ((const RegionRequest*)a)->region - ((const RegionRequest*)b)->region;
+}
+
+int UpdateTerrainStreaming(Terrain* t, int positions, const float pos[][2], float radius, bool wait)
+{
+	TerrainStream* s = t ? t->stream : 0;
+	if (!s)
+		return 0;
+
+	// loader only flips LOADING to LOADED, but hold the lock while looking at states anyway
+	std::unique_lock<std::mutex> lock(s->mu);
+	s->update++;
+
+	// want every region touching circles around given positions, request missing ones nearest first
+	int regions = 1 << (t->level - TERRAIN_REGION_LEVEL);
+	float size = (float)(VISUAL_CELLS << TERRAIN_REGION_LEVEL);
+	float ox = (float)(t->x * VISUAL_CELLS);
+	float oy = (float)(t->y * VISUAL_CELLS);
+
+	// view may reach horizon, no need to go beyond whole map
+	if (!(radius < 2 * regions * size))
+		radius = 2 * regions * size;
+
+	RegionRequest* req = 0;
+	int reqs = 0, reqs_size = 0;
+
+	for (int p = 0; p < positions; p++)
+	{
+		float cx = pos[p][0] + ox;
+		float cy = pos[p][1] + oy;
+		int x0 = (int)floorf((cx - radius) / size), x1 = (int)floorf((cx + radius) / size);
+		int y0 = (int)floorf((cy - radius) / size), y1 = (int)floorf((cy + radius) / size);
+		x0 = x0 < 0 ? 0 : x0;
+		y0 = y0 < 0 ? 0 : y0;
+		x1 = x1 >= regions ? regions - 1 : x1;
+		y1 = y1 >= regions ? regions - 1 : y1;
+
+		for (int y = y0; y <= y1; y++)
+		{
+			for (int x = x0; x <= x1; x++)
+			{
+				float dx = cx < x * size ? x * size - cx : cx > (x + 1) * size ? cx - (x + 1) * size : 0;
+				float dy = cy < y * size ? y * size - cy : cy > (y + 1) * size ? cy - (y + 1) * size : 0;
+				float dist = dx * dx + dy * dy;
+				if (dist > radius * radius)
+					continue;
+
+				int i = FindRegion(s, MortonKey(x, y));
+				if (i < 0)
+					continue;
+
+				TerrainRegion* r = s->region + i;
+				if (r->seen == s->update)
+				{
+					if (dist < req[r->seen_req].dist)
+						req[r->seen_req].dist = dist;
+					continue;
+				}
+
+				if (reqs == reqs_size)
+				{
+					reqs_size = reqs_size ? 2 * reqs_size : 64;
+					req = (RegionRequest*)realloc(req, sizeof(RegionRequest) * reqs_size);
+				}
+				r->seen = s->update;
+				r->seen_req = reqs;
+				req[reqs].region = i;
+				req[reqs].dist = dist;
+				reqs++;
+			}
+		}
+	}
+
+	// only nearest ones fitting in budget are wanted, so it is never exceeded for long
+	qsort(req, reqs, sizeof(RegionRequest), CompareRequest);
+	if (reqs > s->budget)
+		reqs = s->budget;
+
+	int loads = 0;
+	for (int i = 0; i < reqs; i++)
+	{
+		TerrainRegion* r = s->region + req[i].region;
+		r->used = s->update;
+		if (r->state == REGION_COLD)
+		{
+			r->state = REGION_LOADED;
+			s->colds--;
+		}
+		if (r->state != REGION_OUT)
+			continue;
+
+		r->state = REGION_LOADING;
+		s->queue[s->queue_tail] = req[i].region;
+		s->queue_tail = (s->queue_tail + 1) % (s->regions + 1);
+		loads++;
+	}
+
+	if (loads)
+	{
+		s->loading += loads;
+		s->wake.notify_one();
+	}
+	free(req);
+
+	// link whatever is ready (or everything, if waiting)
+	if (wait)
+		s->done.wait(lock, [s] { return s->loading == 0; });
+
+	int linked = 0;
+	for (int i = 0; i < s->regions; i++)
+	{
+		TerrainRegion* r = s->region + i;
+		if (r->state == REGION_LOADED)
+		{
+			LinkRegion(t, r);
+			linked++;
+		}
+	}
+
+	if (linked)
+		UpdateTerrainLOD(t);
+
+	// evict least recently wanted ones over budget, never those wanted now (they fit in budget)
+	while (s->residents > s->budget)
+	{
+		int lru = -1;
+		for (int i = 0; i < s->residents; i++)
+		{
+			const TerrainRegion* r = s->region + s->resident[i];
+			if (r->used != s->update && (lru < 0 || r->used < s->region[s->resident[lru]].used))
+				lru = i;
+		}
+
+		if (lru < 0)
+			break;
+
+		EvictRegion(t, lru);
+	}
+
+	while (s->colds > s->cold_budget)
+		DropColdRegion(s);
+
+	return s->loading;
+}
+
+bool IsTerrainResident(Terrain* t, float x, float y)
+{
+	TerrainStream* s = t ? t->stream : 0;
+	if (!s)
+		return true;
+
+	int regions = 1 << (t->level - TERRAIN_REGION_LEVEL);
+	float size = (float)(VISUAL_CELLS << TERRAIN_REGION_LEVEL);
+	int rx = (int)floorf((x + t->x * VISUAL_CELLS) / size);
+	int ry = (int)floorf((y + t->y * VISUAL_CELLS) / size);
+	if (rx < 0 || ry < 0 || rx >= regions || ry >= regions)
+		return true;
+
+	std::lock_guard<std::mutex> lock(s->mu);
+	int i = FindRegion(s, MortonKey(rx, ry));
+	return i < 0 || s->region[i].state == REGION_RESIDENT;
+}
+
+static size_t GetStreamBytes(TerrainStream* s)
+{
+	std::lock_guard<std::mutex> lock(s->mu);
+	size_t bytes = sizeof(TerrainStream) + sizeof(TerrainRegion) * s->regions_size + sizeof(int) * (2 * s->regions + 1);
+	for (int i = 0; i < s->regions; i++)
+	{
+		const TerrainRegion* r = s->region + i;
+		if (r->state == REGION_COLD)
+			bytes += r->data_nodes * sizeof(FileNode) + r->data_patches * sizeof(FilePackedPatch) + r->blob_size;
+	}
+	return bytes;
+}
+
+#else
+
+Terrain* StreamTerrain(FILE* f, int, int, const float[3])
+{
+	return LoadTerrain(f);
+}
+
+int UpdateTerrainStreaming(Terrain*, int, const float[][2], float, bool)
+{
+	return 0;
+}
+
+bool IsTerrainResident(Terrain*, float, float)
+{
+	return true;
+}
+
+#endif
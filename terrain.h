@@ -24,6 +24,26 @@ void SetTerrainBase(Terrain* t, const int b[2]);
 bool SaveTerrain(const Terrain* t, FILE* f);
 Terrain* LoadTerrain(FILE* f);
 
+// streaming mode, for v2/v3 files only (others are loaded with LoadTerrain), needs file to stay in place:
+// patches are loaded asynchronously in 16x16 regions around positions given to UpdateTerrainStreaming(),
+// up to budget regions stay resident (LRU), others are empty to all queries, edits of them are lost on eviction
+// unless they're kept packed in memory, up to cold evicted regions are (LRU too), bringing them back needs no i/o,
+// with lightpos given, files without dark masks baked for it are loaded whole too (regions can't be rebaked on link)
+Terrain* StreamTerrain(FILE* f, int budget, int cold = 0, const float lightpos[3] = 0);
+
+// call from the thread which queries/renders terrain (between frames), pos are world xy,
+// radius should cover whole view (see GetRenderRadius), regions beyond it may be evicted,
+// only up to budget regions nearest to positions are wanted, so farther ones within radius may stay empty,
+// wait blocks until all wanted regions are resident, returns number of regions still pending
+int UpdateTerrainStreaming(Terrain* t, int positions, const float pos[][2], float radius, bool wait = false);
+
+// false if region at world xy is not resident (yet) in streaming mode, so empty query there means
+// "not loaded" rather than "no ground", always true otherwise
+bool IsTerrainResident(Terrain* t, float x, float y);
+
+// changes whenever streaming links or evicts regions (edits don't change it)
+uint64_t GetTerrainRevision(Terrain* t);
+
 struct Patch;
 
 Patch* GetTerrainPatch(Terrain* t, int x, int y);
@@ -32,7 +52,12 @@ void GetTerrainPatch(Terrain* t, Patch* p, int* x, int* y);
 Patch* AddTerrainPatch(Terrain* t, int x, int y, int z);
 bool DelTerrainPatch(Terrain* t, int x, int y);
 
+// moves all attached patches and nodes into fresh slabs in Morton order, invalidates their pointers
+// (LoadTerrain does it already, editor should only call it after purging undo history)
+void CompactTerrain(Terrain* t);
+
 // don't  use, deticated to urdo only!
+// detached patches stay in terrain's slabs, dispose them before DeleteTerrain()
 size_t TerrainDetach(Terrain* t, Patch* p, int* x, int* y);
 size_t TerrainAttach(Terrain* t, Patch* p, int x, int y);
 size_t TerrainDispose(Patch* p);
@@ -72,16 +97,48 @@ uint16_t GetTerrainDiag(Patch* p);
 void SetTerrainDiag(Patch* p, uint16_t diag);
 
 uint16_t GetTerrainHi(Patch* p, uint16_t* lo = 0);
+uint16_t GetTerrainHi(Terrain* t, uint16_t* lo = 0); // whole terrain
 
 #ifdef DARK_TERRAIN
 uint64_t GetTerrainDark(Patch* p);
 void SetTerrainDark(Patch* p, uint64_t dark);
-void UpdateTerrainDark(Terrain* t, World* w, float lightpos[3], bool editor);
+// patches are baked in parallel on threads (0: all cores) of a pool kept by terrain until threads change,
+// progress is called on caller thread between batches
+void UpdateTerrainDark(Terrain* t, World* w, float lightpos[3], bool editor, int threads = 0,
+	void (*progress)(int done, int total, void* cookie) = 0, void* cookie = 0);
+
+// rebakes only patches which can be shadowed by anything in bbox (x0,x1,y0,y1,z0,z1 like GetInstBBox)
+// or by terrain under it, call after changes with bounds of changed things both before and after
+void UpdateTerrainDarkBox(Terrain* t, World* w, float lightpos[3], bool editor, const double bbox[6], int threads = 0);
+
+// true if all masks were baked with given light (and then kept up to date), it's saved with terrain
+bool HasTerrainDark(Terrain* t, const float lightpos[3]);
+// masks no longer match any light (changes which were not rebaked), so they won't be trusted or saved as baked
+void InvalidateTerrainDark(Terrain* t);
 #endif
 
 void QueryTerrain(Terrain* t, double x, double y, double r, int view_flags, void(*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie);
 void QueryTerrain(Terrain* t, int planes, double plane[][4], int view_flags, void (*cb)(Patch* p, int x, int y, int view_flags, void* cookie), void* cookie);
+struct QueryTerrainCB
+{
+	void (*patch_cb)(Patch* p, int x, int y, int view_flags, void* cookie);
+	bool (*occluded_cb)(int x, int y, int range, int lo, int hi, void* cookie); // optional, true rejects node before descending
+	void (*lod_cb)(Patch* lod, int x, int y, int range, int view_flags, void* cookie); // optional, gets node summary instead of its patches
+	int lod_range; // largest node range passed to lod_cb (nodes with holes are always descended)
+};
+
+// node summaries go stale on edits, bakes and streaming, queries rebuild them on demand (one thread at a time),
+// loading, baking and streaming rebuild them right away, call it before querying from several threads after edits
+void UpdateTerrainLOD(Terrain* t);
+
+// walks tree once for 2 plane sets (ie: direct and reflected view), cb[0] gets patches passing plane, cb[1] ones passing plane2
+// children are visited starting from near_quad (bit 0: +x half, bit 1: +y half)
+void QueryTerrain(Terrain* t, int planes, double plane[][4], double plane2[][4], int view_flags, int near_quad, QueryTerrainCB* cb[2], void* cookie);
 Patch* HitTerrain(Terrain* t, double p[3], double v[3], double ret[4], double nrm[3]=0, bool positive_only = false);
 
+// traces many coherent rays (ie: parallel shadow rays), each gets same ret, nrm and patch (0 if missed) as from single ray version
+// tree is walked once per packet of RAY_PACKET rays, returns number of rays which hit
+int HitTerrain(Terrain* t, int rays, double p[][3], double v[][3], double ret[][3], double nrm[][3], Patch* patch[], bool positive_only = false);
+
 double HitTerrain(Patch* p, double u, double v); // u,v must be normalized
 
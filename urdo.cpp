@@ -48,11 +48,12 @@ struct URDO_PatchCreate : URDO
 
 struct URDO_PatchUpdateHeight : URDO
 {
+	Terrain* terrain;
 	Patch* patch;
 	uint16_t height[HEIGHT_CELLS + 1][HEIGHT_CELLS + 1];
 	uint16_t diag;
 
-	static void Open(Patch* p); // alloc and copy original
+	static void Open(Terrain* t, Patch* p); // alloc and copy original
 	void Do(bool un);
 };
 
@@ -67,10 +68,11 @@ struct URDO_PatchUpdateVisual : URDO
 
 struct URDO_PatchDiag : URDO
 {
+	Terrain* terrain;
 	Patch* patch;
 	uint16_t diag;
 
-	static void Open(Patch* p);
+	static void Open(Terrain* t, Patch* p);
 	void Do(bool un);
 };
 
@@ -115,6 +117,43 @@ static int group_open = 0;
 static int stack_depth = 0;
 static URDO_Group* stack[64];
 
+static bool dirty = false;
+static double dirty_bbox[6];
+
+static void Dirty(const double bbox[6])
+{
+	if (!dirty)
+	{
+		memcpy(dirty_bbox, bbox, sizeof(dirty_bbox));
+		dirty = true;
+		return;
+	}
+
+	for (int i = 0; i < 6; i += 2)
+	{
+		if (bbox[i] < dirty_bbox[i])
+			dirty_bbox[i] = bbox[i];
+		if (bbox[i + 1] > dirty_bbox[i + 1])
+			dirty_bbox[i + 1] = bbox[i + 1];
+	}
+}
+
+static void Dirty(Terrain* t, Patch* p)
+{
+	int x, y;
+	uint16_t lo, hi = GetTerrainHi(p, &lo);
+	GetTerrainPatch(t, p, &x, &y);
+	double bbox[6] = { (double)x * VISUAL_CELLS, (double)(x + 1) * VISUAL_CELLS, (double)y * VISUAL_CELLS, (double)(y + 1) * VISUAL_CELLS, (double)lo, (double)hi };
+	Dirty(bbox);
+}
+
+static void Dirty(Inst* i)
+{
+	double bbox[6];
+	GetInstBBox(i, bbox);
+	Dirty(bbox);
+}
+
 void URDO::Do(bool un)
 {
 	switch (cmd)
@@ -444,6 +483,16 @@ void URDO_Close()
 	URDO_Group::Close();
 }
 
+bool URDO_Dirty(double bbox[6])
+{
+	if (!dirty || group_open)
+		return false;
+
+	memcpy(bbox, dirty_bbox, sizeof(dirty_bbox));
+	dirty = false;
+	return true;
+}
+
 Inst* URDO_Create(Mesh* m, int flags, double tm[16], int story_id)
 {
 	assert(group_open < 64);
@@ -483,17 +532,17 @@ void URDO_Delete(Terrain* t, Patch* p)
 	URDO_PatchCreate::Delete(t,p);
 }
 
-void URDO_Patch(Patch* p, bool visual)
+void URDO_Patch(Terrain* t, Patch* p, bool visual)
 {
 	if (visual)
 		URDO_PatchUpdateVisual::Open(p);
 	else
-		URDO_PatchUpdateHeight::Open(p);
+		URDO_PatchUpdateHeight::Open(t, p);
 }
 
-void URDO_Diag(Patch* p)
+void URDO_Diag(Terrain* t, Patch* p)
 {
-	URDO_PatchDiag::Open(p);
+	URDO_PatchDiag::Open(t, p);
 }
 
 void URDO_Group::Open()
@@ -556,16 +605,18 @@ void URDO_Group::Do(bool un)
 	}
 }
 
-void URDO_PatchUpdateHeight::Open(Patch* p)
+void URDO_PatchUpdateHeight::Open(Terrain* t, Patch* p)
 {
 	if (!group_open)
 		PurgeRedo();
 
 	URDO_PatchUpdateHeight* urdo = (URDO_PatchUpdateHeight*)Alloc(CMD_PATCH_UPDATE_HEIGHT);
 
+	urdo->terrain = t;
 	urdo->patch = p;
 	memcpy(urdo->height, GetTerrainHeightMap(p), sizeof(uint16_t)*(HEIGHT_CELLS+1)*(HEIGHT_CELLS+1));
 	urdo->diag = GetTerrainDiag(p);
+	Dirty(t, p);
 }
 
 void URDO_PatchUpdateVisual::Open(Patch* p)
@@ -581,6 +632,8 @@ void URDO_PatchUpdateVisual::Open(Patch* p)
 
 void URDO_PatchUpdateHeight::Do(bool un)
 {
+	Dirty(terrain, patch);
+
 	uint16_t* t = GetTerrainHeightMap(patch);
 	uint16_t* u = (uint16_t*)height;
 	for (int i = 0; i < (HEIGHT_CELLS + 1)*(HEIGHT_CELLS + 1); i++)
@@ -595,6 +648,8 @@ void URDO_PatchUpdateHeight::Do(bool un)
 
 	UpdateTerrainHeightMap(patch);
 	SetTerrainDiag(patch,d);
+
+	Dirty(terrain, patch);
 }
 
 void URDO_PatchUpdateVisual::Do(bool un)
@@ -612,19 +667,23 @@ void URDO_PatchUpdateVisual::Do(bool un)
 }
 
 
-void URDO_PatchDiag::Open(Patch* p)
+void URDO_PatchDiag::Open(Terrain* t, Patch* p)
 {
 	if (!group_open)
 		PurgeRedo();
 
 	URDO_PatchDiag* urdo = (URDO_PatchDiag*)Alloc(CMD_PATCH_DIAG);
 
+	urdo->terrain = t;
 	urdo->patch = p;
 	urdo->diag = GetTerrainDiag(p);
+	Dirty(t, p);
 }
 
 void URDO_PatchDiag::Do(bool un)
 {
+	Dirty(terrain, patch);
+
 	uint16_t d = diag;
 	diag = GetTerrainDiag(patch);
 	SetTerrainDiag(patch, d);
@@ -640,6 +699,7 @@ void URDO_PatchCreate::Delete(Terrain* t, Patch* p)
 	urdo->terrain = t;
 	urdo->patch = p;
 
+	Dirty(t, p);
 	bytes += TerrainDetach(t,p,&urdo->cx, &urdo->cy);
 	urdo->attached = false;
 }
@@ -657,13 +717,16 @@ Patch* URDO_PatchCreate::Create(Terrain* t, int x, int y, int z)
 	urdo->cx = x;
 	urdo->cy = y;
 
+	Dirty(t, urdo->patch);
 	return urdo->patch;
 }
 
 void URDO_PatchCreate::Do(bool un)
 {
+	// only attached patch has coords in terrain
 	if (attached)
 	{
+		Dirty(terrain, patch);
 		bytes += TerrainDetach(terrain, patch, &cx, &cy);
 		attached = false;
 	}
@@ -671,6 +734,7 @@ void URDO_PatchCreate::Do(bool un)
 	{
 		bytes -= TerrainAttach(terrain, patch, cx, cy);
 		attached = true;
+		Dirty(terrain, patch);
 	}
 }
 
@@ -682,6 +746,7 @@ void URDO_InstCreate::Delete(Inst* i)
 	URDO_InstCreate* urdo = (URDO_InstCreate*)Alloc(CMD_INST_CREATE);
 
 	urdo->inst = i;
+	Dirty(i);
 	SoftInstDel(i);
 	urdo->attached = false;
 }
@@ -696,6 +761,7 @@ Inst* URDO_InstCreate::Create(Mesh* m, int flags, double tm[16], int story_id)
 	urdo->inst = CreateInst(m,flags,tm,0,story_id);
 	urdo->attached = true;
 
+	Dirty(urdo->inst);
 	return urdo->inst;
 }
 
@@ -709,6 +775,7 @@ Inst* URDO_InstCreate::Create(World* w, Sprite* s, int flags, float pos[3], floa
 	urdo->inst = CreateInst(w,s,flags,pos,yaw,anim,frame,reps,0,story_id);
 	urdo->attached = true;
 
+	Dirty(urdo->inst);
 	return urdo->inst;
 }
 
@@ -722,12 +789,14 @@ Inst* URDO_InstCreate::Create(World* w, Item* item, int flags, float pos[3], flo
 	urdo->inst = CreateInst(w, item, flags, pos, yaw, story_id);
 	urdo->attached = true;
 
+	Dirty(urdo->inst);
 	return urdo->inst;
 }
 
 
 void URDO_InstCreate::Do(bool un)
 {
+	Dirty(inst);
 	if (attached)
 	{
 		SoftInstDel(inst);
@@ -19,13 +19,17 @@ void URDO_Redo(int max_depth);
 void URDO_Open();
 void URDO_Close();
 
+// bounds (x0,x1,y0,y1,z0,z1) of patches and instances changed (or undone / redone) since last call,
+// before and after the change, false if none or a group is still open
+bool URDO_Dirty(double bbox[6]);
+
 // patches
 
 Patch* URDO_Create(Terrain* t, int x, int y, int z); // replacement for AddTerrainPatch
 void URDO_Delete(Terrain* t, Patch* p); // replacement for DelTerrainPatch
 
-void URDO_Patch(Patch* p, bool visual = false); // call before changing height map
-void URDO_Diag(Patch* p); // call before flipping diag
+void URDO_Patch(Terrain* t, Patch* p, bool visual = false); // call before changing height map
+void URDO_Diag(Terrain* t, Patch* p); // call before flipping diag
 
 // meshes & sprites (instances)
 
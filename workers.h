@@ -0,0 +1,173 @@
+#pragma once
+
+// tiny fork-join pool
+// RunWorkers() hands out job indices [0,jobs) to pool threads and to the caller,
+// returns when all of them are done. Jobs are picked in increasing order.
+
+#ifndef __EMSCRIPTEN__
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+
+struct Workers
+{
+	int threads; // including caller
+
+#ifndef __EMSCRIPTEN__
+	std::thread* pool; // [threads-1]
+	std::mutex mu;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	uint64_t generation;
+	bool quit;
+
+	// current batch
+	void (*job)(int index, void* cookie);
+	void* cookie;
+	int jobs;
+	std::atomic<int> next;
+	int busy; // pool threads still working on current batch
+
+	void Grab()
+	{
+		while (true)
+		{
+			int i = next.fetch_add(1);
+			if (i >= jobs)
+				break;
+			job(i, cookie);
+		}
+	}
+
+	void Loop()
+	{
+		uint64_t seen = 0;
+		std::unique_lock<std::mutex> lock(mu);
+		while (true)
+		{
+			wake.wait(lock, [&] { return quit || generation != seen; });
+			if (quit)
+				return;
+			seen = generation;
+
+			lock.unlock();
+			Grab();
+			lock.lock();
+
+			if (--busy == 0)
+				done.notify_one();
+		}
+	}
+#endif
+};
+
+inline Workers* CreateWorkers(int threads)
+{
+	Workers* w = (Workers*)malloc(sizeof(Workers));
+
+#ifdef __EMSCRIPTEN__
+	w->threads = 1;
+#else
+	if (threads <= 0)
+		threads = std::thread::hardware_concurrency();
+	if (threads <= 0)
+		threads = 1;
+
+	w->threads = threads;
+	new (&w->mu) std::mutex();
+	new (&w->wake) std::condition_variable();
+	new (&w->done) std::condition_variable();
+	new (&w->next) std::atomic<int>(0);
+	w->generation = 0;
+	w->quit = false;
+	w->job = 0;
+	w->cookie = 0;
+	w->jobs = 0;
+	w->busy = 0;
+
+	w->pool = 0;
+	if (threads > 1)
+	{
+		w->pool = (std::thread*)malloc(sizeof(std::thread) * (threads - 1));
+		for (int i = 0; i < threads - 1; i++)
+			new (w->pool + i) std::thread(&Workers::Loop, w);
+	}
+#endif
+
+	return w;
+}
+
+inline void DeleteWorkers(Workers* w)
+{
+	if (!w)
+		return;
+
+#ifndef __EMSCRIPTEN__
+	{
+		std::lock_guard<std::mutex> lock(w->mu);
+		w->quit = true;
+	}
+	w->wake.notify_all();
+
+	if (w->pool)
+	{
+		for (int i = 0; i < w->threads - 1; i++)
+		{
+			w->pool[i].join();
+			w->pool[i].~thread();
+		}
+		free(w->pool);
+	}
+
+	w->next.~atomic();
+	w->done.~condition_variable();
+	w->wake.~condition_variable();
+	w->mu.~mutex();
+#endif
+
+	free(w);
+}
+
+inline int GetWorkersThreads(Workers* w)
+{
+	return w ? w->threads : 1;
+}
+
+// blocks until job(0..jobs-1, cookie) are all finished, caller thread participates
+inline void RunWorkers(Workers* w, int jobs, void (*job)(int index, void* cookie), void* cookie)
+{
+	if (jobs <= 0)
+		return;
+
+#ifndef __EMSCRIPTEN__
+	if (w && w->threads > 1 && jobs > 1)
+	{
+		{
+			std::lock_guard<std::mutex> lock(w->mu);
+			w->job = job;
+			w->cookie = cookie;
+			w->jobs = jobs;
+			w->next.store(0);
+			w->busy = w->threads - 1;
+			w->generation++;
+		}
+		w->wake.notify_all();
+
+		w->Grab();
+
+		std::unique_lock<std::mutex> lock(w->mu);
+		w->done.wait(lock, [&] { return w->busy == 0; });
+		return;
+	}
+#endif
+
+	for (int i = 0; i < jobs; i++)
+		job(i, cookie);
+}
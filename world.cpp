@@ -12,6 +12,7 @@
 #include "sprite.h"
 #include "world.h"
 #include "matrix.h"
+#include "raypacket.h"
 
 #include "terrain.h"
 #include "inventory.h"
@@ -246,6 +247,55 @@ struct MeshInst : Inst
 
 		return flag;
 	}
+
+	// packet version, each face is transformed once for all lanes in mask, returns lanes which hit
+	int HitFace(int mask, double ray[][10], double ret[][3], double nrm[][3], bool positive_only, bool solid_only)
+	{
+		if (!mesh)
+			return 0;
+
+		int hit = 0;
+
+		Face* f = flags & INST_FLAGS::INST_VISIBLE ? mesh->head_face : 0;
+		while (f)
+		{
+			if (solid_only)
+			{
+				if ((f->abc[0]->rgba[3] | f->abc[1]->rgba[3] | f->abc[2]->rgba[3]) & 0x80)
+				{
+					f = f->next;
+					continue;
+				}
+			}
+
+			double v0[4], v1[4], v2[4];
+			Product(tm, f->abc[0]->xyzw, v0);
+			Product(tm, f->abc[1]->xyzw, v1);
+			Product(tm, f->abc[2]->xyzw, v2);
+
+			for (int i = 0; i < RAY_PACKET; i++)
+			{
+				if (!((mask >> i) & 1))
+					continue;
+
+				if (RayIntersectsTriangle(ray[i], v0, v1, v2, ret[i], positive_only))
+				{
+					if (nrm)
+					{
+						double d1[3] = { v1[0] - v0[0], v1[1] - v0[1], v1[2] - v0[2] };
+						double d2[3] = { v2[0] - v0[0], v2[1] - v0[1], v2[2] - v0[2] };
+						CrossProduct(d1, d2, nrm[i]);
+					}
+
+					hit |= 1 << i;
+				}
+			}
+
+			f = f->next;
+		}
+
+		return hit;
+	}
 };
 
 inline bool HitSprite(Sprite* sprite, int anim, int frame, float pos[3], float yaw, double ray[10], double ret[3], bool positive_only)
@@ -404,9 +454,10 @@ void PurgeItemInstCache()
 	item_inst_cache = 0;
 }
 
-int bsp_tests=0;
-int bsp_insts=0;
-int bsp_nodes=0;
+// query stats for editor, per thread as views can be rendered concurrently
+thread_local int bsp_tests=0;
+thread_local int bsp_insts=0;
+thread_local int bsp_nodes=0;
 
 struct World
 {
@@ -459,6 +510,8 @@ struct World
         if (!m || m->world != this)
             return false;
 
+        LogChange(0);
+
         // kill sharing insts
         Inst* i = m->share_list;
         while (m->share_list)
@@ -638,6 +691,7 @@ struct World
         i->mesh = m;
 
 		i->UpdateBox();
+		LogChange(i->bbox);
 
         i->type = BSP::BSP_TYPE_INST;
         i->flags = flags;
@@ -684,6 +738,8 @@ struct World
         if (!i || !i->mesh || i->mesh->world != this)
             return false;
 
+        LogChange(i->bbox);
+
         if (i->mesh)
         {
             MeshInst** s = &i->mesh->share_list;
@@ -1022,6 +1078,21 @@ struct World
     // overrides visibility?
     Inst* editable;
 
+    // log of world boxes touched by mesh insts changes, see GetWorldChanges()
+    static const int change_log_size = 16;
+    uint64_t change_stamp; // bumped by every change
+    uint64_t change_base; // changes up to this stamp are not logged (mesh reloaded etc.)
+    float change_box[change_log_size][6];
+
+    void LogChange(const float bbox[6])
+    {
+        change_stamp++;
+        if (bbox)
+            memcpy(change_box[change_stamp % change_log_size], bbox, sizeof(float[6]));
+        else
+            change_base = change_stamp;
+    }
+
     // now we want to form a tree of Insts
     BSP* root;
 
@@ -1371,6 +1442,7 @@ struct World
 
 	void Rebuild(bool boxes)
 	{
+		LogChange(0);
 		if (root)
 		{
 			DeleteBSP(root);
@@ -2768,6 +2840,134 @@ struct World
 		return inst;
     }
 
+	struct HitRays
+	{
+		RayPacket rp;
+		double ray[RAY_PACKET][10];
+		double (*ret)[3];
+		double (*nrm)[3];
+		Inst** inst;
+		bool positive_only, editor, solid_only, sprites_too;
+	};
+
+	static void HitInstPacket(Inst* j, int mask, HitRays* hr)
+	{
+		if ((hr->editor && (j->flags & INST_VOLATILE)) ||
+			(!hr->editor && !(j->flags & INST_VOLATILE)))
+			return;
+
+		if (j->inst_type == Inst::INST_TYPE::MESH)
+		{
+			int hit = ((MeshInst*)j)->HitFace(mask, hr->ray, hr->ret, hr->nrm, hr->positive_only, hr->solid_only);
+			for (int i = 0; i < RAY_PACKET; i++)
+			{
+				if ((hit >> i) & 1)
+					hr->inst[i] = j;
+			}
+			return;
+		}
+
+		for (int i = 0; i < RAY_PACKET; i++)
+		{
+			if (!((mask >> i) & 1))
+				continue;
+
+			bool hit = false;
+			if (j->inst_type == Inst::INST_TYPE::SPRITE && hr->sprites_too)
+				hit = ((SpriteInst*)j)->Hit(hr->ray[i], hr->ret[i], hr->positive_only);
+			else
+			if (j->inst_type == Inst::INST_TYPE::ITEM && hr->sprites_too)
+				hit = ((ItemInst*)j)->Hit(hr->ray[i], hr->ret[i], hr->positive_only);
+
+			if (hit)
+				hr->inst[i] = j;
+		}
+	}
+
+	// same visiting order as HitWorld0..7 so sprite hits resolve identically
+	static void HitWorldPacket(BSP* q, int mask, HitRays* hr)
+	{
+		if (!q)
+			return;
+
+		double box[6] = { q->bbox[0], q->bbox[1], q->bbox[2], q->bbox[3], q->bbox[4], q->bbox[5] };
+		mask = HitRayPacket(&hr->rp, mask, box, 0, hr->positive_only);
+		if (!mask)
+			return;
+
+		if (q->type == BSP::TYPE::BSP_TYPE_INST)
+			HitInstPacket((Inst*)q, mask, hr);
+		else
+		if (q->type == BSP::TYPE::BSP_TYPE_NODE)
+		{
+			BSP_Node* n = (BSP_Node*)q;
+			HitWorldPacket(n->bsp_child[0], mask, hr);
+			HitWorldPacket(n->bsp_child[1], mask, hr);
+		}
+		else
+		if (q->type == BSP::TYPE::BSP_TYPE_NODE_SHARE)
+		{
+			BSP_NodeShare* s = (BSP_NodeShare*)q;
+			HitWorldPacket(s->bsp_child[0], mask, hr);
+			HitWorldPacket(s->bsp_child[1], mask, hr);
+			for (Inst* j = s->head; j; j = j->next)
+				HitInstPacket(j, mask, hr);
+		}
+		else
+		if (q->type == BSP::TYPE::BSP_TYPE_LEAF)
+		{
+			BSP_Leaf* l = (BSP_Leaf*)q;
+			for (Inst* j = l->head; j; j = j->next)
+				HitInstPacket(j, mask, hr);
+		}
+	}
+
+	int HitWorld(int rays, double p[][3], double v[][3], double ret[][3], double nrm[][3], Inst* inst[], bool positive_only, bool editor, bool solid_only, bool sprites_too)
+	{
+		for (int i = 0; i < rays; i++)
+			inst[i] = 0;
+
+		if (!root)
+			return 0;
+
+		HitRays hr;
+		hr.positive_only = positive_only;
+		hr.editor = editor;
+		hr.solid_only = solid_only;
+		hr.sprites_too = sprites_too;
+
+		int hits = 0;
+		for (int first = 0; first < rays; first += RAY_PACKET)
+		{
+			int lanes = rays - first < RAY_PACKET ? rays - first : RAY_PACKET;
+
+			InitRayPacket(&hr.rp, lanes, p + first, v + first);
+			for (int i = 0; i < lanes; i++)
+			{
+				double* r = hr.ray[i];
+				const double* o = p[first + i];
+				const double* d = v[first + i];
+				r[0] = o[1] * d[2] - o[2] * d[1];
+				r[1] = o[2] * d[0] - o[0] * d[2];
+				r[2] = o[0] * d[1] - o[1] * d[0];
+				r[3] = d[0]; r[4] = d[1]; r[5] = d[2];
+				r[6] = o[0]; r[7] = o[1]; r[8] = o[2];
+				r[9] = FLT_MAX;
+			}
+
+			hr.ret = ret + first;
+			hr.nrm = nrm ? nrm + first : 0;
+			hr.inst = inst + first;
+
+			HitWorldPacket(root, (1 << lanes) - 1, &hr);
+
+			for (int i = 0; i < lanes; i++)
+				hits += inst[first + i] != 0;
+		}
+
+		return hits;
+	}
+
     static void QueryBSP(int level, BSP* bsp, int planes, double plane[][4], void (*cb)(int level, const float bbox[6], void* cookie), void* cookie)
     {
         // temporarily don't check planes
@@ -3043,6 +3243,168 @@ struct World
         }
     }
 
+    // returns -1 if bsp is outside any of planes, otherwise number of planes still intersecting it
+    static int Cull(BSP* bsp, int planes, double* plane[])
+    {
+        float c[4] = { bsp->bbox[0], bsp->bbox[2], bsp->bbox[4], 1 }; // 0,0,0
+
+        for (int i = 0; i < planes; i++)
+        {
+            int neg_pos[2] = { 0,0 };
+
+            neg_pos[PositiveProduct(plane[i], c)] ++;
+
+            c[0] = bsp->bbox[1]; // 1,0,0
+            neg_pos[PositiveProduct(plane[i], c)] ++;
+
+            c[1] = bsp->bbox[3]; // 1,1,0
+            neg_pos[PositiveProduct(plane[i], c)] ++;
+
+            c[0] = bsp->bbox[0]; // 0,1,0
+            neg_pos[PositiveProduct(plane[i], c)] ++;
+
+            c[2] = bsp->bbox[5]; // 0,1,1
+            neg_pos[PositiveProduct(plane[i], c)] ++;
+
+            c[0] = bsp->bbox[1]; // 1,1,1
+            neg_pos[PositiveProduct(plane[i], c)] ++;
+
+            c[1] = bsp->bbox[2]; // 1,0,1
+            neg_pos[PositiveProduct(plane[i], c)] ++;
+
+            c[0] = bsp->bbox[0]; // 0,0,1
+            neg_pos[PositiveProduct(plane[i], c)] ++;
+
+            c[2] = bsp->bbox[4]; // 0,0,0
+
+            if (neg_pos[0] == 8)
+                return -1;
+
+            if (neg_pos[1] == 8)
+            {
+                planes--;
+                if (i < planes)
+                {
+                    double* swap = plane[i];
+                    plane[i] = plane[planes];
+                    plane[planes] = swap;
+                }
+                i--;
+            }
+        }
+
+        return planes;
+    }
+
+    static void SkipMesh(Mesh*, double[16], void*)
+    {
+    }
+
+    // recursive, 2 plane sets at once, set with negative planes count is culled away
+    // meshes in bsp rejected by set's occluded_cb are skipped, its sprites are still reported
+    static void Query(BSP* bsp, const int planes[2], double* plane[2][6], QueryWorldCB* cb[2], void* cookie)
+    {
+        bsp_tests++;
+
+        int left[2] = { -1,-1 };
+        QueryWorldCB* sub_cb[2] = { cb[0], cb[1] };
+        QueryWorldCB sprites_only[2];
+        for (int s = 0; s < 2; s++)
+        {
+            if (planes[s] < 0)
+                continue;
+            left[s] = Cull(bsp, planes[s], plane[s]);
+            if (left[s] >= 0 && cb[s]->occluded_cb && cb[s]->occluded_cb(bsp->bbox, cookie))
+            {
+                sprites_only[s].mesh_cb = SkipMesh;
+                sprites_only[s].sprite_cb = cb[s]->sprite_cb;
+                sprites_only[s].occluded_cb = 0;
+                sub_cb[s] = sprites_only + s;
+            }
+        }
+
+        if (left[0] < 0 && left[1] < 0)
+            return;
+
+        if (bsp->type == BSP::BSP_TYPE_INST)
+        {
+            for (int s = 0; s < 2; s++)
+            {
+                if (left[s] >= 0)
+                    Query(bsp, sub_cb[s], cookie);
+            }
+        }
+        else
+        if (bsp->type == BSP::BSP_TYPE_NODE)
+        {
+            bsp_nodes++;
+            BSP_Node* n = (BSP_Node*)bsp;
+            if (n->bsp_child[0])
+                Query(n->bsp_child[0],left,plane,sub_cb,cookie);
+            if (n->bsp_child[1])
+                Query(n->bsp_child[1],left,plane,sub_cb,cookie);
+        }
+        else
+        if (bsp->type == BSP::BSP_TYPE_NODE_SHARE)
+        {
+            bsp_nodes++;
+            BSP_NodeShare* s = (BSP_NodeShare*)bsp;
+            if (s->bsp_child[0])
+                Query(s->bsp_child[0],left,plane,sub_cb,cookie);
+            if (s->bsp_child[1])
+                Query(s->bsp_child[1],left,plane,sub_cb,cookie);
+
+            Inst* i = s->head;
+            while (i)
+            {
+                Query(i,left,plane,sub_cb,cookie);
+                i=i->next;
+            }
+        }
+        else
+        if (bsp->type == BSP::BSP_TYPE_LEAF)
+        {
+            bsp_nodes++;
+            Inst* i = ((BSP_Leaf*)bsp)->head;
+            while (i)
+            {
+                Query(i,left,plane,sub_cb,cookie);
+                i=i->next;
+            }
+        }
+        else
+        {
+            assert(0);
+        }
+    }
+
+    // main, 2 plane sets
+    void Query(int planes, double plane[][4], double plane2[][4], QueryWorldCB* cb[2], void* cookie)
+    {
+        bsp_tests=0;
+        bsp_insts=0;
+        bsp_nodes=0;
+
+        int pl[2] = { planes, planes };
+        double* pp[2][6] =
+        {
+            { plane[0],plane[1],plane[2],plane[3],plane[4],plane[5] },
+            { plane2[0],plane2[1],plane2[2],plane2[3],plane2[4],plane2[5] }
+        };
+
+        // static first
+        if (root)
+            Query(root, pl, pp, cb, cookie);
+
+        // dynamic after
+        Inst* i = head_inst;
+        while (i)
+        {
+            Query(i, pl, pp, cb, cookie);
+            i = i->next;
+        }
+    }
+
     // main
     void Query(int planes, double plane[][4], QueryWorldCB* cb, void* cookie)
     {
@@ -3347,6 +3709,8 @@ void ResetItemInsts(World* w)
 
 bool Mesh::Update(const char* path)
 {
+	world->LogChange(0);
+
 	if (strstr(path,".akm"))
 	{
 		int bio = 1;
@@ -4078,6 +4442,8 @@ World* CreateWorld()
     w->tail_inst = 0;
     w->editable = 0;
     w->root = 0;
+    w->change_stamp = 1;
+    w->change_base = 1;
 
     return w;
 }
@@ -4217,6 +4583,13 @@ void QueryWorld(World* w, int planes, double plane[][4], QueryWorldCB* cb, void*
     w->Query(planes,plane,cb,cookie);
 }
 
+void QueryWorld(World* w, int planes, double plane[][4], double plane2[][4], QueryWorldCB* cb[2], void* cookie)
+{
+    if (!w)
+        return;
+    w->Query(planes,plane,plane2,cb,cookie);
+}
+
 void QueryWorldBSP(World* w, int planes, double plane[][4], void (*cb)(int level, const float bbox[6], void* cookie), void* cookie)
 {
     if (!w || !w->root)
@@ -4372,6 +4745,20 @@ void RebuildWorld(World* w, bool boxes)
         w->Rebuild(boxes);
 }
 
+int GetWorldChanges(World* w, uint64_t since, float bbox[][6], int max_boxes, uint64_t* stamp)
+{
+    *stamp = w->change_stamp;
+
+    int logged = max_boxes < World::change_log_size ? max_boxes : World::change_log_size;
+    if (since < w->change_base || w->change_stamp - since > (uint64_t)logged)
+        return -1;
+
+    int boxes = 0;
+    for (uint64_t s = since + 1; s <= w->change_stamp; s++)
+        memcpy(bbox[boxes++], w->change_box[s % World::change_log_size], sizeof(float[6]));
+    return boxes;
+}
+
 
 
 static void SaveInst(Inst* inst, FILE* f)
@@ -4768,6 +5155,11 @@ Inst* HitWorld(World* w, double p[3], double v[3], double ret[3], double nrm[3],
     return w->HitWorld(p,v,ret,nrm, positive_only, editor, solid_only, sprites_too);
 }
 
+int HitWorld(World* w, int rays, double p[][3], double v[][3], double ret[][3], double nrm[][3], Inst* inst[], bool positive_only, bool editor, bool solid_only, bool sprites_too)
+{
+    return w->HitWorld(rays, p, v, ret, nrm, inst, positive_only, editor, solid_only, sprites_too);
+}
+
 Mesh* GetInstMesh(Inst* i)
 {
 	if (i->inst_type == Inst::INST_TYPE::MESH)
@@ -5137,11 +5529,15 @@ bool AttachInst(World* w, Inst* inst)
 
 void ShowInst(Inst* i)
 {
+	if (i->inst_type == Inst::INST_TYPE::MESH && !(i->flags & INST_FLAGS::INST_VISIBLE))
+		GetInstWorld(i)->LogChange(i->bbox);
 	i->flags |= INST_FLAGS::INST_VISIBLE;
 }
 
 void HideInst(Inst* i)
 {
+	if (i->inst_type == Inst::INST_TYPE::MESH && (i->flags & INST_FLAGS::INST_VISIBLE))
+		GetInstWorld(i)->LogChange(i->bbox);
 	i->flags &= ~INST_FLAGS::INST_VISIBLE;
 }
 
@@ -5177,6 +5573,8 @@ void UpdateSpriteInst(World* world, Inst* i, Sprite* sprite, const float pos[3],
 void SoftInstAdd(Inst* i)
 {
 	World* w = GetInstWorld(i);
+	if (i->inst_type == Inst::INST_TYPE::MESH)
+		w->LogChange(i->bbox);
 
 	// it is external thing
 
@@ -5198,6 +5596,8 @@ void SoftInstAdd(Inst* i)
 void SoftInstDel(Inst* i)
 {
 	World* w = GetInstWorld(i);
+	if (i->inst_type == Inst::INST_TYPE::MESH)
+		w->LogChange(i->bbox);
 
 	// it is in bsp or flat
 
@@ -11,6 +11,10 @@ World* CreateWorld();
 void DeleteWorld(World* w);
 void RebuildWorld(World* w, bool boxes = false);
 
+// world boxes of mesh insts added / removed / shown / hidden after 'since' stamp
+// returns -1 if they are not known (too many or unlogged changes like mesh reload)
+int GetWorldChanges(World* w, uint64_t since, float bbox[][6], int max_boxes, uint64_t* stamp);
+
 Mesh* LoadMesh(World* w, const char* path, const char* name = 0);
 void DeleteMesh(Mesh* m);
 
@@ -70,14 +74,19 @@ struct QueryWorldCB
 {
 	void(*mesh_cb)(Mesh* m, double tm[16], void* cookie);
 	void(*sprite_cb)(Inst* inst, Sprite* s, float pos[3], float yaw, int anim, int frame, int reps[4], void* cookie);
+	bool(*occluded_cb)(const float bbox[6], void* cookie); // optional (2 sets query only), true skips meshes in bbox
 };
 
 void QueryWorld(World* w, int planes, double plane[][4], QueryWorldCB* cb, void* cookie);
+// single pass for 2 plane sets (ie: direct and reflected view), cb[0] gets insts passing plane, cb[1] ones passing plane2
+void QueryWorld(World* w, int planes, double plane[][4], double plane2[][4], QueryWorldCB* cb[2], void* cookie);
 void QueryWorldBSP(World* w, int planes, double plane[][4], void (*cb)(int level, const float bbox[6], void* cookie), void* cookie);
 
 
 // if editor==true -> ignore volatile instances
 Inst* HitWorld(World* w, double p[3], double v[3], double ret[3], double nrm[3], bool positive_only = false, bool editor = false, bool solid_only = false, bool sprites_too = true);
+// packet version for many coherent rays, inst[i] is 0 if ray missed, returns number of rays which hit
+int HitWorld(World* w, int rays, double p[][3], double v[][3], double ret[][3], double nrm[][3], Inst* inst[], bool positive_only = false, bool editor = false, bool solid_only = false, bool sprites_too = true);
 
 void SaveWorld(World* w, FILE* f);
 